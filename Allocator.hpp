@@ -0,0 +1,401 @@
+#ifndef LMLIB_ALLOCATOR_HPP_
+#define LMLIB_ALLOCATOR_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "./LMBase.hpp"
+#include "./Logging.hpp"
+#include "./Packet.hpp"
+
+namespace lmlib {
+// alignment of every block handed out by an allocator
+const size_t kAllocAlign = 64;
+
+// byte counters of an allocator, live and peak count the bytes asked for,
+// cached counts the blocks kept around for reuse
+struct AllocStats {
+  size_t live_bytes = 0;
+  size_t peak_bytes = 0;
+  size_t cached_bytes = 0;
+  size_t num_alloc = 0;
+  // allocations that had to go to the backing allocator
+  size_t num_backing_alloc = 0;
+};
+
+// memory behind AllocSpace, FreeSpace and NewTensor, blocks are aligned to
+// kAllocAlign and every method must be thread safe
+class Allocator {
+public:
+  virtual ~Allocator() {}
+  virtual void *Alloc(size_t size) = 0;
+  // size is the size given to Alloc
+  virtual void Free(void *ptr, size_t size) = 0;
+  virtual AllocStats Stats() const = 0;
+};
+
+// thread safe counters shared by the allocators
+class AllocCounter {
+public:
+  inline void OnAlloc(size_t size, bool backing) {
+    const size_t live = live_.fetch_add(size) + size;
+    size_t peak = peak_.load();
+    while (live > peak && !peak_.compare_exchange_weak(peak, live)) {
+    }
+    num_alloc_.fetch_add(1);
+    if (backing)
+      num_backing_alloc_.fetch_add(1);
+  }
+  inline void OnFree(size_t size) { live_.fetch_sub(size); }
+  inline void OnCache(size_t size) { cached_.fetch_add(size); }
+  inline void OnUncache(size_t size) { cached_.fetch_sub(size); }
+  inline AllocStats Get() const {
+    AllocStats stats;
+    stats.live_bytes = live_.load();
+    stats.peak_bytes = peak_.load();
+    stats.cached_bytes = cached_.load();
+    stats.num_alloc = num_alloc_.load();
+    stats.num_backing_alloc = num_backing_alloc_.load();
+    return stats;
+  }
+
+private:
+  std::atomic<size_t> live_{0};
+  std::atomic<size_t> peak_{0};
+  std::atomic<size_t> cached_{0};
+  std::atomic<size_t> num_alloc_{0};
+  std::atomic<size_t> num_backing_alloc_{0};
+};
+
+// straight to the system allocator, big blocks are mapped in huge pages
+// placed by packet::DefaultPagePolicy()
+class SystemAllocator : public Allocator {
+public:
+  inline void *Alloc(size_t size) override {
+    void *ptr = packet::AlignedMallocPages(size);
+    counter_.OnAlloc(size, true);
+    return ptr;
+  }
+  inline void Free(void *ptr, size_t size) override {
+    packet::AlignedFreePages(ptr, size);
+    counter_.OnFree(size);
+  }
+  inline AllocStats Stats() const override { return counter_.Get(); }
+
+  inline static SystemAllocator &Get() {
+    static SystemAllocator *inst = new SystemAllocator();
+    return *inst;
+  }
+
+private:
+  AllocCounter counter_;
+};
+
+// caches freed blocks by size class, 4 classes per power of two so at most
+// a quarter of a block is wasted; the default pool also keeps a small per
+// thread cache in front of its shared free lists
+class PoolAllocator : public Allocator {
+public:
+  // blocks above kMaxPooled go straight to the backing allocator
+  static const size_t kMaxPooled = size_t(1) << 34;
+  static const int kNumClass = 1 + 4 * (34 - 6);
+  // the per thread cache holds at most kThreadCacheDepth blocks of each
+  // class up to kThreadCacheMax bytes
+  static const size_t kThreadCacheMax = size_t(1) << 20;
+  static const size_t kThreadCacheDepth = 8;
+
+  explicit PoolAllocator(Allocator *backing = nullptr)
+      : backing_(backing != nullptr ? backing : &SystemAllocator::Get()),
+        free_(kNumClass) {}
+
+  ~PoolAllocator() override { Trim(); }
+
+  inline void *Alloc(size_t size) override {
+    size_t csize;
+    const int cls = SizeClass(size, &csize);
+    if (cls < 0) {
+      counter_.OnAlloc(size, true);
+      return backing_->Alloc(size);
+    }
+    void *ptr = nullptr;
+    ThreadCache *cache = thread_cache_ ? &LocalCache() : nullptr;
+    if (cache != nullptr && !cache->free[cls].empty()) {
+      ptr = cache->free[cls].back();
+      cache->free[cls].pop_back();
+    } else {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_[cls].empty()) {
+        ptr = free_[cls].back();
+        free_[cls].pop_back();
+      }
+    }
+    if (ptr != nullptr) {
+      counter_.OnUncache(csize);
+      counter_.OnAlloc(size, false);
+      return ptr;
+    }
+    ptr = backing_->Alloc(csize);
+    counter_.OnAlloc(size, true);
+    return ptr;
+  }
+
+  inline void Free(void *ptr, size_t size) override {
+    size_t csize;
+    const int cls = SizeClass(size, &csize);
+    counter_.OnFree(size);
+    if (cls < 0) {
+      backing_->Free(ptr, size);
+      return;
+    }
+    counter_.OnCache(csize);
+    if (thread_cache_ && csize <= kThreadCacheMax) {
+      ThreadCache &cache = LocalCache();
+      if (cache.free[cls].size() < kThreadCacheDepth) {
+        cache.free[cls].push_back(ptr);
+        return;
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_[cls].push_back(ptr);
+  }
+
+  inline AllocStats Stats() const override { return counter_.Get(); }
+
+  // give every cached block back to the backing allocator, the per thread
+  // cache of the calling thread included
+  inline void Trim() {
+    if (thread_cache_)
+      LocalCache().Flush();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int cls = 0; cls < kNumClass; ++cls) {
+      const size_t csize = ClassSize(cls);
+      for (size_t i = 0; i < free_[cls].size(); ++i) {
+        backing_->Free(free_[cls][i], csize);
+        counter_.OnUncache(csize);
+      }
+      free_[cls].clear();
+    }
+  }
+
+  // the process wide pool used when no AllocatorScope is active, it lives
+  // until the process exits
+  inline static PoolAllocator &Default() {
+    static PoolAllocator *inst = new PoolAllocator(nullptr, true);
+    return *inst;
+  }
+
+  // class of a block of size bytes and the size of that class, -1 when the
+  // block is not pooled
+  inline static int SizeClass(size_t size, size_t *class_size) {
+    if (size <= 64) {
+      *class_size = 64;
+      return 0;
+    }
+    if (size > kMaxPooled) {
+      *class_size = size;
+      return -1;
+    }
+    // 2^k < size <= 2^(k+1)
+    int k = 6;
+    while ((size_t(1) << (k + 1)) < size)
+      ++k;
+    const size_t quarter = size_t(1) << (k - 2);
+    const size_t j = (size - (size_t(1) << k) + quarter - 1) / quarter;
+    *class_size = (size_t(1) << k) + j * quarter;
+    return 1 + (k - 6) * 4 + int(j - 1);
+  }
+
+  inline static size_t ClassSize(int cls) {
+    if (cls == 0)
+      return 64;
+    const int k = 6 + (cls - 1) / 4;
+    const size_t j = size_t((cls - 1) % 4 + 1);
+    return (size_t(1) << k) + j * (size_t(1) << (k - 2));
+  }
+
+private:
+  struct ThreadCache {
+    PoolAllocator *owner = nullptr;
+    std::vector<std::vector<void *>> free;
+    ThreadCache() : free(kNumClass) {}
+    ~ThreadCache() { Flush(); }
+    // move every block to the shared lists of the owner
+    inline void Flush() {
+      if (owner == nullptr)
+        return;
+      std::lock_guard<std::mutex> lock(owner->mutex_);
+      for (int cls = 0; cls < kNumClass; ++cls) {
+        owner->free_[cls].insert(owner->free_[cls].end(), free[cls].begin(),
+                                 free[cls].end());
+        free[cls].clear();
+      }
+    }
+  };
+
+  PoolAllocator(Allocator *backing, bool thread_cache)
+      : PoolAllocator(backing) {
+    thread_cache_ = thread_cache;
+  }
+
+  // only the default pool has thread caches, it is never destroyed so the
+  // caches can hand their blocks back when a thread exits
+  inline ThreadCache &LocalCache() {
+    static thread_local ThreadCache cache;
+    cache.owner = this;
+    return cache;
+  }
+
+  Allocator *backing_;
+  bool thread_cache_ = false;
+  std::mutex mutex_;
+  std::vector<std::vector<void *>> free_;
+  AllocCounter counter_;
+
+  PoolAllocator(const PoolAllocator &);
+  void operator=(const PoolAllocator &);
+};
+
+// bump allocator for per iteration scratch memory, Free only updates the
+// counters and Reset makes all of the memory available again; after a Reset
+// the chunks are merged so a repeated iteration runs out of one chunk
+class Arena : public Allocator {
+public:
+  explicit Arena(size_t chunk_size = size_t(1) << 20,
+                 Allocator *backing = nullptr)
+      : chunk_size_(chunk_size),
+        backing_(backing != nullptr ? backing : &PoolAllocator::Default()) {}
+
+  ~Arena() override {
+    for (size_t i = 0; i < chunks_.size(); ++i)
+      backing_->Free(chunks_[i].dptr, chunks_[i].size);
+  }
+
+  inline void *Alloc(size_t size) override {
+    const size_t asize = (size + kAllocAlign - 1) / kAllocAlign * kAllocAlign;
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (current_ < chunks_.size() &&
+           chunks_[current_].size - offset_ < asize) {
+      ++current_;
+      offset_ = 0;
+    }
+    bool backing = false;
+    if (current_ == chunks_.size()) {
+      Chunk chunk;
+      chunk.size = asize > chunk_size_ ? asize : chunk_size_;
+      chunk.dptr = static_cast<char *>(backing_->Alloc(chunk.size));
+      chunks_.push_back(chunk);
+      offset_ = 0;
+      backing = true;
+    }
+    void *ptr = chunks_[current_].dptr + offset_;
+    offset_ += asize;
+    counter_.OnAlloc(size, backing);
+    return ptr;
+  }
+
+  inline void Free(void *, size_t size) override { counter_.OnFree(size); }
+
+  inline AllocStats Stats() const override { return counter_.Get(); }
+
+  // every block handed out so far becomes invalid
+  inline void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (chunks_.size() > 1) {
+      Chunk merged;
+      merged.size = 0;
+      for (size_t i = 0; i < chunks_.size(); ++i) {
+        merged.size += chunks_[i].size;
+        backing_->Free(chunks_[i].dptr, chunks_[i].size);
+      }
+      merged.dptr = static_cast<char *>(backing_->Alloc(merged.size));
+      chunks_.assign(1, merged);
+    }
+    current_ = 0;
+    offset_ = 0;
+    counter_.OnFree(counter_.Get().live_bytes);
+  }
+
+private:
+  struct Chunk {
+    char *dptr;
+    size_t size;
+  };
+  size_t chunk_size_;
+  Allocator *backing_;
+  std::mutex mutex_;
+  std::vector<Chunk> chunks_;
+  size_t current_ = 0;
+  size_t offset_ = 0;
+  AllocCounter counter_;
+
+  Arena(const Arena &);
+  void operator=(const Arena &);
+};
+
+inline Allocator *&CurrentAllocatorSlot() {
+  static thread_local Allocator *current = nullptr;
+  return current;
+}
+
+// allocator of AllocSpace and NewTensor on the calling thread
+inline Allocator *GetAllocator() {
+  Allocator *current = CurrentAllocatorSlot();
+  return current != nullptr ? current : &PoolAllocator::Default();
+}
+
+// makes alloc the allocator of the calling thread until the end of scope,
+// scopes nest
+class AllocatorScope {
+public:
+  explicit AllocatorScope(Allocator *alloc) : prev_(CurrentAllocatorSlot()) {
+    CurrentAllocatorSlot() = alloc;
+  }
+  ~AllocatorScope() { CurrentAllocatorSlot() = prev_; }
+
+private:
+  Allocator *prev_;
+
+  AllocatorScope(const AllocatorScope &);
+  void operator=(const AllocatorScope &);
+};
+
+// scratch tensors of one iteration, everything allocated inside the scope
+// comes from arena and is released at once when the scope ends; tasks still
+// queued on a stream must not use them after that
+class ArenaScope {
+public:
+  explicit ArenaScope(Arena *arena) : arena_(arena), scope_(arena) {}
+  ~ArenaScope() { arena_->Reset(); }
+
+private:
+  Arena *arena_;
+  AllocatorScope scope_;
+};
+
+// every block of AllocSpace starts with a header naming its allocator, so
+// FreeSpace finds it whatever scope is active at that point
+struct AllocHeader {
+  Allocator *owner;
+  size_t size;
+};
+const size_t kAllocHeader = kAllocAlign;
+
+inline void *AllocBytes(size_t size) {
+  Allocator *alloc = GetAllocator();
+  char *base = static_cast<char *>(alloc->Alloc(size + kAllocHeader));
+  AllocHeader *header = reinterpret_cast<AllocHeader *>(base);
+  header->owner = alloc;
+  header->size = size + kAllocHeader;
+  return base + kAllocHeader;
+}
+
+inline void FreeBytes(void *ptr) {
+  char *base = static_cast<char *>(ptr) - kAllocHeader;
+  AllocHeader *header = reinterpret_cast<AllocHeader *>(base);
+  header->owner->Free(base, header->size);
+}
+} // namespace lmlib
+
+#endif // LMLIB_ALLOCATOR_HPP_
@@ -6,6 +6,7 @@
 
 #include "LMBase.hpp"
 #include "Exp.hpp"
+#include "Half.hpp"
 #include "Shape.hpp"
 #include "Stream.hpp"
 
@@ -17,7 +18,7 @@ struct TRValue : public expr::RValueExp<Container, DType> {};
 // comment todo
 template <int dimension, typename DType LMLIB_DEFAULT_DTYPE>
 struct Tensor : public TRValue<Tensor<dimension, DType>, dimension, DType> {
-  static const int kSubDim = dimension - 1;
+  static const int kSubdim = dimension - 1;
   DType *dptr_ = nullptr;
   Shape<dimension> shape_;
   index_t stride_;
@@ -25,13 +26,14 @@ struct Tensor : public TRValue<Tensor<dimension, DType>, dimension, DType> {
 
   inline Tensor() : stream_(NULL) {}
 
-  inline Tensor(const Shape<dimension> &shape) : shape_(shape), stream_(NULL) {}
+  inline Tensor(const Shape<dimension> &shape)
+      : shape_(shape), stride_(shape[kSubdim]), stream_(NULL) {}
 
   inline Tensor(DType *dptr, const Shape<dimension> &shape)
-      : dptr_(dptr), shape_(shape), stride_(shape[kSubDim]), stream_(NULL) {}
+      : dptr_(dptr), shape_(shape), stride_(shape[kSubdim]), stream_(NULL) {}
 
   inline Tensor(DType *dptr, const Shape<dimension> &shape, Stream *stream)
-      : dptr_(dptr), shape_(shape), stride_(shape[kSubDim]), stream_(stream) {}
+      : dptr_(dptr), shape_(shape), stride_(shape[kSubdim]), stream_(stream) {}
 
   inline Tensor(DType *dptr, const Shape<dimension> &shape, index_t stride,
                 Stream *stream)
@@ -51,7 +53,7 @@ struct Tensor : public TRValue<Tensor<dimension, DType>, dimension, DType> {
     return this->shape_[dimension - 1] == stride_;
   }
 
-  inline index_t MSize() const { this->MemSize<0>(); }
+  inline index_t MSize() const { return this->MemSize<0>(); }
 
   inline index_t size(index_t idx) const { return shape_[idx]; }
 
@@ -65,7 +67,7 @@ struct Tensor : public TRValue<Tensor<dimension, DType>, dimension, DType> {
 
   inline Tensor<kSubdim, DType> operator[](index_t idx) const {
     return Tensor<kSubdim, DType>(dptr_ + this->MemSize<1>() * idx,
-                                  shape_.SubShape(), stride_, stream_);
+                                  shape_.Subshape(), stride_, stream_);
   }
 
   inline Tensor<dimension, DType> Slice(index_t begin, index_t end) const {
@@ -102,24 +104,25 @@ public:
   DType *dptr_;
   Shape<1> shape_;
   index_t stride_;
-  Stream<Device> *stream_;
+  Stream *stream_;
 
   // constructor
   inline Tensor(void) : stream_(NULL) {}
 
-  inline Tensor(const Shape<1> &shape) : shape_(shape), stream_(NULL) {}
+  inline Tensor(const Shape<1> &shape)
+      : shape_(shape), stride_(shape[0]), stream_(NULL) {}
 
   inline Tensor(DType *dptr, Shape<1> shape)
       : dptr_(dptr), shape_(shape), stride_(shape[0]), stream_(NULL) {}
 
-  inline Tensor(DType *dptr, Shape<1> shape, Stream<Device> *stream)
+  inline Tensor(DType *dptr, Shape<1> shape, Stream *stream)
       : dptr_(dptr), shape_(shape), stride_(shape[0]), stream_(stream) {}
 
   inline Tensor(DType *dptr, Shape<1> shape, index_t stride,
-                Stream<Device> *stream)
+                Stream *stream)
       : dptr_(dptr), shape_(shape), stride_(stride), stream_(stream) {}
 
-  inline void set_stream(Stream<Device> *stream) { this->stream_ = stream; }
+  inline void set_stream(Stream *stream) { this->stream_ = stream; }
 
   inline Tensor<1, DType> FlatTo1D(void) const { return *this; }
 
@@ -203,12 +206,34 @@ template <typename VDType, typename SDType>
 inline void VectorizedSort(Tensor<1, VDType> values,
                            Tensor<1, SDType> segments);
 
+// records dst (Saver)= exp in the FusionScope of the calling thread, false
+// when there is none or the statement has to run now
+template <typename Saver, typename RValue, int dim, typename DType,
+          typename ExpType, int etype>
+inline bool FuseExp(TRValue<RValue, dim, DType> *dst,
+                    const expr::Exp<ExpType, DType, etype> &exp);
+
 //
 template <typename Saver, typename RValue, int dim, typename DType,
           typename ExpType, int etype>
 inline void MapExp(TRValue<RValue, dim, DType> *dst,
                    const expr::Exp<ExpType, DType, etype> &exp);
 
+// dst (Saver)= scale * reduction of exp over every dimension but the
+// lowest one, Reducer is one of red::
+template <typename Saver, typename Reducer, typename R, typename DType,
+          typename E, int etype>
+inline void MapReduceKeepLowest(TRValue<R, 1, DType> *dst,
+                                const expr::Exp<E, DType, etype> &exp,
+                                DType scale = 1);
+
+// dst (Saver)= scale * reduction of exp over every dimension but dimkeep
+template <typename Saver, typename Reducer, int dimkeep, typename R,
+          typename DType, typename E, int etype>
+inline void MapReduceKeepHighDim(TRValue<R, 1, DType> *dst,
+                                 const expr::Exp<E, DType, etype> &exp,
+                                 DType scale = 1);
+
 //
 template <typename DType>
 inline void VectorDot(Tensor<1, DType> dst, const Tensor<1, DType> &lhs,
@@ -0,0 +1,1150 @@
+#ifndef LMLIB_DENSE_ENGINE_HPP_
+#define LMLIB_DENSE_ENGINE_HPP_
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <type_traits>
+#include <vector>
+
+#include "./Allocator.hpp"
+#include "./LMBase.hpp"
+#include "./Logging.hpp"
+#include "./Dense.hpp"
+#include "./Exp_Engine.hpp"
+#include "./Packet.hpp"
+
+namespace lmlib {
+inline Stream *NewStream(int) { return new Stream(); }
+
+inline void DeleteStream(Stream *stream) { delete stream; }
+
+// memory comes from GetAllocator(), with pad every row starts on a
+// kAllocAlign boundary
+template <int dim, typename DType>
+inline void AllocSpace(Tensor<dim, DType> *obj, bool pad) {
+  Shape<2> shape = obj->shape_.FlatTo2D();
+  index_t stride = shape[1];
+  if (pad && shape[0] > 1 && kAllocAlign % sizeof(DType) == 0) {
+    const index_t align = index_t(kAllocAlign / sizeof(DType));
+    stride = (stride + align - 1) / align * align;
+  }
+  obj->stride_ = stride;
+  obj->dptr_ =
+      static_cast<DType *>(AllocBytes(sizeof(DType) * stride * shape[0]));
+}
+
+// queued work of the stream that uses obj must be finished
+template <int dim, typename DType>
+inline void FreeSpace(Tensor<dim, DType> *obj) {
+  if (obj->dptr_ == nullptr)
+    return;
+  FreeBytes(obj->dptr_);
+  obj->dptr_ = nullptr;
+}
+
+template <int dim, typename DType>
+inline Tensor<dim, DType> NewTensor(const Shape<dim> &shape, DType initv,
+                                    bool pad, Stream *stream) {
+  Tensor<dim, DType> obj(shape);
+  obj.stream_ = stream;
+  AllocSpace(&obj, pad);
+  obj = initv;
+  return obj;
+}
+
+// split the flattened (y, x) space of shape over the threads of stream,
+// func(ybegin, yend, xbegin, xend) is called once per chunk
+template <typename DType, typename F>
+inline void ParallelMap(Stream *stream, const Shape<2> &shape, const F &func) {
+  if (stream == nullptr || stream->pool().NumThreads() == 1 ||
+      shape.Size() < 2 * stream->GrainSize()) {
+    func(0, shape[0], 0, shape[1]);
+    return;
+  }
+  ThreadPool &pool = stream->pool();
+  const index_t grain = stream->GrainSize();
+  if (shape[0] >= pool.NumThreads()) {
+    pool.ParallelFor(0, shape[0], (grain + shape[1] - 1) / shape[1],
+                     [&](index_t ybegin, index_t yend) {
+                       func(ybegin, yend, 0, shape[1]);
+                     });
+  } else {
+    // a few long rows, split the columns in whole cache lines
+    const index_t unit = sizeof(DType) < 64 ? 64 / sizeof(DType) : 1;
+    const index_t nunit = (shape[1] + unit - 1) / unit;
+    pool.ParallelFor(
+        0, nunit, (grain / shape[0] + unit - 1) / unit,
+        [&](index_t ubegin, index_t uend) {
+          const index_t xend = uend * unit < shape[1] ? uend * unit : shape[1];
+          func(0, shape[0], ubegin * unit, xend);
+        });
+  }
+}
+
+// scalar evaluation, one Plan::Eval per element
+template <typename Saver, typename R, typename DType, typename E>
+inline void MapPlan(expr::Plan<R, DType> dplan,
+                    const expr::Plan<E, DType> &plan, index_t ybegin,
+                    index_t yend, index_t xbegin, index_t xend) {
+  for (index_t y = ybegin; y < yend; ++y) {
+    for (index_t x = xbegin; x < xend; ++x) {
+      Saver::template Save<DType>(dplan.REval(y, x), plan.Eval(y, x));
+    }
+  }
+}
+
+// edge of the squares a map that reads a transposed operand is evaluated
+// in, the rows of a source tile all stay in L1
+const index_t kTransposeTile = 32;
+
+// MapPlan over kTransposeTile squares
+template <typename Saver, typename R, typename DType, typename E>
+inline void MapPlanTiled(const expr::Plan<R, DType> &dplan,
+                         const expr::Plan<E, DType> &plan, index_t ybegin,
+                         index_t yend, index_t xbegin, index_t xend) {
+  for (index_t y = ybegin; y < yend; y += kTransposeTile) {
+    const index_t ytend = std::min(y + kTransposeTile, yend);
+    for (index_t x = xbegin; x < xend; x += kTransposeTile)
+      MapPlan<Saver>(dplan, plan, y, ytend, x,
+                     std::min(x + kTransposeTile, xend));
+  }
+}
+
+// arch of the in-register block transpose, avx-512 builds use the 8x8 avx
+// blocks, a tile is bound by its loads and stores rather than shuffles
+template <typename DType> struct TransposeArch {
+  static const packet::PacketArch kDefault =
+      packet::PacketDefault<DType>::kArch;
+  static const packet::PacketArch kArch =
+      kDefault != packet::kAVX512
+          ? kDefault
+          : (LMLIB_USE_AVX2 ? packet::kAVX2 : packet::kSSE2);
+};
+
+// dst(y, x) (Saver)= src(x, y) over [ybegin, yend) x [xbegin, xend)
+template <typename Saver, typename DType>
+inline void TransposeTiles(Tensor<2, DType> dst, const Tensor<2, DType> &src,
+                           index_t ybegin, index_t yend, index_t xbegin,
+                           index_t xend) {
+  const packet::PacketArch kArch = TransposeArch<DType>::kArch;
+  typedef packet::Packet<DType, kArch> P;
+  const index_t k = P::kSize;
+  for (index_t yt = ybegin; yt < yend; yt += kTransposeTile) {
+    const index_t ytend = std::min(yt + kTransposeTile, yend);
+    for (index_t xt = xbegin; xt < xend; xt += kTransposeTile) {
+      const index_t xtend = std::min(xt + kTransposeTile, xend);
+      index_t y = yt;
+      for (; y + k <= ytend; y += k) {
+        index_t x = xt;
+        for (; x + k <= xtend; x += k) {
+          P row[P::kSize];
+          for (index_t i = 0; i < k; ++i)
+            row[i] = P::Load(src.dptr_ + (x + i) * src.stride_ + y);
+          packet::Transpose(row);
+          for (index_t i = 0; i < k; ++i) {
+            packet::Saver<Saver, DType, kArch>::Save(
+                dst.dptr_ + (y + i) * dst.stride_ + x, row[i]);
+          }
+        }
+        for (; x < xtend; ++x) {
+          for (index_t i = y; i < y + k; ++i) {
+            Saver::template Save<DType>(dst.dptr_[i * dst.stride_ + x],
+                                        src.dptr_[x * src.stride_ + i]);
+          }
+        }
+      }
+      for (; y < ytend; ++y) {
+        for (index_t x = xt; x < xtend; ++x) {
+          Saver::template Save<DType>(dst.dptr_[y * dst.stride_ + x],
+                                      src.dptr_[x * src.stride_ + y]);
+        }
+      }
+    }
+  }
+}
+
+// kPacket is true when both sides can be evaluated packet-wise
+// plans only hold pointers and scalars, so they are built on the caller and
+// copied into the stream task, the expression itself may be gone by then
+template <bool kPacket, typename Saver, typename R, int dim, typename DType,
+          typename E, int etype>
+struct MapExpEngine {
+  inline static void Map(TRValue<R, dim, DType> *dst,
+                         const expr::Exp<E, DType, etype> &exp) {
+    Shape<2> shape = expr::ShapeCheck<dim, R>::Check(dst->self()).FlatTo2D();
+    expr::Plan<R, DType> dplan = expr::MakePlan(dst->self());
+    expr::Plan<E, DType> plan = expr::MakePlan(exp.self());
+    Stream *stream = dst->self().stream_;
+    RunOnStream(stream, [=]() {
+      ParallelMap<DType>(stream, shape,
+                         [&](index_t ybegin, index_t yend, index_t xbegin,
+                             index_t xend) {
+                           if (expr::ExpTranspose<E>::kHas) {
+                             MapPlanTiled<Saver>(dplan, plan, ybegin, yend,
+                                                 xbegin, xend);
+                           } else {
+                             MapPlan<Saver>(dplan, plan, ybegin, yend, xbegin,
+                                            xend);
+                           }
+                         });
+    });
+  }
+};
+
+// dst = src.T() of a tensor, tile by tile, with the blocks of a tile
+// transposed in registers
+template <typename Saver, typename DType, int etype>
+struct MapExpEngine<false, Saver, Tensor<2, DType>, 2, DType,
+                    expr::TransposeExp<Tensor<2, DType>, DType>, etype> {
+  inline static void
+  Map(TRValue<Tensor<2, DType>, 2, DType> *dst,
+      const expr::Exp<expr::TransposeExp<Tensor<2, DType>, DType>, DType,
+                      etype> &exp) {
+    Tensor<2, DType> t = dst->self();
+    Tensor<2, DType> src = exp.self().expr;
+    RunOnStream(t.stream_, [=]() {
+      ParallelMap<DType>(t.stream_, t.shape_,
+                         [&](index_t ybegin, index_t yend, index_t xbegin,
+                             index_t xend) {
+                           TransposeTiles<Saver>(t, src, ybegin, yend, xbegin,
+                                                 xend);
+                         });
+    });
+  }
+};
+
+template <typename Saver, int dim, typename DType, typename E, int etype>
+struct MapExpEngine<true, Saver, Tensor<dim, DType>, dim, DType, E, etype> {
+  inline static void Map(TRValue<Tensor<dim, DType>, dim, DType> *dst,
+                         const expr::Exp<E, DType, etype> &exp) {
+    const packet::PacketArch kArch = packet::PacketDefault<DType>::kArch;
+    Tensor<dim, DType> t = dst->self();
+    expr::PacketPlan<E, DType, kArch> plan =
+        expr::MakePacketPlan<kArch>(exp.self());
+    expr::PacketTail<E, DType, kArch> tail(exp.self());
+    RunOnStream(t.stream_, [=]() {
+      ParallelMap<DType>(t.stream_, t.shape_.FlatTo2D(),
+                         [&](index_t ybegin, index_t yend, index_t xbegin,
+                             index_t xend) {
+                           expr::MapPacketPlan<Saver>(t, plan, tail, ybegin,
+                                                      yend, xbegin, xend);
+                         });
+    });
+  }
+};
+
+template <typename Saver, typename R, int dim, typename DType, typename E,
+          int etype>
+inline void MapExp(TRValue<R, dim, DType> *dst,
+                   const expr::Exp<E, DType, etype> &exp) {
+  expr::TypeCheckPass<expr::TypeCheck<dim, DType, E>::kMapPass>::
+      Error_All_Tensor_in_Exp_Must_Have_Same_Type();
+  Shape<dim> eshape = expr::ShapeCheck<dim, E>::Check(exp.self());
+  Shape<dim> dshape = expr::ShapeCheck<dim, R>::Check(dst->self());
+  CHECK(eshape[0] == 0 || eshape == dshape)
+      << "Assignment: Shape of Tensors are not consistent with target, "
+      << "eshape: " << eshape << " dshape:" << dshape;
+  const packet::PacketArch kArch = packet::PacketDefault<DType>::kArch;
+  MapExpEngine<kArch != packet::kPlain &&
+                   expr::PacketCheck<E, kArch>::kPass &&
+                   expr::PacketCheck<R, kArch>::kPass,
+               Saver, R, dim, DType, E, etype>::Map(dst, exp);
+}
+
+// a leaf of the pairwise reduction folds at most kReduceBlock elements of a
+// row, or kReduceRows rows, one after another
+const index_t kReduceBlock = 1024;
+const index_t kReduceRows = 32;
+
+// the plan a reduction runs on, kPacket as in MapExpEngine
+template <bool kPacket, typename E, typename DType> struct ReducePlan {
+  typedef expr::Plan<E, DType> Type;
+  inline static Type Make(const E &exp) { return expr::MakePlan(exp); }
+};
+template <typename E, typename DType> struct ReducePlan<true, E, DType> {
+  static const packet::PacketArch kArch = packet::PacketDefault<DType>::kArch;
+  typedef expr::PacketPlan<E, DType, kArch> Type;
+  inline static Type Make(const E &exp) {
+    return expr::MakePacketPlan<kArch>(exp);
+  }
+};
+
+// fold of plan(y, [xbegin, xend)) with four independent accumulators, long
+// rows are split in halves and combined pairwise
+template <typename Reducer, typename E, typename DType>
+inline DType ReduceRow(const expr::Plan<E, DType> &plan, index_t y,
+                       index_t xbegin, index_t xend) {
+  if (xend - xbegin > kReduceBlock) {
+    const index_t xmid = xbegin + (xend - xbegin) / 2;
+    DType res = ReduceRow<Reducer>(plan, y, xbegin, xmid);
+    Reducer::Reduce(res, ReduceRow<Reducer>(plan, y, xmid, xend));
+    return res;
+  }
+  DType acc[4];
+  for (int i = 0; i < 4; ++i)
+    Reducer::SetInitValue(acc[i]);
+  index_t x = xbegin;
+  for (; x + 4 <= xend; x += 4) {
+    for (int i = 0; i < 4; ++i)
+      Reducer::Reduce(acc[i], plan.Eval(y, x + i));
+  }
+  for (; x < xend; ++x)
+    Reducer::Reduce(acc[0], plan.Eval(y, x));
+  Reducer::Reduce(acc[0], acc[1]);
+  Reducer::Reduce(acc[2], acc[3]);
+  Reducer::Reduce(acc[0], acc[2]);
+  return acc[0];
+}
+
+template <typename Reducer, typename E, typename DType,
+          packet::PacketArch Arch>
+inline DType ReduceRow(const expr::PacketPlan<E, DType, Arch> &plan,
+                       index_t y, index_t xbegin, index_t xend) {
+  typedef packet::Packet<DType, Arch> P;
+  typedef packet::PacketReducer<Reducer, DType, Arch> PR;
+  const index_t kStep = 4 * P::kSize;
+  if (xend - xbegin > kReduceBlock) {
+    const index_t xmid = xbegin + (xend - xbegin) / 2 / kStep * kStep;
+    DType res = ReduceRow<Reducer>(plan, y, xbegin, xmid);
+    Reducer::Reduce(res, ReduceRow<Reducer>(plan, y, xmid, xend));
+    return res;
+  }
+  DType init;
+  Reducer::SetInitValue(init);
+  P acc0 = P::Fill(init), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+  index_t x = xbegin;
+  for (; x + kStep <= xend; x += kStep) {
+    acc0 = PR::Reduce(acc0, plan.EvalPacket(y, x));
+    acc1 = PR::Reduce(acc1, plan.EvalPacket(y, x + P::kSize));
+    acc2 = PR::Reduce(acc2, plan.EvalPacket(y, x + 2 * P::kSize));
+    acc3 = PR::Reduce(acc3, plan.EvalPacket(y, x + 3 * P::kSize));
+  }
+  for (; x + P::kSize <= xend; x += P::kSize)
+    acc0 = PR::Reduce(acc0, plan.EvalPacket(y, x));
+  DType res = PR::Horizontal(
+      PR::Reduce(PR::Reduce(acc0, acc1), PR::Reduce(acc2, acc3)));
+  for (; x < xend; ++x)
+    Reducer::Reduce(res, plan.Eval(y, x));
+  return res;
+}
+
+// acc[x - xbegin] = fold of plan([ybegin, yend), x), four rows at a time
+template <typename Reducer, typename E, typename DType>
+inline void ReduceRowsInto(const expr::Plan<E, DType> &plan, index_t ybegin,
+                           index_t yend, index_t xbegin, index_t xend,
+                           DType *acc) {
+  for (index_t x = xbegin; x < xend; ++x)
+    Reducer::SetInitValue(acc[x - xbegin]);
+  for (index_t y = ybegin; y < yend; y += 4) {
+    const index_t ny = yend - y < 4 ? yend - y : 4;
+    for (index_t x = xbegin; x < xend; ++x) {
+      DType res = plan.Eval(y, x);
+      for (index_t i = 1; i < ny; ++i)
+        Reducer::Reduce(res, plan.Eval(y + i, x));
+      Reducer::Reduce(acc[x - xbegin], res);
+    }
+  }
+}
+
+template <typename Reducer, typename E, typename DType,
+          packet::PacketArch Arch>
+inline void ReduceRowsInto(const expr::PacketPlan<E, DType, Arch> &plan,
+                           index_t ybegin, index_t yend, index_t xbegin,
+                           index_t xend, DType *acc) {
+  typedef packet::Packet<DType, Arch> P;
+  typedef packet::PacketReducer<Reducer, DType, Arch> PR;
+  const index_t xlen = xbegin + packet::LowerAlign<DType, Arch>(xend - xbegin);
+  for (index_t x = xbegin; x < xend; ++x)
+    Reducer::SetInitValue(acc[x - xbegin]);
+  for (index_t y = ybegin; y < yend; y += 4) {
+    if (yend - y >= 4) {
+      for (index_t x = xbegin; x < xlen; x += P::kSize) {
+        P res = PR::Reduce(
+            PR::Reduce(plan.EvalPacket(y, x), plan.EvalPacket(y + 1, x)),
+            PR::Reduce(plan.EvalPacket(y + 2, x), plan.EvalPacket(y + 3, x)));
+        PR::Reduce(P::Load(acc + x - xbegin), res).Store(acc + x - xbegin);
+      }
+    } else {
+      for (index_t i = y; i < yend; ++i) {
+        for (index_t x = xbegin; x < xlen; x += P::kSize) {
+          PR::Reduce(P::Load(acc + x - xbegin), plan.EvalPacket(i, x))
+              .Store(acc + x - xbegin);
+        }
+      }
+    }
+    for (index_t i = y; i < yend && i < y + 4; ++i) {
+      for (index_t x = xlen; x < xend; ++x)
+        Reducer::Reduce(acc[x - xbegin], plan.Eval(i, x));
+    }
+  }
+}
+
+// acc[x - xbegin] = fold of plan([ybegin, yend), x), pairwise over rows
+template <typename Reducer, typename P, typename DType>
+inline void ReduceRowsPairwise(const P &plan, index_t ybegin, index_t yend,
+                               index_t xbegin, index_t xend, DType *acc) {
+  if (yend - ybegin <= kReduceRows) {
+    ReduceRowsInto<Reducer>(plan, ybegin, yend, xbegin, xend, acc);
+    return;
+  }
+  const index_t ymid = ybegin + (yend - ybegin) / 2;
+  std::vector<DType> tmp(xend - xbegin);
+  ReduceRowsPairwise<Reducer>(plan, ybegin, ymid, xbegin, xend, acc);
+  ReduceRowsPairwise<Reducer>(plan, ymid, yend, xbegin, xend, tmp.data());
+  for (index_t x = 0; x < xend - xbegin; ++x)
+    Reducer::Reduce(acc[x], tmp[x]);
+}
+
+// row t of slice c, where slice c of the flattened (y, x) space is the rows
+// y = (t / inner * nslice + c) * inner + t % inner
+inline index_t SliceRow(index_t c, index_t t, index_t nslice, index_t inner) {
+  return (t / inner * nslice + c) * inner + t % inner;
+}
+
+// fold of the short rows [tbegin, tend) of slice c, the accumulators are
+// only folded once at the end
+template <typename Reducer, typename E, typename DType>
+inline DType ReduceSliceRows(const expr::Plan<E, DType> &plan, index_t c,
+                             index_t tbegin, index_t tend, index_t nslice,
+                             index_t inner, index_t xsize) {
+  DType acc[4];
+  for (int i = 0; i < 4; ++i)
+    Reducer::SetInitValue(acc[i]);
+  for (index_t t = tbegin; t < tend; ++t) {
+    const index_t y = SliceRow(c, t, nslice, inner);
+    index_t x = 0;
+    for (; x + 4 <= xsize; x += 4) {
+      for (int i = 0; i < 4; ++i)
+        Reducer::Reduce(acc[i], plan.Eval(y, x + i));
+    }
+    for (; x < xsize; ++x)
+      Reducer::Reduce(acc[0], plan.Eval(y, x));
+  }
+  Reducer::Reduce(acc[0], acc[1]);
+  Reducer::Reduce(acc[2], acc[3]);
+  Reducer::Reduce(acc[0], acc[2]);
+  return acc[0];
+}
+
+template <typename Reducer, typename E, typename DType,
+          packet::PacketArch Arch>
+inline DType ReduceSliceRows(const expr::PacketPlan<E, DType, Arch> &plan,
+                             index_t c, index_t tbegin, index_t tend,
+                             index_t nslice, index_t inner, index_t xsize) {
+  typedef packet::Packet<DType, Arch> P;
+  typedef packet::PacketReducer<Reducer, DType, Arch> PR;
+  const index_t kStep = 4 * P::kSize;
+  DType res;
+  Reducer::SetInitValue(res);
+  P acc0 = P::Fill(res), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+  for (index_t t = tbegin; t < tend; ++t) {
+    const index_t y = SliceRow(c, t, nslice, inner);
+    index_t x = 0;
+    for (; x + kStep <= xsize; x += kStep) {
+      acc0 = PR::Reduce(acc0, plan.EvalPacket(y, x));
+      acc1 = PR::Reduce(acc1, plan.EvalPacket(y, x + P::kSize));
+      acc2 = PR::Reduce(acc2, plan.EvalPacket(y, x + 2 * P::kSize));
+      acc3 = PR::Reduce(acc3, plan.EvalPacket(y, x + 3 * P::kSize));
+    }
+    for (; x + P::kSize <= xsize; x += P::kSize)
+      acc0 = PR::Reduce(acc0, plan.EvalPacket(y, x));
+    for (; x < xsize; ++x)
+      Reducer::Reduce(res, plan.Eval(y, x));
+  }
+  Reducer::Reduce(res, PR::Horizontal(PR::Reduce(PR::Reduce(acc0, acc1),
+                                                 PR::Reduce(acc2, acc3))));
+  return res;
+}
+
+// fold of the rows [tbegin, tend) of slice c, pairwise over rows
+template <typename Reducer, typename DType, typename P>
+inline DType ReduceSlicePairwise(const P &plan, index_t c, index_t tbegin,
+                                 index_t tend, index_t nslice, index_t inner,
+                                 index_t xsize) {
+  if (tend - tbegin == 1)
+    return ReduceRow<Reducer>(plan, SliceRow(c, tbegin, nslice, inner), 0,
+                              xsize);
+  if ((tend - tbegin) * xsize > kReduceBlock) {
+    const index_t tmid = tbegin + (tend - tbegin) / 2;
+    DType res = ReduceSlicePairwise<Reducer, DType>(plan, c, tbegin, tmid,
+                                                    nslice, inner, xsize);
+    Reducer::Reduce(res, ReduceSlicePairwise<Reducer, DType>(
+                             plan, c, tmid, tend, nslice, inner, xsize));
+    return res;
+  }
+  return ReduceSliceRows<Reducer>(plan, c, tbegin, tend, nslice, inner,
+                                  xsize);
+}
+
+// fold part[s * len, (s + 1) * len) for s < nsplit into part[0, len) as a
+// binary tree, the order only depends on nsplit
+template <typename Reducer, typename DType>
+inline void ReduceTreeCombine(DType *part, index_t nsplit, index_t len,
+                              index_t begin, index_t end) {
+  for (index_t step = 1; step < nsplit; step *= 2) {
+    for (index_t s = 0; s + step < nsplit; s += 2 * step) {
+      DType *dst = part + s * len, *src = part + (s + step) * len;
+      for (index_t i = begin; i < end; ++i)
+        Reducer::Reduce(dst[i], src[i]);
+    }
+  }
+}
+
+// number of pieces the reduced extent of each of nout outputs is cut into,
+// so that there is work for every thread of pool
+inline index_t ReduceSplit(ThreadPool *pool, index_t nout, index_t nitem) {
+  const index_t nthread = pool != nullptr ? pool->NumThreads() : 1;
+  if (nthread <= nout)
+    return 1;
+  const index_t nsplit = (nthread + nout - 1) / nout;
+  return nsplit < nitem ? nsplit : (nitem > 0 ? nitem : 1);
+}
+
+template <bool kPacket, typename Saver, typename Reducer, typename R,
+          typename DType, typename E>
+inline void MapReduceKeepLowestEngine(TRValue<R, 1, DType> *dst, const E &exp,
+                                      DType scale) {
+  const int kDim = expr::ExpInfo<E>::kDim;
+  Shape<2> shape = expr::ShapeCheck<kDim, E>::Check(exp).FlatTo2D();
+  Shape<1> dshape = expr::ShapeCheck<1, R>::Check(dst->self());
+  CHECK_EQ(dshape[0], shape[1])
+      << "reduction: dst size mismatch with the kept dimension";
+  expr::Plan<R, DType> dplan = expr::MakePlan(dst->self());
+  typename ReducePlan<kPacket, E, DType>::Type plan =
+      ReducePlan<kPacket, E, DType>::Make(exp);
+  Stream *stream = dst->self().stream_;
+  RunOnStream(stream, [=]() {
+    ThreadPool *pool = GetPool(stream);
+    const index_t nrow = shape[0], ncol = shape[1];
+    const index_t nxblock = (ncol + kReduceBlock - 1) / kReduceBlock;
+    const index_t nsplit =
+        ReduceSplit(pool, nxblock, (nrow + kReduceRows - 1) / kReduceRows);
+    std::vector<DType> part(nsplit * ncol);
+    auto task = [&](index_t begin, index_t end) {
+      for (index_t i = begin; i < end; ++i) {
+        const index_t xb = i % nxblock, s = i / nxblock;
+        const index_t xbegin = xb * kReduceBlock;
+        const index_t xend =
+            xbegin + kReduceBlock < ncol ? xbegin + kReduceBlock : ncol;
+        ReduceRowsPairwise<Reducer>(plan, nrow * s / nsplit,
+                                    nrow * (s + 1) / nsplit, xbegin, xend,
+                                    part.data() + s * ncol + xbegin);
+      }
+    };
+    auto combine = [&](index_t begin, index_t end) {
+      const index_t xbegin = begin * kReduceBlock;
+      const index_t xend =
+          end * kReduceBlock < ncol ? end * kReduceBlock : ncol;
+      ReduceTreeCombine<Reducer>(part.data(), nsplit, ncol, xbegin, xend);
+      expr::Plan<R, DType> out = dplan;
+      for (index_t x = xbegin; x < xend; ++x)
+        Saver::template Save<DType>(out.REval(0, x), part[x] * scale);
+    };
+    if (pool != nullptr) {
+      pool->ParallelFor(0, nxblock * nsplit, 1, task);
+      pool->ParallelFor(0, nxblock, 1, combine);
+    } else {
+      task(0, nxblock * nsplit);
+      combine(0, nxblock);
+    }
+  });
+}
+
+template <bool kPacket, typename Saver, typename Reducer, int dimkeep,
+          typename R, typename DType, typename E>
+inline void MapReduceKeepHighDimEngine(TRValue<R, 1, DType> *dst,
+                                       const E &exp, DType scale) {
+  const int kDim = expr::ExpInfo<E>::kDim;
+  Shape<kDim> sshape = expr::ShapeCheck<kDim, E>::Check(exp);
+  Shape<1> dshape = expr::ShapeCheck<1, R>::Check(dst->self());
+  CHECK_EQ(dshape[0], sshape[dimkeep])
+      << "reduction: dst size mismatch with the kept dimension";
+  // the flattened rows are (outer, nslice, inner)
+  index_t inner = 1;
+  for (int i = dimkeep + 1; i < kDim - 1; ++i)
+    inner *= sshape[i];
+  const index_t nslice = sshape[dimkeep];
+  Shape<2> shape = sshape.FlatTo2D();
+  const index_t nitem = nslice > 0 ? shape[0] / nslice : 0;
+  expr::Plan<R, DType> dplan = expr::MakePlan(dst->self());
+  typename ReducePlan<kPacket, E, DType>::Type plan =
+      ReducePlan<kPacket, E, DType>::Make(exp);
+  Stream *stream = dst->self().stream_;
+  RunOnStream(stream, [=]() {
+    ThreadPool *pool = GetPool(stream);
+    const index_t nsplit = ReduceSplit(pool, nslice, nitem);
+    std::vector<DType> part(nsplit * nslice);
+    auto task = [&](index_t begin, index_t end) {
+      for (index_t i = begin; i < end; ++i) {
+        const index_t c = i % nslice, s = i / nslice;
+        part[i] = ReduceSlicePairwise<Reducer, DType>(
+            plan, c, nitem * s / nsplit, nitem * (s + 1) / nsplit, nslice,
+            inner, shape[1]);
+      }
+    };
+    if (pool != nullptr) {
+      pool->ParallelFor(0, nslice * nsplit, 1, task);
+    } else {
+      task(0, nslice * nsplit);
+    }
+    ReduceTreeCombine<Reducer>(part.data(), nsplit, nslice, 0, nslice);
+    expr::Plan<R, DType> out = dplan;
+    for (index_t c = 0; c < nslice; ++c)
+      Saver::template Save<DType>(out.REval(0, c), part[c] * scale);
+  });
+}
+
+template <typename Saver, typename Reducer, typename R, typename DType,
+          typename E, int etype>
+inline void MapReduceKeepLowest(TRValue<R, 1, DType> *dst,
+                                const expr::Exp<E, DType, etype> &exp,
+                                DType scale) {
+  expr::TypeCheckPass<expr::TypeCheck<1, DType, E>::kRedPass>::
+      Error_TypeCheck_Not_Pass_For_Reduce_Exp();
+  const packet::PacketArch kArch = packet::PacketDefault<DType>::kArch;
+  MapReduceKeepLowestEngine<
+      kArch != packet::kPlain && expr::PacketCheck<E, kArch>::kPass &&
+          packet::PacketReducer<Reducer, DType, kArch>::kEnabled,
+      Saver, Reducer>(dst, exp.self(), scale);
+}
+
+template <typename Saver, typename Reducer, int dimkeep, typename R,
+          typename DType, typename E, int etype>
+inline void MapReduceKeepHighDim(TRValue<R, 1, DType> *dst,
+                                 const expr::Exp<E, DType, etype> &exp,
+                                 DType scale) {
+  expr::TypeCheckPass<expr::TypeCheck<1, DType, E>::kRedPass>::
+      Error_TypeCheck_Not_Pass_For_Reduce_Exp();
+  const packet::PacketArch kArch = packet::PacketDefault<DType>::kArch;
+  MapReduceKeepHighDimEngine<
+      kArch != packet::kPlain && expr::PacketCheck<E, kArch>::kPass &&
+          packet::PacketReducer<Reducer, DType, kArch>::kEnabled,
+      Saver, Reducer, dimkeep>(dst, exp.self(), scale);
+}
+
+// copies of at least kCopyStreamMin bytes would not stay in the cache, they
+// use non-temporal stores so they do not evict the working set either
+const size_t kCopyStreamMin = size_t(4) << 20;
+// below kCopyParallelMin bytes one thread does the copy
+const size_t kCopyParallelMin = size_t(256) << 10;
+
+// dst = src, contiguous tensors are copied as a single row; the rows are split
+// over the threads of stream, or when there are fewer rows than threads each
+// row is cut into cache line aligned pieces
+template <int dim, typename DType>
+inline void Copy(Tensor<dim, DType> dst, const Tensor<dim, DType> &src,
+                 Stream *stream) {
+  CHECK_EQ(dst.shape_, src.shape_)
+      << "Copy: shape mismatch, dst " << dst.shape_ << " src " << src.shape_;
+  const bool flat = dst.CheckContiguous() && src.CheckContiguous();
+  const Tensor<2, DType> to = dst.FlatTo2D(), from = src.FlatTo2D();
+  const index_t nrow = flat ? 1 : to.size(0);
+  const size_t rbytes = sizeof(DType) * (flat ? to.shape_.Size() : to.size(1));
+  RunOnStream(stream, [=]() {
+    ThreadPool *pool = GetPool(stream);
+    const size_t bytes = rbytes * nrow;
+    const bool nt = bytes >= kCopyStreamMin;
+    auto copy = [&](index_t row, size_t begin, size_t end) {
+      char *d = reinterpret_cast<char *>(to.dptr_ + row * to.stride_);
+      const char *s =
+          reinterpret_cast<const char *>(from.dptr_ + row * from.stride_);
+      if (nt) {
+        packet::StreamCopy(d + begin, s + begin, end - begin);
+      } else {
+        std::memcpy(d + begin, s + begin, end - begin);
+      }
+    };
+    const int nchunk =
+        pool == nullptr || bytes < kCopyParallelMin ? 1 : pool->NumThreads();
+    auto chunk = [&](int c) {
+      if (nrow >= nchunk) {
+        for (index_t y = nrow * c / nchunk; y < nrow * (c + 1) / nchunk; ++y)
+          copy(y, 0, rbytes);
+      } else {
+        const size_t begin = rbytes * c / nchunk & ~size_t(63);
+        const size_t end =
+            c + 1 == nchunk ? rbytes : rbytes * (c + 1) / nchunk & ~size_t(63);
+        for (index_t y = 0; y < nrow; ++y)
+          copy(y, begin, end);
+      }
+      if (nt)
+        packet::StreamFence();
+    };
+    if (nchunk == 1) {
+      chunk(0);
+    } else {
+      pool->Run(nchunk, chunk);
+    }
+  });
+}
+
+// ## gather and scatter
+// rows ahead of the one being copied that are prefetched, enough to cover
+// the latency of a miss to dram
+const index_t kIndexPrefetch = 8;
+// below kIndexParallelMin copied elements one thread does all the rows
+const index_t kIndexParallelMin = index_t(1) << 15;
+
+// prefetch the n elements of a row, one hint per cache line
+template <typename DType> inline void PrefetchRow(const DType *row, index_t n) {
+  for (index_t i = 0; i < n; i += index_t(64 / sizeof(DType)))
+    packet::Prefetch(row + i);
+}
+
+// dst[index[i]] = src[i]; every thread owns a block of dst rows and copies
+// the src rows that land in it in order, so threads never write the same
+// row and a repeated index keeps the last row as in a serial loop
+template <typename IndexType, typename DType>
+inline void IndexFill(Tensor<2, DType> dst, const Tensor<1, IndexType> &index,
+                      const Tensor<2, DType> &src) {
+  CHECK_EQ(index.size(0), src.size(0))
+      << "IndexFill: index and src must have the same number of rows";
+  CHECK_EQ(dst.size(1), src.size(1))
+      << "IndexFill: dst and src rows must have the same length";
+  Tensor<1, IndexType> idx = index;
+  Tensor<2, DType> from = src;
+  RunOnStream(dst.stream_, [=]() {
+    ThreadPool *pool = GetPool(dst.stream_);
+    const index_t n = idx.size(0), nrow = dst.size(0), ncol = dst.size(1);
+    auto copy = [&](index_t row, index_t i) {
+      std::memcpy(dst.dptr_ + row * dst.stride_, from.dptr_ + i * from.stride_,
+                  sizeof(DType) * ncol);
+    };
+    auto target = [&](index_t i) {
+      const index_t row = index_t(idx.dptr_[i]);
+      CHECK(row >= 0 && row < nrow)
+          << "IndexFill: index " << row << " out of range " << nrow;
+      return row;
+    };
+    if (pool == nullptr || pool->NumThreads() == 1 ||
+        n * ncol < kIndexParallelMin) {
+      for (index_t i = 0; i < n; ++i) {
+        if (i + kIndexPrefetch < n) {
+          PrefetchRow(from.dptr_ + (i + kIndexPrefetch) * from.stride_, ncol);
+          const index_t ahead = index_t(idx.dptr_[i + kIndexPrefetch]);
+          if (ahead >= 0 && ahead < nrow)
+            PrefetchRow(dst.dptr_ + ahead * dst.stride_, ncol);
+        }
+        copy(target(i), i);
+      }
+      return;
+    }
+    // chunk c owns the rows [nrow * c / nchunk, nrow * (c + 1) / nchunk);
+    // one pass checks every index and counts it for its owner, a second
+    // lays the src rows of each chunk out in order, so a worker only walks
+    // its own bucket
+    index_t nchunk = pool->NumThreads();
+    if (nchunk > nrow)
+      nchunk = nrow;
+    std::vector<index_t> rows(static_cast<size_t>(n));
+    std::vector<index_t> start(static_cast<size_t>(nchunk + 1), 0);
+    std::vector<index_t> order(static_cast<size_t>(n));
+    for (index_t i = 0; i < n; ++i) {
+      rows[i] = target(i);
+      ++start[((rows[i] + 1) * nchunk - 1) / nrow + 1];
+    }
+    for (index_t c = 0; c < nchunk; ++c)
+      start[c + 1] += start[c];
+    std::vector<index_t> pos(start.begin(), start.end() - 1);
+    for (index_t i = 0; i < n; ++i)
+      order[pos[((rows[i] + 1) * nchunk - 1) / nrow]++] = i;
+    pool->ParallelFor(0, nchunk, 1, [&](index_t cbegin, index_t cend) {
+      const index_t jend = start[cend];
+      for (index_t j = start[cbegin]; j < jend; ++j) {
+        if (j + kIndexPrefetch < jend) {
+          const index_t ahead = order[j + kIndexPrefetch];
+          PrefetchRow(from.dptr_ + ahead * from.stride_, ncol);
+          PrefetchRow(dst.dptr_ + rows[ahead] * dst.stride_, ncol);
+        }
+        copy(rows[order[j]], order[j]);
+      }
+    });
+  });
+}
+
+// ## sort
+// maps a key to an unsigned integer of the same width whose order is the
+// order of the keys; negative floats are flipped whole, the others only get
+// their sign bit set, so -0 sorts before +0 and NaNs go to the ends
+template <typename DType, bool kSigned = std::is_signed<DType>::value,
+          bool kFloat = std::is_floating_point<DType>::value>
+struct SortKeyBits {
+  typedef typename std::make_unsigned<DType>::type UType;
+  static const UType kSignBit =
+      kSigned ? UType(UType(1) << (8 * sizeof(UType) - 1)) : UType(0);
+  inline static UType Encode(DType key) {
+    return UType(UType(key) ^ kSignBit);
+  }
+  inline static DType Decode(UType bits) {
+    return DType(UType(bits ^ kSignBit));
+  }
+};
+template <typename DType> struct SortKeyBits<DType, true, true> {
+  typedef typename std::conditional<sizeof(DType) == 4, uint32_t,
+                                    uint64_t>::type UType;
+  static const UType kSignBit = UType(1) << (8 * sizeof(UType) - 1);
+  inline static UType Encode(DType key) {
+    UType bits;
+    std::memcpy(&bits, &key, sizeof(bits));
+    return (bits & kSignBit) != 0 ? ~bits : bits | kSignBit;
+  }
+  inline static DType Decode(UType bits) {
+    bits = (bits & kSignBit) != 0 ? bits & ~kSignBit : ~bits;
+    DType key;
+    std::memcpy(&key, &bits, sizeof(key));
+    return key;
+  }
+};
+
+// below kSortRadixMin pairs a comparison sort on the packed pairs is faster
+// than the passes of the radix sort
+const index_t kSortRadixMin = 2048;
+// the radix sort takes kSortRadixBits of the key per pass, 11 bits need a
+// pass less than bytes on 32 and 64 bit keys while the counts still fit in L1
+const int kSortRadixBits = 11;
+const index_t kSortRadixBucket = index_t(1) << kSortRadixBits;
+
+// threads a sort pass over n items is split over
+inline int SortChunks(ThreadPool *pool, index_t n) {
+  if (pool == nullptr)
+    return 1;
+  return int(std::min(index_t(pool->NumThreads()),
+                      (n + kSortRadixMin - 1) / kSortRadixMin));
+}
+
+template <typename UType, typename VDType> struct SortItem {
+  UType key;
+  VDType value;
+};
+
+// stable LSD radix sort of the n items in buf, tmp is scratch of the same
+// size; every pass counts the digits of each thread chunk, then scatters
+// the chunk from per thread offsets, passes where every key has the same
+// digit are skipped; returns the buffer that holds the result
+template <typename UType, typename VDType>
+inline SortItem<UType, VDType> *
+RadixSortItems(ThreadPool *pool, SortItem<UType, VDType> *buf,
+               SortItem<UType, VDType> *tmp, index_t n) {
+  const int npass =
+      int((8 * sizeof(UType) + kSortRadixBits - 1) / kSortRadixBits);
+  const int nchunk = SortChunks(pool, n);
+  std::vector<index_t> hist(size_t(nchunk) * kSortRadixBucket);
+  auto run = [&](const std::function<void(int)> &func) {
+    if (pool == nullptr) {
+      func(0);
+    } else {
+      pool->Run(nchunk, func);
+    }
+  };
+  for (int pass = 0; pass < npass; ++pass) {
+    const int shift = pass * kSortRadixBits;
+    run([&](int c) {
+      index_t *h = &hist[size_t(c) * kSortRadixBucket];
+      std::fill(h, h + kSortRadixBucket, index_t(0));
+      for (index_t i = n * c / nchunk; i < n * (c + 1) / nchunk; ++i)
+        ++h[(buf[i].key >> shift) & (kSortRadixBucket - 1)];
+    });
+    // exclusive prefix sum in digit major order gives each chunk the
+    // place of its first item of every digit
+    index_t sum = 0;
+    bool trivial = false;
+    for (index_t d = 0; d < kSortRadixBucket; ++d) {
+      index_t total = 0;
+      for (int c = 0; c < nchunk; ++c) {
+        const index_t cnt = hist[size_t(c) * kSortRadixBucket + d];
+        hist[size_t(c) * kSortRadixBucket + d] = sum + total;
+        total += cnt;
+      }
+      trivial = trivial || total == n;
+      sum += total;
+    }
+    if (trivial)
+      continue;
+    run([&](int c) {
+      index_t *pos = &hist[size_t(c) * kSortRadixBucket];
+      for (index_t i = n * c / nchunk; i < n * (c + 1) / nchunk; ++i)
+        tmp[pos[(buf[i].key >> shift) & (kSortRadixBucket - 1)]++] = buf[i];
+    });
+    std::swap(buf, tmp);
+  }
+  return buf;
+}
+
+// stable, equal keys keep the order of their values
+template <typename KDType, typename VDType>
+inline void SortByKey(Tensor<1, KDType> keys, Tensor<1, VDType> values,
+                      bool is_ascend) {
+  CHECK_EQ(keys.size(0), values.size(0))
+      << "SortByKey: keys and values must have the same size";
+  typedef SortKeyBits<KDType> Bits;
+  typedef typename Bits::UType UType;
+  typedef SortItem<UType, VDType> Item;
+  RunOnStream(keys.stream_, [=]() {
+    ThreadPool *pool = GetPool(keys.stream_);
+    const index_t n = keys.size(0);
+    if (n < 2)
+      return;
+    // descending order sorts the complemented keys, which stays stable
+    const UType flip = is_ascend ? UType(0) : ~UType(0);
+    const size_t bytes = sizeof(Item) * size_t(n);
+    Item *buf = static_cast<Item *>(AllocBytes(bytes));
+    auto parallel = [&](const std::function<void(index_t, index_t)> &func) {
+      if (pool == nullptr || n < kSortRadixMin) {
+        func(0, n);
+      } else {
+        pool->ParallelFor(0, n, kSortRadixMin, func);
+      }
+    };
+    parallel([&](index_t begin, index_t end) {
+      for (index_t i = begin; i < end; ++i) {
+        buf[i].key = Bits::Encode(keys.dptr_[i]) ^ flip;
+        buf[i].value = values.dptr_[i];
+      }
+    });
+    Item *res = buf;
+    Item *tmp = nullptr;
+    if (n < kSortRadixMin) {
+      std::stable_sort(buf, buf + n, [](const Item &a, const Item &b) {
+        return a.key < b.key;
+      });
+    } else {
+      tmp = static_cast<Item *>(AllocBytes(bytes));
+      res = RadixSortItems(pool, buf, tmp, n);
+    }
+    parallel([&](index_t begin, index_t end) {
+      for (index_t i = begin; i < end; ++i) {
+        keys.dptr_[i] = Bits::Decode(res[i].key ^ flip);
+        values.dptr_[i] = res[i].value;
+      }
+    });
+    FreeBytes(buf);
+    if (tmp != nullptr)
+      FreeBytes(tmp);
+  });
+}
+
+// segments of at least kSortLongSegment keys are sorted by all threads of
+// the pool together, shorter ones by one thread each
+const index_t kSortLongSegment = index_t(1) << 16;
+
+template <typename UType, packet::PacketArch Arch>
+inline void CompareExchange(packet::Packet<UType, Arch> &a,
+                            packet::Packet<UType, Arch> &b) {
+  const packet::Packet<UType, Arch> lo = Min(a, b);
+  b = Max(a, b);
+  a = lo;
+}
+
+// sorts the 8 keys of every lane of k with the 19 comparator network, all
+// lanes at once with packet Min and Max
+template <typename UType, packet::PacketArch Arch>
+inline void SortNetwork8(packet::Packet<UType, Arch> *k) {
+  CompareExchange(k[0], k[2]), CompareExchange(k[1], k[3]);
+  CompareExchange(k[4], k[6]), CompareExchange(k[5], k[7]);
+  CompareExchange(k[0], k[4]), CompareExchange(k[1], k[5]);
+  CompareExchange(k[2], k[6]), CompareExchange(k[3], k[7]);
+  CompareExchange(k[0], k[1]), CompareExchange(k[2], k[3]);
+  CompareExchange(k[4], k[5]), CompareExchange(k[6], k[7]);
+  CompareExchange(k[2], k[4]), CompareExchange(k[3], k[5]);
+  CompareExchange(k[1], k[4]), CompareExchange(k[3], k[6]);
+  CompareExchange(k[1], k[2]), CompareExchange(k[3], k[4]);
+  CompareExchange(k[5], k[6]);
+}
+
+// sorts every run of 8 keys of k, kSize runs at a time: key j of the run in
+// lane r is copied to block[j * kSize + r], which leaves the runs in the
+// columns of 8 packets, no shuffles needed; the last run is padded with the
+// largest key
+template <typename UType> inline void SortRuns8(UType *k, index_t n) {
+  typedef packet::Packet<UType, packet::KeyPacketDefault<UType>::kArch> P;
+  const index_t kBlock = 8 * P::kSize;
+  UType block[kBlock];
+  P row[8];
+  for (index_t i = 0; i < n; i += kBlock) {
+    const index_t len = std::min(n - i, kBlock);
+    for (index_t t = 0; t < kBlock; ++t)
+      block[t % 8 * P::kSize + t / 8] = t < len ? k[i + t] : ~UType(0);
+    for (int j = 0; j < 8; ++j)
+      row[j] = P::Load(block + j * P::kSize);
+    SortNetwork8(row);
+    for (int j = 0; j < 8; ++j)
+      row[j].Store(block + j * P::kSize);
+    for (index_t t = 0; t < len; ++t)
+      k[i + t] = block[t % 8 * P::kSize + t / 8];
+  }
+}
+
+// out = merge of the sorted a and b, ties take a first
+template <typename UType>
+inline void MergeKeys(const UType *a, index_t na, const UType *b, index_t nb,
+                      UType *out) {
+  index_t i = 0, j = 0;
+  while (i < na && j < nb) {
+    const bool take_b = b[j] < a[i];
+    *out++ = take_b ? b[j] : a[i];
+    j += take_b;
+    i += !take_b;
+  }
+  out = std::copy(a + i, a + na, out);
+  std::copy(b + j, b + nb, out);
+}
+
+// number of items of a among the first d outputs of MergeKeys(a, b), the
+// merge path split that lets threads merge disjoint parts of the output
+template <typename UType>
+inline index_t MergePathSplit(const UType *a, index_t na, const UType *b,
+                              index_t nb, index_t d) {
+  index_t lo = d > nb ? d - nb : 0, hi = d < na ? d : na;
+  while (lo < hi) {
+    const index_t mid = (lo + hi) / 2;
+    if (b[d - mid - 1] < a[mid]) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+// sorts the n keys of k, tmp is scratch of the same size; runs of 8 are
+// sorted by the network, then merged bottom up
+template <typename UType>
+inline void MergeSortKeys(UType *k, UType *tmp, index_t n) {
+  SortRuns8(k, n);
+  UType *src = k, *dst = tmp;
+  for (index_t width = 8; width < n; width *= 2) {
+    for (index_t i = 0; i < n; i += 2 * width) {
+      const index_t mid = std::min(i + width, n);
+      const index_t end = std::min(i + 2 * width, n);
+      MergeKeys(src + i, mid - i, src + mid, end - mid, dst + i);
+    }
+    std::swap(src, dst);
+  }
+  if (src != k)
+    std::copy(src, src + n, k);
+}
+
+// MergeSortKeys with every thread of pool, each thread sorts a chunk, then
+// the chunks are merged pairwise with the output of every merge split
+// evenly over the threads by merge path
+template <typename UType>
+inline void MergeSortKeys(ThreadPool *pool, UType *k, UType *tmp, index_t n) {
+  const int nchunk = pool->NumThreads();
+  std::vector<index_t> bound(nchunk + 1);
+  for (int c = 0; c <= nchunk; ++c)
+    bound[c] = n * c / nchunk;
+  pool->Run(nchunk, [&](int c) {
+    MergeSortKeys(k + bound[c], tmp + bound[c], bound[c + 1] - bound[c]);
+  });
+  UType *src = k, *dst = tmp;
+  while (bound.size() > 2) {
+    std::vector<index_t> next;
+    for (size_t r = 0; r + 1 < bound.size(); r += 2) {
+      next.push_back(bound[r]);
+      if (r + 2 >= bound.size()) {
+        // odd run out, carried over as is
+        std::copy(src + bound[r], src + bound[r + 1], dst + bound[r]);
+        continue;
+      }
+      const UType *a = src + bound[r], *b = src + bound[r + 1];
+      const index_t na = bound[r + 1] - bound[r];
+      const index_t nb = bound[r + 2] - bound[r + 1];
+      UType *out = dst + bound[r];
+      pool->Run(nchunk, [&](int c) {
+        const index_t d0 = (na + nb) * c / nchunk;
+        const index_t d1 = (na + nb) * (c + 1) / nchunk;
+        const index_t i0 = MergePathSplit(a, na, b, nb, d0);
+        const index_t i1 = MergePathSplit(a, na, b, nb, d1);
+        MergeKeys(a + i0, i1 - i0, b + d0 - i0, d1 - i1 - d0 + i0, out + d0);
+      });
+    }
+    next.push_back(bound.back());
+    bound.swap(next);
+    std::swap(src, dst);
+  }
+  if (src != k)
+    std::copy(src, src + n, k);
+}
+
+// values are sorted ascending within each run of equal segment ids, segments
+// are left as they are; the ids must never decrease, unsorted ids are not
+// grouped but fail a CHECK; keys are compared through SortKeyBits as in
+// SortByKey, under which equal keys are the same bits, so the sort is stable
+template <typename VDType, typename SDType>
+inline void VectorizedSort(Tensor<1, VDType> values,
+                           Tensor<1, SDType> segments) {
+  CHECK_EQ(values.size(0), segments.size(0))
+      << "VectorizedSort: values and segments must have the same size";
+  typedef SortKeyBits<VDType> Bits;
+  typedef typename Bits::UType UType;
+  RunOnStream(values.stream_, [=]() {
+    ThreadPool *pool = GetPool(values.stream_);
+    const index_t n = values.size(0);
+    if (n < 2)
+      return;
+    const int nchunk = SortChunks(pool, n);
+    auto run = [&](const std::function<void(int, index_t, index_t)> &func) {
+      auto chunk = [&](int c) {
+        func(c, n * c / nchunk, n * (c + 1) / nchunk);
+      };
+      if (nchunk == 1) {
+        chunk(0);
+      } else {
+        pool->Run(nchunk, chunk);
+      }
+    };
+    // starts of the segments, found per chunk and joined in order
+    std::vector<std::vector<index_t> > part(nchunk);
+    std::vector<char> ordered(nchunk, 1);
+    run([&](int c, index_t begin, index_t end) {
+      for (index_t i = begin; i < end; ++i) {
+        if (i == 0 || segments.dptr_[i] != segments.dptr_[i - 1]) {
+          part[c].push_back(i);
+          if (i != 0 && segments.dptr_[i] < segments.dptr_[i - 1])
+            ordered[c] = 0;
+        }
+      }
+    });
+    std::vector<index_t> start;
+    for (int c = 0; c < nchunk; ++c) {
+      CHECK(ordered[c]) << "VectorizedSort: segments must be ascending";
+      start.insert(start.end(), part[c].begin(), part[c].end());
+    }
+    start.push_back(n);
+    UType *keys = static_cast<UType *>(AllocBytes(2 * sizeof(UType) * n));
+    UType *tmp = keys + n;
+    auto sort_segment = [&](index_t begin, index_t end, bool shared) {
+      for (index_t i = begin; i < end; ++i)
+        keys[i] = Bits::Encode(values.dptr_[i]);
+      if (shared) {
+        MergeSortKeys(pool, keys + begin, tmp + begin, end - begin);
+      } else {
+        MergeSortKeys(keys + begin, tmp + begin, end - begin);
+      }
+      for (index_t i = begin; i < end; ++i)
+        values.dptr_[i] = Bits::Decode(keys[i]);
+    };
+    // each thread sorts the segments that start in its part of the values,
+    // which balances the work by keys rather than by segments
+    const bool share_long = pool != nullptr && pool->NumThreads() > 1;
+    run([&](int, index_t begin, index_t end) {
+      size_t s = std::lower_bound(start.begin(), start.end(), begin) -
+                 start.begin();
+      for (; start[s] < end; ++s) {
+        if (!share_long || start[s + 1] - start[s] < kSortLongSegment)
+          sort_segment(start[s], start[s + 1], false);
+      }
+    });
+    if (share_long) {
+      for (size_t s = 0; s + 1 < start.size(); ++s) {
+        if (start[s + 1] - start[s] >= kSortLongSegment)
+          sort_segment(start[s], start[s + 1], true);
+      }
+    }
+    FreeBytes(keys);
+  });
+}
+} // namespace lmlib
+
+#endif // LMLIB_DENSE_ENGINE_HPP_
@@ -4,6 +4,969 @@
 #include <vector>
 
 #include "./LMBase.hpp"
+#include "./Logging.hpp"
+#include "./Dense.hpp"
+#include "./Exp.hpp"
+#include "./Packet.hpp"
+
+namespace lmlib {
+namespace expr {
+// blocking of the gemm, a kMR x kNR tile of C stays in registers, a kKC x kNR
+// micro-panel of B stays in L1, a kMC x kKC block of A in L2 and a kKC x kNC
+// panel of B in L3
+template <typename DType, packet::PacketArch Arch> struct GemmTraits {
+  static const int kMR = 6;
+  static const int kNV = 2;
+  static const index_t kNR = kNV * packet::Packet<DType, Arch>::kSize;
+  static const index_t kKC = 256;
+  static const index_t kMC = 144;
+  static const index_t kNC = 3072;
+};
+template <typename DType> struct GemmTraits<DType, packet::kPlain> {
+  static const int kMR = 4;
+  static const int kNV = 4;
+  static const index_t kNR = 4;
+  static const index_t kKC = 256;
+  static const index_t kMC = 128;
+  static const index_t kNC = 2048;
+};
+
+// m * n * k below which one thread computes a whole product of a batch
+const index_t kSmallGemm = 128 * 128 * 128;
+
+// grow-only aligned scratch memory, one per thread and slot
+template <typename DType, int kSlot> struct GemmWorkspace {
+  DType *dptr_ = nullptr;
+  size_t size_ = 0;
+  ~GemmWorkspace() {
+    if (dptr_ != nullptr)
+      packet::AlignedFree(dptr_);
+  }
+  inline static DType *Get(size_t size) {
+    static thread_local GemmWorkspace<DType, kSlot> ws;
+    if (ws.size_ < size) {
+      DType *dptr = static_cast<DType *>(packet::AlignedMalloc(
+          size * sizeof(DType), packet::AlignBytes<packet::kAVX512>::value));
+      if (ws.dptr_ != nullptr)
+        packet::AlignedFree(ws.dptr_);
+      ws.dptr_ = dptr;
+      ws.size_ = size;
+    }
+    return ws.dptr_;
+  }
+};
+
+// pack mc x kc of op(A) into kMR-row micro-panels laid out as [k][kMR],
+// rows past mc are zero so the kernel never needs a row mask; the panels
+// hold DType, a reduced precision SType widens on the way
+template <typename DType, int kMR, typename SType>
+inline void GemmPackA(bool trans, index_t mc, index_t kc, const SType *a,
+                      index_t lda, DType *dst) {
+  for (index_t i = 0; i < mc; i += kMR, dst += kMR * kc) {
+    const index_t mr = mc - i < kMR ? mc - i : kMR;
+    if (!trans) {
+      for (index_t r = 0; r < mr; ++r) {
+        const SType *src = a + (i + r) * lda;
+        for (index_t k = 0; k < kc; ++k)
+          dst[k * kMR + r] = DType(src[k]);
+      }
+    } else {
+      for (index_t k = 0; k < kc; ++k) {
+        const SType *src = a + k * lda + i;
+        for (index_t r = 0; r < mr; ++r)
+          dst[k * kMR + r] = DType(src[r]);
+      }
+    }
+    for (index_t r = mr; r < kMR; ++r) {
+      for (index_t k = 0; k < kc; ++k)
+        dst[k * kMR + r] = DType(0);
+    }
+  }
+}
+
+// pack kc x nc of op(B) into kNR-column micro-panels laid out as [k][kNR]
+template <typename DType, int kNR, typename SType>
+inline void GemmPackB(bool trans, index_t kc, index_t nc, const SType *b,
+                      index_t ldb, DType *dst) {
+  for (index_t j = 0; j < nc; j += kNR, dst += kNR * kc) {
+    const index_t nr = nc - j < kNR ? nc - j : kNR;
+    if (!trans) {
+      for (index_t k = 0; k < kc; ++k) {
+        const SType *src = b + k * ldb + j;
+        for (index_t c = 0; c < nr; ++c)
+          dst[k * kNR + c] = DType(src[c]);
+        for (index_t c = nr; c < kNR; ++c)
+          dst[k * kNR + c] = DType(0);
+      }
+    } else {
+      for (index_t c = 0; c < nr; ++c) {
+        const SType *src = b + (j + c) * ldb;
+        for (index_t k = 0; k < kc; ++k)
+          dst[k * kNR + c] = DType(src[k]);
+      }
+      for (index_t c = nr; c < kNR; ++c) {
+        for (index_t k = 0; k < kc; ++k)
+          dst[k * kNR + c] = DType(0);
+      }
+    }
+  }
+}
+
+// packets of C in the type DType the kernel computes in, a reduced
+// precision CType converts on the way
+template <typename DType, typename CType, packet::PacketArch Arch>
+struct GemmC {
+  inline static packet::Packet<DType, Arch> Load(const CType *c) {
+    return packet::Packet<CType, Arch>::Load(c).data_;
+  }
+  inline static void Store(CType *c, const packet::Packet<DType, Arch> &src) {
+    packet::Packet<CType, Arch>(src).Store(c);
+  }
+};
+template <typename DType, packet::PacketArch Arch>
+struct GemmC<DType, DType, Arch> {
+  inline static packet::Packet<DType, Arch> Load(const DType *c) {
+    return packet::Packet<DType, Arch>::Load(c);
+  }
+  inline static void Store(DType *c, const packet::Packet<DType, Arch> &src) {
+    src.Store(c);
+  }
+};
+
+// C[mr x nr] = alpha * A_panel * B_panel + beta * C with kMR x kNR register
+// accumulators, beta == 0 never reads C; C may be stored in a reduced
+// precision CType, it is converted when loaded and stored
+template <typename DType, packet::PacketArch Arch, typename CType>
+inline void GemmKernel(index_t kc, const DType *a, const DType *b, DType alpha,
+                       DType beta, CType *c, index_t ldc, index_t mr,
+                       index_t nr) {
+  typedef packet::Packet<DType, Arch> P;
+  typedef GemmC<DType, CType, Arch> C;
+  typedef GemmTraits<DType, Arch> Traits;
+  const int kMR = Traits::kMR;
+  const int kNV = Traits::kNV;
+  const index_t kNR = Traits::kNR;
+  P acc[kMR][kNV];
+#pragma GCC unroll 16
+  for (int r = 0; r < kMR; ++r) {
+#pragma GCC unroll 16
+    for (int v = 0; v < kNV; ++v)
+      acc[r][v] = P::Fill(DType(0));
+  }
+  for (index_t k = 0; k < kc; ++k, a += kMR, b += kNR) {
+    P bv[kNV];
+#pragma GCC unroll 16
+    for (int v = 0; v < kNV; ++v)
+      bv[v] = P::Load(b + v * P::kSize);
+#pragma GCC unroll 16
+    for (int r = 0; r < kMR; ++r) {
+      P av = P::Fill(a[r]);
+#pragma GCC unroll 16
+      for (int v = 0; v < kNV; ++v)
+        acc[r][v] = packet::FMA(av, bv[v], acc[r][v]);
+    }
+  }
+  P palpha = P::Fill(alpha);
+  if (mr == kMR && nr == kNR) {
+    for (int r = 0; r < kMR; ++r) {
+      CType *crow = c + r * ldc;
+      for (int v = 0; v < kNV; ++v) {
+        CType *cptr = crow + v * P::kSize;
+        if (beta == DType(0)) {
+          C::Store(cptr, acc[r][v] * palpha);
+        } else if (beta == DType(1)) {
+          C::Store(cptr, packet::FMA(acc[r][v], palpha, C::Load(cptr)));
+        } else {
+          C::Store(cptr, packet::FMA(acc[r][v], palpha,
+                                     C::Load(cptr) * P::Fill(beta)));
+        }
+      }
+    }
+    return;
+  }
+  // edge tile, go through a buffer and only touch the valid part of C
+  DType tmp[kMR * kNR];
+  for (int r = 0; r < kMR; ++r) {
+    for (int v = 0; v < kNV; ++v)
+      (acc[r][v] * palpha).Store(tmp + r * kNR + v * P::kSize);
+  }
+  for (index_t r = 0; r < mr; ++r) {
+    CType *crow = c + r * ldc;
+    for (index_t j = 0; j < nr; ++j) {
+      crow[j] = CType(beta == DType(0)
+                          ? tmp[r * kNR + j]
+                          : tmp[r * kNR + j] + beta * DType(crow[j]));
+    }
+  }
+}
+
+// C = beta * C, what a gemm with k == 0 leaves, beta == 0 never reads C
+template <typename DType>
+inline void GemmScaleC(index_t m, index_t n, DType beta, DType *c,
+                       index_t ldc) {
+  for (index_t i = 0; i < m; ++i) {
+    for (index_t j = 0; j < n; ++j)
+      c[i * ldc + j] = beta == DType(0) ? DType(0) : beta * c[i * ldc + j];
+  }
+}
+
+// C = alpha * op(A) * B + beta * C, row major, op(A) is m x k and B is
+// k x n; packb(pc, jc, kc, nc, dst) packs the kc x nc block of B at (pc, jc)
+// the way GemmPackB does, so B never has to exist in memory as a matrix;
+// the blocks of A are split over pool when it is not NULL; the panels and
+// the accumulators are in ComputeType<DType>, the dst of packb too
+template <typename DType, typename PackB>
+inline void GemmPacked(ThreadPool *pool, bool transa, index_t m, index_t n,
+                       index_t k, DType alpha, const DType *a, index_t lda,
+                       const PackB &packb, DType beta, DType *c,
+                       index_t ldc) {
+  typedef typename packet::ComputeType<DType>::Type AType;
+  const packet::PacketArch kArch = packet::PacketDefault<AType>::kArch;
+  typedef GemmTraits<AType, kArch> Traits;
+  const int kMR = Traits::kMR;
+  const index_t kNR = Traits::kNR;
+  if (m == 0 || n == 0)
+    return;
+  if (k == 0) {
+    GemmScaleC(m, n, beta, c, ldc);
+    return;
+  }
+  const int nthread = pool != nullptr ? pool->NumThreads() : 1;
+  // shrink the A block so that every thread gets rows to work on
+  index_t mc = (m + nthread - 1) / nthread;
+  mc = (mc + kMR - 1) / kMR * kMR;
+  if (mc > Traits::kMC)
+    mc = Traits::kMC;
+  const index_t nblock = (m + mc - 1) / mc;
+  const index_t kc_max = k < Traits::kKC ? k : Traits::kKC;
+  const index_t nc_max = n < Traits::kNC ? n : Traits::kNC;
+  AType *bpack = GemmWorkspace<AType, 0>::Get(
+      size_t((nc_max + kNR - 1) / kNR * kNR * kc_max));
+  for (index_t jc = 0; jc < n; jc += Traits::kNC) {
+    const index_t nc = n - jc < Traits::kNC ? n - jc : Traits::kNC;
+    for (index_t pc = 0; pc < k; pc += Traits::kKC) {
+      const index_t kc = k - pc < Traits::kKC ? k - pc : Traits::kKC;
+      const AType beta_pc = pc == 0 ? AType(beta) : AType(1);
+      packb(pc, jc, kc, nc, bpack);
+      auto block = [&](index_t begin, index_t end) {
+        AType *apack = GemmWorkspace<AType, 1>::Get(size_t(mc * kc));
+        for (index_t blk = begin; blk < end; ++blk) {
+          const index_t ic = blk * mc;
+          const index_t mcur = m - ic < mc ? m - ic : mc;
+          GemmPackA<AType, kMR>(transa, mcur, kc,
+                                transa ? a + pc * lda + ic : a + ic * lda + pc,
+                                lda, apack);
+          for (index_t jr = 0; jr < nc; jr += kNR) {
+            const index_t nr = nc - jr < kNR ? nc - jr : kNR;
+            for (index_t ir = 0; ir < mcur; ir += kMR) {
+              const index_t mr = mcur - ir < kMR ? mcur - ir : kMR;
+              GemmKernel<AType, kArch>(kc, apack + ir * kc, bpack + jr * kc,
+                                       AType(alpha), beta_pc,
+                                       c + (ic + ir) * ldc + jc + jr, ldc, mr,
+                                       nr);
+            }
+          }
+        }
+      };
+      if (nthread > 1 && nblock > 1) {
+        pool->ParallelFor(0, nblock, 1, block);
+      } else {
+        block(0, nblock);
+      }
+    }
+  }
+}
+
+// C = alpha * op(A) * op(B) + beta * C, row major, op(A) is m x k and
+// op(B) is k x n; the blocks of A are split over pool when it is not NULL
+template <typename DType>
+inline void Gemm(ThreadPool *pool, bool transa, bool transb, index_t m,
+                 index_t n, index_t k, DType alpha, const DType *a,
+                 index_t lda, const DType *b, index_t ldb, DType beta,
+                 DType *c, index_t ldc) {
+  typedef typename packet::ComputeType<DType>::Type AType;
+  const packet::PacketArch kArch = packet::PacketDefault<AType>::kArch;
+  const index_t kNR = GemmTraits<AType, kArch>::kNR;
+  GemmPacked(pool, transa, m, n, k, alpha, a, lda,
+             [=](index_t pc, index_t jc, index_t kc, index_t nc, AType *dst) {
+               const DType *src =
+                   transb ? b + jc * ldb + pc : b + pc * ldb + jc;
+               GemmPackB<AType, kNR>(transb, kc, nc, src, ldb, dst);
+             },
+             beta, c, ldc);
+}
+
+// run func(i, pool) for i < batch where each item is a gemm of work
+// multiply-adds; small products do not split well, so then every thread
+// takes whole items, otherwise the items run in turn on the whole pool
+template <typename F>
+inline void ForEachBatch(ThreadPool *pool, index_t batch, index_t work,
+                         const F &func) {
+  const int nthread = pool != nullptr ? pool->NumThreads() : 1;
+  if (nthread > 1 && batch > 1 && (batch >= nthread || work <= kSmallGemm)) {
+    pool->ParallelFor(0, batch, 1, [&](index_t begin, index_t end) {
+      for (index_t i = begin; i < end; ++i)
+        func(i, static_cast<ThreadPool *>(nullptr));
+    });
+  } else {
+    for (index_t i = 0; i < batch; ++i)
+      func(i, pool);
+  }
+}
+
+// dst[i] = alpha * op(A[i]) * op(B[i]) + beta * dst[i] for i < batch, A[i]
+// starts at a + i * stridea; a zero stride shares one matrix over the batch
+template <typename DType>
+inline void BatchGemm(ThreadPool *pool, bool transa, bool transb,
+                      index_t batch, index_t m, index_t n, index_t k,
+                      DType alpha, const DType *a, index_t lda, index_t stridea,
+                      const DType *b, index_t ldb, index_t strideb, DType beta,
+                      DType *c, index_t ldc, index_t stridec) {
+  ForEachBatch(pool, batch, m * n * k, [&](index_t i, ThreadPool *ipool) {
+    Gemm(ipool, transa, transb, m, n, k, alpha, a + i * stridea, lda,
+         b + i * strideb, ldb, beta, c + i * stridec, ldc);
+  });
+}
+
+// rows of a block of the blocked syrk
+const index_t kSyrkBlock = 96;
+
+// block(i0, i1) for the kSyrkBlock row blocks of an n x n lower triangle;
+// row block I costs I + 1 blocks, so the pool takes them in the order
+// 0, B - 1, 1, B - 2, ... where every run of consecutive ones costs about
+// the same
+template <typename F>
+inline void ForEachTriangleBlock(ThreadPool *pool, index_t n, const F &block) {
+  const index_t nblock = (n + kSyrkBlock - 1) / kSyrkBlock;
+  auto run = [&](index_t begin, index_t end) {
+    for (index_t t = begin; t < end; ++t) {
+      const index_t blk = t % 2 == 0 ? t / 2 : nblock - 1 - t / 2;
+      const index_t i0 = blk * kSyrkBlock;
+      block(i0, n - i0 < kSyrkBlock ? n : i0 + kSyrkBlock);
+    }
+  };
+  const int nthread = pool != nullptr ? pool->NumThreads() : 1;
+  if (nthread > 1 && nblock > 1) {
+    pool->ParallelFor(0, nblock, 1, run);
+  } else {
+    run(0, nblock);
+  }
+}
+
+// S = alpha * op(A) * op(A)^T for the n x k op(A), one gemm per row block
+// of the lower triangle: rows [i0, i1) of S up to column i1 go to a per
+// thread tmp with leading dimension i1 and are handed to store(i0, i1, tmp);
+// the diagonal block comes out whole, nothing right of it is computed
+template <typename DType, typename F>
+inline void SyrkBlocks(ThreadPool *pool, bool trans, index_t n, index_t k,
+                       DType alpha, const DType *a, index_t lda,
+                       const F &store) {
+  ForEachTriangleBlock(pool, n, [&](index_t i0, index_t i1) {
+    DType *tmp = GemmWorkspace<DType, 4>::Get(size_t(kSyrkBlock * i1));
+    Gemm(static_cast<ThreadPool *>(nullptr), trans, !trans, i1 - i0, i1, k,
+         alpha, trans ? a + i0 : a + i0 * lda, lda, a, lda, DType(0), tmp,
+         i1);
+    store(i0, i1, static_cast<const DType *>(tmp));
+  });
+}
+
+// C = alpha * op(A) * op(A)^T + beta * C, row major, op(A) is n x k; the
+// lower triangle is computed and written to both halves, so C need not be
+// symmetric when beta != 0; beta == 0 never reads C
+template <typename DType>
+inline void Syrk(ThreadPool *pool, bool trans, index_t n, index_t k,
+                 DType alpha, const DType *a, index_t lda, DType beta,
+                 DType *c, index_t ldc) {
+  if (n <= kSyrkBlock || k == 0) {
+    Gemm(pool, trans, !trans, n, n, k, alpha, a, lda, a, lda, beta, c, ldc);
+    return;
+  }
+  SyrkBlocks(pool, trans, n, k, alpha, a, lda,
+             [&](index_t i0, index_t i1, const DType *tmp) {
+               const index_t mb = i1 - i0;
+               for (index_t r = 0; r < mb; ++r) {
+                 const DType *t = tmp + r * i1;
+                 DType *crow = c + (i0 + r) * ldc;
+                 for (index_t j = 0; j < i1; ++j)
+                   crow[j] = beta == DType(0) ? t[j] : t[j] + beta * crow[j];
+               }
+               // the mirror of the block left of the diagonal block
+               for (index_t j = 0; j < i0; ++j) {
+                 DType *crow = c + j * ldc + i0;
+                 for (index_t r = 0; r < mb; ++r) {
+                   const DType t = tmp[r * i1 + j];
+                   crow[r] = beta == DType(0) ? t : t + beta * crow[r];
+                 }
+               }
+             });
+}
+
+// rows of A a gemv dots with x at once, and the width of the partial sums of
+// a transposed gemv, which stay in L1 while the rows stream through
+const int kGemvRows = 4;
+const index_t kGemvCols = 2048;
+
+// y[i] = alpha * A[i] . x + beta * y[i] for rows [begin, end) of the row
+// major A, kGemvRows rows share each packet of x and every row keeps two
+// accumulators; rows past end repeat the last row and are dropped
+template <typename DType, typename AType, packet::PacketArch Arch>
+inline void GemvRows(index_t begin, index_t end, index_t n, AType alpha,
+                     const DType *a, index_t lda, const DType *x, AType beta,
+                     DType *y) {
+  typedef packet::Packet<AType, Arch> P;
+  typedef GemmC<AType, DType, Arch> L;
+  const index_t kStep = 2 * P::kSize;
+  for (index_t i = begin; i < end; i += kGemvRows) {
+    const index_t mr = end - i < kGemvRows ? end - i : kGemvRows;
+    const DType *row[kGemvRows];
+    for (int r = 0; r < kGemvRows; ++r)
+      row[r] = a + (i + (r < mr ? r : mr - 1)) * lda;
+    P acc[kGemvRows][2];
+#pragma GCC unroll 16
+    for (int r = 0; r < kGemvRows; ++r)
+      acc[r][0] = acc[r][1] = P::Fill(AType(0));
+    index_t j = 0;
+    for (; j + kStep <= n; j += kStep) {
+      const P x0 = L::Load(x + j), x1 = L::Load(x + j + P::kSize);
+#pragma GCC unroll 16
+      for (int r = 0; r < kGemvRows; ++r) {
+        acc[r][0] = packet::FMA(L::Load(row[r] + j), x0, acc[r][0]);
+        acc[r][1] = packet::FMA(L::Load(row[r] + j + P::kSize), x1, acc[r][1]);
+      }
+    }
+    for (; j + P::kSize <= n; j += P::kSize) {
+      const P x0 = L::Load(x + j);
+#pragma GCC unroll 16
+      for (int r = 0; r < kGemvRows; ++r)
+        acc[r][0] = packet::FMA(L::Load(row[r] + j), x0, acc[r][0]);
+    }
+    for (index_t r = 0; r < mr; ++r) {
+      AType sum = (acc[r][0] + acc[r][1]).Sum();
+      for (index_t t = j; t < n; ++t)
+        sum += AType(row[r][t]) * AType(x[t]);
+      y[i + r] = DType(beta == AType(0) ? alpha * sum
+                                        : alpha * sum + beta * AType(y[i + r]));
+    }
+  }
+}
+
+// out[j] += sum of xs[r] * row[r][j] for r < kRows and j < nc
+template <int kRows, typename DType, typename AType, packet::PacketArch Arch>
+inline void GemvAxpyRows(index_t nc, const DType *const *row,
+                         const AType *xs, AType *out) {
+  typedef packet::Packet<AType, Arch> P;
+  typedef GemmC<AType, DType, Arch> L;
+  P xv[kRows];
+#pragma GCC unroll 16
+  for (int r = 0; r < kRows; ++r)
+    xv[r] = P::Fill(xs[r]);
+  index_t j = 0;
+  for (; j + P::kSize <= nc; j += P::kSize) {
+    P acc = P::Load(out + j);
+#pragma GCC unroll 16
+    for (int r = 0; r < kRows; ++r)
+      acc = packet::FMA(L::Load(row[r] + j), xv[r], acc);
+    acc.Store(out + j);
+  }
+  for (; j < nc; ++j) {
+    for (int r = 0; r < kRows; ++r)
+      out[j] += AType(row[r][j]) * xs[r];
+  }
+}
+
+// part[j] = sum of x[i] * A[i][j] over rows [begin, end), column slices of
+// kGemvCols go down the rows kGemvRows at a time, so every element of A is
+// read once and part is loaded and stored once per kGemvRows rows; the
+// rows left over go one at a time, never padded with zero weighted rows
+// that would turn an Inf of A into NaN
+template <typename DType, typename AType, packet::PacketArch Arch>
+inline void GemvColumns(index_t begin, index_t end, index_t n,
+                        const DType *a, index_t lda, const DType *x,
+                        AType *part) {
+  for (index_t jc = 0; jc < n; jc += kGemvCols) {
+    const index_t nc = n - jc < kGemvCols ? n - jc : kGemvCols;
+    AType *out = part + jc;
+    for (index_t j = 0; j < nc; ++j)
+      out[j] = AType(0);
+    const DType *row[kGemvRows];
+    AType xs[kGemvRows];
+    index_t i = begin;
+    for (; i + kGemvRows <= end; i += kGemvRows) {
+      for (int r = 0; r < kGemvRows; ++r) {
+        row[r] = a + (i + r) * lda + jc;
+        xs[r] = AType(x[i + r]);
+      }
+      GemvAxpyRows<kGemvRows, DType, AType, Arch>(nc, row, xs, out);
+    }
+    for (; i < end; ++i) {
+      row[0] = a + i * lda + jc;
+      xs[0] = AType(x[i]);
+      GemvAxpyRows<1, DType, AType, Arch>(nc, row, xs, out);
+    }
+  }
+}
+
+// y = alpha * op(A) * x + beta * y for the row major m x n A, beta == 0 never
+// reads y; both orientations read A exactly once in row order. rows are
+// split over pool in chunks of at least grain elements of A, a transposed
+// product sums the partial y of every chunk afterwards
+template <typename DType>
+inline void Gemv(ThreadPool *pool, index_t grain, bool trans, index_t m,
+                 index_t n, DType alpha, const DType *a, index_t lda,
+                 const DType *x, DType beta, DType *y) {
+  typedef typename packet::ComputeType<DType>::Type AType;
+  const packet::PacketArch kArch = packet::PacketDefault<AType>::kArch;
+  const index_t ylen = trans ? n : m;
+  if (m == 0 || n == 0) {
+    GemmScaleC(index_t(1), ylen, beta, y, ylen);
+    return;
+  }
+  const int nthread = pool != nullptr ? pool->NumThreads() : 1;
+  const index_t ngroup = (m + kGemvRows - 1) / kGemvRows;
+  index_t nchunk = m * n / (grain > 0 ? grain : 1);
+  if (nchunk > nthread)
+    nchunk = nthread;
+  if (nchunk > ngroup)
+    nchunk = ngroup;
+  if (nchunk < 1)
+    nchunk = 1;
+  auto rows = [&](index_t c, index_t *begin, index_t *end) {
+    *begin = ngroup * c / nchunk * kGemvRows;
+    *end = ngroup * (c + 1) / nchunk * kGemvRows;
+    if (*end > m)
+      *end = m;
+  };
+  if (!trans) {
+    auto chunk = [&](index_t cbegin, index_t cend) {
+      for (index_t c = cbegin; c < cend; ++c) {
+        index_t begin, end;
+        rows(c, &begin, &end);
+        GemvRows<DType, AType, kArch>(begin, end, n, AType(alpha), a, lda, x,
+                                      AType(beta), y);
+      }
+    };
+    if (nchunk > 1) {
+      pool->ParallelFor(0, nchunk, 1, chunk);
+    } else {
+      chunk(0, 1);
+    }
+    return;
+  }
+  AType *part = GemmWorkspace<AType, 3>::Get(size_t(nchunk * n));
+  auto chunk = [&](index_t cbegin, index_t cend) {
+    for (index_t c = cbegin; c < cend; ++c) {
+      index_t begin, end;
+      rows(c, &begin, &end);
+      GemvColumns<DType, AType, kArch>(begin, end, n, a, lda, x,
+                                       part + c * n);
+    }
+  };
+  // y = alpha * (sum of the partial y) + beta * y over columns [jb, je)
+  const AType aalpha = AType(alpha), abeta = AType(beta);
+  auto reduce = [&](index_t jb, index_t je) {
+    for (index_t j = jb; j < je; ++j) {
+      AType sum = part[j];
+      for (index_t c = 1; c < nchunk; ++c)
+        sum += part[c * n + j];
+      y[j] = DType(abeta == AType(0) ? aalpha * sum
+                                     : aalpha * sum + abeta * AType(y[j]));
+    }
+  };
+  if (nchunk > 1) {
+    pool->ParallelFor(0, nchunk, 1, chunk);
+    pool->ParallelFor(0, n, kGemvCols, reduce);
+  } else {
+    chunk(0, 1);
+    reduce(0, n);
+  }
+}
+
+// blocking of the quantized gemm, a kKC of 256 groups keeps the panels as
+// many bytes as the float ones and the int32 dot of a block from overflowing
+template <packet::PacketArch Arch> struct QGemmTraits {
+  static const int kMR = 6;
+  static const int kNV = 2;
+  static const index_t kNR = kNV * packet::QPacket<Arch>::kSize;
+  static const index_t kKC = 256 * packet::QPacket<Arch>::kGroup;
+  static const index_t kMC = 144;
+  static const index_t kNC = 3072;
+};
+template <> struct QGemmTraits<packet::kPlain> {
+  static const int kMR = 4;
+  static const int kNV = 4;
+  static const index_t kNR = 4;
+  static const index_t kKC = 1024;
+  static const index_t kMC = 128;
+  static const index_t kNC = 2048;
+};
+
+// scale and zero point of a quantized operand, the real value of q is
+// (q - zero) * scale; entry i * inc belongs to row i of A or column i of B,
+// an inc of 0 shares one over the matrix
+struct QuantParam {
+  const float *scale_;
+  index_t scale_inc_;
+  const int32_t *zero_;
+  index_t zero_inc_;
+  inline float Scale(index_t i) const { return scale_[i * scale_inc_]; }
+  inline int32_t Zero(index_t i) const { return zero_[i * zero_inc_]; }
+};
+
+// pack mc x kc of row major A into kMR-row micro-panels laid out as
+// [k / kGroup][kMR][kGroup], rows past mc and k past kc are zero; the sum
+// of every row, padding included, goes to rowsum
+template <typename AType, int kMR, int kGroup>
+inline void QGemmPackA(index_t mc, index_t kc, const uint8_t *a, index_t lda,
+                       AType *dst, int32_t *rowsum) {
+  const index_t kcp = (kc + kGroup - 1) / kGroup * kGroup;
+  for (index_t i = 0; i < mc; i += kMR, dst += kMR * kcp) {
+    const index_t mr = mc - i < kMR ? mc - i : kMR;
+    for (index_t r = 0; r < kMR; ++r) {
+      int32_t sum = 0;
+      for (index_t k = 0; k < kcp; ++k) {
+        const int32_t v = r < mr && k < kc ? a[(i + r) * lda + k] : 0;
+        dst[(k / kGroup * kMR + r) * kGroup + k % kGroup] = AType(v);
+        sum += v;
+      }
+      rowsum[i + r] = sum;
+    }
+  }
+}
+
+// pack kc x nc of op(B) into kNR-column micro-panels laid out as
+// [k / kGroup][kNR][kGroup], the sum of every column goes to colsum
+template <typename BType, int kNR, int kGroup>
+inline void QGemmPackB(bool trans, index_t kc, index_t nc, const int8_t *b,
+                       index_t ldb, BType *dst, int32_t *colsum) {
+  const index_t kcp = (kc + kGroup - 1) / kGroup * kGroup;
+  for (index_t j = 0; j < nc; j += kNR, dst += kNR * kcp) {
+    const index_t nr = nc - j < kNR ? nc - j : kNR;
+    int32_t *sum = colsum + j;
+    for (index_t c = 0; c < kNR; ++c)
+      sum[c] = 0;
+    for (index_t k = 0; k < kcp; ++k) {
+      BType *out = dst + k / kGroup * kNR * kGroup + k % kGroup;
+      for (index_t c = 0; c < kNR; ++c) {
+        int32_t v = 0;
+        if (c < nr && k < kc)
+          v = trans ? b[(j + c) * ldb + k] : b[k * ldb + j + c];
+        out[c * kGroup] = BType(v);
+        sum[c] += v;
+      }
+    }
+  }
+}
+
+// acc[kMR x kNR] = A_panel * B_panel in int32 over kcp values of k, kcp a
+// multiple of kGroup
+template <packet::PacketArch Arch>
+inline void QGemmKernel(index_t kcp,
+                        const typename packet::QPacket<Arch>::AType *a,
+                        const typename packet::QPacket<Arch>::BType *b,
+                        int32_t *out) {
+  typedef packet::QPacket<Arch> Q;
+  typedef QGemmTraits<Arch> Traits;
+  const int kMR = Traits::kMR;
+  const int kNV = Traits::kNV;
+  const index_t kNR = Traits::kNR;
+  const int kGroup = Q::kGroup;
+  Q acc[kMR][kNV];
+#pragma GCC unroll 16
+  for (int r = 0; r < kMR; ++r) {
+#pragma GCC unroll 16
+    for (int v = 0; v < kNV; ++v)
+      acc[r][v] = Q::Zero();
+  }
+  for (index_t k = 0; k < kcp;
+       k += kGroup, a += kMR * kGroup, b += kNR * kGroup) {
+    Q bv[kNV];
+#pragma GCC unroll 16
+    for (int v = 0; v < kNV; ++v)
+      bv[v] = Q::Load(b + v * Q::kSize * kGroup);
+#pragma GCC unroll 16
+    for (int r = 0; r < kMR; ++r) {
+      Q av = Q::Broadcast(a + r * kGroup);
+#pragma GCC unroll 16
+      for (int v = 0; v < kNV; ++v)
+        acc[r][v] = packet::QDot(av, bv[v], acc[r][v]);
+    }
+  }
+  for (int r = 0; r < kMR; ++r) {
+    for (int v = 0; v < kNV; ++v)
+      acc[r][v].Store(out + r * kNR + v * Q::kSize);
+  }
+}
+
+// C = alpha * A' * op(B)' + beta * C, row major, where A' and op(B)' are the
+// real values of the u8 m x k A and the s8 k x n op(B), quantized per row of
+// A and per column of op(B); (A - za)(B - zb) = AB - za sum(B) - zb (sum(A)
+// - k za) over each block of k, so the int32 dots of a block are corrected
+// with the row and column sums of the packed panels and scaled into C; the
+// blocks of A are split over pool when it is not NULL
+inline void QGemm(ThreadPool *pool, index_t m, index_t n, index_t k,
+                  float alpha, const uint8_t *a, index_t lda,
+                  const QuantParam &qa, bool transb, const int8_t *b,
+                  index_t ldb, const QuantParam &qb, float beta, float *c,
+                  index_t ldc) {
+  const packet::PacketArch kArch = packet::QPacketDefault::kArch;
+  typedef packet::QPacket<kArch> Q;
+  typedef QGemmTraits<kArch> Traits;
+  typedef typename Q::AType AType;
+  typedef typename Q::BType BType;
+  const int kMR = Traits::kMR;
+  const index_t kNR = Traits::kNR;
+  const int kGroup = Q::kGroup;
+  if (m == 0 || n == 0)
+    return;
+  if (k == 0) {
+    GemmScaleC(m, n, beta, c, ldc);
+    return;
+  }
+  const int nthread = pool != nullptr ? pool->NumThreads() : 1;
+  index_t mc = (m + nthread - 1) / nthread;
+  mc = (mc + kMR - 1) / kMR * kMR;
+  if (mc > Traits::kMC)
+    mc = Traits::kMC;
+  const index_t nblock = (m + mc - 1) / mc;
+  const index_t kc_max = k < Traits::kKC ? k : Traits::kKC;
+  const index_t kcp_max = (kc_max + kGroup - 1) / kGroup * kGroup;
+  const index_t nc_max = n < Traits::kNC ? n : Traits::kNC;
+  const index_t ncp_max = (nc_max + kNR - 1) / kNR * kNR;
+  BType *bpack = GemmWorkspace<BType, 0>::Get(size_t(ncp_max * kcp_max));
+  // column sums, zero points and scales of the panel of B, padded to kNR
+  int32_t *colsum = GemmWorkspace<int32_t, 0>::Get(size_t(2 * ncp_max));
+  int32_t *colzero = colsum + ncp_max;
+  float *colscale = GemmWorkspace<float, 2>::Get(size_t(ncp_max));
+  for (index_t jc = 0; jc < n; jc += Traits::kNC) {
+    const index_t nc = n - jc < Traits::kNC ? n - jc : Traits::kNC;
+    const index_t ncp = (nc + kNR - 1) / kNR * kNR;
+    for (index_t j = 0; j < ncp; ++j) {
+      colzero[j] = j < nc ? qb.Zero(jc + j) : 0;
+      colscale[j] = j < nc ? qb.Scale(jc + j) : 0.0f;
+    }
+    for (index_t pc = 0; pc < k; pc += Traits::kKC) {
+      const index_t kc = k - pc < Traits::kKC ? k - pc : Traits::kKC;
+      const index_t kcp = (kc + kGroup - 1) / kGroup * kGroup;
+      const float beta_pc = pc == 0 ? beta : 1.0f;
+      QGemmPackB<BType, kNR, kGroup>(
+          transb, kc, nc, transb ? b + jc * ldb + pc : b + pc * ldb + jc, ldb,
+          bpack, colsum);
+      auto block = [&](index_t begin, index_t end) {
+        AType *apack = GemmWorkspace<AType, 1>::Get(size_t(mc * kcp));
+        int32_t rowsum[Traits::kMC + kMR];
+        int32_t acc[kMR * kNR];
+        float res[kMR * kNR];
+        for (index_t blk = begin; blk < end; ++blk) {
+          const index_t ic = blk * mc;
+          const index_t mcur = m - ic < mc ? m - ic : mc;
+          QGemmPackA<AType, kMR, kGroup>(mcur, kc, a + ic * lda + pc, lda,
+                                         apack, rowsum);
+          for (index_t jr = 0; jr < nc; jr += kNR) {
+            const index_t nr = nc - jr < kNR ? nc - jr : kNR;
+            const int32_t *csum = colsum + jr;
+            const int32_t *czero = colzero + jr;
+            const float *cscale = colscale + jr;
+            for (index_t ir = 0; ir < mcur; ir += kMR) {
+              const index_t mr = mcur - ir < kMR ? mcur - ir : kMR;
+              QGemmKernel<kArch>(kcp, apack + ir * kcp, bpack + jr * kcp,
+                                 acc);
+              for (int r = 0; r < kMR; ++r) {
+                const index_t i = ic + ir + (r < mr ? r : 0);
+                const int32_t za = qa.Zero(i);
+                const int32_t t = rowsum[ir + r] - int32_t(kc) * za;
+                const float sa = alpha * qa.Scale(i);
+                const int32_t *arow = acc + r * kNR;
+                float *rrow = res + r * kNR;
+                for (index_t j = 0; j < kNR; ++j) {
+                  rrow[j] = sa * cscale[j] *
+                            float(arow[j] - za * csum[j] - czero[j] * t);
+                }
+              }
+              for (index_t r = 0; r < mr; ++r) {
+                const float *rrow = res + r * kNR;
+                float *crow = c + (ic + ir + r) * ldc + jc + jr;
+                if (beta_pc == 0.0f) {
+                  for (index_t j = 0; j < nr; ++j)
+                    crow[j] = rrow[j];
+                } else {
+                  for (index_t j = 0; j < nr; ++j)
+                    crow[j] = rrow[j] + beta_pc * crow[j];
+                }
+              }
+            }
+          }
+        }
+      };
+      if (nthread > 1 && nblock > 1) {
+        pool->ParallelFor(0, nblock, 1, block);
+      } else {
+        block(0, nblock);
+      }
+    }
+  }
+}
+
+// shape of op(x)
+inline Shape<2> GetShape(const Shape<2> &shape, bool transpose) {
+  return transpose ? Shape2(shape[1], shape[0]) : shape;
+}
+
+// matrix shape and batch stride of a batch_dot operand, a Tensor<2> is
+// broadcast over the batch with stride 0
+template <typename DType>
+inline Shape<2> MatShape(const Tensor<2, DType> &t) {
+  return t.shape_;
+}
+template <typename DType>
+inline Shape<2> MatShape(const Tensor<3, DType> &t) {
+  return Shape2(t.shape_[1], t.shape_[2]);
+}
+template <typename DType>
+inline index_t BatchStride(const Tensor<2, DType> &) {
+  return 0;
+}
+template <typename DType>
+inline index_t BatchStride(const Tensor<3, DType> &t) {
+  return t.template MemSize<1>();
+}
+
+// whether a and b view the same matrix
+template <typename DType>
+inline bool SameTensor(const Tensor<2, DType> &a, const Tensor<2, DType> &b) {
+  return a.dptr_ == b.dptr_ && a.shape_ == b.shape_ && a.stride_ == b.stride_;
+}
+
+// elements of A a gemv hands to one thread, the grain of the stream
+inline index_t GemvGrain(Stream *stream) {
+  return stream != nullptr ? stream->GrainSize() : 0;
+}
+
+template <typename SV, typename DType, int ddim, int ldim, int rdim,
+          bool ltrans, bool rtrans>
+struct DotEngine {
+  inline static void Eval(Tensor<ddim, DType> *p_dst,
+                          const Tensor<ldim, DType> &lhs,
+                          const Tensor<rdim, DType> &rhs, DType scale);
+};
+
+// dst (SV)= scale * dot(lhs, rhs), the saver maps onto alpha and beta so
+// += and -= accumulate straight into dst, transposes are folded into the
+// packing
+template <typename SV, typename DType, bool ltrans, bool rtrans>
+struct DotEngine<SV, DType, 2, 2, 2, ltrans, rtrans> {
+  inline static void Eval(Tensor<2, DType> *p_dst, const Tensor<2, DType> &lhs,
+                          const Tensor<2, DType> &rhs, DType scale) {
+    Tensor<2, DType> dst = *p_dst, a = lhs, b = rhs;
+    Shape<2> sleft = GetShape(lhs.shape_, ltrans);
+    Shape<2> sright = GetShape(rhs.shape_, rtrans);
+    CHECK(dst.size(0) == sleft[0] && dst.size(1) == sright[1] &&
+          sleft[1] == sright[0])
+        << "dot-gemm: matrix shape mismatch, lhs " << sleft << " rhs "
+        << sright << " dst " << dst.shape_;
+    // dot(a, a.T()) and dot(a.T(), a) are symmetric, the types tell the
+    // transposes apart at compile time, whether both are a only at run time
+    if (ltrans != rtrans && SameTensor(a, b)) {
+      RunOnStream(dst.stream_, [=]() {
+        Syrk(GetPool(dst.stream_), ltrans, dst.size(0), sleft[1],
+             scale * DType(SV::kAlphaBLAS), a.dptr_, a.stride_,
+             DType(SV::kBetaBLAS), dst.dptr_, dst.stride_);
+      });
+      return;
+    }
+    RunOnStream(dst.stream_, [=]() {
+      Gemm(GetPool(dst.stream_), ltrans, rtrans, dst.size(0), dst.size(1),
+           sleft[1], scale * DType(SV::kAlphaBLAS), a.dptr_, a.stride_,
+           b.dptr_, b.stride_, DType(SV::kBetaBLAS), dst.dptr_, dst.stride_);
+    });
+  }
+};
+
+// dst (SV)= scale * op(lhs) * rhs, a matrix times a vector is a gemv
+template <typename SV, typename DType, bool ltrans, bool rtrans>
+struct DotEngine<SV, DType, 1, 2, 1, ltrans, rtrans> {
+  inline static void Eval(Tensor<1, DType> *p_dst, const Tensor<2, DType> &lhs,
+                          const Tensor<1, DType> &rhs, DType scale) {
+    Tensor<1, DType> dst = *p_dst, x = rhs;
+    Tensor<2, DType> a = lhs;
+    Shape<2> sleft = GetShape(lhs.shape_, ltrans);
+    CHECK(dst.size(0) == sleft[0] && sleft[1] == rhs.size(0))
+        << "dot-gemv: shape mismatch, lhs " << sleft << " rhs " << rhs.shape_
+        << " dst " << dst.shape_;
+    RunOnStream(dst.stream_, [=]() {
+      Gemv(GetPool(dst.stream_), GemvGrain(dst.stream_), ltrans, a.size(0),
+           a.size(1), scale * DType(SV::kAlphaBLAS), a.dptr_, a.stride_,
+           x.dptr_, DType(SV::kBetaBLAS), dst.dptr_);
+    });
+  }
+};
+
+// dst (SV)= scale * lhs * op(rhs), a vector times a matrix is the gemv of
+// the transposed matrix
+template <typename SV, typename DType, bool ltrans, bool rtrans>
+struct DotEngine<SV, DType, 1, 1, 2, ltrans, rtrans> {
+  inline static void Eval(Tensor<1, DType> *p_dst, const Tensor<1, DType> &lhs,
+                          const Tensor<2, DType> &rhs, DType scale) {
+    Tensor<1, DType> dst = *p_dst, x = lhs;
+    Tensor<2, DType> b = rhs;
+    Shape<2> sright = GetShape(rhs.shape_, rtrans);
+    CHECK(dst.size(0) == sright[1] && sright[0] == lhs.size(0))
+        << "dot-gemv: shape mismatch, lhs " << lhs.shape_ << " rhs " << sright
+        << " dst " << dst.shape_;
+    RunOnStream(dst.stream_, [=]() {
+      Gemv(GetPool(dst.stream_), GemvGrain(dst.stream_), !rtrans, b.size(0),
+           b.size(1), scale * DType(SV::kAlphaBLAS), b.dptr_, b.stride_,
+           x.dptr_, DType(SV::kBetaBLAS), dst.dptr_);
+    });
+  }
+};
+
+// batch_dot, dst[i] (SV)= scale * dot(lhs[i], rhs[i]), either operand may be
+// a Tensor<2> shared by every batch
+template <typename SV, typename DType, int ldim, int rdim, bool ltrans,
+          bool rtrans>
+struct DotEngine<SV, DType, 3, ldim, rdim, ltrans, rtrans> {
+  inline static void Eval(Tensor<3, DType> *p_dst,
+                          const Tensor<ldim, DType> &lhs,
+                          const Tensor<rdim, DType> &rhs, DType scale) {
+    Tensor<3, DType> dst = *p_dst;
+    Tensor<ldim, DType> a = lhs;
+    Tensor<rdim, DType> b = rhs;
+    Shape<2> sleft = GetShape(MatShape(lhs), ltrans);
+    Shape<2> sright = GetShape(MatShape(rhs), rtrans);
+    CHECK(dst.size(1) == sleft[0] && dst.size(2) == sright[1] &&
+          sleft[1] == sright[0])
+        << "batch_dot: matrix shape mismatch, lhs " << sleft << " rhs "
+        << sright << " dst " << dst.shape_;
+    CHECK((ldim == 2 || lhs.size(0) == dst.size(0)) &&
+          (rdim == 2 || rhs.size(0) == dst.size(0)))
+        << "batch_dot: batch size mismatch";
+    RunOnStream(dst.stream_, [=]() {
+      BatchGemm(GetPool(dst.stream_), ltrans, rtrans, dst.size(0),
+                dst.size(1), dst.size(2), sleft[1],
+                scale * DType(SV::kAlphaBLAS), a.dptr_, a.stride_,
+                BatchStride(a), b.dptr_, b.stride_, BatchStride(b),
+                DType(SV::kBetaBLAS), dst.dptr_, dst.stride_,
+                BatchStride(dst));
+    });
+  }
+};
+
+template <typename SV, typename Tlhs, typename Trhs, bool ltrans, bool rtrans,
+          int dim, typename DType>
+struct ExpComplexEngine<SV, Tensor<dim, DType>,
+                        DotExp<Tlhs, Trhs, ltrans, rtrans, DType>, DType> {
+  inline static void
+  Eval(Tensor<dim, DType> *dst,
+       const DotExp<Tlhs, Trhs, ltrans, rtrans, DType> &exp) {
+    DotEngine<SV, DType, dim, ExpInfo<Tlhs>::kDim, ExpInfo<Trhs>::kDim,
+              ltrans, rtrans>::Eval(dst, exp.lhs_, exp.rhs_, exp.scale_);
+  }
+};
+} // namespace expr
+} // namespace lmlib
+
 #include "./extension/Implicit_gemm.hpp"
+#include "./extension/Quantize.hpp"
+#include "./extension/Packed_matrix.hpp"
 
-#endif // LMLIB_DOT_ENGINE_HPP_
\ No newline at end of file
+#endif // LMLIB_DOT_ENGINE_HPP_
@@ -21,6 +21,9 @@ template <typename TrueType, typename DType, int exp_type> struct Exp {
 
 template <typename Saver, typename RValue, typename DType> struct ExpEngine;
 
+template <typename Saver, typename RValue, typename ExpType, typename DType>
+struct ExpComplexEngine;
+
 // store a scalar value into a expression
 template <typename DType>
 struct ScalarExp : public Exp<ScalarExp<DType>, DType, type::kMapper> {
@@ -154,24 +157,74 @@ dot(const RValueExp<Tlhs, DType> &lhs, const RValueExp<Trhs, DType> &rhs) {
 
 template <typename Tlhs, typename Trhs, typename DType>
 inline DotExp<Tlhs, Trhs, false, true, DType>
-dot(const RValueExp<Tlhs, DType> &lhs, const RValueExp<Trhs, DType> &rhs) {
+dot(const RValueExp<Tlhs, DType> &lhs, const TransposeExp<Trhs, DType> &rhs) {
   return DotExp<Tlhs, Trhs, false, true, DType>(lhs.self(), rhs.expr,
                                                 DType(1.0f));
 }
 
 template <typename Tlhs, typename Trhs, typename DType>
 inline DotExp<Tlhs, Trhs, true, false, DType>
-dot(const RValueExp<Tlhs, DType> &lhs, const RValueExp<Trhs, DType> &rhs) {
+dot(const TransposeExp<Tlhs, DType> &lhs, const RValueExp<Trhs, DType> &rhs) {
   return DotExp<Tlhs, Trhs, true, false, DType>(lhs.expr, rhs.self(),
                                                 DType(1.0f));
 }
 
 template <typename Tlhs, typename Trhs, typename DType>
 inline DotExp<Tlhs, Trhs, true, true, DType>
-dot(const RValueExp<Tlhs, DType> &lhs, const RValueExp<Trhs, DType> &rhs) {
+dot(const TransposeExp<Tlhs, DType> &lhs,
+    const TransposeExp<Trhs, DType> &rhs) {
   return DotExp<Tlhs, Trhs, true, true, DType>(lhs.expr, rhs.expr, DType(1.0f));
 }
 
+// dot(a, b) * s and s * dot(a, b) fold s into scale_
+template <typename Tlhs, typename Trhs, bool ltrans, bool rtrans,
+          typename DType>
+inline DotExp<Tlhs, Trhs, ltrans, rtrans, DType>
+operator*(const DotExp<Tlhs, Trhs, ltrans, rtrans, DType> &lhs, DType rhs) {
+  return DotExp<Tlhs, Trhs, ltrans, rtrans, DType>(lhs.lhs_, lhs.rhs_,
+                                                   lhs.scale_ * rhs);
+}
+
+template <typename Tlhs, typename Trhs, bool ltrans, bool rtrans,
+          typename DType>
+inline DotExp<Tlhs, Trhs, ltrans, rtrans, DType>
+operator*(DType lhs, const DotExp<Tlhs, Trhs, ltrans, rtrans, DType> &rhs) {
+  return rhs * lhs;
+}
+
+template <typename Tlhs, typename Trhs, bool ltrans, bool rtrans,
+          typename DType>
+inline DotExp<Tlhs, Trhs, ltrans, rtrans, DType>
+operator*(const DotExp<Tlhs, Trhs, ltrans, rtrans, DType> &lhs,
+          const ScalarExp<DType> &rhs) {
+  return lhs * rhs.scalar_;
+}
+
+template <typename Tlhs, typename Trhs, bool ltrans, bool rtrans,
+          typename DType>
+inline DotExp<Tlhs, Trhs, ltrans, rtrans, DType>
+operator*(const ScalarExp<DType> &lhs,
+          const DotExp<Tlhs, Trhs, ltrans, rtrans, DType> &rhs) {
+  return rhs * lhs.scalar_;
+}
+
+// dot(a, b) / s folds 1 / s into scale_ as well
+template <typename Tlhs, typename Trhs, bool ltrans, bool rtrans,
+          typename DType>
+inline DotExp<Tlhs, Trhs, ltrans, rtrans, DType>
+operator/(const DotExp<Tlhs, Trhs, ltrans, rtrans, DType> &lhs, DType rhs) {
+  return DotExp<Tlhs, Trhs, ltrans, rtrans, DType>(lhs.lhs_, lhs.rhs_,
+                                                   lhs.scale_ / rhs);
+}
+
+template <typename Tlhs, typename Trhs, bool ltrans, bool rtrans,
+          typename DType>
+inline DotExp<Tlhs, Trhs, ltrans, rtrans, DType>
+operator/(const DotExp<Tlhs, Trhs, ltrans, rtrans, DType> &lhs,
+          const ScalarExp<DType> &rhs) {
+  return lhs / rhs.scalar_;
+}
+
 template <bool transpose_left, bool transpose_right, typename Tlhs,
           typename Trhs, typename DType>
 inline DotExp<Tlhs, Trhs, transpose_left, transpose_right, DType>
@@ -218,7 +271,7 @@ struct BinaryMapExp
   const Tlhs &lhs_;
   const Trhs &rhs_;
   explicit BinaryMapExp(const Tlhs &lhs, const Trhs &rhs)
-      : lhs(lhs_), rhs(rhs_) {}
+      : lhs_(lhs), rhs_(rhs) {}
 };
 
 template <typename OP, typename Tlhs, typename Trhs, typename DType, int etlhs,
@@ -267,6 +320,32 @@ operator/(const Exp<Tlhs, DType, etlhs> &lhs,
   return MakeExp<op::div>(lhs, rhs);
 }
 
+// chains of scalars fold while the expression is built, so
+// scalar(a) * scalar(b) * x computes a * b once instead of per element
+template <typename DType>
+inline ScalarExp<DType> operator+(const ScalarExp<DType> &lhs,
+                                  const ScalarExp<DType> &rhs) {
+  return ScalarExp<DType>(lhs.scalar_ + rhs.scalar_);
+}
+
+template <typename DType>
+inline ScalarExp<DType> operator-(const ScalarExp<DType> &lhs,
+                                  const ScalarExp<DType> &rhs) {
+  return ScalarExp<DType>(lhs.scalar_ - rhs.scalar_);
+}
+
+template <typename DType>
+inline ScalarExp<DType> operator*(const ScalarExp<DType> &lhs,
+                                  const ScalarExp<DType> &rhs) {
+  return ScalarExp<DType>(lhs.scalar_ * rhs.scalar_);
+}
+
+template <typename DType>
+inline ScalarExp<DType> operator/(const ScalarExp<DType> &lhs,
+                                  const ScalarExp<DType> &rhs) {
+  return ScalarExp<DType>(lhs.scalar_ / rhs.scalar_);
+}
+
 // comment todo
 template <typename OP, typename TA, typename DType, int etype>
 struct UnaryMapExp
@@ -278,7 +357,7 @@ struct UnaryMapExp
 template <typename OP, typename TA, typename DType, int etype>
 inline UnaryMapExp<OP, TA, DType, (etype | type::kMapper)>
 MakeExp(const Exp<TA, DType, etype> &src) {
-  return UnaryMapExp<OP, TA, DType, (ta | type::kMapper)>(src.self());
+  return UnaryMapExp<OP, TA, DType, (etype | type::kMapper)>(src.self());
 }
 
 template <typename OP, typename TA, typename DType, int etype>
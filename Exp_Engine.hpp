@@ -31,22 +31,15 @@ public:
   inline const DType &REval(index_t y, index_t x) const {
     return dptr_[y * stride_ + x];
   }
+  inline const DType &Eval(index_t y, index_t x) const {
+    return dptr_[y * stride_ + x];
+  }
 
 private:
   DType *dptr_;
   index_t stride_;
 };
 
-template <typename DType> class Plan<Tensor<1, DType>, DType> {
-public:
-  explicit Plan(const Tensor<1, DType> &t) : dptr_(t.dptr_) {}
-  inline DType &REval(index_t y, index_t x) { return dptr_[x]; }
-  inline const DType &REval(index_t y, index_t x) const { return dptr_[x]; }
-
-private:
-  DType *dptr_;
-};
-
 template <typename DType> class Plan<ScalarExp<DType>, DType> {
 public:
   explicit Plan(DType scalar) : scalar_(scalar) {}
@@ -93,7 +86,7 @@ public:
   explicit Plan(const Plan<TA, DType> &lhs, const Plan<TB, DType> &rhs)
       : lhs_(lhs), rhs_(rhs) {}
   inline DType Eval(index_t y, index_t x) const {
-    return OP::Map(item1_.Eval(y, x), rhs_.Eval(y, x));
+    return OP::Map(lhs_.Eval(y, x), rhs_.Eval(y, x));
   }
 
 private:
@@ -101,6 +94,22 @@ private:
   Plan<TB, DType> rhs_;
 };
 
+// x / scalar, rewritten to the multiply of op::div_scalar
+template <typename TA, typename DType, int etype>
+class Plan<BinaryMapExp<op::div, TA, ScalarExp<DType>, DType, etype>, DType> {
+public:
+  explicit Plan(const Plan<TA, DType> &lhs,
+                const Plan<ScalarExp<DType>, DType> &rhs)
+      : lhs_(lhs), divisor_(op::div_scalar::Divisor(rhs.Eval(0, 0))) {}
+  inline DType Eval(index_t y, index_t x) const {
+    return op::div_scalar::Map<DType>(lhs_.Eval(y, x), divisor_);
+  }
+
+private:
+  Plan<TA, DType> lhs_;
+  DType divisor_;
+};
+
 // unary expression
 template <typename OP, typename TA, typename DType, int etype>
 class Plan<UnaryMapExp<OP, TA, DType, etype>, DType> {
@@ -119,7 +128,7 @@ template <typename EType, typename DType>
 class Plan<TransposeExp<EType, DType>, DType> {
 public:
   explicit Plan(const Plan<EType, DType> &src) : src_(src) {}
-  MSHADOW_XINLINE DType Eval(index_t y, index_t x) const {
+  inline DType Eval(index_t y, index_t x) const {
     return src_.Eval(x, y);
   }
 
@@ -127,6 +136,17 @@ private:
   Plan<EType, DType> src_;
 };
 
+// tensor-like expressions evaluate through the plan of their SubType
+template <typename SubType, typename SrcExp, int dim, typename DType>
+class Plan<MakeTensorExp<SubType, SrcExp, dim, DType>, DType> {
+public:
+  explicit Plan(const Plan<SubType, DType> &src) : src_(src) {}
+  inline DType Eval(index_t y, index_t x) const { return src_.Eval(y, x); }
+
+private:
+  Plan<SubType, DType> src_;
+};
+
 template <typename OP, typename TA, typename TB, typename DType, int etype>
 inline Plan<BinaryMapExp<OP, TA, TB, DType, etype>, DType>
 MakePlan(const BinaryMapExp<OP, TA, TB, DType, etype> &e);
@@ -145,7 +165,7 @@ template <typename DstDType, typename SrcDType, typename EType, int etype>
 inline Plan<TypecastExp<DstDType, SrcDType, EType, etype>, DstDType>
 MakePlan(const TypecastExp<DstDType, SrcDType, EType, etype> &e) {
   return Plan<TypecastExp<DstDType, SrcDType, EType, etype>, DstDType>(
-      MakePlan(e.exp));
+      MakePlan(e.expr));
 }
 
 template <typename T, typename DType>
@@ -156,12 +176,14 @@ inline Plan<T, DType> MakePlan(const RValueExp<T, DType> &e) {
 template <typename T, typename DType>
 inline Plan<TransposeExp<T, DType>, DType>
 MakePlan(const TransposeExp<T, DType> &e) {
-  return Plan<TransposeExp<T, DType>, DType>(MakePlan(e.exp));
+  return Plan<TransposeExp<T, DType>, DType>(MakePlan(e.expr));
 }
 
 template <typename T, typename SrcExp, int dim, typename DType>
-inline Plan<T, DType> MakePlan(const MakeTensorExp<T, SrcExp, dim, DType> &e) {
-  return Plan<T, DType>(e.real_self());
+inline Plan<MakeTensorExp<T, SrcExp, dim, DType>, DType>
+MakePlan(const MakeTensorExp<T, SrcExp, dim, DType> &e) {
+  return Plan<MakeTensorExp<T, SrcExp, dim, DType>, DType>(
+      Plan<T, DType>(e.real_self()));
 }
 
 template <typename OP, typename TA, typename DType, int etype>
@@ -183,7 +205,7 @@ template <typename OP, typename TA, typename TB, typename TC, typename DType,
 inline Plan<TernaryMapExp<OP, TA, TB, TC, DType, etype>, DType>
 MakePlan(const TernaryMapExp<OP, TA, TB, TC, DType, etype> &e) {
   return Plan<TernaryMapExp<OP, TA, TB, TC, DType, etype>, DType>(
-      MakePlan(e.item1_), MakePlan(e.item2_), MakePlan(e.item3_));
+      MakePlan(e._1_), MakePlan(e._2_), MakePlan(e._3_));
 }
 
 // if ExpInfo<E>::kDim == -1, mismatching expression
@@ -238,6 +260,32 @@ struct ExpInfo<TernaryMapExp<OP, TA, TB, TC, DType, etype>> {
   static const int kDim = kDimItem1;
 };
 
+// whether the expression reads an operand transposed, such maps are
+// evaluated in tiles so the column walk over that operand stays in cache
+template <typename E> struct ExpTranspose { static const bool kHas = false; };
+template <typename E, typename DType>
+struct ExpTranspose<TransposeExp<E, DType>> {
+  static const bool kHas = true;
+};
+template <typename DstDType, typename SrcDType, typename EType, int etype>
+struct ExpTranspose<TypecastExp<DstDType, SrcDType, EType, etype>> {
+  static const bool kHas = ExpTranspose<EType>::kHas;
+};
+template <typename OP, typename TA, typename DType, int etype>
+struct ExpTranspose<UnaryMapExp<OP, TA, DType, etype>> {
+  static const bool kHas = ExpTranspose<TA>::kHas;
+};
+template <typename OP, typename TA, typename TB, typename DType, int etype>
+struct ExpTranspose<BinaryMapExp<OP, TA, TB, DType, etype>> {
+  static const bool kHas = ExpTranspose<TA>::kHas || ExpTranspose<TB>::kHas;
+};
+template <typename OP, typename TA, typename TB, typename TC, typename DType,
+          int etype>
+struct ExpTranspose<TernaryMapExp<OP, TA, TB, TC, DType, etype>> {
+  static const bool kHas = ExpTranspose<TA>::kHas || ExpTranspose<TB>::kHas ||
+                           ExpTranspose<TC>::kHas;
+};
+
 template <int dim, typename DType, typename E> struct TypeCheck {
   static const int kExpDim = ExpInfo<E>::kDim;
   static const bool kMapPass = (kExpDim == 0 || kExpDim == dim);
@@ -271,14 +319,14 @@ template <int dim, typename DstDType, typename SrcDType, typename EType,
 struct ShapeCheck<dim, TypecastExp<DstDType, SrcDType, EType, etype>> {
   inline static Shape<dim>
   Check(const TypecastExp<DstDType, SrcDType, EType, etype> &exp) {
-    return ShapeCheck<dim, EType>::Check(exp.exp);
+    return ShapeCheck<dim, EType>::Check(exp.expr);
   }
 };
 template <int dim, typename E, typename DType>
 struct ShapeCheck<dim, TransposeExp<E, DType>> {
   inline static Shape<dim> Check(const TransposeExp<E, DType> &e) {
     // swap the lowest two dimensions
-    Shape<dim> s = ShapeCheck<dim, E>::Check(e.exp);
+    Shape<dim> s = ShapeCheck<dim, E>::Check(e.expr);
     std::swap(s[0], s[1]);
     return s;
   }
@@ -326,9 +374,9 @@ template <int dim, typename OP, typename TA, typename TB, typename TC,
 struct ShapeCheck<dim, TernaryMapExp<OP, TA, TB, TC, DType, etype>> {
   inline static Shape<dim>
   Check(const TernaryMapExp<OP, TA, TB, TC, DType, etype> &t) {
-    Shape<dim> shape1 = ShapeCheck<dim, TA>::Check(t.item1_);
-    Shape<dim> shape2 = ShapeCheck<dim, TB>::Check(t.item2_);
-    Shape<dim> shape3 = ShapeCheck<dim, TC>::Check(t.item3_);
+    Shape<dim> shape1 = ShapeCheck<dim, TA>::Check(t._1_);
+    Shape<dim> shape2 = ShapeCheck<dim, TB>::Check(t._2_);
+    Shape<dim> shape3 = ShapeCheck<dim, TC>::Check(t._3_);
     bool same = (shape1 == shape2) && (shape2 == shape3);
     CHECK(same) << "TernaryMapExp: Shapes of operands are not the same, "
                 << "Shape1=" << shape1 << ", Shape2=" << shape2
@@ -345,7 +393,36 @@ struct ShapeCheck<dim, TernaryMapExp<OP, TA, TB, TC, DType, etype>> {
 #include "./Dot_Engine.hpp"
 
 namespace lmlib {
-namespace expr {} // namespace expr
+namespace expr {
+// dispatch an assignment by the type of the right hand side expression,
+// unless a FusionScope defers it
+template <typename Saver, typename RValue, typename DType> struct ExpEngine {
+  template <typename E>
+  inline static void Eval(RValue *dst,
+                          const Exp<E, DType, type::kMapper> &exp) {
+    if (!FuseExp<Saver>(dst, exp))
+      MapExp<Saver>(dst, exp);
+  }
+  template <typename E>
+  inline static void Eval(RValue *dst,
+                          const Exp<E, DType, type::kChainer> &exp) {
+    if (!FuseExp<Saver>(dst, exp))
+      MapExp<Saver>(dst, exp);
+  }
+  template <typename E>
+  inline static void Eval(RValue *dst,
+                          const Exp<E, DType, type::kRValue> &exp) {
+    if (!FuseExp<Saver>(dst, exp))
+      MapExp<Saver>(dst, exp);
+  }
+  template <typename E>
+  inline static void Eval(RValue *dst,
+                          const Exp<E, DType, type::kComplex> &exp) {
+    if (!FuseExp<Saver>(dst, exp))
+      ExpComplexEngine<Saver, RValue, E, DType>::Eval(dst, exp.self());
+  }
+};
+} // namespace expr
 
 } // namespace lmlib
 
@@ -3,5 +3,7 @@
 
 #include "./Exp_Engine.hpp"
 #include "./extension/Broadcast.hpp"
+#include "./extension/Reduce_to_1d.hpp"
+#include "./extension/Take.hpp"
 
 #endif // LMLIB_EXTENSION_HPP_
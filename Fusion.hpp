@@ -0,0 +1,423 @@
+#ifndef LMLIB_FUSION_HPP_
+#define LMLIB_FUSION_HPP_
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "./LMBase.hpp"
+#include "./Logging.hpp"
+#include "./Dense.hpp"
+#include "./Exp_Engine.hpp"
+#include "./Dense_Engine.hpp"
+#include "./Packet.hpp"
+#include "./Stream.hpp"
+
+namespace lmlib {
+namespace expr {
+// the elementwise expressions, the only ones a FusionScope defers
+template <typename E> struct FuseCheck {
+  static const bool kPass = false;
+};
+template <int dim, typename DType> struct FuseCheck<Tensor<dim, DType>> {
+  static const bool kPass = true;
+};
+template <typename DType> struct FuseCheck<ScalarExp<DType>> {
+  static const bool kPass = true;
+};
+template <typename DstDType, typename SrcDType, typename EType, int etype>
+struct FuseCheck<TypecastExp<DstDType, SrcDType, EType, etype>> {
+  static const bool kPass = FuseCheck<EType>::kPass;
+};
+template <typename OP, typename TA, typename DType, int etype>
+struct FuseCheck<UnaryMapExp<OP, TA, DType, etype>> {
+  static const bool kPass = FuseCheck<TA>::kPass;
+};
+template <typename OP, typename TA, typename TB, typename DType, int etype>
+struct FuseCheck<BinaryMapExp<OP, TA, TB, DType, etype>> {
+  static const bool kPass = FuseCheck<TA>::kPass && FuseCheck<TB>::kPass;
+};
+template <typename OP, typename TA, typename TB, typename TC, typename DType,
+          int etype>
+struct FuseCheck<TernaryMapExp<OP, TA, TB, TC, DType, etype>> {
+  static const bool kPass = FuseCheck<TA>::kPass && FuseCheck<TB>::kPass &&
+                            FuseCheck<TC>::kPass;
+};
+
+// a tensor read or written by a deferred statement
+struct FuseLeaf {
+  const char *dptr;
+  index_t stride;
+  size_t elem;
+};
+template <int dim, typename DType>
+inline FuseLeaf MakeFuseLeaf(const Tensor<dim, DType> &t) {
+  FuseLeaf leaf = {reinterpret_cast<const char *>(t.dptr_), t.stride_,
+                   sizeof(DType)};
+  return leaf;
+}
+
+// collects the tensors an elementwise expression reads
+template <typename E> struct FuseLeaves {
+  inline static void Collect(const E &, std::vector<FuseLeaf> *) {}
+};
+template <int dim, typename DType> struct FuseLeaves<Tensor<dim, DType>> {
+  inline static void Collect(const Tensor<dim, DType> &t,
+                             std::vector<FuseLeaf> *out) {
+    out->push_back(MakeFuseLeaf(t));
+  }
+};
+template <typename DstDType, typename SrcDType, typename EType, int etype>
+struct FuseLeaves<TypecastExp<DstDType, SrcDType, EType, etype>> {
+  inline static void
+  Collect(const TypecastExp<DstDType, SrcDType, EType, etype> &e,
+          std::vector<FuseLeaf> *out) {
+    FuseLeaves<EType>::Collect(e.expr, out);
+  }
+};
+template <typename OP, typename TA, typename DType, int etype>
+struct FuseLeaves<UnaryMapExp<OP, TA, DType, etype>> {
+  inline static void Collect(const UnaryMapExp<OP, TA, DType, etype> &e,
+                             std::vector<FuseLeaf> *out) {
+    FuseLeaves<TA>::Collect(e.src_, out);
+  }
+};
+template <typename OP, typename TA, typename TB, typename DType, int etype>
+struct FuseLeaves<BinaryMapExp<OP, TA, TB, DType, etype>> {
+  inline static void Collect(const BinaryMapExp<OP, TA, TB, DType, etype> &e,
+                             std::vector<FuseLeaf> *out) {
+    FuseLeaves<TA>::Collect(e.lhs_, out);
+    FuseLeaves<TB>::Collect(e.rhs_, out);
+  }
+};
+template <typename OP, typename TA, typename TB, typename TC, typename DType,
+          int etype>
+struct FuseLeaves<TernaryMapExp<OP, TA, TB, TC, DType, etype>> {
+  inline static void
+  Collect(const TernaryMapExp<OP, TA, TB, TC, DType, etype> &e,
+          std::vector<FuseLeaf> *out) {
+    FuseLeaves<TA>::Collect(e._1_, out);
+    FuseLeaves<TB>::Collect(e._2_, out);
+    FuseLeaves<TC>::Collect(e._3_, out);
+  }
+};
+} // namespace expr
+
+// elements of a chunk, every deferred statement runs over a chunk before the
+// next chunk starts, so what one statement writes is still in cache when the
+// next one reads it
+const index_t kFuseChunk = 1024;
+
+// one deferred statement, run(y, xbegin, xend) evaluates the rows handed out
+// by FusionScope::Flush
+typedef std::function<void(index_t, index_t, index_t)> FuseStatement;
+
+// kPacket as in MapExpEngine, the destination is addressed by index like the
+// plans, the row pointer of a chunk may be out of any tensor
+template <bool kPacket> struct FuseStatementMaker {
+  template <typename Saver, int dim, typename DType, typename E, int etype>
+  inline static FuseStatement Make(const Tensor<dim, DType> &dst,
+                                   const expr::Exp<E, DType, etype> &exp) {
+    expr::Plan<Tensor<dim, DType>, DType> dplan = expr::MakePlan(dst);
+    expr::Plan<E, DType> plan = expr::MakePlan(exp.self());
+    return [=](index_t y, index_t xbegin, index_t xend) {
+      expr::Plan<Tensor<dim, DType>, DType> d = dplan;
+      MapPlan<Saver>(d, plan, y, y + 1, xbegin, xend);
+    };
+  }
+};
+template <> struct FuseStatementMaker<true> {
+  template <typename Saver, int dim, typename DType, typename E, int etype>
+  inline static FuseStatement Make(const Tensor<dim, DType> &dst,
+                                   const expr::Exp<E, DType, etype> &exp) {
+    const packet::PacketArch kArch = packet::PacketDefault<DType>::kArch;
+    expr::PacketPlan<E, DType, kArch> plan =
+        expr::MakePacketPlan<kArch>(exp.self());
+    expr::PacketTail<E, DType, kArch> tail(exp.self());
+    DType *dptr = dst.dptr_;
+    const index_t stride = dst.stride_;
+    return [=](index_t y, index_t xbegin, index_t xend) {
+      const index_t xlen =
+          xbegin + packet::LowerAlign<DType, kArch>(xend - xbegin);
+      const index_t base = y * stride;
+      index_t x = xbegin;
+      for (; x < xlen; x += packet::Packet<DType, kArch>::kSize) {
+        packet::Saver<Saver, DType, kArch>::Save(dptr + (base + x),
+                                                 plan.EvalPacket(y, x));
+      }
+      for (; x < xend; ++x) {
+        tail.template Save<Saver>(dptr + (base + x), plan, y, x);
+      }
+    };
+  }
+};
+
+class FusionScope;
+inline FusionScope *&CurrentFusionSlot() {
+  static thread_local FusionScope *current = nullptr;
+  return current;
+}
+
+// defers the elementwise assignments made on the calling thread until the
+// end of scope, or until a statement can not join the pending ones, and
+// then runs them in a single pass over memory:
+//
+//   FusionScope scope(stream);
+//   Tensor<1, float> g = scope.Temp<float>(w.shape_);
+//   g = grad + scalar(decay) * w;
+//   m = scalar(beta) * m + scalar(1 - beta) * g;
+//   w -= scalar(lr) * m;
+//
+// a statement joins when its target and operands are contiguous tensors or
+// temps of the same shape as the pending ones and on the stream of the scope,
+// and it does not read or write memory a pending statement touches at
+// another offset; anything else runs the pending statements first.  a temp
+// only lives in per thread scratch and is valid within the statements that
+// run together, reading it elsewhere, in a reduction or a dot, is an error.
+// functions called directly, Copy, SortByKey and the like, see the tensors
+// as they were before the pending statements; Flush first
+class FusionScope {
+public:
+  explicit FusionScope(Stream *stream = nullptr)
+      : prev_(CurrentFusionSlot()), stream_(stream),
+        nthread_(stream != nullptr ? stream->pool().NumThreads() : 1),
+        group_(0) {
+    if (prev_ != nullptr)
+      prev_->Flush();
+    CurrentFusionSlot() = this;
+  }
+  ~FusionScope() {
+    Flush();
+    CurrentFusionSlot() = prev_;
+  }
+
+  // an intermediate of the pending statements, each thread keeps one chunk
+  // of it in scratch; the tensor indexes that scratch through the rows
+  // Flush hands out, stride = width - kFuseChunk
+  template <typename DType, int dim>
+  inline Tensor<dim, DType> Temp(const Shape<dim> &shape) {
+    const size_t nelem = size_t(nthread_ * kFuseChunk);
+    // the tensor points at the end of the chunks, the padding keeps that
+    // address inside the block
+    std::shared_ptr<void> block(
+        packet::AlignedMalloc(nelem * sizeof(DType) + kAllocAlign,
+                              kAllocAlign),
+        packet::AlignedFree);
+    DType *dptr = static_cast<DType *>(block.get()) + nelem;
+    scratch_.push_back(block);
+    TempInfo temp = {reinterpret_cast<const char *>(dptr), -1};
+    temps_.push_back(temp);
+    return Tensor<dim, DType>(dptr, shape, shape[dim - 1] - kFuseChunk,
+                              stream_);
+  }
+
+  // records dst (Saver)= exp, false when the statement can not be deferred
+  // and the caller has to run it now
+  template <typename Saver, int dim, typename DType, typename E, int etype>
+  inline bool Record(const Tensor<dim, DType> &dst,
+                     const expr::Exp<E, DType, etype> &exp) {
+    expr::TypeCheckPass<expr::TypeCheck<dim, DType, E>::kMapPass>::
+        Error_All_Tensor_in_Exp_Must_Have_Same_Type();
+    Shape<dim> eshape = expr::ShapeCheck<dim, E>::Check(exp.self());
+    CHECK(eshape[0] == 0 || eshape == dst.shape_)
+        << "Assignment: Shape of Tensors are not consistent with target, "
+        << "eshape: " << eshape << " dshape:" << dst.shape_;
+    const Shape<2> shape = dst.shape_.FlatTo2D();
+    const expr::FuseLeaf write = expr::MakeFuseLeaf(dst);
+    std::vector<expr::FuseLeaf> reads;
+    expr::FuseLeaves<E>::Collect(exp.self(), &reads);
+    if (!std::is_same<Saver, sv::saveto>::value)
+      reads.push_back(write);
+    bool fusable = dst.stream_ == stream_ && Contiguous(write, shape);
+    for (size_t i = 0; i < reads.size(); ++i)
+      fusable = fusable && Contiguous(reads[i], shape);
+    if (!fusable) {
+      CHECK(FindTemp(write) == nullptr)
+          << "FusionScope: temp written by a statement that can not be fused";
+      for (size_t i = 0; i < reads.size(); ++i) {
+        CHECK(FindTemp(reads[i]) == nullptr)
+            << "FusionScope: temp read by a statement that can not be fused";
+      }
+      Flush();
+      return false;
+    }
+    if (!stmts_.empty() && (!(shape == shape_) || Conflict(reads, write)))
+      Flush();
+    shape_ = shape;
+    for (size_t i = 0; i < reads.size(); ++i) {
+      TempInfo *temp = FindTemp(reads[i]);
+      if (temp != nullptr) {
+        CHECK(temp->group == group_)
+            << "FusionScope: temp read outside the statements that wrote it";
+      } else {
+        reads_.push_back(Range(reads[i]));
+      }
+    }
+    TempInfo *temp = FindTemp(write);
+    if (temp != nullptr) {
+      temp->group = group_;
+    } else {
+      writes_.push_back(Range(write));
+    }
+    const packet::PacketArch kArch = packet::PacketDefault<DType>::kArch;
+    stmts_.push_back(
+        FuseStatementMaker<kArch != packet::kPlain &&
+                           expr::PacketCheck<E, kArch>::kPass>::
+            template Make<Saver>(dst, exp));
+    return true;
+  }
+
+  // runs the pending statements before a statement that is not deferred
+  template <typename R> inline void Reject(const R &) { Flush(); }
+  template <int dim, typename DType>
+  inline void Reject(const Tensor<dim, DType> &dst) {
+    CHECK(FindTemp(expr::MakeFuseLeaf(dst)) == nullptr)
+        << "FusionScope: temp written by a statement that can not be fused";
+    Flush();
+  }
+
+  // runs the pending statements, on the stream of the scope if it has one;
+  // thread t runs chunks [kbegin, kend) and gives chunk k the row
+  // k - t + nthread, the real tensors see element k * kFuseChunk at the
+  // start of the row and the temps see the chunk of thread t
+  inline void Flush() {
+    if (stmts_.empty())
+      return;
+    std::shared_ptr<std::vector<FuseStatement>> stmts =
+        std::make_shared<std::vector<FuseStatement>>();
+    stmts->swap(stmts_);
+    std::vector<std::shared_ptr<void>> scratch = scratch_;
+    Stream *stream = stream_;
+    const index_t n = shape_.Size(), width = shape_[1], nthread = nthread_;
+    RunOnStream(stream, [=]() {
+      const index_t nchunk = (n + kFuseChunk - 1) / kFuseChunk;
+      const int nrun = stream == nullptr || nthread == 1 ||
+                               n < 2 * stream->GrainSize()
+                           ? 1
+                           : int(nthread);
+      auto chunk = [&](int t) {
+        for (index_t k = nchunk * t / nrun; k < nchunk * (t + 1) / nrun; ++k) {
+          const index_t y = k - t + nthread;
+          const index_t fbegin = k * kFuseChunk;
+          const index_t fend = std::min(n, fbegin + kFuseChunk);
+          for (size_t i = 0; i < stmts->size(); ++i)
+            (*stmts)[i](y, fbegin - y * width, fend - y * width);
+        }
+      };
+      if (nrun == 1) {
+        chunk(0);
+      } else {
+        stream->pool().Run(nrun, chunk);
+      }
+      (void)scratch;
+    });
+    reads_.clear();
+    writes_.clear();
+    ++group_;
+  }
+
+private:
+  struct TempInfo {
+    const char *dptr;
+    int group;
+  };
+  struct ByteRange {
+    const char *begin, *end;
+    size_t elem;
+  };
+
+  inline TempInfo *FindTemp(const expr::FuseLeaf &leaf) {
+    for (size_t i = 0; i < temps_.size(); ++i) {
+      if (temps_[i].dptr == leaf.dptr)
+        return &temps_[i];
+    }
+    return nullptr;
+  }
+  inline bool Contiguous(const expr::FuseLeaf &leaf, const Shape<2> &shape) {
+    return leaf.stride ==
+           (FindTemp(leaf) != nullptr ? shape[1] - kFuseChunk : shape[1]);
+  }
+  inline ByteRange Range(const expr::FuseLeaf &leaf) const {
+    ByteRange range = {leaf.dptr, leaf.dptr + shape_.Size() * leaf.elem,
+                       leaf.elem};
+    return range;
+  }
+  // true when a and b share memory at different offsets, a statement then
+  // sees another element than the one the chunk order gives it
+  inline static bool Overlap(const ByteRange &a, const ByteRange &b) {
+    return a.begin < b.end && b.begin < a.end &&
+           (a.begin != b.begin || a.elem != b.elem);
+  }
+  // temps are private scratch behind a fake pointer and never alias a real
+  // tensor, they stay out of the overlap checks
+  inline bool Conflict(const std::vector<expr::FuseLeaf> &reads,
+                       const expr::FuseLeaf &write) {
+    for (size_t i = 0; i < reads.size(); ++i) {
+      if (FindTemp(reads[i]) != nullptr)
+        continue;
+      const ByteRange r = Range(reads[i]);
+      for (size_t j = 0; j < writes_.size(); ++j) {
+        if (Overlap(r, writes_[j]))
+          return true;
+      }
+    }
+    if (FindTemp(write) != nullptr)
+      return false;
+    const ByteRange w = Range(write);
+    for (size_t j = 0; j < writes_.size(); ++j) {
+      if (Overlap(w, writes_[j]))
+        return true;
+    }
+    for (size_t j = 0; j < reads_.size(); ++j) {
+      if (Overlap(w, reads_[j]))
+        return true;
+    }
+    return false;
+  }
+
+  FusionScope *prev_;
+  Stream *stream_;
+  index_t nthread_;
+  int group_;
+  Shape<2> shape_;
+  std::vector<FuseStatement> stmts_;
+  std::vector<ByteRange> reads_, writes_;
+  std::vector<TempInfo> temps_;
+  std::vector<std::shared_ptr<void>> scratch_;
+
+  FusionScope(const FusionScope &);
+  void operator=(const FusionScope &);
+};
+
+// kPass is true when dst is a tensor and exp is elementwise
+template <bool kPass> struct FuseEngine {
+  template <typename Saver, typename R, typename DType, typename E, int etype>
+  inline static bool Record(FusionScope *scope, const R &dst,
+                            const expr::Exp<E, DType, etype> &) {
+    scope->Reject(dst);
+    return false;
+  }
+};
+template <> struct FuseEngine<true> {
+  template <typename Saver, int dim, typename DType, typename E, int etype>
+  inline static bool Record(FusionScope *scope, const Tensor<dim, DType> &dst,
+                            const expr::Exp<E, DType, etype> &exp) {
+    return scope->template Record<Saver>(dst, exp);
+  }
+};
+
+template <typename Saver, typename R, int dim, typename DType, typename E,
+          int etype>
+inline bool FuseExp(TRValue<R, dim, DType> *dst,
+                    const expr::Exp<E, DType, etype> &exp) {
+  FusionScope *scope = CurrentFusionSlot();
+  if (scope == nullptr)
+    return false;
+  return FuseEngine<std::is_same<R, Tensor<dim, DType>>::value &&
+                    expr::FuseCheck<E>::kPass>::template Record<Saver>(
+      scope, dst->self(), exp);
+}
+} // namespace lmlib
+
+#endif // LMLIB_FUSION_HPP_
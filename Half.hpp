@@ -0,0 +1,192 @@
+#ifndef LMLIB_HALF_HPP_
+#define LMLIB_HALF_HPP_
+
+#include <cstring>
+#include <limits>
+
+#include "LMBase.hpp"
+
+namespace lmlib {
+// ## reduced precision storage types, both round to nearest even when made
+// from a float and widen exactly; arithmetic on them goes through float and
+// rounds the result, maps on tensors of them keep float in the packet lanes
+
+inline uint32_t FloatBits(float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+inline float BitsFloat(uint32_t bits) {
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// ieee binary16 bits of value, nan keeps the top of its payload and turns
+// quiet, like vcvtps2ph does
+inline uint16_t FloatToHalfBits(float value) {
+  uint32_t x = FloatBits(value);
+  const uint16_t sign = uint16_t((x >> 16) & 0x8000);
+  x &= 0x7FFFFFFF;
+  if (x >= 0x7F800000) {
+    return sign | (x > 0x7F800000 ? uint16_t(0x7E00 | ((x >> 13) & 0x3FF))
+                                  : uint16_t(0x7C00));
+  }
+  // past the middle of 65504 and 65536
+  if (x >= 0x477FF000)
+    return sign | 0x7C00;
+  // normal halves, rebias the exponent and round the 13 dropped bits
+  if (x >= 0x38800000)
+    return sign | uint16_t((x - 0x38000000 + 0xFFF + ((x >> 13) & 1)) >> 13);
+  // subnormal halves count in 2^-24, anything up to 2^-25 rounds to zero
+  const uint32_t exponent = x >> 23;
+  if (exponent < 102)
+    return sign;
+  const uint32_t mantissa = (x & 0x7FFFFF) | 0x800000;
+  const uint32_t shift = 126 - exponent;
+  const uint32_t half = 1u << (shift - 1);
+  const uint32_t rest = mantissa & ((1u << shift) - 1);
+  uint32_t res = mantissa >> shift;
+  if (rest > half || (rest == half && (res & 1)))
+    ++res;
+  return sign | uint16_t(res);
+}
+
+inline float HalfBitsToFloat(uint16_t h) {
+  const uint32_t sign = uint32_t(h & 0x8000) << 16;
+  const uint32_t exponent = (h >> 10) & 0x1F;
+  uint32_t mantissa = h & 0x3FF;
+  if (exponent == 0x1F) {
+    return BitsFloat(sign | 0x7F800000 | (mantissa << 13) |
+                     (mantissa != 0 ? 0x400000 : 0));
+  }
+  if (exponent != 0)
+    return BitsFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+  if (mantissa == 0)
+    return BitsFloat(sign);
+  uint32_t e = 113;
+  for (; (mantissa & 0x400) == 0; mantissa <<= 1)
+    --e;
+  return BitsFloat(sign | (e << 23) | ((mantissa & 0x3FF) << 13));
+}
+
+// the upper half of a float, nan turns quiet like vcvtneps2bf16 does
+inline uint16_t FloatToBF16Bits(float value) {
+  const uint32_t x = FloatBits(value);
+  if ((x & 0x7FFFFFFF) > 0x7F800000)
+    return uint16_t((x >> 16) | 0x40);
+  return uint16_t((x + 0x7FFF + ((x >> 16) & 1)) >> 16);
+}
+
+inline float BF16BitsToFloat(uint16_t b) {
+  return BitsFloat(uint32_t(b) << 16);
+}
+
+struct half_t {
+  uint16_t bits_;
+
+  inline half_t() {}
+  inline explicit half_t(float value) : bits_(FloatToHalfBits(value)) {}
+  inline operator float() const { return HalfBitsToFloat(bits_); }
+
+  inline static half_t FromBits(uint16_t bits) {
+    half_t res;
+    res.bits_ = bits;
+    return res;
+  }
+  inline half_t &operator+=(half_t rhs) {
+    return *this = half_t(float(*this) + float(rhs));
+  }
+  inline half_t &operator-=(half_t rhs) {
+    return *this = half_t(float(*this) - float(rhs));
+  }
+  inline half_t &operator*=(half_t rhs) {
+    return *this = half_t(float(*this) * float(rhs));
+  }
+  inline half_t &operator/=(half_t rhs) {
+    return *this = half_t(float(*this) / float(rhs));
+  }
+};
+
+// bfloat16, the exponent range of float with 8 bits of mantissa
+struct bf16_t {
+  uint16_t bits_;
+
+  inline bf16_t() {}
+  inline explicit bf16_t(float value) : bits_(FloatToBF16Bits(value)) {}
+  inline operator float() const { return BF16BitsToFloat(bits_); }
+
+  inline static bf16_t FromBits(uint16_t bits) {
+    bf16_t res;
+    res.bits_ = bits;
+    return res;
+  }
+  inline bf16_t &operator+=(bf16_t rhs) {
+    return *this = bf16_t(float(*this) + float(rhs));
+  }
+  inline bf16_t &operator-=(bf16_t rhs) {
+    return *this = bf16_t(float(*this) - float(rhs));
+  }
+  inline bf16_t &operator*=(bf16_t rhs) {
+    return *this = bf16_t(float(*this) * float(rhs));
+  }
+  inline bf16_t &operator/=(bf16_t rhs) {
+    return *this = bf16_t(float(*this) / float(rhs));
+  }
+};
+
+inline half_t operator+(half_t a, half_t b) { return half_t(float(a) + b); }
+inline half_t operator-(half_t a, half_t b) { return half_t(float(a) - b); }
+inline half_t operator*(half_t a, half_t b) { return half_t(float(a) * b); }
+inline half_t operator/(half_t a, half_t b) { return half_t(float(a) / b); }
+inline half_t operator-(half_t a) {
+  return half_t::FromBits(uint16_t(a.bits_ ^ 0x8000));
+}
+
+inline bf16_t operator+(bf16_t a, bf16_t b) { return bf16_t(float(a) + b); }
+inline bf16_t operator-(bf16_t a, bf16_t b) { return bf16_t(float(a) - b); }
+inline bf16_t operator*(bf16_t a, bf16_t b) { return bf16_t(float(a) * b); }
+inline bf16_t operator/(bf16_t a, bf16_t b) { return bf16_t(float(a) / b); }
+inline bf16_t operator-(bf16_t a) {
+  return bf16_t::FromBits(uint16_t(a.bits_ ^ 0x8000));
+}
+} // namespace lmlib
+
+namespace std {
+// what the reducers and op::div_scalar ask of a DType
+template <> class numeric_limits<lmlib::half_t> {
+public:
+  static const bool is_specialized = true;
+  static const bool is_signed = true;
+  static const bool is_integer = false;
+  static const bool is_exact = false;
+  static const bool has_infinity = true;
+  static const bool has_quiet_NaN = true;
+  static const int digits = 11;
+  static lmlib::half_t min() { return lmlib::half_t::FromBits(0x0400); }
+  static lmlib::half_t max() { return lmlib::half_t::FromBits(0x7BFF); }
+  static lmlib::half_t lowest() { return lmlib::half_t::FromBits(0xFBFF); }
+  static lmlib::half_t epsilon() { return lmlib::half_t::FromBits(0x1400); }
+  static lmlib::half_t infinity() { return lmlib::half_t::FromBits(0x7C00); }
+  static lmlib::half_t quiet_NaN() { return lmlib::half_t::FromBits(0x7E00); }
+};
+template <> class numeric_limits<lmlib::bf16_t> {
+public:
+  static const bool is_specialized = true;
+  static const bool is_signed = true;
+  static const bool is_integer = false;
+  static const bool is_exact = false;
+  static const bool has_infinity = true;
+  static const bool has_quiet_NaN = true;
+  static const int digits = 8;
+  static lmlib::bf16_t min() { return lmlib::bf16_t::FromBits(0x0080); }
+  static lmlib::bf16_t max() { return lmlib::bf16_t::FromBits(0x7F7F); }
+  static lmlib::bf16_t lowest() { return lmlib::bf16_t::FromBits(0xFF7F); }
+  static lmlib::bf16_t epsilon() { return lmlib::bf16_t::FromBits(0x3C00); }
+  static lmlib::bf16_t infinity() { return lmlib::bf16_t::FromBits(0x7F80); }
+  static lmlib::bf16_t quiet_NaN() { return lmlib::bf16_t::FromBits(0x7FC0); }
+};
+} // namespace std
+
+#endif // LMLIB_HALF_HPP_
@@ -0,0 +1,279 @@
+#ifndef LMLIB_INTERLEAVED_HPP_
+#define LMLIB_INTERLEAVED_HPP_
+
+#include <algorithm>
+#include "./Allocator.hpp"
+#include "./LMBase.hpp"
+#include "./Logging.hpp"
+#include "./Dense.hpp"
+#include "./Dense_Engine.hpp"
+#include "./Packet.hpp"
+#include "./Stream.hpp"
+
+namespace lmlib {
+// a batch of nbatch rows x cols matrices laid out for SIMD across the
+// batch: matrices come in groups of kLanes, and element (r, c) of the
+// matrices of group g is the kLanes contiguous values at
+// dptr_ + ((g * rows + r) * cols + c) * kLanes, one cache line, so lane i of
+// a packet holds element (r, c) of matrix i.  lanes past nbatch in the last
+// group are padding.  the storage is the Tensor<4> Storage(), elementwise
+// updates such as p += q run on it with the usual expressions
+template <typename DType> struct InterleavedTensor {
+  static const index_t kLanes = index_t(kAllocAlign / sizeof(DType));
+  DType *dptr_ = nullptr;
+  index_t nbatch_, rows_, cols_;
+  Stream *stream_;
+
+  inline InterleavedTensor() : nbatch_(0), rows_(0), cols_(0), stream_(NULL) {}
+
+  inline InterleavedTensor(DType *dptr, index_t nbatch, index_t rows,
+                           index_t cols, Stream *stream = NULL)
+      : dptr_(dptr), nbatch_(nbatch), rows_(rows), cols_(cols),
+        stream_(stream) {}
+
+  // shape of the storage of nbatch rows x cols matrices
+  inline static Shape<4> StorageShape(index_t nbatch, index_t rows,
+                                      index_t cols) {
+    return Shape4((nbatch + kLanes - 1) / kLanes, rows, cols, kLanes);
+  }
+
+  inline index_t NumGroups() const { return (nbatch_ + kLanes - 1) / kLanes; }
+
+  inline Tensor<4, DType> Storage() const {
+    return Tensor<4, DType>(dptr_, StorageShape(nbatch_, rows_, cols_),
+                            stream_);
+  }
+
+  // element (0, 0) of the matrices of group g
+  inline DType *Group(index_t g) const {
+    return dptr_ + g * rows_ * cols_ * kLanes;
+  }
+};
+
+// storage comes from GetAllocator() like AllocSpace
+template <typename DType>
+inline InterleavedTensor<DType> NewInterleaved(index_t nbatch, index_t rows,
+                                               index_t cols,
+                                               Stream *stream = NULL) {
+  Tensor<4, DType> storage(
+      InterleavedTensor<DType>::StorageShape(nbatch, rows, cols));
+  AllocSpace(&storage, false);
+  return InterleavedTensor<DType>(storage.dptr_, nbatch, rows, cols, stream);
+}
+
+// queued work of the stream that uses obj must be finished
+template <typename DType> inline void FreeSpace(InterleavedTensor<DType> *obj) {
+  if (obj->dptr_ == nullptr)
+    return;
+  FreeBytes(obj->dptr_);
+  obj->dptr_ = nullptr;
+}
+
+// func(g) for every group, split over the threads of stream
+template <typename F>
+inline void ForEachGroup(Stream *stream, index_t ngroup, index_t group_size,
+                         const F &func) {
+  ThreadPool *pool = GetPool(stream);
+  if (pool == nullptr || pool->NumThreads() == 1 ||
+      ngroup * group_size < 2 * stream->GrainSize()) {
+    for (index_t g = 0; g < ngroup; ++g)
+      func(g);
+    return;
+  }
+  pool->ParallelFor(0, ngroup, stream->GrainSize() / group_size + 1,
+                    [&](index_t gbegin, index_t gend) {
+                      for (index_t g = gbegin; g < gend; ++g)
+                        func(g);
+                    });
+}
+
+// the packets covering the kLanes lanes of a group, kernels run once per
+// packet on pointers offset by sub * kSize
+template <typename DType> struct InterleavedPacket {
+  static const packet::PacketArch kArch = packet::PacketDefault<DType>::kArch;
+  typedef packet::Packet<DType, kArch> Type;
+  static const index_t kSub = InterleavedTensor<DType>::kLanes / Type::kSize;
+};
+
+// dst[i] = src[i] for the matrices of a Tensor<3>, padding lanes get the
+// identity, or zero when the matrices are not square, so that a solve over
+// them stays finite
+template <typename DType>
+inline void Interleave(InterleavedTensor<DType> dst,
+                       const Tensor<3, DType> &src) {
+  CHECK(src.size(0) == dst.nbatch_ && src.size(1) == dst.rows_ &&
+        src.size(2) == dst.cols_)
+      << "Interleave: shape " << src.shape_ << " for a batch of "
+      << dst.nbatch_ << " " << dst.rows_ << "x" << dst.cols_;
+  const index_t kLanes = InterleavedTensor<DType>::kLanes;
+  RunOnStream(dst.stream_, [=]() {
+    ForEachGroup(dst.stream_, dst.NumGroups(), dst.rows_ * dst.cols_ * kLanes,
+                 [&](index_t g) {
+                   DType *d = dst.Group(g);
+                   for (index_t r = 0; r < dst.rows_; ++r) {
+                     for (index_t c = 0; c < dst.cols_; ++c, d += kLanes) {
+                       for (index_t l = 0; l < kLanes; ++l) {
+                         const index_t b = g * kLanes + l;
+                         d[l] = b < dst.nbatch_
+                                    ? src.dptr_[(b * src.size(1) + r) *
+                                                    src.stride_ +
+                                                c]
+                                    : DType(r == c && dst.rows_ == dst.cols_);
+                       }
+                     }
+                   }
+                 });
+  });
+}
+
+// dst[i] = src[i] back into a Tensor<3>
+template <typename DType>
+inline void Deinterleave(Tensor<3, DType> dst,
+                         const InterleavedTensor<DType> &src) {
+  CHECK(dst.size(0) == src.nbatch_ && dst.size(1) == src.rows_ &&
+        dst.size(2) == src.cols_)
+      << "Deinterleave: shape " << dst.shape_ << " for a batch of "
+      << src.nbatch_ << " " << src.rows_ << "x" << src.cols_;
+  const index_t kLanes = InterleavedTensor<DType>::kLanes;
+  RunOnStream(src.stream_, [=]() {
+    ForEachGroup(src.stream_, src.NumGroups(), src.rows_ * src.cols_ * kLanes,
+                 [&](index_t g) {
+                   const DType *s = src.Group(g);
+                   const index_t nlane =
+                       std::min(kLanes, src.nbatch_ - g * kLanes);
+                   for (index_t r = 0; r < src.rows_; ++r) {
+                     for (index_t c = 0; c < src.cols_; ++c, s += kLanes) {
+                       for (index_t l = 0; l < nlane; ++l) {
+                         const index_t b = g * kLanes + l;
+                         dst.dptr_[(b * dst.size(1) + r) * dst.stride_ + c] =
+                             s[l];
+                       }
+                     }
+                   }
+                 });
+  });
+}
+
+// dst[i] = scale * op(lhs[i]) * op(rhs[i]) for every matrix of the batch,
+// op transposes when ltrans / rtrans; dst must not share storage with the
+// operands
+template <bool ltrans, bool rtrans, typename DType>
+inline void BatchDot(InterleavedTensor<DType> dst,
+                     const InterleavedTensor<DType> &lhs,
+                     const InterleavedTensor<DType> &rhs,
+                     DType scale = DType(1)) {
+  const index_t n = ltrans ? lhs.cols_ : lhs.rows_;
+  const index_t k = ltrans ? lhs.rows_ : lhs.cols_;
+  const index_t m = rtrans ? rhs.rows_ : rhs.cols_;
+  CHECK(dst.nbatch_ == lhs.nbatch_ && dst.nbatch_ == rhs.nbatch_ &&
+        dst.rows_ == n && dst.cols_ == m &&
+        (rtrans ? rhs.cols_ : rhs.rows_) == k)
+      << "BatchDot: shapes of the batches do not match";
+  CHECK(dst.dptr_ != lhs.dptr_ && dst.dptr_ != rhs.dptr_)
+      << "BatchDot: dst shares storage with an operand";
+  typedef typename InterleavedPacket<DType>::Type P;
+  const index_t kLanes = InterleavedTensor<DType>::kLanes;
+  // strides between the elements (i, kk) of op(lhs) and (kk, j) of op(rhs)
+  const index_t li = (ltrans ? 1 : lhs.cols_) * kLanes;
+  const index_t lk = (ltrans ? lhs.cols_ : 1) * kLanes;
+  const index_t rk = (rtrans ? 1 : rhs.cols_) * kLanes;
+  const index_t rj = (rtrans ? rhs.cols_ : 1) * kLanes;
+  RunOnStream(dst.stream_, [=]() {
+    ForEachGroup(
+        dst.stream_, dst.NumGroups(), n * m * k * kLanes, [&](index_t g) {
+          for (index_t sub = 0; sub < InterleavedPacket<DType>::kSub; ++sub) {
+            const DType *a = lhs.Group(g) + sub * P::kSize;
+            const DType *b = rhs.Group(g) + sub * P::kSize;
+            DType *d = dst.Group(g) + sub * P::kSize;
+            for (index_t i = 0; i < n; ++i) {
+              for (index_t j = 0; j < m; ++j) {
+                P acc = P::Fill(DType(0));
+                for (index_t kk = 0; kk < k; ++kk) {
+                  acc = packet::FMA(P::Load(a + i * li + kk * lk),
+                                    P::Load(b + kk * rk + j * rj), acc);
+                }
+                (acc * P::Fill(scale)).Store(d + (i * m + j) * kLanes);
+              }
+            }
+          }
+        });
+  });
+}
+
+// solves a[i] x = b[i] for every matrix of the batch, the n x n a is
+// overwritten with its LU factors and the n x m b with x.  the lanes of a
+// packet belong to different matrices and can not pivot on their own, so
+// the factorization does not pivot: the matrices must not need it, as with
+// the symmetric positive definite innovation covariance of a Kalman update
+// or diagonally dominant systems
+template <typename DType>
+inline void BatchSolve(InterleavedTensor<DType> a, InterleavedTensor<DType> b) {
+  CHECK(a.rows_ == a.cols_ && b.rows_ == a.rows_ && a.nbatch_ == b.nbatch_)
+      << "BatchSolve: shapes of the batches do not match";
+  CHECK(a.dptr_ != b.dptr_) << "BatchSolve: a and b share storage";
+  typedef typename InterleavedPacket<DType>::Type P;
+  const index_t kLanes = InterleavedTensor<DType>::kLanes;
+  const index_t n = a.rows_, m = b.cols_;
+  RunOnStream(b.stream_, [=]() {
+    ForEachGroup(
+        b.stream_, a.NumGroups(), n * n * (n + m) * kLanes, [&](index_t g) {
+          for (index_t sub = 0; sub < InterleavedPacket<DType>::kSub; ++sub) {
+            DType *pa = a.Group(g) + sub * P::kSize;
+            DType *pb = b.Group(g) + sub * P::kSize;
+            auto A = [&](index_t i, index_t j) {
+              return pa + (i * n + j) * kLanes;
+            };
+            auto B = [&](index_t i, index_t j) {
+              return pb + (i * m + j) * kLanes;
+            };
+            // a = LU with a unit lower L, forward substitution on b
+            for (index_t kk = 0; kk < n; ++kk) {
+              const P inv = P::Fill(DType(1)) / P::Load(A(kk, kk));
+              for (index_t i = kk + 1; i < n; ++i) {
+                const P l = P::Load(A(i, kk)) * inv;
+                l.Store(A(i, kk));
+                for (index_t j = kk + 1; j < n; ++j)
+                  (P::Load(A(i, j)) - l * P::Load(A(kk, j))).Store(A(i, j));
+                for (index_t j = 0; j < m; ++j)
+                  (P::Load(B(i, j)) - l * P::Load(B(kk, j))).Store(B(i, j));
+              }
+            }
+            // back substitution with U
+            for (index_t i = n - 1; i >= 0; --i) {
+              const P inv = P::Fill(DType(1)) / P::Load(A(i, i));
+              for (index_t j = 0; j < m; ++j) {
+                P x = P::Load(B(i, j));
+                for (index_t kk = i + 1; kk < n; ++kk)
+                  x = x - P::Load(A(i, kk)) * P::Load(B(kk, j));
+                (x * inv).Store(B(i, j));
+              }
+            }
+          }
+        });
+  });
+}
+
+// dst[i] = inverse of a[i] for every matrix of the batch through
+// BatchSolve, a is overwritten with its LU factors and must not need
+// pivoting
+template <typename DType>
+inline void BatchInverse(InterleavedTensor<DType> dst,
+                         InterleavedTensor<DType> a) {
+  CHECK(dst.rows_ == a.rows_ && dst.cols_ == a.cols_ &&
+        dst.nbatch_ == a.nbatch_)
+      << "BatchInverse: shapes of the batches do not match";
+  const index_t kLanes = InterleavedTensor<DType>::kLanes;
+  const index_t n = a.rows_;
+  RunOnStream(dst.stream_, [=]() {
+    ForEachGroup(dst.stream_, dst.NumGroups(), n * n * kLanes,
+                 [&](index_t g) {
+                   DType *d = dst.Group(g);
+                   for (index_t i = 0; i < n * n; ++i, d += kLanes)
+                     std::fill(d, d + kLanes, DType(i / n == i % n));
+                 });
+  });
+  BatchSolve(a, dst);
+}
+} // namespace lmlib
+
+#endif // LMLIB_INTERLEAVED_HPP_
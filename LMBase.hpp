@@ -2,6 +2,7 @@
 #define LMLIB_LMBASE_HPP_
 
 #include <iostream>
+#include <limits>
 
 namespace lmlib {
 // ## unify all integer typename
@@ -57,6 +58,17 @@ struct div {
   }
 };
 
+// a / s for a divisor s shared by every element, plans keep Divisor(s) and
+// floating point types multiply by that reciprocal, which rounds once more
+struct div_scalar {
+  template <typename DType> inline static DType Divisor(DType s) {
+    return std::numeric_limits<DType>::is_integer ? s : DType(1) / s;
+  }
+  template <typename DType, typename T> inline static T Map(T a, T d) {
+    return std::numeric_limits<DType>::is_integer ? a / d : a * d;
+  }
+};
+
 struct rhs {
   template <typename DType> inline static DType Map(DType a, DType b) {
     return b;
@@ -72,6 +84,9 @@ struct identity {
 namespace sv {
 struct saveto {
   using OPType = op::rhs;
+  // dst = kAlphaBLAS * exp + kBetaBLAS * dst, used by the gemm engine
+  static const int kAlphaBLAS = 1;
+  static const int kBetaBLAS = 0;
   template <typename DType> inline static void Save(DType &a, DType b) {
     a = b;
   }
@@ -79,6 +94,8 @@ struct saveto {
 
 struct plusto {
   using OPType = op::plus;
+  static const int kAlphaBLAS = 1;
+  static const int kBetaBLAS = 1;
   template <typename DType> inline static void Save(DType &a, DType b) {
     a += b;
   }
@@ -86,6 +103,8 @@ struct plusto {
 
 struct minusto {
   using OPType = op::minus;
+  static const int kAlphaBLAS = -1;
+  static const int kBetaBLAS = 1;
   template <typename DType> inline static void Save(DType &a, DType b) {
     a -= b;
   }
@@ -106,6 +125,31 @@ struct divto {
 };
 } // namespace sv
 
+// ## define reducers, Reduce folds src into dst and SetInitValue sets the
+// identity of the reduction
+namespace red {
+struct sum {
+  template <typename DType> inline static void Reduce(DType &dst, DType src) {
+    dst += src;
+  }
+  template <typename DType> inline static void SetInitValue(DType &init) {
+    init = DType(0);
+  }
+};
+
+struct maximum {
+  template <typename DType> inline static void Reduce(DType &dst, DType src) {
+    if (src > dst)
+      dst = src;
+  }
+  template <typename DType> inline static void SetInitValue(DType &init) {
+    init = std::numeric_limits<DType>::has_infinity
+               ? -std::numeric_limits<DType>::infinity()
+               : std::numeric_limits<DType>::lowest();
+  }
+};
+} // namespace red
+
 } // namespace lmlib
 
 #endif // LMLIB_LMBASE_HPP_
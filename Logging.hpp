@@ -3,10 +3,50 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "./LMBase.hpp"
 
-#endif // LMLIB_LOGGING_HPP_
\ No newline at end of file
+namespace lmlib {
+// exception thrown when a CHECK fails
+struct Error : public std::runtime_error {
+  explicit Error(const std::string &s) : std::runtime_error(s) {}
+};
+
+// collect the message of a failed CHECK, throw it on destruction
+class LogMessageFatal {
+public:
+  LogMessageFatal(const char *file, int line) {
+    log_stream_ << file << ":" << line << ": ";
+  }
+  inline std::ostringstream &stream() { return log_stream_; }
+  ~LogMessageFatal() noexcept(false) { throw Error(log_stream_.str()); }
+
+private:
+  std::ostringstream log_stream_;
+  LogMessageFatal(const LogMessageFatal &);
+  void operator=(const LogMessageFatal &);
+};
+} // namespace lmlib
+
+#ifndef CHECK
+#define CHECK(x)                                                               \
+  if (!(x))                                                                    \
+  ::lmlib::LogMessageFatal(__FILE__, __LINE__).stream()                        \
+      << "Check failed: " #x << ' '
+#define CHECK_EQ(x, y) CHECK((x) == (y))
+#define CHECK_NE(x, y) CHECK((x) != (y))
+#define CHECK_LT(x, y) CHECK((x) < (y))
+#define CHECK_LE(x, y) CHECK((x) <= (y))
+#define CHECK_GT(x, y) CHECK((x) > (y))
+#define CHECK_GE(x, y) CHECK((x) >= (y))
+#endif // !CHECK
+
+#ifndef LOG_FATAL
+#define LOG_FATAL ::lmlib::LogMessageFatal(__FILE__, __LINE__).stream()
+#endif // !LOG_FATAL
+
+#endif // LMLIB_LOGGING_HPP_
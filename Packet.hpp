@@ -6,10 +6,85 @@
 #else
 #include <malloc.h>
 #endif
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
 
 #include "./LMBase.hpp"
 #include "./Dense.hpp"
 #include "./Exp.hpp"
+#include "./Thread_Pool.hpp"
+
+// ## select the instruction sets, default to what the compiler is targeting
+#ifndef LMLIB_USE_SSE
+#if defined(__SSE2__) || defined(_M_X64) ||                                    \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LMLIB_USE_SSE 1
+#else
+#define LMLIB_USE_SSE 0
+#endif
+#endif // !LMLIB_USE_SSE
+
+#ifndef LMLIB_USE_AVX2
+#if defined(__AVX2__)
+#define LMLIB_USE_AVX2 1
+#else
+#define LMLIB_USE_AVX2 0
+#endif
+#endif // !LMLIB_USE_AVX2
+
+#ifndef LMLIB_USE_AVX512
+#if defined(__AVX512F__)
+#define LMLIB_USE_AVX512 1
+#else
+#define LMLIB_USE_AVX512 0
+#endif
+#endif // !LMLIB_USE_AVX512
+
+// half conversions, and the bfloat16 conversion of avx-512 that flushes
+// float denormals to zero on the way
+#ifndef LMLIB_USE_F16C
+#if defined(__F16C__)
+#define LMLIB_USE_F16C 1
+#else
+#define LMLIB_USE_F16C 0
+#endif
+#endif // !LMLIB_USE_F16C
+
+// the int8 dot products of the quantized gemm, avx-512 needs bw or vnni for
+// its int8 and int16 lanes
+#ifndef LMLIB_USE_AVX512BW
+#if defined(__AVX512BW__)
+#define LMLIB_USE_AVX512BW 1
+#else
+#define LMLIB_USE_AVX512BW 0
+#endif
+#endif // !LMLIB_USE_AVX512BW
+
+#ifndef LMLIB_USE_AVX512VNNI
+#if defined(__AVX512VNNI__)
+#define LMLIB_USE_AVX512VNNI 1
+#else
+#define LMLIB_USE_AVX512VNNI 0
+#endif
+#endif // !LMLIB_USE_AVX512VNNI
+
+#ifndef LMLIB_USE_AVXVNNI
+#if defined(__AVXVNNI__)
+#define LMLIB_USE_AVXVNNI 1
+#else
+#define LMLIB_USE_AVXVNNI 0
+#endif
+#endif // !LMLIB_USE_AVXVNNI
 
 namespace lmlib {
 namespace packet {
@@ -17,30 +92,940 @@ namespace packet {
 enum PacketArch {
   kPlain,
   kSSE2,
+  kAVX2,
+  kAVX512,
 };
 
-#if LMLIB_USE_SSE
+#ifndef LMLIB_DEFAULT_PACKEL
+#if LMLIB_USE_AVX512
+#define LMLIB_DEFAULT_PACKEL ::lmlib::packet::kAVX512
+#elif LMLIB_USE_AVX2
+#define LMLIB_DEFAULT_PACKEL ::lmlib::packet::kAVX2
+#elif LMLIB_USE_SSE
 #define LMLIB_DEFAULT_PACKEL ::lmlib::packet::kSSE2
 #else
 #define LMLIB_DEFAULT_PACKEL ::lmlib::packet::kPlain
 #endif
+#endif // !LMLIB_DEFAULT_PACKEL
 
+// a packet holds Packet::kSize elements of DType in one register
 template <typename DType, PacketArch Arch = LMLIB_DEFAULT_PACKEL> struct Packet;
 
+// the arch used to vectorize DType, types without simd packets use kPlain
+template <typename DType> struct PacketDefault {
+  static const PacketArch kArch = kPlain;
+};
+template <> struct PacketDefault<float> {
+  static const PacketArch kArch = LMLIB_DEFAULT_PACKEL;
+};
+template <> struct PacketDefault<double> {
+  static const PacketArch kArch = LMLIB_DEFAULT_PACKEL;
+};
+
+// whether FMA of DType packets on Arch rounds once, the arch headers
+// specialize it where FMA is a fused instruction
+template <typename DType, PacketArch Arch> struct FusedFMA {
+  static const bool value = false;
+};
+
+// the type the lanes of a DType packet hold in registers, the reduced
+// precision storage types compute in float
+template <typename DType> struct ComputeType {
+  typedef DType Type;
+};
+
+// a packet of DstDType from the plan of a SrcDType expression, the plan
+// runs on kSrcArch, which holds as many lanes or half as many when the
+// types differ in width
+template <typename DstDType, typename SrcDType, PacketArch Arch>
+struct PacketCast {
+  static const bool kPass = false;
+  static const PacketArch kSrcArch = Arch;
+};
+template <typename DType, PacketArch Arch>
+struct PacketCast<DType, DType, Arch> {
+  static const bool kPass = true;
+  static const PacketArch kSrcArch = Arch;
+  template <typename Plan>
+  inline static Packet<DType, Arch> Eval(const Plan &src, index_t y,
+                                         index_t x) {
+    return src.EvalPacket(y, x);
+  }
+};
+
 template <PacketArch Arch> struct AlignBytes {
   static const index_t value = 4;
 };
+template <> struct AlignBytes<kSSE2> {
+  static const index_t value = 16;
+};
+template <> struct AlignBytes<kAVX2> {
+  static const index_t value = 32;
+};
+template <> struct AlignBytes<kAVX512> {
+  static const index_t value = 64;
+};
 
 } // namespace packet
 } // namespace lmlib
 
+#include "./packet/Plain.hpp"
+#include "./packet/SSE2.hpp"
+#include "./packet/AVX2.hpp"
+#include "./packet/AVX512.hpp"
+#include "./packet/Half.hpp"
+#include "./packet/Int8.hpp"
+#include "./packet/Key.hpp"
+
+namespace lmlib {
+namespace packet {
+
+// round size down to a multiple of the packet size
+template <typename DType, PacketArch Arch>
+inline index_t LowerAlign(index_t size) {
+  const index_t packet_size = Packet<DType, Arch>::kSize;
+  return size / packet_size * packet_size;
+}
+
+// two packets of doubles narrow to one of floats
+template <PacketArch Arch> struct PacketCast<float, double, Arch> {
+  static const bool kPass = Arch != kPlain;
+  static const PacketArch kSrcArch = Arch;
+  template <typename Plan>
+  inline static Packet<float, Arch> Eval(const Plan &src, index_t y,
+                                         index_t x) {
+    return Narrow(src.EvalPacket(y, x),
+                  src.EvalPacket(y, x + Packet<double, Arch>::kSize));
+  }
+};
+
+// doubles widen from a packet of floats of half the width
+template <PacketArch Arch> struct HalfArch {
+  static const PacketArch kArch = kPlain;
+};
+#if LMLIB_USE_AVX2
+template <> struct HalfArch<kAVX512> {
+  static const PacketArch kArch = kAVX2;
+};
+#endif
+#if LMLIB_USE_SSE
+template <> struct HalfArch<kAVX2> {
+  static const PacketArch kArch = kSSE2;
+};
+#endif
+template <PacketArch Arch> struct PacketCast<double, float, Arch> {
+  static const PacketArch kSrcArch = HalfArch<Arch>::kArch;
+  static const bool kPass = kSrcArch != kPlain;
+  template <typename Plan>
+  inline static Packet<double, Arch> Eval(const Plan &src, index_t y,
+                                          index_t x) {
+    return Widen(src.EvalPacket(y, x));
+  }
+};
+
+// hint that the cache line at ptr is about to be read
+inline void Prefetch(const void *ptr) {
+#if defined(__GNUC__)
+  __builtin_prefetch(ptr, 0, 3);
+#elif LMLIB_USE_SSE
+  _mm_prefetch(static_cast<const char *>(ptr), _MM_HINT_T0);
+#else
+  (void)ptr;
+#endif
+}
+
+// copy bytes with non-temporal stores that go around the caches, for copies
+// too big to stay in them; the stores are weakly ordered, the thread that
+// made them calls StreamFence before the data is handed to another thread
+inline void StreamCopy(void *dst, const void *src, size_t bytes) {
+  char *d = static_cast<char *>(dst);
+  const char *s = static_cast<const char *>(src);
+#if LMLIB_USE_SSE
+  // the streaming stores need an aligned dst, the unaligned head and the
+  // tail are copied as usual
+  size_t head = size_t(-reinterpret_cast<uintptr_t>(d)) & 63;
+  head = head < bytes ? head : bytes;
+  std::memcpy(d, s, head);
+  d += head, s += head, bytes -= head;
+  for (; bytes >= 64; bytes -= 64, d += 64, s += 64) {
+#if LMLIB_USE_AVX512
+    _mm512_stream_si512(reinterpret_cast<__m512i *>(d),
+                        _mm512_loadu_si512(s));
+#elif LMLIB_USE_AVX2
+    for (int i = 0; i < 64; i += 32) {
+      _mm256_stream_si256(
+          reinterpret_cast<__m256i *>(d + i),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s + i)));
+    }
+#else
+    for (int i = 0; i < 64; i += 16) {
+      _mm_stream_si128(
+          reinterpret_cast<__m128i *>(d + i),
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i)));
+    }
+#endif
+  }
+#endif
+  std::memcpy(d, s, bytes);
+}
+
+inline void StreamFence() {
+#if LMLIB_USE_SSE
+  _mm_sfence();
+#endif
+}
+
+// packet version of the operators in op::
+template <typename OP, typename DType, PacketArch Arch> struct PacketOp {
+  static const bool kEnabled = false;
+};
+template <typename DType, PacketArch Arch>
+struct PacketOp<op::plus, DType, Arch> {
+  static const bool kEnabled = true;
+  inline static Packet<DType, Arch> Map(const Packet<DType, Arch> &lhs,
+                                        const Packet<DType, Arch> &rhs) {
+    return lhs + rhs;
+  }
+};
+template <typename DType, PacketArch Arch>
+struct PacketOp<op::minus, DType, Arch> {
+  static const bool kEnabled = true;
+  inline static Packet<DType, Arch> Map(const Packet<DType, Arch> &lhs,
+                                        const Packet<DType, Arch> &rhs) {
+    return lhs - rhs;
+  }
+};
+template <typename DType, PacketArch Arch>
+struct PacketOp<op::mul, DType, Arch> {
+  static const bool kEnabled = true;
+  inline static Packet<DType, Arch> Map(const Packet<DType, Arch> &lhs,
+                                        const Packet<DType, Arch> &rhs) {
+    return lhs * rhs;
+  }
+};
+template <typename DType, PacketArch Arch>
+struct PacketOp<op::div, DType, Arch> {
+  static const bool kEnabled = true;
+  inline static Packet<DType, Arch> Map(const Packet<DType, Arch> &lhs,
+                                        const Packet<DType, Arch> &rhs) {
+    return lhs / rhs;
+  }
+};
+template <typename DType, PacketArch Arch>
+struct PacketOp<op::rhs, DType, Arch> {
+  static const bool kEnabled = true;
+  inline static Packet<DType, Arch> Map(const Packet<DType, Arch> &lhs,
+                                        const Packet<DType, Arch> &rhs) {
+    return rhs;
+  }
+};
+template <typename DType, PacketArch Arch>
+struct PacketOp<op::identity, DType, Arch> {
+  static const bool kEnabled = true;
+  inline static Packet<DType, Arch> Map(const Packet<DType, Arch> &src) {
+    return src;
+  }
+};
+
+// packet version of the reducers in red::, Reduce combines two packets
+// lane by lane and Horizontal folds the lanes of one packet
+template <typename Reducer, typename DType, PacketArch Arch>
+struct PacketReducer {
+  static const bool kEnabled = false;
+};
+template <typename DType, PacketArch Arch>
+struct PacketReducer<red::sum, DType, Arch> {
+  static const bool kEnabled = true;
+  inline static Packet<DType, Arch> Reduce(const Packet<DType, Arch> &lhs,
+                                           const Packet<DType, Arch> &rhs) {
+    return lhs + rhs;
+  }
+  inline static DType Horizontal(const Packet<DType, Arch> &src) {
+    return src.Sum();
+  }
+};
+template <typename DType, PacketArch Arch>
+struct PacketReducer<red::maximum, DType, Arch> {
+  static const bool kEnabled = true;
+  inline static Packet<DType, Arch> Reduce(const Packet<DType, Arch> &lhs,
+                                           const Packet<DType, Arch> &rhs) {
+    return Max(lhs, rhs);
+  }
+  inline static DType Horizontal(const Packet<DType, Arch> &src) {
+    DType lane[Packet<DType, Arch>::kSize];
+    src.Store(lane);
+    DType res = lane[0];
+    for (index_t i = 1; i < Packet<DType, Arch>::kSize; ++i)
+      red::maximum::Reduce(res, lane[i]);
+    return res;
+  }
+};
+
+// packet version of the savers in sv::
+template <typename SV, typename DType, PacketArch Arch> struct Saver {
+  inline static void Save(DType *dst, const Packet<DType, Arch> &src) {
+    Packet<DType, Arch> lhs = Packet<DType, Arch>::Load(dst);
+    Packet<DType, Arch> ans =
+        PacketOp<typename SV::OPType, DType, Arch>::Map(lhs, src);
+    ans.Store(dst);
+  }
+};
+template <typename DType, PacketArch Arch>
+struct Saver<sv::saveto, DType, Arch> {
+  inline static void Save(DType *dst, const Packet<DType, Arch> &src) {
+    src.Store(dst);
+  }
+};
+
+} // namespace packet
+} // namespace lmlib
+
+namespace lmlib {
+namespace expr {
+
+// plan that evaluates a whole packet at (y, x), (y, x + kSize)
+template <typename ExpType, typename DType, packet::PacketArch Arch>
+class PacketPlan {
+public:
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const;
+  inline DType Eval(index_t y, index_t x) const;
+};
+
+template <int dim, typename DType, packet::PacketArch Arch>
+class PacketPlan<Tensor<dim, DType>, DType, Arch> {
+public:
+  explicit PacketPlan(const Tensor<dim, DType> &t)
+      : dptr_(t.dptr_), stride_(t.stride_) {}
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const {
+    return packet::Packet<DType, Arch>::Load(&dptr_[y * stride_ + x]);
+  }
+  inline DType Eval(index_t y, index_t x) const {
+    return dptr_[y * stride_ + x];
+  }
+
+private:
+  const DType *dptr_;
+  index_t stride_;
+};
+
+template <typename DType, packet::PacketArch Arch>
+class PacketPlan<ScalarExp<DType>, DType, Arch> {
+public:
+  explicit PacketPlan(DType scalar) : scalar_(scalar) {}
+  // the splat is loop invariant and gets hoisted out of the row loop, plans
+  // do not keep packets as members since they are copied into stream tasks
+  // and heap storage is not aligned for wide registers
+  inline packet::Packet<DType, Arch> EvalPacket(index_t, index_t) const {
+    return packet::Packet<DType, Arch>::Fill(scalar_);
+  }
+  inline DType Eval(index_t, index_t) const { return scalar_; }
+
+private:
+  DType scalar_;
+};
+
+template <typename OP, typename TA, typename TB, typename DType, int etype,
+          packet::PacketArch Arch>
+class PacketPlan<BinaryMapExp<OP, TA, TB, DType, etype>, DType, Arch> {
+public:
+  explicit PacketPlan(const PacketPlan<TA, DType, Arch> &lhs,
+                      const PacketPlan<TB, DType, Arch> &rhs)
+      : lhs_(lhs), rhs_(rhs) {}
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const {
+    return packet::PacketOp<OP, DType, Arch>::Map(lhs_.EvalPacket(y, x),
+                                                  rhs_.EvalPacket(y, x));
+  }
+  inline DType Eval(index_t y, index_t x) const {
+    return OP::Map(lhs_.Eval(y, x), rhs_.Eval(y, x));
+  }
+  inline const PacketPlan<TA, DType, Arch> &lhs() const { return lhs_; }
+  inline const PacketPlan<TB, DType, Arch> &rhs() const { return rhs_; }
+
+private:
+  PacketPlan<TA, DType, Arch> lhs_;
+  PacketPlan<TB, DType, Arch> rhs_;
+};
+
+// x / scalar as in Plan
+template <typename TA, typename DType, int etype, packet::PacketArch Arch>
+class PacketPlan<BinaryMapExp<op::div, TA, ScalarExp<DType>, DType, etype>,
+                 DType, Arch> {
+public:
+  explicit PacketPlan(const PacketPlan<TA, DType, Arch> &lhs,
+                      const PacketPlan<ScalarExp<DType>, DType, Arch> &rhs)
+      : lhs_(lhs), divisor_(op::div_scalar::Divisor(rhs.Eval(0, 0))) {}
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const {
+    return op::div_scalar::Map<DType>(
+        lhs_.EvalPacket(y, x), packet::Packet<DType, Arch>::Fill(divisor_));
+  }
+  inline DType Eval(index_t y, index_t x) const {
+    return op::div_scalar::Map<DType>(lhs_.Eval(y, x), divisor_);
+  }
+
+private:
+  PacketPlan<TA, DType, Arch> lhs_;
+  DType divisor_;
+};
+
+// a * b + c for the scalar tail of a packet FMA, rounded once exactly when
+// the packets are
+template <bool kFused> struct ScalarFMA {
+  template <typename DType>
+  inline static DType Eval(DType a, DType b, DType c) {
+    return a * b + c;
+  }
+};
+template <> struct ScalarFMA<true> {
+  template <typename DType>
+  inline static DType Eval(DType a, DType b, DType c) {
+    return std::fma(a, b, c);
+  }
+};
+
+// a * x + y as one packet::FMA, the rewrite of x * scalar + y and
+// scalar * x + y; the scalar tail rounds like the packets do, so where an
+// element falls never changes its value
+template <typename TX, typename TY, typename DType, packet::PacketArch Arch>
+class AxpyPacketPlan {
+public:
+  explicit AxpyPacketPlan(const PacketPlan<TX, DType, Arch> &x, DType a,
+                          const PacketPlan<TY, DType, Arch> &y)
+      : x_(x), y_(y), a_(a) {}
+  // unqualified, the FMA of the wide packets is a friend only found by adl
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const {
+    return FMA(x_.EvalPacket(y, x), packet::Packet<DType, Arch>::Fill(a_),
+               y_.EvalPacket(y, x));
+  }
+  inline DType Eval(index_t y, index_t x) const {
+    return ScalarFMA<packet::FusedFMA<DType, Arch>::value>::Eval(
+        x_.Eval(y, x), a_, y_.Eval(y, x));
+  }
+
+private:
+  PacketPlan<TX, DType, Arch> x_;
+  PacketPlan<TY, DType, Arch> y_;
+  DType a_;
+};
+
+template <typename TA, typename TB, typename DType, int emul, int etype,
+          packet::PacketArch Arch>
+class PacketPlan<BinaryMapExp<op::plus,
+                              BinaryMapExp<op::mul, TA, ScalarExp<DType>,
+                                           DType, emul>,
+                              TB, DType, etype>,
+                 DType, Arch> : public AxpyPacketPlan<TA, TB, DType, Arch> {
+public:
+  explicit PacketPlan(
+      const PacketPlan<BinaryMapExp<op::mul, TA, ScalarExp<DType>, DType,
+                                    emul>,
+                       DType, Arch> &lhs,
+      const PacketPlan<TB, DType, Arch> &rhs)
+      : AxpyPacketPlan<TA, TB, DType, Arch>(lhs.lhs(), lhs.rhs().Eval(0, 0),
+                                            rhs) {}
+};
+
+template <typename TA, typename TB, typename DType, int emul, int etype,
+          packet::PacketArch Arch>
+class PacketPlan<BinaryMapExp<op::plus,
+                              BinaryMapExp<op::mul, ScalarExp<DType>, TA,
+                                           DType, emul>,
+                              TB, DType, etype>,
+                 DType, Arch> : public AxpyPacketPlan<TA, TB, DType, Arch> {
+public:
+  explicit PacketPlan(
+      const PacketPlan<BinaryMapExp<op::mul, ScalarExp<DType>, TA, DType,
+                                    emul>,
+                       DType, Arch> &lhs,
+      const PacketPlan<TB, DType, Arch> &rhs)
+      : AxpyPacketPlan<TA, TB, DType, Arch>(lhs.rhs(), lhs.lhs().Eval(0, 0),
+                                            rhs) {}
+};
+
+// scalar * scalar + y made with F<op::mul> matches both forms above
+template <typename TB, typename DType, int emul, int etype,
+          packet::PacketArch Arch>
+class PacketPlan<
+    BinaryMapExp<op::plus,
+                 BinaryMapExp<op::mul, ScalarExp<DType>, ScalarExp<DType>,
+                              DType, emul>,
+                 TB, DType, etype>,
+    DType, Arch> : public AxpyPacketPlan<ScalarExp<DType>, TB, DType, Arch> {
+public:
+  explicit PacketPlan(
+      const PacketPlan<BinaryMapExp<op::mul, ScalarExp<DType>,
+                                    ScalarExp<DType>, DType, emul>,
+                       DType, Arch> &lhs,
+      const PacketPlan<TB, DType, Arch> &rhs)
+      : AxpyPacketPlan<ScalarExp<DType>, TB, DType, Arch>(
+            lhs.lhs(), lhs.rhs().Eval(0, 0), rhs) {}
+};
+
+template <typename OP, typename TA, typename DType, int etype,
+          packet::PacketArch Arch>
+class PacketPlan<UnaryMapExp<OP, TA, DType, etype>, DType, Arch> {
+public:
+  explicit PacketPlan(const PacketPlan<TA, DType, Arch> &src) : src_(src) {}
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const {
+    return packet::PacketOp<OP, DType, Arch>::Map(src_.EvalPacket(y, x));
+  }
+  inline DType Eval(index_t y, index_t x) const {
+    return OP::Map(src_.Eval(y, x));
+  }
+
+private:
+  PacketPlan<TA, DType, Arch> src_;
+};
+
+template <packet::PacketArch Arch, typename DType>
+inline PacketPlan<ScalarExp<DType>, DType, Arch>
+MakePacketPlan(const ScalarExp<DType> &e) {
+  return PacketPlan<ScalarExp<DType>, DType, Arch>(e.scalar_);
+}
+
+template <packet::PacketArch Arch, typename T, typename DType>
+inline PacketPlan<T, DType, Arch> MakePacketPlan(const RValueExp<T, DType> &e) {
+  return PacketPlan<T, DType, Arch>(e.self());
+}
+
+template <packet::PacketArch Arch, typename OP, typename TA, typename DType,
+          int etype>
+inline PacketPlan<UnaryMapExp<OP, TA, DType, etype>, DType, Arch>
+MakePacketPlan(const UnaryMapExp<OP, TA, DType, etype> &e) {
+  return PacketPlan<UnaryMapExp<OP, TA, DType, etype>, DType, Arch>(
+      MakePacketPlan<Arch>(e.src_));
+}
+
+template <packet::PacketArch Arch, typename OP, typename TA, typename TB,
+          typename DType, int etype>
+inline PacketPlan<BinaryMapExp<OP, TA, TB, DType, etype>, DType, Arch>
+MakePacketPlan(const BinaryMapExp<OP, TA, TB, DType, etype> &e) {
+  return PacketPlan<BinaryMapExp<OP, TA, TB, DType, etype>, DType, Arch>(
+      MakePacketPlan<Arch>(e.lhs_), MakePacketPlan<Arch>(e.rhs_));
+}
+
+// tensor-like expressions built on MakeTensorExp provide
+// PacketPlan<SubType, DType, Arch> and PacketCheck<SubType, Arch>
+template <typename SubType, typename SrcExp, int dim, typename DType>
+struct MakeTensorExp;
+
+template <typename SubType, typename SrcExp, int dim, typename DType,
+          packet::PacketArch Arch>
+class PacketPlan<MakeTensorExp<SubType, SrcExp, dim, DType>, DType, Arch> {
+public:
+  explicit PacketPlan(const PacketPlan<SubType, DType, Arch> &src)
+      : src_(src) {}
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const {
+    return src_.EvalPacket(y, x);
+  }
+  inline DType Eval(index_t y, index_t x) const { return src_.Eval(y, x); }
+
+private:
+  PacketPlan<SubType, DType, Arch> src_;
+};
+
+template <packet::PacketArch Arch, typename T, typename SrcExp, int dim,
+          typename DType>
+inline PacketPlan<MakeTensorExp<T, SrcExp, dim, DType>, DType, Arch>
+MakePacketPlan(const MakeTensorExp<T, SrcExp, dim, DType> &e) {
+  return PacketPlan<MakeTensorExp<T, SrcExp, dim, DType>, DType, Arch>(
+      PacketPlan<T, DType, Arch>(e.real_self()));
+}
+
+// typecast<DstDType>(src) with the source plan on PacketCast::kSrcArch
+template <typename DstDType, typename SrcDType, typename EType, int etype,
+          packet::PacketArch Arch>
+class PacketPlan<TypecastExp<DstDType, SrcDType, EType, etype>, DstDType,
+                 Arch> {
+public:
+  typedef packet::PacketCast<DstDType, SrcDType, Arch> Cast;
+  explicit PacketPlan(const TypecastExp<DstDType, SrcDType, EType, etype> &e)
+      : src_(MakePacketPlan<Cast::kSrcArch>(e.expr)) {}
+  inline packet::Packet<DstDType, Arch> EvalPacket(index_t y,
+                                                   index_t x) const {
+    return Cast::Eval(src_, y, x);
+  }
+  inline DstDType Eval(index_t y, index_t x) const {
+    return DstDType(src_.Eval(y, x));
+  }
+
+private:
+  PacketPlan<EType, SrcDType, Cast::kSrcArch> src_;
+};
+
+// int32 has no packets, a tensor of it converts on load
+template <typename DstDType, int dim, int etype, packet::PacketArch Arch>
+class PacketPlan<TypecastExp<DstDType, int32_t, Tensor<dim, int32_t>, etype>,
+                 DstDType, Arch> {
+public:
+  explicit PacketPlan(
+      const TypecastExp<DstDType, int32_t, Tensor<dim, int32_t>, etype> &e)
+      : dptr_(e.expr.dptr_), stride_(e.expr.stride_) {}
+  inline packet::Packet<DstDType, Arch> EvalPacket(index_t y,
+                                                   index_t x) const {
+    return packet::Packet<DstDType, Arch>::Convert(&dptr_[y * stride_ + x]);
+  }
+  inline DstDType Eval(index_t y, index_t x) const {
+    return DstDType(dptr_[y * stride_ + x]);
+  }
+
+private:
+  const int32_t *dptr_;
+  index_t stride_;
+};
+
+template <packet::PacketArch Arch, typename DstDType, typename SrcDType,
+          typename EType, int etype>
+inline PacketPlan<TypecastExp<DstDType, SrcDType, EType, etype>, DstDType,
+                  Arch>
+MakePacketPlan(const TypecastExp<DstDType, SrcDType, EType, etype> &e) {
+  return PacketPlan<TypecastExp<DstDType, SrcDType, EType, etype>, DstDType,
+                    Arch>(e);
+}
+
+// whether an expression tree can be evaluated by PacketPlan
+template <typename E, packet::PacketArch Arch> struct PacketCheck {
+  static const bool kPass = false;
+};
+template <int dim, typename DType, packet::PacketArch Arch>
+struct PacketCheck<Tensor<dim, DType>, Arch> {
+  static const bool kPass = true;
+};
+template <typename DType, packet::PacketArch Arch>
+struct PacketCheck<ScalarExp<DType>, Arch> {
+  static const bool kPass = true;
+};
+template <typename OP, typename TA, typename DType, int etype,
+          packet::PacketArch Arch>
+struct PacketCheck<UnaryMapExp<OP, TA, DType, etype>, Arch> {
+  static const bool kPass = PacketCheck<TA, Arch>::kPass &&
+                            packet::PacketOp<OP, DType, Arch>::kEnabled;
+};
+template <typename OP, typename TA, typename TB, typename DType, int etype,
+          packet::PacketArch Arch>
+struct PacketCheck<BinaryMapExp<OP, TA, TB, DType, etype>, Arch> {
+  static const bool kPass = PacketCheck<TA, Arch>::kPass &&
+                            PacketCheck<TB, Arch>::kPass &&
+                            packet::PacketOp<OP, DType, Arch>::kEnabled;
+};
+template <typename T, typename SrcExp, int dim, typename DType,
+          packet::PacketArch Arch>
+struct PacketCheck<MakeTensorExp<T, SrcExp, dim, DType>, Arch> {
+  static const bool kPass = PacketCheck<T, Arch>::kPass;
+};
+template <typename DstDType, typename SrcDType, typename EType, int etype,
+          packet::PacketArch Arch>
+struct PacketCheck<TypecastExp<DstDType, SrcDType, EType, etype>, Arch> {
+  typedef packet::PacketCast<DstDType, SrcDType, Arch> Cast;
+  static const bool kPass =
+      Cast::kPass && PacketCheck<EType, Cast::kSrcArch>::kPass;
+};
+template <typename DstDType, int dim, int etype, packet::PacketArch Arch>
+struct PacketCheck<TypecastExp<DstDType, int32_t, Tensor<dim, int32_t>, etype>,
+                   Arch> {
+  static const bool kPass = std::is_same<DstDType, float>::value ||
+                            std::is_same<DstDType, double>::value;
+};
+
+// the columns of a row after its last full packet, one PacketPlan::Eval
+// per element; the reduced precision types run them on a kPlain plan
+// instead, its one float lane computes and rounds on store like the wide
+// packets do, so where an element falls never changes its value
+template <typename E, typename DType, packet::PacketArch Arch,
+          bool kWide = !std::is_same<typename packet::ComputeType<DType>::Type,
+                                     DType>::value &&
+                       PacketCheck<E, packet::kPlain>::kPass>
+struct PacketTail {
+  explicit PacketTail(const E &) {}
+  template <typename SV>
+  inline void Save(DType *dst, const PacketPlan<E, DType, Arch> &plan,
+                   index_t y, index_t x) const {
+    SV::template Save<DType>(*dst, plan.Eval(y, x));
+  }
+};
+template <typename E, typename DType, packet::PacketArch Arch>
+struct PacketTail<E, DType, Arch, true> {
+  explicit PacketTail(const E &e) : plan_(MakePacketPlan<packet::kPlain>(e)) {}
+  template <typename SV>
+  inline void Save(DType *dst, const PacketPlan<E, DType, Arch> &, index_t y,
+                   index_t x) const {
+    packet::Saver<SV, DType, packet::kPlain>::Save(dst,
+                                                   plan_.EvalPacket(y, x));
+  }
+
+private:
+  PacketPlan<E, DType, packet::kPlain> plan_;
+};
+
+// evaluate rows [ybegin, yend) and columns [xbegin, xend) of the plan,
+// full packets first and the tail of every row
+template <typename SV, typename E, int dim, typename DType,
+          packet::PacketArch Arch>
+inline void MapPacketPlan(Tensor<dim, DType> dst,
+                          const PacketPlan<E, DType, Arch> &plan,
+                          const PacketTail<E, DType, Arch> &tail,
+                          index_t ybegin, index_t yend, index_t xbegin,
+                          index_t xend) {
+  const index_t xlen = xbegin + packet::LowerAlign<DType, Arch>(xend - xbegin);
+  const index_t packet_size = packet::Packet<DType, Arch>::kSize;
+  for (index_t y = ybegin; y < yend; ++y) {
+    DType *drow = dst.dptr_ + y * dst.stride_;
+    for (index_t x = xbegin; x < xlen; x += packet_size) {
+      packet::Saver<SV, DType, Arch>::Save(drow + x, plan.EvalPacket(y, x));
+    }
+    for (index_t x = xlen; x < xend; ++x) {
+      tail.template Save<SV>(drow + x, plan, y, x);
+    }
+  }
+}
+
+} // namespace expr
+} // namespace lmlib
+
 namespace lmlib {
 namespace packet {
 
-inline void *AlignedMallocPitch(size_t *out_pitch, size_t lspace,
-                                size_t num_line);
+// allocate size bytes aligned to align bytes, align is a power of two
+inline void *AlignedMalloc(size_t size, size_t align) {
+#ifdef _MSC_VER
+  void *res = _aligned_malloc(size, align);
+#else
+  void *res = nullptr;
+  if (posix_memalign(&res, align, size) != 0)
+    res = nullptr;
+#endif
+  if (res == nullptr)
+    throw std::bad_alloc();
+  return res;
+}
+
+inline void AlignedFree(void *ptr) {
+#ifdef _MSC_VER
+  _aligned_free(ptr);
+#else
+  free(ptr);
+#endif
+}
+
+// ## page placement of big buffers
+// buffers of at least kPageMinBytes are mapped straight from the kernel in
+// whole huge pages, smaller ones come from AlignedMalloc
+const size_t kHugePageSize = size_t(2) << 20;
+const size_t kPageMinBytes = size_t(4) << 20;
+const size_t kPageSize = 4096;
+
+enum HugePageMode {
+  // normal pages only
+  kHugePageNone,
+  // ask for transparent huge pages with madvise
+  kHugePageTransparent,
+  // take pages from the reserved hugetlb pool, fall back to transparent
+  // huge pages when the pool is empty
+  kHugePageExplicit
+};
+
+enum NumaMode {
+  // pages land on the node of the thread that touches them first
+  kNumaLocal,
+  // spread the pages round robin over all nodes
+  kNumaInterleave,
+  // keep the pages on PagePolicy::node
+  kNumaBind
+};
+
+struct PagePolicy {
+  HugePageMode huge_page = kHugePageTransparent;
+  NumaMode numa = kNumaLocal;
+  int node = 0;
+};
+
+// process wide policy, set it before the buffers are allocated, the
+// defaults are read from LMLIB_HUGEPAGE=none|thp|explicit and
+// LMLIB_NUMA=local|interleave|<node>
+inline PagePolicy &DefaultPagePolicy() {
+  static PagePolicy policy = [] {
+    PagePolicy res;
+    const char *huge = std::getenv("LMLIB_HUGEPAGE");
+    if (huge != nullptr) {
+      if (std::strcmp(huge, "none") == 0)
+        res.huge_page = kHugePageNone;
+      else if (std::strcmp(huge, "explicit") == 0)
+        res.huge_page = kHugePageExplicit;
+    }
+    const char *numa = std::getenv("LMLIB_NUMA");
+    if (numa != nullptr) {
+      if (std::strcmp(numa, "interleave") == 0) {
+        res.numa = kNumaInterleave;
+      } else if (numa[0] >= '0' && numa[0] <= '9') {
+        res.numa = kNumaBind;
+        res.node = std::atoi(numa);
+      }
+    }
+    return res;
+  }();
+  return policy;
+}
+
+// bit i is set when numa node i is online, nodes above 63 are ignored
+inline unsigned long NumaOnlineNodes() {
+  static const unsigned long mask = [] {
+    unsigned long res = 1;
+#ifdef __linux__
+    FILE *fp = std::fopen("/sys/devices/system/node/online", "r");
+    if (fp == nullptr)
+      return res;
+    res = 0;
+    // the file is a list of ranges such as 0-1,4
+    int lo, hi;
+    while (std::fscanf(fp, "%d", &lo) == 1) {
+      hi = lo;
+      int c = std::fgetc(fp);
+      if (c == '-') {
+        if (std::fscanf(fp, "%d", &hi) != 1)
+          break;
+        c = std::fgetc(fp);
+      }
+      for (int i = lo; i <= hi && i < 64; ++i)
+        res |= 1UL << i;
+      if (c != ',')
+        break;
+    }
+    std::fclose(fp);
+    if (res == 0)
+      res = 1;
+#endif
+    return res;
+  }();
+  return mask;
+}
+
+// placement is a hint, failures leave the default local policy
+inline void ApplyNumaPolicy(void *ptr, size_t size, const PagePolicy &policy) {
+#if defined(__linux__) && defined(SYS_mbind)
+  // constants of linux/mempolicy.h, spelled out to avoid libnuma
+  const int kMpolBind = 2, kMpolInterleave = 3;
+  unsigned long mask = NumaOnlineNodes();
+  int mode;
+  if (policy.numa == kNumaInterleave) {
+    if ((mask & (mask - 1)) == 0)
+      return;
+    mode = kMpolInterleave;
+  } else if (policy.numa == kNumaBind) {
+    if (policy.node < 0 || policy.node >= 64 ||
+        (mask >> policy.node & 1) == 0)
+      return;
+    mask = 1UL << policy.node;
+    mode = kMpolBind;
+  } else {
+    return;
+  }
+  syscall(SYS_mbind, ptr, size, mode, &mask, 8 * sizeof(mask) + 1, 0);
+#else
+  (void)ptr;
+  (void)size;
+  (void)policy;
+#endif
+}
+
+// allocate size bytes placed by policy, aligned to at least 64 bytes,
+// release with AlignedFreePages(ptr, size); whether the pages are mapped
+// only depends on size, so policy may change between the two calls
+inline void *
+AlignedMallocPages(size_t size,
+                   const PagePolicy &policy = DefaultPagePolicy()) {
+#ifdef __linux__
+  if (size >= kPageMinBytes) {
+    const size_t len =
+        (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    void *res = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (policy.huge_page == kHugePageExplicit) {
+      res = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (res == MAP_FAILED) {
+      // map one extra huge page and cut the ends off to align the start
+      void *raw = mmap(nullptr, len + kHugePageSize, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (raw == MAP_FAILED)
+        throw std::bad_alloc();
+      char *base = static_cast<char *>(raw);
+      char *aligned = reinterpret_cast<char *>(
+          (reinterpret_cast<uintptr_t>(base) + kHugePageSize - 1) &
+          ~uintptr_t(kHugePageSize - 1));
+      if (aligned != base)
+        munmap(base, aligned - base);
+      if (aligned + len != base + len + kHugePageSize)
+        munmap(aligned + len, base + kHugePageSize - aligned);
+      res = aligned;
+#ifdef MADV_HUGEPAGE
+      if (policy.huge_page != kHugePageNone)
+        madvise(res, len, MADV_HUGEPAGE);
+#endif
+    }
+    ApplyNumaPolicy(res, len, policy);
+    return res;
+  }
+#endif
+  (void)policy;
+  return AlignedMalloc(size, 64);
+}
+
+inline void AlignedFreePages(void *ptr, size_t size) {
+  if (ptr == nullptr)
+    return;
+#ifdef __linux__
+  if (size >= kPageMinBytes) {
+    munmap(ptr, (size + kHugePageSize - 1) / kHugePageSize * kHugePageSize);
+    return;
+  }
+#endif
+  (void)size;
+  AlignedFree(ptr);
+}
+
+// allocate num_line lines of lspace bytes, the pitch between lines is
+// padded to a whole cache line, which also covers the widest packet;
+// when pool is given and the pages are fresh and placed by first touch,
+// the lines are touched by the pool threads that ParallelFor over the
+// lines later hands them to, so each thread works on local memory;
+// release with AlignedFreePages(ptr, *out_pitch * num_line)
+inline void *
+AlignedMallocPitch(size_t *out_pitch, size_t lspace, size_t num_line,
+                   ThreadPool *pool = nullptr,
+                   const PagePolicy &policy = DefaultPagePolicy()) {
+  const size_t pitch = (lspace + 63) / 64 * 64;
+  const size_t size = pitch * num_line;
+  *out_pitch = pitch;
+  char *res = static_cast<char *>(AlignedMallocPages(size, policy));
+  if (pool == nullptr || pool->NumThreads() == 1 || size < kPageMinBytes ||
+      policy.numa != kNumaLocal)
+    return res;
+  // write one byte per page, a page shared by two chunks goes to the one
+  // holding its first byte
+  auto touch = [res](size_t begin, size_t end) {
+    for (size_t p = (begin + kPageSize - 1) / kPageSize * kPageSize; p < end;
+         p += kPageSize)
+      res[p] = 0;
+  };
+  if (num_line >= size_t(pool->NumThreads())) {
+    pool->ParallelFor(0, index_t(num_line), 1,
+                      [&](index_t ybegin, index_t yend) {
+                        touch(size_t(ybegin) * pitch, size_t(yend) * pitch);
+                      });
+  } else {
+    // a few long lines get split by columns
+    pool->ParallelFor(0, index_t(pitch / 64), 1,
+                      [&](index_t ubegin, index_t uend) {
+                        for (size_t y = 0; y < num_line; ++y)
+                          touch(y * pitch + size_t(ubegin) * 64,
+                                y * pitch + size_t(uend) * 64);
+                      });
+  }
+  return res;
+}
 
 } // namespace packet
 } // namespace lmlib
 
-#endif // LMLIB_PACKET_HPP
\ No newline at end of file
+#endif // LMLIB_PACKET_HPP
@@ -313,6 +313,47 @@ inline Shape<5> Shape5(index_t _0, index_t _1, index_t _2, index_t _3,
   return _;
 }
 
+/**
+ * @brief product of the extents dims...
+ *
+ * dims... 的乘积
+ */
+template <index_t... dims> struct StaticProd;
+template <> struct StaticProd<> {
+  static const index_t kValue = 1;
+};
+template <index_t d, index_t... dims> struct StaticProd<d, dims...> {
+  static const index_t kValue = d * StaticProd<dims...>::kValue;
+};
+
+/**
+ * @brief a shape whose extents are compile time constants
+ *
+ * 编译期确定的尺寸，例如 StaticShape<3, 3> 表示 3x3 矩阵
+ *
+ * @tparam dims 各维的大小
+ * @note 用于 SmallTensor，循环的次数在编译期已知，可以完全展开
+ */
+template <index_t... dims> struct StaticShape {
+  static const int kDimension = sizeof...(dims);
+  static const index_t kSize = StaticProd<dims...>::kValue;
+
+  /**
+   * @brief the same shape as a runtime Shape
+   *
+   * 转换为运行期的 Shape
+   *
+   * @return Shape<kDimension> 尺寸信息
+   */
+  inline static Shape<kDimension> Get() {
+    const index_t extents[kDimension] = {dims...};
+    Shape<kDimension> ret;
+    for (int i = 0; i < kDimension; i++)
+      ret[i] = extents[i];
+    return ret;
+  }
+};
+
 /**
  * @brief output the Shape to std::ostream
  *
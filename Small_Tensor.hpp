@@ -0,0 +1,321 @@
+#ifndef LMLIB_SMALL_TENSOR_HPP_
+#define LMLIB_SMALL_TENSOR_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include "./LMBase.hpp"
+#include "./Logging.hpp"
+#include "./Shape.hpp"
+#include "./Dense.hpp"
+#include "./Exp_Engine.hpp"
+#include "./Dense_Engine.hpp"
+
+namespace lmlib {
+// f(i) for every i in [begin, end), unrolled at compile time
+template <index_t begin, index_t end> struct StaticFor {
+  template <typename F> inline static void Run(const F &f) {
+    f(begin);
+    StaticFor<begin + 1, end>::Run(f);
+  }
+};
+template <index_t end> struct StaticFor<end, end> {
+  template <typename F> inline static void Run(const F &) {}
+};
+
+// a N x M matrix with compile time extents and its elements inside the
+// object, for the 3x3 and 4x4 transforms of geometry code; it takes part in
+// expressions like Tensor<2, DType>, and assignments to it, dot, Inverse and
+// Determinant are fully unrolled with no shape or loop overhead
+//
+//   SmallTensor<3, 3, float> r = {0, -1, 0, 1, 0, 0, 0, 0, 1};
+//   SmallTensor<3, 1, float> p = {1, 2, 3}, q;
+//   q = dot(r, p);
+//   q += t;
+template <index_t N, index_t M, typename DType LMLIB_DEFAULT_DTYPE>
+struct SmallTensor : public TRValue<SmallTensor<N, M, DType>, 2, DType> {
+  typedef StaticShape<N, M> ShapeType;
+  static const index_t kRows = N;
+  static const index_t kCols = M;
+  DType data_[N * M];
+
+  inline SmallTensor() {}
+
+  // row major elements, the rest are zero
+  inline SmallTensor(std::initializer_list<DType> data) {
+    CHECK(index_t(data.size()) <= N * M)
+        << "SmallTensor: " << data.size() << " elements for " << N << "x"
+        << M;
+    std::fill(std::copy(data.begin(), data.end(), data_), data_ + N * M,
+              DType(0));
+  }
+
+  inline DType &operator()(index_t y, index_t x) { return data_[y * M + x]; }
+  inline const DType &operator()(index_t y, index_t x) const {
+    return data_[y * M + x];
+  }
+
+  inline index_t size(index_t idx) const { return idx == 0 ? N : M; }
+
+  // a tensor over the elements, for the engines taking Tensor<2, DType>
+  inline Tensor<2, DType> View() {
+    return Tensor<2, DType>(data_, ShapeType::Get());
+  }
+
+  template <typename EType, int etype>
+  inline SmallTensor<N, M, DType> &
+  operator=(const expr::Exp<EType, DType, etype> &exp) {
+    return this->__assign(exp);
+  }
+
+  inline SmallTensor<N, M, DType> &operator=(const DType &exp) {
+    return this->__assign(exp);
+  }
+};
+
+namespace expr {
+template <index_t N, index_t M, typename DType>
+struct ExpInfo<SmallTensor<N, M, DType>> {
+  static const int kDim = 2;
+};
+
+template <index_t N, index_t M, typename DType>
+struct ShapeCheck<2, SmallTensor<N, M, DType>> {
+  inline static Shape<2> Check(const SmallTensor<N, M, DType> &) {
+    return StaticShape<N, M>::Get();
+  }
+};
+
+template <index_t N, index_t M, typename DType>
+class Plan<SmallTensor<N, M, DType>, DType> {
+public:
+  explicit Plan(const SmallTensor<N, M, DType> &t) : dptr_(t.data_) {}
+  inline const DType &Eval(index_t y, index_t x) const {
+    return dptr_[y * M + x];
+  }
+
+private:
+  const DType *dptr_;
+};
+
+// dst (SV)= scale * op(lhs) * op(rhs), every product unrolled; the result
+// is formed before dst is written, so dst may be an operand
+template <typename SV, index_t N, index_t K, index_t LN, index_t LM,
+          index_t RN, index_t RM, bool ltrans, bool rtrans, typename DType>
+struct ExpComplexEngine<
+    SV, SmallTensor<N, K, DType>,
+    DotExp<SmallTensor<LN, LM, DType>, SmallTensor<RN, RM, DType>, ltrans,
+           rtrans, DType>,
+    DType> {
+  static const index_t kInner = ltrans ? LN : LM;
+  inline static void
+  Eval(SmallTensor<N, K, DType> *dst,
+       const DotExp<SmallTensor<LN, LM, DType>, SmallTensor<RN, RM, DType>,
+                    ltrans, rtrans, DType> &exp) {
+    static_assert((ltrans ? LM : LN) == N && (rtrans ? RN : RM) == K &&
+                      (rtrans ? RM : RN) == kInner,
+                  "dot: shapes of SmallTensor do not match");
+    const DType *a = exp.lhs_.data_, *b = exp.rhs_.data_;
+    DType out[N * K];
+    StaticFor<0, N * K>::Run([&](index_t i) {
+      const index_t y = i / K, x = i % K;
+      DType sum = DType(0);
+      StaticFor<0, kInner>::Run([&](index_t k) {
+        sum += a[ltrans ? k * LM + y : y * LM + k] *
+               b[rtrans ? x * RM + k : k * RM + x];
+      });
+      out[i] = sum;
+    });
+    DType *d = dst->data_;
+    const DType scale = exp.scale_;
+    StaticFor<0, N * K>::Run([&](index_t i) {
+      SV::template Save<DType>(d[i], scale * out[i]);
+    });
+  }
+};
+} // namespace expr
+
+// dst (Saver)= exp unrolled over the N * M elements, the values are formed
+// before dst is written, so a = a.T() works
+template <typename Saver, index_t N, index_t M, typename DType, typename E,
+          int etype>
+struct MapExpEngine<false, Saver, SmallTensor<N, M, DType>, 2, DType, E,
+                    etype> {
+  inline static void Map(TRValue<SmallTensor<N, M, DType>, 2, DType> *dst,
+                         const expr::Exp<E, DType, etype> &exp) {
+    expr::Plan<E, DType> plan = expr::MakePlan(exp.self());
+    DType out[N * M];
+    StaticFor<0, N * M>::Run(
+        [&](index_t i) { out[i] = plan.Eval(i / M, i % M); });
+    DType *d = dst->ptrself()->data_;
+    StaticFor<0, N * M>::Run(
+        [&](index_t i) { Saver::template Save<DType>(d[i], out[i]); });
+  }
+};
+
+// determinant and inverse of a N x N matrix by Gauss-Jordan elimination
+// with partial pivoting, 2x2, 3x3 and 4x4 use the closed forms below
+template <index_t N, typename DType> struct SmallSolver {
+  inline static DType Determinant(const DType *src) {
+    DType a[N * N];
+    std::copy(src, src + N * N, a);
+    DType det = DType(1);
+    for (index_t c = 0; c < N; ++c) {
+      index_t p = c;
+      for (index_t r = c + 1; r < N; ++r) {
+        if (std::abs(a[r * N + c]) > std::abs(a[p * N + c]))
+          p = r;
+      }
+      if (a[p * N + c] == DType(0))
+        return DType(0);
+      if (p != c) {
+        std::swap_ranges(a + p * N, a + p * N + N, a + c * N);
+        det = -det;
+      }
+      det *= a[c * N + c];
+      for (index_t r = c + 1; r < N; ++r) {
+        const DType f = a[r * N + c] / a[c * N + c];
+        for (index_t k = c; k < N; ++k)
+          a[r * N + k] -= f * a[c * N + k];
+      }
+    }
+    return det;
+  }
+  inline static void Inverse(const DType *src, DType *dst) {
+    DType a[N * N];
+    std::copy(src, src + N * N, a);
+    for (index_t i = 0; i < N * N; ++i)
+      dst[i] = DType(i / N == i % N);
+    for (index_t c = 0; c < N; ++c) {
+      index_t p = c;
+      for (index_t r = c + 1; r < N; ++r) {
+        if (std::abs(a[r * N + c]) > std::abs(a[p * N + c]))
+          p = r;
+      }
+      std::swap_ranges(a + p * N, a + p * N + N, a + c * N);
+      std::swap_ranges(dst + p * N, dst + p * N + N, dst + c * N);
+      const DType inv = DType(1) / a[c * N + c];
+      for (index_t k = 0; k < N; ++k) {
+        a[c * N + k] *= inv;
+        dst[c * N + k] *= inv;
+      }
+      for (index_t r = 0; r < N; ++r) {
+        if (r == c)
+          continue;
+        const DType f = a[r * N + c];
+        for (index_t k = 0; k < N; ++k) {
+          a[r * N + k] -= f * a[c * N + k];
+          dst[r * N + k] -= f * dst[c * N + k];
+        }
+      }
+    }
+  }
+};
+
+template <typename DType> struct SmallSolver<2, DType> {
+  inline static DType Determinant(const DType *a) {
+    return a[0] * a[3] - a[1] * a[2];
+  }
+  inline static void Inverse(const DType *a, DType *b) {
+    const DType inv = DType(1) / Determinant(a);
+    const DType a0 = a[0];
+    b[0] = a[3] * inv;
+    b[1] = -a[1] * inv;
+    b[2] = -a[2] * inv;
+    b[3] = a0 * inv;
+  }
+};
+
+template <typename DType> struct SmallSolver<3, DType> {
+  inline static DType Determinant(const DType *a) {
+    return a[0] * (a[4] * a[8] - a[5] * a[7]) +
+           a[1] * (a[5] * a[6] - a[3] * a[8]) +
+           a[2] * (a[3] * a[7] - a[4] * a[6]);
+  }
+  // adjugate over determinant
+  inline static void Inverse(const DType *a, DType *b) {
+    DType c[9];
+    c[0] = a[4] * a[8] - a[5] * a[7];
+    c[1] = a[2] * a[7] - a[1] * a[8];
+    c[2] = a[1] * a[5] - a[2] * a[4];
+    c[3] = a[5] * a[6] - a[3] * a[8];
+    c[4] = a[0] * a[8] - a[2] * a[6];
+    c[5] = a[2] * a[3] - a[0] * a[5];
+    c[6] = a[3] * a[7] - a[4] * a[6];
+    c[7] = a[1] * a[6] - a[0] * a[7];
+    c[8] = a[0] * a[4] - a[1] * a[3];
+    const DType inv = DType(1) / (a[0] * c[0] + a[1] * c[3] + a[2] * c[6]);
+    for (int i = 0; i < 9; ++i)
+      b[i] = c[i] * inv;
+  }
+};
+
+template <typename DType> struct SmallSolver<4, DType> {
+  // the 2x2 minors of the top two rows (s) and the bottom two rows (c)
+  struct Minors {
+    DType s[6], c[6];
+    explicit Minors(const DType *a) {
+      s[0] = a[0] * a[5] - a[4] * a[1];
+      s[1] = a[0] * a[6] - a[4] * a[2];
+      s[2] = a[0] * a[7] - a[4] * a[3];
+      s[3] = a[1] * a[6] - a[5] * a[2];
+      s[4] = a[1] * a[7] - a[5] * a[3];
+      s[5] = a[2] * a[7] - a[6] * a[3];
+      c[5] = a[10] * a[15] - a[14] * a[11];
+      c[4] = a[9] * a[15] - a[13] * a[11];
+      c[3] = a[9] * a[14] - a[13] * a[10];
+      c[2] = a[8] * a[15] - a[12] * a[11];
+      c[1] = a[8] * a[14] - a[12] * a[10];
+      c[0] = a[8] * a[13] - a[12] * a[9];
+    }
+    inline DType Determinant() const {
+      return s[0] * c[5] - s[1] * c[4] + s[2] * c[3] + s[3] * c[2] -
+             s[4] * c[1] + s[5] * c[0];
+    }
+  };
+  inline static DType Determinant(const DType *a) {
+    return Minors(a).Determinant();
+  }
+  inline static void Inverse(const DType *a, DType *b) {
+    const Minors m(a);
+    const DType *s = m.s, *c = m.c;
+    const DType inv = DType(1) / m.Determinant();
+    DType r[16];
+    r[0] = a[5] * c[5] - a[6] * c[4] + a[7] * c[3];
+    r[1] = -a[1] * c[5] + a[2] * c[4] - a[3] * c[3];
+    r[2] = a[13] * s[5] - a[14] * s[4] + a[15] * s[3];
+    r[3] = -a[9] * s[5] + a[10] * s[4] - a[11] * s[3];
+    r[4] = -a[4] * c[5] + a[6] * c[2] - a[7] * c[1];
+    r[5] = a[0] * c[5] - a[2] * c[2] + a[3] * c[1];
+    r[6] = -a[12] * s[5] + a[14] * s[2] - a[15] * s[1];
+    r[7] = a[8] * s[5] - a[10] * s[2] + a[11] * s[1];
+    r[8] = a[4] * c[4] - a[5] * c[2] + a[7] * c[0];
+    r[9] = -a[0] * c[4] + a[1] * c[2] - a[3] * c[0];
+    r[10] = a[12] * s[4] - a[13] * s[2] + a[15] * s[0];
+    r[11] = -a[8] * s[4] + a[9] * s[2] - a[11] * s[0];
+    r[12] = -a[4] * c[3] + a[5] * c[1] - a[6] * c[0];
+    r[13] = a[0] * c[3] - a[1] * c[1] + a[2] * c[0];
+    r[14] = -a[12] * s[3] + a[13] * s[1] - a[14] * s[0];
+    r[15] = a[8] * s[3] - a[9] * s[1] + a[10] * s[0];
+    for (int i = 0; i < 16; ++i)
+      b[i] = r[i] * inv;
+  }
+};
+
+// determinant of a square SmallTensor
+template <index_t N, typename DType>
+inline DType Determinant(const SmallTensor<N, N, DType> &a) {
+  return SmallSolver<N, DType>::Determinant(a.data_);
+}
+
+// inverse of a square SmallTensor of a floating point type, a singular
+// matrix gives inf or nan elements, test Determinant first when that matters
+template <index_t N, typename DType>
+inline SmallTensor<N, N, DType> Inverse(const SmallTensor<N, N, DType> &a) {
+  SmallTensor<N, N, DType> ret;
+  SmallSolver<N, DType>::Inverse(a.data_, ret.data_);
+  return ret;
+}
+} // namespace lmlib
+
+#endif // LMLIB_SMALL_TENSOR_HPP_
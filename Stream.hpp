@@ -1,13 +1,174 @@
 #ifndef LMLIB_STREAM_HPP_
 #define LMLIB_STREAM_HPP_
 
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 #include "LMBase.hpp"
+#include "Thread_Pool.hpp"
 
 namespace lmlib {
+// in-order asynchronous work queue, tasks run one after another on a queue
+// thread, which also acts as thread 0 of the pool for parallel kernels
 struct Stream {
-  inline void Wait() {}
-  inline bool CheckIdle() { return true; }
+  // nthread <= 0 uses ThreadPool::DefaultNumThreads()
+  explicit Stream(int nthread = 0)
+      : pool_(nthread), queue_thread_(&Stream::QueueLoop, this) {}
+
+  ~Stream() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_cond_.wait(lock, [this] { return queue_.empty() && !running_; });
+      shutdown_ = true;
+    }
+    task_cond_.notify_one();
+    queue_thread_.join();
+  }
+
+  // block until every task pushed so far has finished, rethrow the first
+  // error raised by a task; must not be called from a task of this stream
+  inline void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_cond_.wait(lock, [this] { return queue_.empty() && !running_; });
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = std::exception_ptr();
+      std::rethrow_exception(error);
+    }
+  }
+
+  inline bool CheckIdle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.empty() && !running_;
+  }
+
+  // enqueue a task, everything it touches must outlive the task
+  inline void Push(const std::function<void()> &task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(task);
+    }
+    task_cond_.notify_one();
+  }
+
+  inline ThreadPool &pool() { return pool_; }
+
+  // minimum number of elements handed to one thread by the map engine
+  inline index_t GrainSize() const { return grain_size_; }
+  inline void SetGrainSize(index_t grain_size) {
+    grain_size_ = grain_size > 0 ? grain_size : 1;
+  }
+
+private:
+  inline void QueueLoop() {
+    while (true) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_cond_.wait(lock, [this] { return !queue_.empty() || shutdown_; });
+        if (queue_.empty())
+          return;
+        task.swap(queue_.front());
+        queue_.pop_front();
+        running_ = true;
+      }
+      try {
+        task();
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error_)
+          error_ = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+      if (queue_.empty())
+        idle_cond_.notify_all();
+    }
+  }
+
+  ThreadPool pool_;
+  index_t grain_size_ = 1 << 15;
+  std::mutex mutex_;
+  std::condition_variable task_cond_;
+  std::condition_variable idle_cond_;
+  std::deque<std::function<void()>> queue_;
+  bool running_ = false;
+  bool shutdown_ = false;
+  std::exception_ptr error_;
+  std::thread queue_thread_;
+
+  Stream(const Stream &);
+  void operator=(const Stream &);
 };
+
+// marks a point in a stream, other streams or the host can wait for it
+class Event {
+public:
+  // the event completes when the stream reaches this point
+  inline void Record(Stream *stream) {
+    std::shared_ptr<State> state = std::make_shared<State>();
+    state_ = state;
+    stream->Push([state] { state->Signal(); });
+  }
+
+  // true when the last Record has been reached, or Record was never called
+  inline bool Query() const { return !state_ || state_->Query(); }
+
+  // block the host until the last Record has been reached
+  inline void Synchronize() const {
+    if (state_)
+      state_->Wait();
+  }
+
+  // make later tasks of stream wait for the last Record of this event
+  inline void StreamWait(Stream *stream) const {
+    if (!state_)
+      return;
+    std::shared_ptr<State> state = state_;
+    stream->Push([state] { state->Wait(); });
+  }
+
+private:
+  struct State {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool done = false;
+
+    inline void Signal() {
+      std::lock_guard<std::mutex> lock(mutex);
+      done = true;
+      cond.notify_all();
+    }
+    inline bool Query() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return done;
+    }
+    inline void Wait() {
+      std::unique_lock<std::mutex> lock(mutex);
+      cond.wait(lock, [this] { return done; });
+    }
+  };
+  std::shared_ptr<State> state_;
+};
+
+// pool of stream, NULL when there is no stream
+inline ThreadPool *GetPool(Stream *stream) {
+  return stream != nullptr ? &stream->pool() : nullptr;
+}
+
+// push func to stream, or run it right away when stream is NULL
+template <typename F> inline void RunOnStream(Stream *stream, const F &func) {
+  if (stream == nullptr) {
+    func();
+  } else {
+    stream->Push(func);
+  }
+}
 } // namespace lmlib
 
 #endif // LMLIB_STREAM_HPP_
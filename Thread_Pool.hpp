@@ -0,0 +1,153 @@
+#ifndef LMLIB_THREAD_POOL_HPP_
+#define LMLIB_THREAD_POOL_HPP_
+
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "./LMBase.hpp"
+
+namespace lmlib {
+// fork-join pool, the calling thread works as thread 0
+class ThreadPool {
+public:
+  // nthread <= 0 means LMLIB_NUM_THREADS or the hardware concurrency
+  explicit ThreadPool(int nthread = 0)
+      : nthread_(nthread > 0 ? nthread : DefaultNumThreads()) {
+    for (int i = 1; i < nthread_; ++i) {
+      workers_.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shutdown_ = true;
+      ++generation_;
+    }
+    start_cond_.notify_all();
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      workers_[i].join();
+    }
+  }
+
+  inline int NumThreads() const { return nthread_; }
+
+  // run func(tid) for tid in [0, njob), njob <= NumThreads()
+  // nested calls from inside a job run serially on the calling thread
+  inline void Run(int njob, const std::function<void(int)> &func) {
+    if (njob > nthread_)
+      njob = nthread_;
+    if (njob <= 1 || InWorker()) {
+      for (int i = 0; i < njob; ++i)
+        func(i);
+      return;
+    }
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = &func;
+      njob_ = njob;
+      pending_ = njob - 1;
+      error_ = std::exception_ptr();
+      ++generation_;
+    }
+    start_cond_.notify_all();
+    RunJob(func, 0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cond_.wait(lock, [this] { return pending_ == 0; });
+    job_ = nullptr;
+    if (error_) {
+      std::exception_ptr error = error_;
+      error_ = std::exception_ptr();
+      std::rethrow_exception(error);
+    }
+  }
+
+  // split [begin, end) into at most NumThreads() contiguous chunks of at
+  // least grain items, the split only depends on the range and thread count
+  inline void ParallelFor(index_t begin, index_t end, index_t grain,
+                          const std::function<void(index_t, index_t)> &func) {
+    const index_t n = end - begin;
+    if (n <= 0)
+      return;
+    if (grain < 1)
+      grain = 1;
+    index_t nchunk = (n + grain - 1) / grain;
+    if (nchunk > nthread_)
+      nchunk = nthread_;
+    Run(int(nchunk), [&](int i) {
+      func(begin + n * i / nchunk, begin + n * (i + 1) / nchunk);
+    });
+  }
+
+  inline static int DefaultNumThreads() {
+    const char *env = std::getenv("LMLIB_NUM_THREADS");
+    int n = env != nullptr ? std::atoi(env) : 0;
+    if (n <= 0)
+      n = int(std::thread::hardware_concurrency());
+    return n > 0 ? n : 1;
+  }
+
+private:
+  inline static bool &InWorker() {
+    static thread_local bool in_worker = false;
+    return in_worker;
+  }
+
+  inline void RunJob(const std::function<void(int)> &func, int tid) {
+    InWorker() = true;
+    try {
+      func(tid);
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error_)
+        error_ = std::current_exception();
+    }
+    InWorker() = false;
+  }
+
+  inline void WorkerLoop(int tid) {
+    uint64_t seen = 0;
+    while (true) {
+      const std::function<void(int)> *job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_cond_.wait(lock, [&] { return generation_ != seen; });
+        seen = generation_;
+        if (shutdown_)
+          return;
+        if (tid >= njob_)
+          continue;
+        job = job_;
+      }
+      RunJob(*job, tid);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_ == 0)
+        done_cond_.notify_one();
+    }
+  }
+
+  int nthread_;
+  std::vector<std::thread> workers_;
+  std::mutex run_mutex_;
+  std::mutex mutex_;
+  std::condition_variable start_cond_;
+  std::condition_variable done_cond_;
+  const std::function<void(int)> *job_ = nullptr;
+  int njob_ = 0;
+  int pending_ = 0;
+  uint64_t generation_ = 0;
+  bool shutdown_ = false;
+  std::exception_ptr error_;
+
+  ThreadPool(const ThreadPool &);
+  void operator=(const ThreadPool &);
+};
+} // namespace lmlib
+
+#endif // LMLIB_THREAD_POOL_HPP_
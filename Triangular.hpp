@@ -0,0 +1,141 @@
+#ifndef LMLIB_TRIANGULAR_HPP_
+#define LMLIB_TRIANGULAR_HPP_
+
+#include "./Allocator.hpp"
+#include "./LMBase.hpp"
+#include "./Logging.hpp"
+#include "./Dense.hpp"
+#include "./Exp_Engine.hpp"
+#include "./Dense_Engine.hpp"
+#include "./Stream.hpp"
+
+namespace lmlib {
+// a symmetric n x n matrix that keeps only its lower triangle, row by row:
+// element (y, x) with x <= y is at dptr_[y * (y + 1) / 2 + x], half the
+// memory of a Tensor<2>.  it is assigned from dot(a, a.T()) or
+// dot(a.T(), a), which then computes only that triangle, and reads in
+// expressions as the full symmetric matrix
+//
+//   TriangularTensor<float> gram = NewTriangular<float>(a.size(0));
+//   gram = dot(a, a.T());
+//   full = gram;
+template <typename DType LMLIB_DEFAULT_DTYPE>
+struct TriangularTensor
+    : public TRValue<TriangularTensor<DType>, 2, DType> {
+  DType *dptr_ = nullptr;
+  index_t size_;
+  Stream *stream_;
+
+  inline TriangularTensor() : size_(0), stream_(NULL) {}
+
+  inline TriangularTensor(DType *dptr, index_t size, Stream *stream = NULL)
+      : dptr_(dptr), size_(size), stream_(stream) {}
+
+  // number of stored elements of a size x size matrix
+  inline static index_t PackedSize(index_t size) {
+    return size * (size + 1) / 2;
+  }
+
+  inline Shape<2> shape() const { return Shape2(size_, size_); }
+
+  // first element of row y, it holds y + 1 of them
+  inline DType *Row(index_t y) const { return dptr_ + y * (y + 1) / 2; }
+
+  template <typename EType, int etype>
+  inline TriangularTensor<DType> &
+  operator=(const expr::Exp<EType, DType, etype> &exp) {
+    return this->__assign(exp);
+  }
+};
+
+// storage comes from GetAllocator() like AllocSpace
+template <typename DType>
+inline TriangularTensor<DType> NewTriangular(index_t size,
+                                             Stream *stream = NULL) {
+  DType *dptr = static_cast<DType *>(AllocBytes(
+      size_t(TriangularTensor<DType>::PackedSize(size)) * sizeof(DType)));
+  return TriangularTensor<DType>(dptr, size, stream);
+}
+
+// queued work of the stream that uses obj must be finished
+template <typename DType> inline void FreeSpace(TriangularTensor<DType> *obj) {
+  if (obj->dptr_ == nullptr)
+    return;
+  FreeBytes(obj->dptr_);
+  obj->dptr_ = nullptr;
+}
+
+namespace expr {
+template <typename DType> struct ExpInfo<TriangularTensor<DType>> {
+  static const int kDim = 2;
+};
+
+template <typename DType> struct ShapeCheck<2, TriangularTensor<DType>> {
+  inline static Shape<2> Check(const TriangularTensor<DType> &t) {
+    return t.shape();
+  }
+};
+
+// the upper triangle reads its mirror
+template <typename DType> class Plan<TriangularTensor<DType>, DType> {
+public:
+  explicit Plan(const TriangularTensor<DType> &t) : dptr_(t.dptr_) {}
+  inline const DType &Eval(index_t y, index_t x) const {
+    return x <= y ? dptr_[y * (y + 1) / 2 + x] : dptr_[x * (x + 1) / 2 + y];
+  }
+
+private:
+  const DType *dptr_;
+};
+
+// packed lower triangle of alpha * op(A) * op(A)^T + beta * C for the
+// n x k op(A), beta == 0 never reads C
+template <typename DType>
+inline void SyrkPacked(ThreadPool *pool, bool trans, index_t n, index_t k,
+                       DType alpha, const DType *a, index_t lda, DType beta,
+                       DType *c) {
+  SyrkBlocks(pool, trans, n, k, alpha, a, lda,
+             [&](index_t i0, index_t i1, const DType *tmp) {
+               for (index_t i = i0; i < i1; ++i) {
+                 const DType *t = tmp + (i - i0) * i1;
+                 DType *crow = c + i * (i + 1) / 2;
+                 for (index_t j = 0; j <= i; ++j)
+                   crow[j] = beta == DType(0) ? t[j] : t[j] + beta * crow[j];
+               }
+             });
+}
+
+// dst (SV)= scale * dot(a, a.T()) or scale * dot(a.T(), a), other products
+// are not symmetric and have no triangular form
+template <typename SV, typename DType, bool ltrans, bool rtrans>
+struct ExpComplexEngine<
+    SV, TriangularTensor<DType>,
+    DotExp<Tensor<2, DType>, Tensor<2, DType>, ltrans, rtrans, DType>,
+    DType> {
+  inline static void
+  Eval(TriangularTensor<DType> *p_dst,
+       const DotExp<Tensor<2, DType>, Tensor<2, DType>, ltrans, rtrans, DType>
+           &exp) {
+    static_assert(ltrans != rtrans,
+                  "TriangularTensor: only dot(a, a.T()) and dot(a.T(), a) "
+                  "are symmetric");
+    TriangularTensor<DType> dst = *p_dst;
+    Tensor<2, DType> a = exp.lhs_;
+    CHECK(SameTensor(exp.lhs_, exp.rhs_))
+        << "TriangularTensor: both operands of dot must be the same tensor";
+    Shape<2> sleft = GetShape(a.shape_, ltrans);
+    CHECK_EQ(dst.size_, sleft[0])
+        << "TriangularTensor: size mismatch, lhs " << sleft << " dst "
+        << dst.shape();
+    const DType alpha = exp.scale_ * DType(SV::kAlphaBLAS);
+    RunOnStream(dst.stream_, [=]() {
+      SyrkPacked(GetPool(dst.stream_), ltrans, dst.size_, sleft[1], alpha,
+                 a.dptr_, a.stride_, DType(SV::kBetaBLAS), dst.dptr_);
+    });
+  }
+};
+} // namespace expr
+
+} // namespace lmlib
+
+#endif // LMLIB_TRIANGULAR_HPP_
@@ -2,8 +2,11 @@
 #define LMLIB_EXTENSION_BROADCAST_HPP_
 
 #include "../Extension.h"
+#include "../Packet.hpp"
 namespace lmlib {
 namespace expr {
+// a 1D expression repeated into shape, its element i lands at every position
+// whose index along dimension dimdst - dimdst_m_cast is i
 template <typename SrcExp, typename DType, int dimdst, int dimdst_m_cast>
 struct Broadcast1DExp
     : public MakeTensorExp<Broadcast1DExp<SrcExp, DType, dimdst, dimdst_m_cast>,
@@ -15,8 +18,102 @@ struct Broadcast1DExp
   }
 };
 
+// broadcast src along dimension dimcast of shape, e.g. adding a bias to
+// every channel of an NCHW tensor is out = data + broadcast<1>(bias, shape)
+template <int dimcast, typename SrcExp, typename DType, int etype, int dimdst>
+inline Broadcast1DExp<SrcExp, DType, dimdst, dimdst - dimcast>
+broadcast(const Exp<SrcExp, DType, etype> &src, Shape<dimdst> shape) {
+  TypeCheckPass<(dimcast < dimdst && ExpInfo<SrcExp>::kDim == 1)>::
+      Error_Expression_Does_Not_Meet_Dimension_Req();
+  Shape<1> sshape = ShapeCheck<1, SrcExp>::Check(src.self());
+  CHECK_EQ(sshape[0], shape[dimcast])
+      << "broadcast: shape mismatch, src " << sshape << " dst " << shape;
+  return Broadcast1DExp<SrcExp, DType, dimdst, dimdst - dimcast>(src.self(),
+                                                                 shape);
+}
+
+// the broadcast dimension is one of the row dimensions of the flattened 2D
+// view, so the value only depends on y
+template <typename SrcExp, typename DType, int dimdst, int dimdst_m_cast>
+class Plan<Broadcast1DExp<SrcExp, DType, dimdst, dimdst_m_cast>, DType> {
+public:
+  static const int kDimCast = dimdst - dimdst_m_cast;
+  explicit Plan(const Broadcast1DExp<SrcExp, DType, dimdst, dimdst_m_cast> &e)
+      : src_(MakePlan(e.src_)), ystride_(1), length_(e.shape_[kDimCast]) {
+    for (int i = kDimCast + 1; i < dimdst - 1; ++i)
+      ystride_ *= e.shape_[i];
+  }
+  inline DType Eval(index_t y, index_t) const {
+    return src_.Eval(0, (y / ystride_) % length_);
+  }
+
+private:
+  Plan<SrcExp, DType> src_;
+  index_t ystride_, length_;
+};
+
+// broadcast along the last dimension, the value only depends on x
+template <typename SrcExp, typename DType, int dimdst>
+class Plan<Broadcast1DExp<SrcExp, DType, dimdst, 1>, DType> {
+public:
+  explicit Plan(const Broadcast1DExp<SrcExp, DType, dimdst, 1> &e)
+      : src_(MakePlan(e.src_)) {}
+  inline DType Eval(index_t, index_t x) const { return src_.Eval(0, x); }
+
+private:
+  Plan<SrcExp, DType> src_;
+};
+
+// one value per row, splatted; the index only depends on y so it is
+// computed once per row of the map loop
+template <typename SrcExp, typename DType, int dimdst, int dimdst_m_cast,
+          packet::PacketArch Arch>
+class PacketPlan<Broadcast1DExp<SrcExp, DType, dimdst, dimdst_m_cast>, DType,
+                 Arch> {
+public:
+  static const int kDimCast = dimdst - dimdst_m_cast;
+  explicit PacketPlan(
+      const Broadcast1DExp<SrcExp, DType, dimdst, dimdst_m_cast> &e)
+      : src_(MakePacketPlan<Arch>(e.src_)), ystride_(1),
+        length_(e.shape_[kDimCast]) {
+    for (int i = kDimCast + 1; i < dimdst - 1; ++i)
+      ystride_ *= e.shape_[i];
+  }
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const {
+    return packet::Packet<DType, Arch>::Fill(Eval(y, x));
+  }
+  inline DType Eval(index_t y, index_t) const {
+    return src_.Eval(0, (y / ystride_) % length_);
+  }
+
+private:
+  PacketPlan<SrcExp, DType, Arch> src_;
+  index_t ystride_, length_;
+};
+
+// a row of the result is the source itself, load it packet by packet
+template <typename SrcExp, typename DType, int dimdst, packet::PacketArch Arch>
+class PacketPlan<Broadcast1DExp<SrcExp, DType, dimdst, 1>, DType, Arch> {
+public:
+  explicit PacketPlan(const Broadcast1DExp<SrcExp, DType, dimdst, 1> &e)
+      : src_(MakePacketPlan<Arch>(e.src_)) {}
+  inline packet::Packet<DType, Arch> EvalPacket(index_t, index_t x) const {
+    return src_.EvalPacket(0, x);
+  }
+  inline DType Eval(index_t, index_t x) const { return src_.Eval(0, x); }
+
+private:
+  PacketPlan<SrcExp, DType, Arch> src_;
+};
+
+template <typename SrcExp, typename DType, int dimdst, int dimdst_m_cast,
+          packet::PacketArch Arch>
+struct PacketCheck<Broadcast1DExp<SrcExp, DType, dimdst, dimdst_m_cast>,
+                   Arch> {
+  static const bool kPass = PacketCheck<SrcExp, Arch>::kPass;
+};
 } // namespace expr
 
 } // namespace lmlib
 
-#endif // LMLIB_EXTENSION_BROADCAST_HPP_
\ No newline at end of file
+#endif // LMLIB_EXTENSION_BROADCAST_HPP_
@@ -1,10 +1,182 @@
 #ifndef LMLIB_EXTENSION_IMPLICIT_GEMM_HPP_
 #define LMLIB_EXTENSION_IMPLICIT_GEMM_HPP_
 
+#include "../Dot_Engine.hpp"
+
 namespace lmlib {
 
-namespace expr {} // namespace expr
+namespace expr {
+// 2d convolution of data (N, C, H, W) with weight (K, C, R, S), the result
+// is (N, K, OH, OW); every image is one gemm weight * col, where col is the
+// (C * R * S) x (OH * OW) im2col matrix of the image, the gemm builds col
+// panel by panel while packing B so it never exists as a whole
+template <typename DType>
+struct ConvExp : public Exp<ConvExp<DType>, DType, type::kComplex> {
+  const Tensor<4, DType> &data_;
+  const Tensor<4, DType> &weight_;
+  index_t stride_y_, stride_x_;
+  index_t pad_y_, pad_x_;
+  index_t dilate_y_, dilate_x_;
+  DType scale_;
+  ConvExp(const Tensor<4, DType> &data, const Tensor<4, DType> &weight,
+          index_t stride_y, index_t stride_x, index_t pad_y, index_t pad_x,
+          index_t dilate_y, index_t dilate_x, DType scale)
+      : data_(data), weight_(weight), stride_y_(stride_y),
+        stride_x_(stride_x), pad_y_(pad_y), pad_x_(pad_x),
+        dilate_y_(dilate_y), dilate_x_(dilate_x), scale_(scale) {}
+  // output height and width
+  inline index_t OutY() const {
+    return (data_.size(2) + 2 * pad_y_ - dilate_y_ * (weight_.size(2) - 1) -
+            1) / stride_y_ + 1;
+  }
+  inline index_t OutX() const {
+    return (data_.size(3) + 2 * pad_x_ - dilate_x_ * (weight_.size(3) - 1) -
+            1) / stride_x_ + 1;
+  }
+};
+
+template <typename DType>
+inline ConvExp<DType>
+conv2d(const Tensor<4, DType> &data, const Tensor<4, DType> &weight,
+       index_t stride_y, index_t stride_x, index_t pad_y, index_t pad_x,
+       index_t dilate_y, index_t dilate_x) {
+  return ConvExp<DType>(data, weight, stride_y, stride_x, pad_y, pad_x,
+                        dilate_y, dilate_x, DType(1.0f));
+}
+
+// the same stride, pad and dilation in both directions
+template <typename DType>
+inline ConvExp<DType> conv2d(const Tensor<4, DType> &data,
+                             const Tensor<4, DType> &weight,
+                             index_t stride = 1, index_t pad = 0,
+                             index_t dilate = 1) {
+  return conv2d(data, weight, stride, stride, pad, pad, dilate, dilate);
+}
+
+// conv2d(x, w) * s and s * conv2d(x, w) fold s into scale_
+template <typename DType>
+inline ConvExp<DType> operator*(const ConvExp<DType> &lhs, DType rhs) {
+  return ConvExp<DType>(lhs.data_, lhs.weight_, lhs.stride_y_, lhs.stride_x_,
+                        lhs.pad_y_, lhs.pad_x_, lhs.dilate_y_, lhs.dilate_x_,
+                        lhs.scale_ * rhs);
+}
+
+template <typename DType>
+inline ConvExp<DType> operator*(DType lhs, const ConvExp<DType> &rhs) {
+  return rhs * lhs;
+}
+
+// packs blocks of the im2col matrix of one image for GemmPacked, row
+// (c * R + r) * S + s and column oy * OW + ox of col hold
+// data[c][oy * stride_y + r * dilate_y - pad_y][ox * stride_x + s * dilate_x
+// - pad_x], zero when that falls into the padding
+template <typename DType, int kNR> struct Im2colPacker {
+  const DType *data_;
+  index_t ld_;
+  index_t height_, width_;
+  index_t ksize_y_, ksize_x_;
+  index_t out_x_;
+  index_t stride_y_, stride_x_;
+  index_t pad_y_, pad_x_;
+  index_t dilate_y_, dilate_x_;
+
+  template <typename AType>
+  inline void operator()(index_t pc, index_t jc, index_t kc, index_t nc,
+                         AType *dst) const {
+    index_t iy[kNR], ix[kNR];
+    for (index_t j = 0; j < nc; j += kNR, dst += kNR * kc) {
+      const index_t nr = nc - j < kNR ? nc - j : kNR;
+      // top left input pixel of every output column of the panel
+      for (index_t col = 0; col < nr; ++col) {
+        const index_t o = jc + j + col;
+        iy[col] = o / out_x_ * stride_y_ - pad_y_;
+        ix[col] = o % out_x_ * stride_x_ - pad_x_;
+      }
+      index_t c = pc / (ksize_y_ * ksize_x_);
+      index_t r = pc / ksize_x_ % ksize_y_;
+      index_t s = pc % ksize_x_;
+      for (index_t k = 0; k < kc; ++k) {
+        const DType *plane = data_ + c * height_ * ld_;
+        const index_t dy = r * dilate_y_, dx = s * dilate_x_;
+        AType *out = dst + k * kNR;
+        for (index_t col = 0; col < nr; ++col) {
+          const index_t y = iy[col] + dy, x = ix[col] + dx;
+          out[col] = y >= 0 && y < height_ && x >= 0 && x < width_
+                         ? AType(plane[y * ld_ + x])
+                         : AType(0);
+        }
+        for (index_t col = nr; col < kNR; ++col)
+          out[col] = AType(0);
+        if (++s == ksize_x_) {
+          s = 0;
+          if (++r == ksize_y_) {
+            r = 0;
+            ++c;
+          }
+        }
+      }
+    }
+  }
+};
+
+// dst (SV)= scale * conv2d(data, weight), the saver maps onto alpha and beta
+// of the gemm like it does for dot
+template <typename SV, typename DType>
+struct ExpComplexEngine<SV, Tensor<4, DType>, ConvExp<DType>, DType> {
+  inline static void Eval(Tensor<4, DType> *p_dst, const ConvExp<DType> &exp) {
+    typedef typename packet::ComputeType<DType>::Type AType;
+    const packet::PacketArch kArch = packet::PacketDefault<AType>::kArch;
+    const index_t kNR = GemmTraits<AType, kArch>::kNR;
+    Tensor<4, DType> dst = *p_dst, data = exp.data_, weight = exp.weight_;
+    CHECK(exp.stride_y_ > 0 && exp.stride_x_ > 0 && exp.dilate_y_ > 0 &&
+          exp.dilate_x_ > 0 && exp.pad_y_ >= 0 && exp.pad_x_ >= 0)
+        << "conv2d: stride and dilate must be positive, pad non-negative";
+    CHECK_EQ(data.size(1), weight.size(1))
+        << "conv2d: channel mismatch, data " << data.shape_ << " weight "
+        << weight.shape_;
+    CHECK(data.size(2) + 2 * exp.pad_y_ >
+              exp.dilate_y_ * (weight.size(2) - 1) &&
+          data.size(3) + 2 * exp.pad_x_ > exp.dilate_x_ * (weight.size(3) - 1))
+        << "conv2d: kernel " << weight.shape_ << " larger than padded input "
+        << data.shape_;
+    const index_t out_y = exp.OutY(), out_x = exp.OutX();
+    CHECK_EQ(dst.shape_,
+             Shape4(data.size(0), weight.size(0), out_y, out_x))
+        << "conv2d: dst shape mismatch, dst " << dst.shape_;
+    CHECK(dst.CheckContiguous() && weight.CheckContiguous())
+        << "conv2d: dst and weight must be contiguous";
+    Im2colPacker<DType, kNR> packer;
+    packer.data_ = data.dptr_;
+    packer.ld_ = data.stride_;
+    packer.height_ = data.size(2);
+    packer.width_ = data.size(3);
+    packer.ksize_y_ = weight.size(2);
+    packer.ksize_x_ = weight.size(3);
+    packer.out_x_ = out_x;
+    packer.stride_y_ = exp.stride_y_;
+    packer.stride_x_ = exp.stride_x_;
+    packer.pad_y_ = exp.pad_y_;
+    packer.pad_x_ = exp.pad_x_;
+    packer.dilate_y_ = exp.dilate_y_;
+    packer.dilate_x_ = exp.dilate_x_;
+    const index_t m = weight.size(0), n = out_y * out_x;
+    const index_t k = weight.size(1) * weight.size(2) * weight.size(3);
+    const index_t image = data.template MemSize<1>();
+    const DType alpha = exp.scale_ * DType(SV::kAlphaBLAS);
+    RunOnStream(dst.stream_, [=]() {
+      ForEachBatch(GetPool(dst.stream_), dst.size(0), m * n * k,
+                   [&](index_t i, ThreadPool *pool) {
+                     Im2colPacker<DType, kNR> ipacker = packer;
+                     ipacker.data_ += i * image;
+                     GemmPacked(pool, false, m, n, k, alpha, weight.dptr_, k,
+                                ipacker, DType(SV::kBetaBLAS),
+                                dst.dptr_ + i * m * n, n);
+                   });
+    });
+  }
+};
+} // namespace expr
 
 } // namespace lmlib
 
-#endif // LMLIB_EXTENSION_IMPLICIT_GEMM_HPP_
\ No newline at end of file
+#endif // LMLIB_EXTENSION_IMPLICIT_GEMM_HPP_
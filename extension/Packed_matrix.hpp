@@ -0,0 +1,262 @@
+#ifndef LMLIB_EXTENSION_PACKED_MATRIX_HPP_
+#define LMLIB_EXTENSION_PACKED_MATRIX_HPP_
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include "../Allocator.hpp"
+#include "../Dot_Engine.hpp"
+
+namespace lmlib {
+// the k x n rhs of a gemm packed once into the panels the kernel reads: the
+// kKC x kNC block of B at (pc, jc) is the GemmPackB panel of that block and
+// starts at dptr_ + jc * k + ncp * pc, where ncp is the width of the block
+// rounded up to kNR; dot(x, w) with w a PackedMatrix skips packing B
+template <typename DType> struct PackedMatrix {
+  typedef typename packet::ComputeType<DType>::Type AType;
+  static const packet::PacketArch kArch = packet::PacketDefault<AType>::kArch;
+  typedef expr::GemmTraits<AType, kArch> Traits;
+  AType *dptr_ = nullptr;
+  index_t k_, n_;
+
+  inline PackedMatrix() : k_(0), n_(0) {}
+
+  // shape of the matrix it stands for
+  inline Shape<2> shape() const { return Shape2(k_, n_); }
+
+  // number of AType in the panels
+  inline static index_t PackedSize(index_t k, index_t n) {
+    return (n + Traits::kNR - 1) / Traits::kNR * Traits::kNR * k;
+  }
+
+  // the kNR-column micro-panel of the block of k starting at pc that holds
+  // column j, a multiple of kNR
+  inline const AType *Panel(index_t pc, index_t j) const {
+    const index_t jc = j / Traits::kNC * Traits::kNC;
+    const index_t nc = n_ - jc < Traits::kNC ? n_ - jc : Traits::kNC;
+    const index_t kc = k_ - pc < Traits::kKC ? k_ - pc : Traits::kKC;
+    const index_t ncp = (nc + Traits::kNR - 1) / Traits::kNR * Traits::kNR;
+    return dptr_ + jc * k_ + ncp * pc + (j - jc) * kc;
+  }
+};
+
+// packs op(b), trans reads b as n x k like weights stored (out, in); runs on
+// the calling thread, work queued on the stream of b must be finished; the
+// panels come from GetAllocator() like AllocSpace
+template <typename DType>
+inline PackedMatrix<DType> NewPacked(const Tensor<2, DType> &b,
+                                     bool trans = false) {
+  typedef PackedMatrix<DType> Packed;
+  typedef typename Packed::AType AType;
+  typedef typename Packed::Traits Traits;
+  Packed packed;
+  packed.k_ = trans ? b.size(1) : b.size(0);
+  packed.n_ = trans ? b.size(0) : b.size(1);
+  const index_t k = packed.k_, n = packed.n_;
+  packed.dptr_ = static_cast<AType *>(
+      AllocBytes(size_t(Packed::PackedSize(k, n)) * sizeof(AType)));
+  for (index_t jc = 0; jc < n; jc += Traits::kNC) {
+    const index_t nc = n - jc < Traits::kNC ? n - jc : Traits::kNC;
+    for (index_t pc = 0; pc < k; pc += Traits::kKC) {
+      const index_t kc = k - pc < Traits::kKC ? k - pc : Traits::kKC;
+      expr::GemmPackB<AType, Traits::kNR>(
+          trans, kc, nc,
+          trans ? b.dptr_ + jc * b.stride_ + pc : b.dptr_ + pc * b.stride_ + jc,
+          b.stride_, const_cast<AType *>(packed.Panel(pc, jc)));
+    }
+  }
+  return packed;
+}
+
+// queued work of the streams that use obj must be finished
+template <typename DType> inline void FreeSpace(PackedMatrix<DType> *obj) {
+  if (obj->dptr_ == nullptr)
+    return;
+  FreeBytes(obj->dptr_);
+  obj->dptr_ = nullptr;
+}
+
+// header of a saved PackedMatrix, the blocking it was packed with decides
+// whether the panels can be read as they are
+struct PackedHeader {
+  char magic[4];
+  uint32_t elem_size;
+  int64_t nr, kc, nc;
+  int64_t k, n;
+};
+
+template <typename DType>
+inline void SavePacked(std::ostream &os, const PackedMatrix<DType> &packed) {
+  typedef PackedMatrix<DType> Packed;
+  typedef typename Packed::Traits Traits;
+  PackedHeader header;
+  std::memcpy(header.magic, "LMPK", 4);
+  header.elem_size = uint32_t(sizeof(typename Packed::AType));
+  header.nr = Traits::kNR;
+  header.kc = Traits::kKC;
+  header.nc = Traits::kNC;
+  header.k = packed.k_;
+  header.n = packed.n_;
+  os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  os.write(reinterpret_cast<const char *>(packed.dptr_),
+           std::streamsize(Packed::PackedSize(packed.k_, packed.n_) *
+                           sizeof(typename Packed::AType)));
+  CHECK(os.good()) << "SavePacked: write failed";
+}
+
+// reads what SavePacked wrote; panels packed with the blocking of another
+// arch are unpacked and packed again for this one
+template <typename DType>
+inline PackedMatrix<DType> LoadPacked(std::istream &is) {
+  typedef PackedMatrix<DType> Packed;
+  typedef typename Packed::AType AType;
+  typedef typename Packed::Traits Traits;
+  PackedHeader header;
+  is.read(reinterpret_cast<char *>(&header), sizeof(header));
+  CHECK(is.good() && std::memcmp(header.magic, "LMPK", 4) == 0)
+      << "LoadPacked: not a packed matrix";
+  CHECK_EQ(header.elem_size, uint32_t(sizeof(AType)))
+      << "LoadPacked: element size mismatch";
+  const index_t k = header.k, n = header.n;
+  if (header.nr == Traits::kNR && header.kc == Traits::kKC &&
+      header.nc == Traits::kNC) {
+    Packed packed;
+    packed.k_ = k;
+    packed.n_ = n;
+    const size_t bytes = size_t(Packed::PackedSize(k, n)) * sizeof(AType);
+    packed.dptr_ = static_cast<AType *>(AllocBytes(bytes));
+    is.read(reinterpret_cast<char *>(packed.dptr_), std::streamsize(bytes));
+    CHECK(is.good()) << "LoadPacked: truncated panels";
+    return packed;
+  }
+  const index_t nr = header.nr, kcb = header.kc, ncb = header.nc;
+  std::vector<AType> panels(size_t((n + nr - 1) / nr * nr * k));
+  is.read(reinterpret_cast<char *>(panels.data()),
+          std::streamsize(panels.size() * sizeof(AType)));
+  CHECK(is.good()) << "LoadPacked: truncated panels";
+  std::vector<AType> dense(size_t(k * n));
+  for (index_t jc = 0; jc < n; jc += ncb) {
+    const index_t nc = n - jc < ncb ? n - jc : ncb;
+    const index_t ncp = (nc + nr - 1) / nr * nr;
+    for (index_t pc = 0; pc < k; pc += kcb) {
+      const index_t kc = k - pc < kcb ? k - pc : kcb;
+      const AType *block = panels.data() + jc * k + ncp * pc;
+      for (index_t j = 0; j < nc; ++j) {
+        const AType *col = block + j / nr * nr * kc + j % nr;
+        for (index_t p = 0; p < kc; ++p)
+          dense[(pc + p) * n + jc + j] = col[p * nr];
+      }
+    }
+  }
+  // AType is DType or the float DType widens into, both pack the same
+  Tensor<2, AType> b(dense.data(), Shape2(k, n));
+  PackedMatrix<AType> repacked = NewPacked(b);
+  Packed packed;
+  packed.dptr_ = repacked.dptr_;
+  packed.k_ = k;
+  packed.n_ = n;
+  return packed;
+}
+
+namespace expr {
+// C = alpha * op(A) * B + beta * C with B already packed; the kNR-column
+// panels of C are split over pool, every thread packing the rows of A for
+// its own panels, so a few rows still spread over the pool and no thread
+// waits for a shared panel of B; products below kSmallGemm stay on one
+// thread
+template <typename DType>
+inline void GemmPrepacked(ThreadPool *pool, bool transa, index_t m, index_t n,
+                          index_t k, DType alpha, const DType *a, index_t lda,
+                          const PackedMatrix<DType> &b, DType beta, DType *c,
+                          index_t ldc) {
+  typedef typename PackedMatrix<DType>::AType AType;
+  typedef typename PackedMatrix<DType>::Traits Traits;
+  const packet::PacketArch kArch = PackedMatrix<DType>::kArch;
+  const int kMR = Traits::kMR;
+  const index_t kNR = Traits::kNR;
+  if (m == 0 || n == 0)
+    return;
+  if (k == 0) {
+    GemmScaleC(m, n, beta, c, ldc);
+    return;
+  }
+  const index_t npanel = (n + kNR - 1) / kNR;
+  auto panels = [&](index_t pbegin, index_t pend) {
+    for (index_t ic = 0; ic < m; ic += Traits::kMC) {
+      const index_t mc = m - ic < Traits::kMC ? m - ic : Traits::kMC;
+      for (index_t pc = 0; pc < k; pc += Traits::kKC) {
+        const index_t kc = k - pc < Traits::kKC ? k - pc : Traits::kKC;
+        const AType beta_pc = pc == 0 ? AType(beta) : AType(1);
+        AType *apack = GemmWorkspace<AType, 1>::Get(
+            size_t((mc + kMR - 1) / kMR * kMR * kc));
+        GemmPackA<AType, kMR>(transa, mc, kc,
+                              transa ? a + pc * lda + ic : a + ic * lda + pc,
+                              lda, apack);
+        for (index_t p = pbegin; p < pend; ++p) {
+          const index_t j = p * kNR;
+          const index_t nr = n - j < kNR ? n - j : kNR;
+          const AType *bpanel = b.Panel(pc, j);
+          for (index_t ir = 0; ir < mc; ir += kMR) {
+            const index_t mr = mc - ir < kMR ? mc - ir : kMR;
+            GemmKernel<AType, kArch>(kc, apack + ir * kc, bpanel,
+                                     AType(alpha), beta_pc,
+                                     c + (ic + ir) * ldc + j, ldc, mr, nr);
+          }
+        }
+      }
+    }
+  };
+  const int nthread = pool != nullptr ? pool->NumThreads() : 1;
+  if (nthread > 1 && npanel > 1 && m * n * k > kSmallGemm) {
+    pool->ParallelFor(0, npanel, 1, panels);
+  } else {
+    panels(0, npanel);
+  }
+}
+
+template <typename Tlhs, typename DType>
+inline DotExp<Tlhs, PackedMatrix<DType>, false, false, DType>
+dot(const RValueExp<Tlhs, DType> &lhs, const PackedMatrix<DType> &rhs) {
+  return DotExp<Tlhs, PackedMatrix<DType>, false, false, DType>(
+      lhs.self(), rhs, DType(1.0f));
+}
+
+template <typename Tlhs, typename DType>
+inline DotExp<Tlhs, PackedMatrix<DType>, true, false, DType>
+dot(const TransposeExp<Tlhs, DType> &lhs, const PackedMatrix<DType> &rhs) {
+  return DotExp<Tlhs, PackedMatrix<DType>, true, false, DType>(
+      lhs.expr, rhs, DType(1.0f));
+}
+
+// dst (SV)= scale * dot(lhs, packed), the saver maps onto alpha and beta
+template <typename SV, typename DType, bool ltrans>
+struct ExpComplexEngine<
+    SV, Tensor<2, DType>,
+    DotExp<Tensor<2, DType>, PackedMatrix<DType>, ltrans, false, DType>,
+    DType> {
+  inline static void
+  Eval(Tensor<2, DType> *p_dst,
+       const DotExp<Tensor<2, DType>, PackedMatrix<DType>, ltrans, false,
+                    DType> &exp) {
+    Tensor<2, DType> dst = *p_dst, a = exp.lhs_;
+    PackedMatrix<DType> b = exp.rhs_;
+    Shape<2> sleft = GetShape(a.shape_, ltrans);
+    CHECK(dst.size(0) == sleft[0] && dst.size(1) == b.n_ &&
+          sleft[1] == b.k_)
+        << "dot-packed: matrix shape mismatch, lhs " << sleft << " rhs "
+        << b.shape() << " dst " << dst.shape_;
+    const DType alpha = exp.scale_ * DType(SV::kAlphaBLAS);
+    RunOnStream(dst.stream_, [=]() {
+      GemmPrepacked(GetPool(dst.stream_), ltrans, dst.size(0), dst.size(1),
+                    sleft[1], alpha, a.dptr_, a.stride_, b,
+                    DType(SV::kBetaBLAS), dst.dptr_, dst.stride_);
+    });
+  }
+};
+} // namespace expr
+
+} // namespace lmlib
+
+#endif // LMLIB_EXTENSION_PACKED_MATRIX_HPP_
@@ -0,0 +1,192 @@
+#ifndef LMLIB_EXTENSION_QUANTIZE_HPP_
+#define LMLIB_EXTENSION_QUANTIZE_HPP_
+
+#include <cmath>
+#include <limits>
+
+#include "../Dot_Engine.hpp"
+
+namespace lmlib {
+
+namespace expr {
+// src quantized to the integer QType, round(src / scale) + zero clamped to
+// the range of QType; NaN goes to the lowest value
+template <typename SrcExp, typename SrcDType, typename QType, int dim>
+struct QuantizeExp
+    : public MakeTensorExp<QuantizeExp<SrcExp, SrcDType, QType, dim>, SrcExp,
+                           dim, QType> {
+  const SrcExp &src_;
+  float scale_;
+  int32_t zero_;
+  QuantizeExp(const SrcExp &src, Shape<dim> shape, float scale, int32_t zero)
+      : src_(src), scale_(scale), zero_(zero) {
+    this->shape_ = shape;
+  }
+};
+
+// the real value of the quantized src, (src - zero) * scale
+template <typename SrcExp, typename QType, int dim>
+struct DequantizeExp
+    : public MakeTensorExp<DequantizeExp<SrcExp, QType, dim>, SrcExp, dim,
+                           float> {
+  const SrcExp &src_;
+  float scale_;
+  int32_t zero_;
+  DequantizeExp(const SrcExp &src, Shape<dim> shape, float scale,
+                int32_t zero)
+      : src_(src), scale_(scale), zero_(zero) {
+    this->shape_ = shape;
+  }
+};
+
+// per tensor quantization, weights quantized per output channel take one
+// call per row, e.g. qw[i] = quantize<int8_t>(w[i], s[i], 0)
+template <typename QType, typename SrcExp, typename SrcDType, int etype>
+inline QuantizeExp<SrcExp, SrcDType, QType, ExpInfo<SrcExp>::kDim>
+quantize(const Exp<SrcExp, SrcDType, etype> &src, float scale,
+         int32_t zero = 0) {
+  const int dim = ExpInfo<SrcExp>::kDim;
+  TypeCheckPass<(dim > 0)>::Error_Expression_Does_Not_Meet_Dimension_Req();
+  CHECK(scale > 0.0f) << "quantize: scale must be positive";
+  return QuantizeExp<SrcExp, SrcDType, QType, dim>(
+      src.self(), ShapeCheck<dim, SrcExp>::Check(src.self()), scale, zero);
+}
+
+template <typename SrcExp, typename QType, int etype>
+inline DequantizeExp<SrcExp, QType, ExpInfo<SrcExp>::kDim>
+dequantize(const Exp<SrcExp, QType, etype> &src, float scale,
+           int32_t zero = 0) {
+  const int dim = ExpInfo<SrcExp>::kDim;
+  TypeCheckPass<(dim > 0)>::Error_Expression_Does_Not_Meet_Dimension_Req();
+  return DequantizeExp<SrcExp, QType, dim>(
+      src.self(), ShapeCheck<dim, SrcExp>::Check(src.self()), scale, zero);
+}
+
+template <typename SrcExp, typename SrcDType, typename QType, int dim>
+class Plan<QuantizeExp<SrcExp, SrcDType, QType, dim>, QType> {
+public:
+  explicit Plan(const QuantizeExp<SrcExp, SrcDType, QType, dim> &e)
+      : src_(MakePlan(e.src_)), inv_scale_(1.0f / e.scale_),
+        zero_(float(e.zero_)) {}
+  inline QType Eval(index_t y, index_t x) const {
+    const float lo = float(std::numeric_limits<QType>::min());
+    const float hi = float(std::numeric_limits<QType>::max());
+    const float v =
+        std::nearbyint(float(src_.Eval(y, x)) * inv_scale_) + zero_;
+    return QType(v >= lo ? (v <= hi ? v : hi) : lo);
+  }
+
+private:
+  Plan<SrcExp, SrcDType> src_;
+  float inv_scale_, zero_;
+};
+
+template <typename SrcExp, typename QType, int dim>
+class Plan<DequantizeExp<SrcExp, QType, dim>, float> {
+public:
+  explicit Plan(const DequantizeExp<SrcExp, QType, dim> &e)
+      : src_(MakePlan(e.src_)), scale_(e.scale_), zero_(e.zero_) {}
+  inline float Eval(index_t y, index_t x) const {
+    return float(int32_t(src_.Eval(y, x)) - zero_) * scale_;
+  }
+
+private:
+  Plan<SrcExp, QType> src_;
+  float scale_;
+  int32_t zero_;
+};
+
+// the product of a u8 m x k lhs with scale and zero point per row, or one
+// for all rows when they hold a single value, and a s8 k x n rhs with them
+// per column, the result is float
+template <bool rtrans>
+struct QDotExp : public Exp<QDotExp<rtrans>, float, type::kComplex> {
+  const Tensor<2, uint8_t> &lhs_;
+  const Tensor<1, float> &lscale_;
+  const Tensor<1, int32_t> &lzero_;
+  const Tensor<2, int8_t> &rhs_;
+  const Tensor<1, float> &rscale_;
+  const Tensor<1, int32_t> &rzero_;
+  float scale_;
+  QDotExp(const Tensor<2, uint8_t> &lhs, const Tensor<1, float> &lscale,
+          const Tensor<1, int32_t> &lzero, const Tensor<2, int8_t> &rhs,
+          const Tensor<1, float> &rscale, const Tensor<1, int32_t> &rzero,
+          float scale)
+      : lhs_(lhs), lscale_(lscale), lzero_(lzero), rhs_(rhs),
+        rscale_(rscale), rzero_(rzero), scale_(scale) {}
+};
+
+inline QDotExp<false>
+qdot(const Tensor<2, uint8_t> &lhs, const Tensor<1, float> &lscale,
+     const Tensor<1, int32_t> &lzero, const Tensor<2, int8_t> &rhs,
+     const Tensor<1, float> &rscale, const Tensor<1, int32_t> &rzero) {
+  return QDotExp<false>(lhs, lscale, lzero, rhs, rscale, rzero, 1.0f);
+}
+
+// weights stored as (out, in) are used as rhs.T(), the layout packs best
+inline QDotExp<true>
+qdot(const Tensor<2, uint8_t> &lhs, const Tensor<1, float> &lscale,
+     const Tensor<1, int32_t> &lzero,
+     const TransposeExp<Tensor<2, int8_t>, int8_t> &rhs,
+     const Tensor<1, float> &rscale, const Tensor<1, int32_t> &rzero) {
+  return QDotExp<true>(lhs, lscale, lzero, rhs.expr, rscale, rzero, 1.0f);
+}
+
+// qdot(...) * s and s * qdot(...) fold s into scale_
+template <bool rtrans>
+inline QDotExp<rtrans> operator*(const QDotExp<rtrans> &lhs, float rhs) {
+  return QDotExp<rtrans>(lhs.lhs_, lhs.lscale_, lhs.lzero_, lhs.rhs_,
+                         lhs.rscale_, lhs.rzero_, lhs.scale_ * rhs);
+}
+
+template <bool rtrans>
+inline QDotExp<rtrans> operator*(float lhs, const QDotExp<rtrans> &rhs) {
+  return rhs * lhs;
+}
+
+// scale and zero point vectors of length 1 are shared by every row or
+// column, otherwise there is one per row or column
+inline QuantParam MakeQuantParam(const Tensor<1, float> &scale,
+                                 const Tensor<1, int32_t> &zero,
+                                 index_t size) {
+  CHECK((scale.size(0) == 1 || scale.size(0) == size) &&
+        (zero.size(0) == 1 || zero.size(0) == size))
+      << "qdot: " << size << " rows or columns, scale " << scale.shape_
+      << " zero " << zero.shape_;
+  QuantParam param;
+  param.scale_ = scale.dptr_;
+  param.scale_inc_ = scale.size(0) == 1 ? 0 : 1;
+  param.zero_ = zero.dptr_;
+  param.zero_inc_ = zero.size(0) == 1 ? 0 : 1;
+  return param;
+}
+
+// dst (SV)= scale * qdot(...), the saver maps onto alpha and beta of the
+// gemm like it does for dot
+template <typename SV, bool rtrans>
+struct ExpComplexEngine<SV, Tensor<2, float>, QDotExp<rtrans>, float> {
+  inline static void Eval(Tensor<2, float> *p_dst,
+                          const QDotExp<rtrans> &exp) {
+    Tensor<2, float> dst = *p_dst;
+    Tensor<2, uint8_t> a = exp.lhs_;
+    Tensor<2, int8_t> b = exp.rhs_;
+    Shape<2> sright = GetShape(b.shape_, rtrans);
+    CHECK(dst.size(0) == a.size(0) && dst.size(1) == sright[1] &&
+          a.size(1) == sright[0])
+        << "qdot: matrix shape mismatch, lhs " << a.shape_ << " rhs "
+        << sright << " dst " << dst.shape_;
+    const QuantParam qa = MakeQuantParam(exp.lscale_, exp.lzero_, a.size(0));
+    const QuantParam qb = MakeQuantParam(exp.rscale_, exp.rzero_, sright[1]);
+    const float alpha = exp.scale_ * float(SV::kAlphaBLAS);
+    RunOnStream(dst.stream_, [=]() {
+      QGemm(GetPool(dst.stream_), dst.size(0), dst.size(1), a.size(1), alpha,
+            a.dptr_, a.stride_, qa, rtrans, b.dptr_, b.stride_, qb,
+            float(SV::kBetaBLAS), dst.dptr_, dst.stride_);
+    });
+  }
+};
+} // namespace expr
+
+} // namespace lmlib
+
+#endif // LMLIB_EXTENSION_QUANTIZE_HPP_
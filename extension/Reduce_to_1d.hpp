@@ -0,0 +1,106 @@
+#ifndef LMLIB_EXTENSION_REDUCE_TO_1D_HPP_
+#define LMLIB_EXTENSION_REDUCE_TO_1D_HPP_
+
+#include "../Extension.h"
+#include "../Dense_Engine.hpp"
+namespace lmlib {
+namespace expr {
+// reduction of src over every dimension but dimkeep, the result is a 1D
+// expression of size shape[dimkeep] that is scaled by scale_
+template <typename SrcExp, typename DType, typename Reducer, int dimkeep>
+struct ReduceTo1DExp
+    : public Exp<ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep>, DType,
+                 type::kComplex> {
+  const SrcExp &src_;
+  DType scale_;
+  ReduceTo1DExp(const SrcExp &src, DType scale) : src_(src), scale_(scale) {}
+};
+
+// sum over every dimension but dimkeep, e.g. the per channel sum of an NCHW
+// tensor is sumall_except_dim<1>(data)
+template <int dimkeep, typename SrcExp, typename DType, int etype>
+inline ReduceTo1DExp<SrcExp, DType, red::sum, dimkeep>
+sumall_except_dim(const Exp<SrcExp, DType, etype> &exp) {
+  TypeCheckPass<(dimkeep < ExpInfo<SrcExp>::kDim)>::
+      Error_Expression_Does_Not_Meet_Dimension_Req();
+  return ReduceTo1DExp<SrcExp, DType, red::sum, dimkeep>(exp.self(),
+                                                         DType(1));
+}
+
+// sum of all the rows of the flattened 2D view, one value per column
+template <typename SrcExp, typename DType, int etype>
+inline ReduceTo1DExp<SrcExp, DType, red::sum, ExpInfo<SrcExp>::kDim - 1>
+sum_rows(const Exp<SrcExp, DType, etype> &exp) {
+  return sumall_except_dim<ExpInfo<SrcExp>::kDim - 1>(exp);
+}
+
+// maximum over every dimension but dimkeep
+template <int dimkeep, typename SrcExp, typename DType, int etype>
+inline ReduceTo1DExp<SrcExp, DType, red::maximum, dimkeep>
+reduce_max(const Exp<SrcExp, DType, etype> &exp) {
+  TypeCheckPass<(dimkeep < ExpInfo<SrcExp>::kDim)>::
+      Error_Expression_Does_Not_Meet_Dimension_Req();
+  return ReduceTo1DExp<SrcExp, DType, red::maximum, dimkeep>(exp.self(),
+                                                             DType(1));
+}
+
+// mean over every dimension but dimkeep
+template <int dimkeep, typename SrcExp, typename DType, int etype>
+inline ReduceTo1DExp<SrcExp, DType, red::sum, dimkeep>
+mean(const Exp<SrcExp, DType, etype> &exp) {
+  const int kDim = ExpInfo<SrcExp>::kDim;
+  TypeCheckPass<(dimkeep < kDim)>::
+      Error_Expression_Does_Not_Meet_Dimension_Req();
+  Shape<kDim> shape = ShapeCheck<kDim, SrcExp>::Check(exp.self());
+  const index_t count = shape.Size() / shape[dimkeep];
+  return ReduceTo1DExp<SrcExp, DType, red::sum, dimkeep>(
+      exp.self(), count > 0 ? DType(1) / DType(count) : DType(1));
+}
+
+// reduce(x) * s and s * reduce(x) fold s into scale_
+template <typename SrcExp, typename DType, typename Reducer, int dimkeep>
+inline ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep>
+operator*(const ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep> &lhs,
+          DType rhs) {
+  return ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep>(lhs.src_,
+                                                        lhs.scale_ * rhs);
+}
+
+template <typename SrcExp, typename DType, typename Reducer, int dimkeep>
+inline ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep>
+operator*(DType lhs,
+          const ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep> &rhs) {
+  return rhs * lhs;
+}
+
+template <typename SV, typename RV, typename SrcExp, typename DType,
+          typename Reducer, int dimkeep>
+struct ExpComplexEngine<SV, RV, ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep>,
+                        DType> {
+  static const int kDimSrc = ExpInfo<SrcExp>::kDim;
+  inline static void
+  Eval(RV *dst, const ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep> &exp) {
+    ReduceDispatch<dimkeep == kDimSrc - 1>::Eval(dst, exp);
+  }
+
+private:
+  template <bool kKeepLowest, int kDummy = 0> struct ReduceDispatch {
+    inline static void
+    Eval(RV *dst,
+         const ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep> &exp) {
+      MapReduceKeepLowest<SV, Reducer>(dst, exp.src_, exp.scale_);
+    }
+  };
+  template <int kDummy> struct ReduceDispatch<false, kDummy> {
+    inline static void
+    Eval(RV *dst,
+         const ReduceTo1DExp<SrcExp, DType, Reducer, dimkeep> &exp) {
+      MapReduceKeepHighDim<SV, Reducer, dimkeep>(dst, exp.src_, exp.scale_);
+    }
+  };
+};
+} // namespace expr
+
+} // namespace lmlib
+
+#endif // LMLIB_EXTENSION_REDUCE_TO_1D_HPP_
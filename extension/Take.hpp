@@ -0,0 +1,85 @@
+#ifndef LMLIB_EXTENSION_TAKE_HPP_
+#define LMLIB_EXTENSION_TAKE_HPP_
+
+#include "../Extension.h"
+#include "../Dense_Engine.hpp"
+#include "../Packet.hpp"
+namespace lmlib {
+namespace expr {
+// rows of the table src picked by a 1D index expression, row y of the result
+// is src[index[y]]; indices outside src are clipped to its first or last row
+template <typename IndexExp, typename IType, typename DType>
+struct TakeExp : public MakeTensorExp<TakeExp<IndexExp, IType, DType>,
+                                      Tensor<2, DType>, 2, DType> {
+  const IndexExp &index_;
+  const Tensor<2, DType> &src_;
+  TakeExp(const IndexExp &index, const Tensor<2, DType> &src, index_t nidx)
+      : index_(index), src_(src) {
+    this->shape_ = Shape2(nidx, src.size(1));
+  }
+};
+
+// gather the rows of src without a temporary, e.g. an embedding lookup
+// feeding a map is out = take(table, ids) * scalar(scale)
+template <typename DType, typename IndexExp, typename IType, int itype>
+inline TakeExp<IndexExp, IType, DType>
+take(const Tensor<2, DType> &src, const Exp<IndexExp, IType, itype> &index) {
+  TypeCheckPass<ExpInfo<IndexExp>::kDim == 1>::
+      Error_Expression_Does_Not_Meet_Dimension_Req();
+  Shape<1> ishape = ShapeCheck<1, IndexExp>::Check(index.self());
+  return TakeExp<IndexExp, IType, DType>(index.self(), src, ishape[0]);
+}
+
+// the row is looked up once per element, starting a row prefetches the row
+// kIndexPrefetch entries ahead, so the misses of a lookup over a big
+// table overlap
+template <typename IndexExp, typename IType, typename DType>
+class Plan<TakeExp<IndexExp, IType, DType>, DType> {
+public:
+  explicit Plan(const TakeExp<IndexExp, IType, DType> &e)
+      : index_(MakePlan(e.index_)), dptr_(e.src_.dptr_),
+        stride_(e.src_.stride_), nrow_(e.src_.size(0)),
+        ncol_(e.src_.size(1)), nidx_(e.shape_[0]) {}
+  inline DType Eval(index_t y, index_t x) const { return *Row(y, x); }
+
+  // address of element x of the row picked by y
+  inline const DType *Row(index_t y, index_t x) const {
+    if (x == 0 && y + kIndexPrefetch < nidx_)
+      PrefetchRow(dptr_ + Clip(y + kIndexPrefetch) * stride_, ncol_);
+    return dptr_ + Clip(y) * stride_ + x;
+  }
+
+private:
+  inline index_t Clip(index_t y) const {
+    const index_t row = index_t(index_.Eval(0, y));
+    return row < 0 ? 0 : (row >= nrow_ ? nrow_ - 1 : row);
+  }
+  Plan<IndexExp, IType> index_;
+  const DType *dptr_;
+  index_t stride_, nrow_, ncol_, nidx_;
+};
+
+template <typename IndexExp, typename IType, typename DType,
+          packet::PacketArch Arch>
+class PacketPlan<TakeExp<IndexExp, IType, DType>, DType, Arch> {
+public:
+  explicit PacketPlan(const TakeExp<IndexExp, IType, DType> &e) : plan_(e) {}
+  inline packet::Packet<DType, Arch> EvalPacket(index_t y, index_t x) const {
+    return packet::Packet<DType, Arch>::Load(plan_.Row(y, x));
+  }
+  inline DType Eval(index_t y, index_t x) const { return plan_.Eval(y, x); }
+
+private:
+  Plan<TakeExp<IndexExp, IType, DType>, DType> plan_;
+};
+
+template <typename IndexExp, typename IType, typename DType,
+          packet::PacketArch Arch>
+struct PacketCheck<TakeExp<IndexExp, IType, DType>, Arch> {
+  static const bool kPass = true;
+};
+} // namespace expr
+
+} // namespace lmlib
+
+#endif // LMLIB_EXTENSION_TAKE_HPP_
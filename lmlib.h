@@ -3,5 +3,11 @@
 
 #include "Dense.hpp"
 #include "Exp_Engine.hpp"
+#include "Dense_Engine.hpp"
+#include "Fusion.hpp"
+#include "Small_Tensor.hpp"
+#include "Interleaved.hpp"
+#include "Triangular.hpp"
+#include "Extension.h"
 
 #endif // LMLIB_lmlin_HPP_
@@ -0,0 +1,191 @@
+#ifndef LMLIB_PACKET_AVX2_HPP_
+#define LMLIB_PACKET_AVX2_HPP_
+
+#include "../LMBase.hpp"
+
+#if LMLIB_USE_AVX2
+#include <immintrin.h>
+
+namespace lmlib {
+namespace packet {
+
+template <> struct Packet<float, kAVX2> {
+  static const index_t kSize = 8;
+  __m256 data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m256 data) : data_(data) {}
+
+  inline static Packet<float, kAVX2> Fill(float s) {
+    return Packet<float, kAVX2>(_mm256_set1_ps(s));
+  }
+  inline static Packet<float, kAVX2> Load(const float *src) {
+    return Packet<float, kAVX2>(_mm256_loadu_ps(src));
+  }
+  // kSize int32 converted to float
+  inline static Packet<float, kAVX2> Convert(const int32_t *src) {
+    return Packet<float, kAVX2>(_mm256_cvtepi32_ps(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src))));
+  }
+  inline void Store(float *dst) const { _mm256_storeu_ps(dst, data_); }
+  inline float Sum() const {
+    __m128 t = _mm_add_ps(_mm256_castps256_ps128(data_),
+                          _mm256_extractf128_ps(data_, 1));
+    t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+    t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+    return _mm_cvtss_f32(t);
+  }
+};
+
+inline Packet<float, kAVX2> operator+(const Packet<float, kAVX2> &lhs,
+                                      const Packet<float, kAVX2> &rhs) {
+  return Packet<float, kAVX2>(_mm256_add_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX2> operator-(const Packet<float, kAVX2> &lhs,
+                                      const Packet<float, kAVX2> &rhs) {
+  return Packet<float, kAVX2>(_mm256_sub_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX2> operator*(const Packet<float, kAVX2> &lhs,
+                                      const Packet<float, kAVX2> &rhs) {
+  return Packet<float, kAVX2>(_mm256_mul_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX2> operator/(const Packet<float, kAVX2> &lhs,
+                                      const Packet<float, kAVX2> &rhs) {
+  return Packet<float, kAVX2>(_mm256_div_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX2> FMA(const Packet<float, kAVX2> &a,
+                                const Packet<float, kAVX2> &b,
+                                const Packet<float, kAVX2> &c) {
+#if defined(__FMA__)
+  return Packet<float, kAVX2>(_mm256_fmadd_ps(a.data_, b.data_, c.data_));
+#else
+  return a * b + c;
+#endif
+}
+inline Packet<float, kAVX2> Max(const Packet<float, kAVX2> &lhs,
+                                const Packet<float, kAVX2> &rhs) {
+  return Packet<float, kAVX2>(_mm256_max_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX2> Min(const Packet<float, kAVX2> &lhs,
+                                const Packet<float, kAVX2> &rhs) {
+  return Packet<float, kAVX2>(_mm256_min_ps(lhs.data_, rhs.data_));
+}
+
+template <> struct Packet<double, kAVX2> {
+  static const index_t kSize = 4;
+  __m256d data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m256d data) : data_(data) {}
+
+  inline static Packet<double, kAVX2> Fill(double s) {
+    return Packet<double, kAVX2>(_mm256_set1_pd(s));
+  }
+  inline static Packet<double, kAVX2> Load(const double *src) {
+    return Packet<double, kAVX2>(_mm256_loadu_pd(src));
+  }
+  // kSize int32 converted to double
+  inline static Packet<double, kAVX2> Convert(const int32_t *src) {
+    return Packet<double, kAVX2>(_mm256_cvtepi32_pd(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src))));
+  }
+  inline void Store(double *dst) const { _mm256_storeu_pd(dst, data_); }
+  inline double Sum() const {
+    __m128d t = _mm_add_pd(_mm256_castpd256_pd128(data_),
+                           _mm256_extractf128_pd(data_, 1));
+    t = _mm_add_sd(t, _mm_unpackhi_pd(t, t));
+    return _mm_cvtsd_f64(t);
+  }
+};
+
+inline Packet<double, kAVX2> operator+(const Packet<double, kAVX2> &lhs,
+                                       const Packet<double, kAVX2> &rhs) {
+  return Packet<double, kAVX2>(_mm256_add_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX2> operator-(const Packet<double, kAVX2> &lhs,
+                                       const Packet<double, kAVX2> &rhs) {
+  return Packet<double, kAVX2>(_mm256_sub_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX2> operator*(const Packet<double, kAVX2> &lhs,
+                                       const Packet<double, kAVX2> &rhs) {
+  return Packet<double, kAVX2>(_mm256_mul_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX2> operator/(const Packet<double, kAVX2> &lhs,
+                                       const Packet<double, kAVX2> &rhs) {
+  return Packet<double, kAVX2>(_mm256_div_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX2> FMA(const Packet<double, kAVX2> &a,
+                                 const Packet<double, kAVX2> &b,
+                                 const Packet<double, kAVX2> &c) {
+#if defined(__FMA__)
+  return Packet<double, kAVX2>(_mm256_fmadd_pd(a.data_, b.data_, c.data_));
+#else
+  return a * b + c;
+#endif
+}
+#if defined(__FMA__)
+template <> struct FusedFMA<float, kAVX2> {
+  static const bool value = true;
+};
+template <> struct FusedFMA<double, kAVX2> {
+  static const bool value = true;
+};
+#endif // __FMA__
+inline Packet<double, kAVX2> Max(const Packet<double, kAVX2> &lhs,
+                                 const Packet<double, kAVX2> &rhs) {
+  return Packet<double, kAVX2>(_mm256_max_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX2> Min(const Packet<double, kAVX2> &lhs,
+                                 const Packet<double, kAVX2> &rhs) {
+  return Packet<double, kAVX2>(_mm256_min_pd(lhs.data_, rhs.data_));
+}
+
+// transpose the 8x8 block held in row[0..8) in registers
+inline void Transpose(Packet<float, kAVX2> *row) {
+  __m256 t[8], u[8];
+  for (int i = 0; i < 8; i += 2) {
+    t[i] = _mm256_unpacklo_ps(row[i].data_, row[i + 1].data_);
+    t[i + 1] = _mm256_unpackhi_ps(row[i].data_, row[i + 1].data_);
+  }
+  for (int i = 0; i < 8; i += 4) {
+    u[i] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(1, 0, 1, 0));
+    u[i + 1] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(3, 2, 3, 2));
+    u[i + 2] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(1, 0, 1, 0));
+    u[i + 3] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(3, 2, 3, 2));
+  }
+  for (int i = 0; i < 4; ++i) {
+    row[i].data_ = _mm256_permute2f128_ps(u[i], u[i + 4], 0x20);
+    row[i + 4].data_ = _mm256_permute2f128_ps(u[i], u[i + 4], 0x31);
+  }
+}
+inline void Transpose(Packet<double, kAVX2> *row) {
+  const __m256d t0 = _mm256_unpacklo_pd(row[0].data_, row[1].data_);
+  const __m256d t1 = _mm256_unpackhi_pd(row[0].data_, row[1].data_);
+  const __m256d t2 = _mm256_unpacklo_pd(row[2].data_, row[3].data_);
+  const __m256d t3 = _mm256_unpackhi_pd(row[2].data_, row[3].data_);
+  row[0].data_ = _mm256_permute2f128_pd(t0, t2, 0x20);
+  row[1].data_ = _mm256_permute2f128_pd(t1, t3, 0x20);
+  row[2].data_ = _mm256_permute2f128_pd(t0, t2, 0x31);
+  row[3].data_ = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+// the doubles of lo and hi as one packet of floats
+inline Packet<float, kAVX2> Narrow(const Packet<double, kAVX2> &lo,
+                                   const Packet<double, kAVX2> &hi) {
+  return Packet<float, kAVX2>(
+      _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(lo.data_)),
+                           _mm256_cvtpd_ps(hi.data_), 1));
+}
+#if LMLIB_USE_SSE
+// the floats of a half-width packet as doubles
+inline Packet<double, kAVX2> Widen(const Packet<float, kSSE2> &src) {
+  return Packet<double, kAVX2>(_mm256_cvtps_pd(src.data_));
+}
+#endif
+
+} // namespace packet
+} // namespace lmlib
+
+#endif // LMLIB_USE_AVX2
+
+#endif // LMLIB_PACKET_AVX2_HPP_
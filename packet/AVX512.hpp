@@ -0,0 +1,174 @@
+#ifndef LMLIB_PACKET_AVX512_HPP_
+#define LMLIB_PACKET_AVX512_HPP_
+
+#include "../LMBase.hpp"
+
+#if LMLIB_USE_AVX512
+#include <immintrin.h>
+
+namespace lmlib {
+namespace packet {
+
+template <> struct Packet<float, kAVX512> {
+  static const index_t kSize = 16;
+  __m512 data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m512 data) : data_(data) {}
+
+  inline static Packet<float, kAVX512> Fill(float s) {
+    return Packet<float, kAVX512>(_mm512_set1_ps(s));
+  }
+  inline static Packet<float, kAVX512> Load(const float *src) {
+    return Packet<float, kAVX512>(_mm512_loadu_ps(src));
+  }
+  // kSize int32 converted to float, masked for the same reason as Sum
+  inline static Packet<float, kAVX512> Convert(const int32_t *src) {
+    return Packet<float, kAVX512>(_mm512_maskz_cvtepi32_ps(
+        __mmask16(0xFFFF), _mm512_loadu_si512(src)));
+  }
+  inline void Store(float *dst) const { _mm512_storeu_ps(dst, data_); }
+  // a tree over the lanes, the reduce intrinsics of gcc 12 trip
+  // -Wuninitialized on their _mm512_undefined_* placeholders
+  inline float Sum() const {
+    float lane[kSize];
+    _mm512_storeu_ps(lane, data_);
+    for (index_t width = kSize / 2; width > 0; width /= 2) {
+      for (index_t i = 0; i < width; ++i)
+        lane[i] += lane[i + width];
+    }
+    return lane[0];
+  }
+};
+
+inline Packet<float, kAVX512> operator+(const Packet<float, kAVX512> &lhs,
+                                        const Packet<float, kAVX512> &rhs) {
+  return Packet<float, kAVX512>(_mm512_add_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX512> operator-(const Packet<float, kAVX512> &lhs,
+                                        const Packet<float, kAVX512> &rhs) {
+  return Packet<float, kAVX512>(_mm512_sub_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX512> operator*(const Packet<float, kAVX512> &lhs,
+                                        const Packet<float, kAVX512> &rhs) {
+  return Packet<float, kAVX512>(_mm512_mul_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX512> operator/(const Packet<float, kAVX512> &lhs,
+                                        const Packet<float, kAVX512> &rhs) {
+  return Packet<float, kAVX512>(_mm512_div_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX512> FMA(const Packet<float, kAVX512> &a,
+                                  const Packet<float, kAVX512> &b,
+                                  const Packet<float, kAVX512> &c) {
+  return Packet<float, kAVX512>(_mm512_fmadd_ps(a.data_, b.data_, c.data_));
+}
+template <> struct FusedFMA<float, kAVX512> {
+  static const bool value = true;
+};
+template <> struct FusedFMA<double, kAVX512> {
+  static const bool value = true;
+};
+inline Packet<float, kAVX512> Max(const Packet<float, kAVX512> &lhs,
+                                  const Packet<float, kAVX512> &rhs) {
+  // masked form for the same reason as Sum
+  return Packet<float, kAVX512>(
+      _mm512_mask_max_ps(lhs.data_, __mmask16(0xFFFF), lhs.data_, rhs.data_));
+}
+inline Packet<float, kAVX512> Min(const Packet<float, kAVX512> &lhs,
+                                  const Packet<float, kAVX512> &rhs) {
+  return Packet<float, kAVX512>(
+      _mm512_mask_min_ps(lhs.data_, __mmask16(0xFFFF), lhs.data_, rhs.data_));
+}
+
+template <> struct Packet<double, kAVX512> {
+  static const index_t kSize = 8;
+  __m512d data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m512d data) : data_(data) {}
+
+  inline static Packet<double, kAVX512> Fill(double s) {
+    return Packet<double, kAVX512>(_mm512_set1_pd(s));
+  }
+  inline static Packet<double, kAVX512> Load(const double *src) {
+    return Packet<double, kAVX512>(_mm512_loadu_pd(src));
+  }
+  // kSize int32 converted to double, masked for the same reason as Sum
+  inline static Packet<double, kAVX512> Convert(const int32_t *src) {
+    return Packet<double, kAVX512>(_mm512_maskz_cvtepi32_pd(
+        __mmask8(0xFF),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src))));
+  }
+  inline void Store(double *dst) const { _mm512_storeu_pd(dst, data_); }
+  // a tree over the lanes, the reduce intrinsics of gcc 12 trip
+  // -Wuninitialized on their _mm512_undefined_* placeholders
+  inline double Sum() const {
+    double lane[kSize];
+    _mm512_storeu_pd(lane, data_);
+    for (index_t width = kSize / 2; width > 0; width /= 2) {
+      for (index_t i = 0; i < width; ++i)
+        lane[i] += lane[i + width];
+    }
+    return lane[0];
+  }
+};
+
+inline Packet<double, kAVX512> operator+(const Packet<double, kAVX512> &lhs,
+                                         const Packet<double, kAVX512> &rhs) {
+  return Packet<double, kAVX512>(_mm512_add_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX512> operator-(const Packet<double, kAVX512> &lhs,
+                                         const Packet<double, kAVX512> &rhs) {
+  return Packet<double, kAVX512>(_mm512_sub_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX512> operator*(const Packet<double, kAVX512> &lhs,
+                                         const Packet<double, kAVX512> &rhs) {
+  return Packet<double, kAVX512>(_mm512_mul_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX512> operator/(const Packet<double, kAVX512> &lhs,
+                                         const Packet<double, kAVX512> &rhs) {
+  return Packet<double, kAVX512>(_mm512_div_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX512> FMA(const Packet<double, kAVX512> &a,
+                                   const Packet<double, kAVX512> &b,
+                                   const Packet<double, kAVX512> &c) {
+  return Packet<double, kAVX512>(_mm512_fmadd_pd(a.data_, b.data_, c.data_));
+}
+inline Packet<double, kAVX512> Max(const Packet<double, kAVX512> &lhs,
+                                   const Packet<double, kAVX512> &rhs) {
+  // masked form for the same reason as Sum
+  return Packet<double, kAVX512>(
+      _mm512_mask_max_pd(lhs.data_, __mmask8(0xFF), lhs.data_, rhs.data_));
+}
+inline Packet<double, kAVX512> Min(const Packet<double, kAVX512> &lhs,
+                                   const Packet<double, kAVX512> &rhs) {
+  return Packet<double, kAVX512>(
+      _mm512_mask_min_pd(lhs.data_, __mmask8(0xFF), lhs.data_, rhs.data_));
+}
+
+// the doubles of lo and hi as one packet of floats, the conversions are
+// masked for the same reason as Sum
+inline Packet<float, kAVX512> Narrow(const Packet<double, kAVX512> &lo,
+                                     const Packet<double, kAVX512> &hi) {
+  const __m256 flo = _mm512_maskz_cvtpd_ps(__mmask8(0xFF), lo.data_);
+  const __m256 fhi = _mm512_maskz_cvtpd_ps(__mmask8(0xFF), hi.data_);
+  const __m512d wide = _mm512_maskz_insertf64x4(
+      __mmask8(0xFF), _mm512_setzero_pd(), _mm256_castps_pd(flo), 0);
+  const __m512d res = _mm512_maskz_insertf64x4(__mmask8(0xFF), wide,
+                                               _mm256_castps_pd(fhi), 1);
+  return Packet<float, kAVX512>(_mm512_castpd_ps(res));
+}
+#if LMLIB_USE_AVX2
+// the floats of a half-width packet as doubles
+inline Packet<double, kAVX512> Widen(const Packet<float, kAVX2> &src) {
+  return Packet<double, kAVX512>(
+      _mm512_maskz_cvtps_pd(__mmask8(0xFF), src.data_));
+}
+#endif
+
+} // namespace packet
+} // namespace lmlib
+
+#endif // LMLIB_USE_AVX512
+
+#endif // LMLIB_PACKET_AVX512_HPP_
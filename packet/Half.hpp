@@ -0,0 +1,306 @@
+#ifndef LMLIB_PACKET_HALF_HPP_
+#define LMLIB_PACKET_HALF_HPP_
+
+#include <cmath>
+
+#include "../Half.hpp"
+#include "../LMBase.hpp"
+
+#if LMLIB_USE_SSE
+#include <immintrin.h>
+#endif
+
+namespace lmlib {
+namespace packet {
+
+// kSize elements of a reduced precision DType from and to the float lanes of
+// a packet, lane by lane where the arch has nothing better
+template <typename DType, PacketArch Arch> struct WideConvert {
+  inline static Packet<float, Arch> Load(const DType *src) {
+    float lane[Packet<float, Arch>::kSize];
+    for (index_t i = 0; i < Packet<float, Arch>::kSize; ++i)
+      lane[i] = float(src[i]);
+    return Packet<float, Arch>::Load(lane);
+  }
+  inline static void Store(DType *dst, const Packet<float, Arch> &src) {
+    float lane[Packet<float, Arch>::kSize];
+    src.Store(lane);
+    for (index_t i = 0; i < Packet<float, Arch>::kSize; ++i)
+      dst[i] = DType(lane[i]);
+  }
+};
+
+#if LMLIB_USE_AVX512
+// the avx-512 conversions are masked, the plain forms of gcc 12 trip
+// -Wuninitialized on their _mm512_undefined_* placeholders
+template <> struct WideConvert<half_t, kAVX512> {
+  inline static Packet<float, kAVX512> Load(const half_t *src) {
+    return Packet<float, kAVX512>(_mm512_maskz_cvtph_ps(
+        __mmask16(0xFFFF),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src))));
+  }
+  inline static void Store(half_t *dst, const Packet<float, kAVX512> &src) {
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(dst),
+        _mm512_maskz_cvtps_ph(__mmask16(0xFFFF), src.data_,
+                              _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  }
+};
+template <> struct WideConvert<bf16_t, kAVX512> {
+  inline static Packet<float, kAVX512> Load(const bf16_t *src) {
+    const __m512i bits = _mm512_maskz_cvtepu16_epi32(
+        __mmask16(0xFFFF),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)));
+    return Packet<float, kAVX512>(_mm512_castsi512_ps(
+        _mm512_maskz_slli_epi32(__mmask16(0xFFFF), bits, 16)));
+  }
+  inline static void Store(bf16_t *dst, const Packet<float, kAVX512> &src) {
+    // the rounding of FloatToBF16Bits on 16 lanes; not vcvtneps2bf16, it
+    // flushes denormals to zero and the other arches keep them
+    const __mmask16 all = 0xFFFF;
+    const __m512i x = _mm512_castps_si512(src.data_);
+    const __m512i top = _mm512_maskz_srli_epi32(all, x, 16);
+    const __m512i odd = _mm512_and_si512(top, _mm512_set1_epi32(1));
+    __m512i res = _mm512_maskz_srli_epi32(
+        all,
+        _mm512_add_epi32(x, _mm512_add_epi32(odd, _mm512_set1_epi32(0x7FFF))),
+        16);
+    const __mmask16 nan =
+        _mm512_cmp_ps_mask(src.data_, src.data_, _CMP_UNORD_Q);
+    res = _mm512_mask_or_epi32(res, nan, top, _mm512_set1_epi32(0x40));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst),
+                        _mm512_maskz_cvtepi32_epi16(all, res));
+  }
+};
+#endif // LMLIB_USE_AVX512
+
+#if LMLIB_USE_AVX2
+#if LMLIB_USE_F16C
+template <> struct WideConvert<half_t, kAVX2> {
+  inline static Packet<float, kAVX2> Load(const half_t *src) {
+    return Packet<float, kAVX2>(_mm256_cvtph_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src))));
+  }
+  inline static void Store(half_t *dst, const Packet<float, kAVX2> &src) {
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(dst),
+        _mm256_cvtps_ph(src.data_,
+                        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+  }
+};
+#endif
+template <> struct WideConvert<bf16_t, kAVX2> {
+  inline static Packet<float, kAVX2> Load(const bf16_t *src) {
+    const __m256i bits = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+    return Packet<float, kAVX2>(
+        _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16)));
+  }
+  inline static void Store(bf16_t *dst, const Packet<float, kAVX2> &src) {
+    const __m256i x = _mm256_castps_si256(src.data_);
+    const __m256i odd = _mm256_and_si256(_mm256_srli_epi32(x, 16),
+                                         _mm256_set1_epi32(1));
+    __m256i res = _mm256_srli_epi32(
+        _mm256_add_epi32(x, _mm256_add_epi32(odd, _mm256_set1_epi32(0x7FFF))),
+        16);
+    const __m256i nan = _mm256_castps_si256(
+        _mm256_cmp_ps(src.data_, src.data_, _CMP_UNORD_Q));
+    res = _mm256_blendv_epi8(
+        res,
+        _mm256_or_si256(_mm256_srli_epi32(x, 16), _mm256_set1_epi32(0x40)),
+        nan);
+    // the 16 bit halves of both 128 bit lanes, then the two lanes together
+    res = _mm256_permute4x64_epi64(_mm256_packus_epi32(res, res), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                     _mm256_castsi256_si128(res));
+  }
+};
+#endif // LMLIB_USE_AVX2
+
+#if LMLIB_USE_SSE
+#if LMLIB_USE_F16C
+template <> struct WideConvert<half_t, kSSE2> {
+  inline static Packet<float, kSSE2> Load(const half_t *src) {
+    return Packet<float, kSSE2>(_mm_cvtph_ps(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src))));
+  }
+  inline static void Store(half_t *dst, const Packet<float, kSSE2> &src) {
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst),
+                     _mm_cvtps_ph(src.data_, _MM_FROUND_TO_NEAREST_INT |
+                                                 _MM_FROUND_NO_EXC));
+  }
+};
+#endif
+template <> struct WideConvert<bf16_t, kSSE2> {
+  inline static Packet<float, kSSE2> Load(const bf16_t *src) {
+    return Packet<float, kSSE2>(_mm_castsi128_ps(_mm_unpacklo_epi16(
+        _mm_setzero_si128(),
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src)))));
+  }
+  inline static void Store(bf16_t *dst, const Packet<float, kSSE2> &src) {
+    const __m128i x = _mm_castps_si128(src.data_);
+    const __m128i odd =
+        _mm_and_si128(_mm_srli_epi32(x, 16), _mm_set1_epi32(1));
+    const __m128i round = _mm_srli_epi32(
+        _mm_add_epi32(x, _mm_add_epi32(odd, _mm_set1_epi32(0x7FFF))), 16);
+    const __m128i quiet =
+        _mm_or_si128(_mm_srli_epi32(x, 16), _mm_set1_epi32(0x40));
+    const __m128i nan =
+        _mm_castps_si128(_mm_cmpunord_ps(src.data_, src.data_));
+    __m128i res = _mm_or_si128(_mm_andnot_si128(nan, round),
+                               _mm_and_si128(nan, quiet));
+    // sign extend the 16 bit values so the signed pack keeps them
+    res = _mm_srai_epi32(_mm_slli_epi32(res, 16), 16);
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(dst),
+                     _mm_packs_epi32(res, res));
+  }
+};
+#endif // LMLIB_USE_SSE
+
+// FMA of the float lanes, the one lane of kPlain fuses when the packets of
+// the default arch do, so the tail of a row rounds like its packets
+template <PacketArch Arch> struct WideFMA {
+  inline static Packet<float, Arch> Eval(const Packet<float, Arch> &a,
+                                         const Packet<float, Arch> &b,
+                                         const Packet<float, Arch> &c) {
+    return FMA(a, b, c);
+  }
+};
+template <> struct WideFMA<kPlain> {
+  inline static Packet<float, kPlain> Eval(const Packet<float, kPlain> &a,
+                                           const Packet<float, kPlain> &b,
+                                           const Packet<float, kPlain> &c) {
+    return Packet<float, kPlain>(
+        FusedFMA<float, LMLIB_DEFAULT_PACKEL>::value
+            ? std::fma(a.data_, b.data_, c.data_)
+            : a.data_ * b.data_ + c.data_);
+  }
+};
+
+// the packet of a reduced precision type holds its lanes as a packet of
+// floats, maps over it do their arithmetic in float and round once when
+// they store; the one lane kPlain packet is what the tail of a row runs on
+template <typename DType, PacketArch Arch> struct WidePacket {
+  typedef Packet<DType, Arch> P;
+  static const index_t kSize = Packet<float, Arch>::kSize;
+  Packet<float, Arch> data_;
+
+  inline static P Fill(DType s) {
+    return P(Packet<float, Arch>::Fill(float(s)));
+  }
+  inline static P Load(const DType *src) {
+    return P(WideConvert<DType, Arch>::Load(src));
+  }
+  inline void Store(DType *dst) const {
+    WideConvert<DType, Arch>::Store(dst, data_);
+  }
+  inline DType Sum() const { return DType(data_.Sum()); }
+
+  // friends, so that on kPlain they win over the generic plain operators
+  friend inline P operator+(const P &lhs, const P &rhs) {
+    return P(lhs.data_ + rhs.data_);
+  }
+  friend inline P operator-(const P &lhs, const P &rhs) {
+    return P(lhs.data_ - rhs.data_);
+  }
+  friend inline P operator*(const P &lhs, const P &rhs) {
+    return P(lhs.data_ * rhs.data_);
+  }
+  friend inline P operator/(const P &lhs, const P &rhs) {
+    return P(lhs.data_ / rhs.data_);
+  }
+  friend inline P FMA(const P &a, const P &b, const P &c) {
+    return P(WideFMA<Arch>::Eval(a.data_, b.data_, c.data_));
+  }
+  friend inline P Max(const P &lhs, const P &rhs) {
+    return P(Max(lhs.data_, rhs.data_));
+  }
+  friend inline P Min(const P &lhs, const P &rhs) {
+    return P(Min(lhs.data_, rhs.data_));
+  }
+};
+
+template <PacketArch Arch>
+struct Packet<half_t, Arch> : public WidePacket<half_t, Arch> {
+  inline Packet() {}
+  inline explicit Packet(const Packet<float, Arch> &data) {
+    this->data_ = data;
+  }
+};
+template <PacketArch Arch>
+struct Packet<bf16_t, Arch> : public WidePacket<bf16_t, Arch> {
+  inline Packet() {}
+  inline explicit Packet(const Packet<float, Arch> &data) {
+    this->data_ = data;
+  }
+};
+// kPlain, picked over both partial specializations
+template <> struct Packet<half_t, kPlain> : public WidePacket<half_t, kPlain> {
+  inline Packet() {}
+  inline explicit Packet(const Packet<float, kPlain> &data) {
+    this->data_ = data;
+  }
+};
+template <> struct Packet<bf16_t, kPlain> : public WidePacket<bf16_t, kPlain> {
+  inline Packet() {}
+  inline explicit Packet(const Packet<float, kPlain> &data) {
+    this->data_ = data;
+  }
+};
+
+template <> struct PacketDefault<half_t> {
+  static const PacketArch kArch = LMLIB_DEFAULT_PACKEL;
+};
+template <> struct PacketDefault<bf16_t> {
+  static const PacketArch kArch = LMLIB_DEFAULT_PACKEL;
+};
+template <> struct ComputeType<half_t> {
+  typedef float Type;
+};
+template <> struct ComputeType<bf16_t> {
+  typedef float Type;
+};
+
+// to and from float only moves the lanes, the conversion happens on load
+// and store
+template <PacketArch Arch> struct PacketCast<float, half_t, Arch> {
+  static const bool kPass = true;
+  static const PacketArch kSrcArch = Arch;
+  template <typename Plan>
+  inline static Packet<float, Arch> Eval(const Plan &src, index_t y,
+                                         index_t x) {
+    return src.EvalPacket(y, x).data_;
+  }
+};
+template <PacketArch Arch> struct PacketCast<half_t, float, Arch> {
+  static const bool kPass = true;
+  static const PacketArch kSrcArch = Arch;
+  template <typename Plan>
+  inline static Packet<half_t, Arch> Eval(const Plan &src, index_t y,
+                                          index_t x) {
+    return Packet<half_t, Arch>(src.EvalPacket(y, x));
+  }
+};
+template <PacketArch Arch> struct PacketCast<float, bf16_t, Arch> {
+  static const bool kPass = true;
+  static const PacketArch kSrcArch = Arch;
+  template <typename Plan>
+  inline static Packet<float, Arch> Eval(const Plan &src, index_t y,
+                                         index_t x) {
+    return src.EvalPacket(y, x).data_;
+  }
+};
+template <PacketArch Arch> struct PacketCast<bf16_t, float, Arch> {
+  static const bool kPass = true;
+  static const PacketArch kSrcArch = Arch;
+  template <typename Plan>
+  inline static Packet<bf16_t, Arch> Eval(const Plan &src, index_t y,
+                                          index_t x) {
+    return Packet<bf16_t, Arch>(src.EvalPacket(y, x));
+  }
+};
+
+} // namespace packet
+} // namespace lmlib
+
+#endif // LMLIB_PACKET_HALF_HPP_
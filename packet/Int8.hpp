@@ -0,0 +1,189 @@
+#ifndef LMLIB_PACKET_INT8_HPP_
+#define LMLIB_PACKET_INT8_HPP_
+
+#include <cstring>
+
+#include "../LMBase.hpp"
+
+#if LMLIB_USE_SSE
+#include <immintrin.h>
+#endif
+
+namespace lmlib {
+namespace packet {
+
+// int32 lanes of the u8 x s8 gemm, QDot(a, b, acc) adds to every lane the
+// dot of the kGroup values of a row of A that Broadcast read with the kGroup
+// values of one column of B that Load read; vnni does that in one
+// instruction on the bytes, without it maddubs would saturate its int16 sum
+// of two u8 x s8 products, so the panels hold int16 and pmaddwd sums pairs
+// of them exactly, on the same ports as maddubs
+template <PacketArch Arch> struct QPacket;
+
+// the four bytes of a group as one int32 lane
+inline int32_t GroupBits(const void *src) {
+  int32_t bits;
+  std::memcpy(&bits, src, sizeof(bits));
+  return bits;
+}
+
+template <> struct QPacket<kPlain> {
+  typedef uint8_t AType;
+  typedef int8_t BType;
+  static const index_t kSize = 1;
+  static const int kGroup = 1;
+  int32_t data_;
+
+  inline QPacket() {}
+  inline explicit QPacket(int32_t data) : data_(data) {}
+
+  inline static QPacket<kPlain> Zero() { return QPacket<kPlain>(0); }
+  inline static QPacket<kPlain> Broadcast(const AType *a) {
+    return QPacket<kPlain>(a[0]);
+  }
+  inline static QPacket<kPlain> Load(const BType *b) {
+    return QPacket<kPlain>(b[0]);
+  }
+  inline void Store(int32_t *dst) const { dst[0] = data_; }
+};
+
+inline QPacket<kPlain> QDot(const QPacket<kPlain> &a,
+                            const QPacket<kPlain> &b,
+                            const QPacket<kPlain> &acc) {
+  return QPacket<kPlain>(acc.data_ + a.data_ * b.data_);
+}
+
+#if LMLIB_USE_SSE
+template <> struct QPacket<kSSE2> {
+  typedef int16_t AType;
+  typedef int16_t BType;
+  static const index_t kSize = 4;
+  static const int kGroup = 2;
+  __m128i data_;
+
+  inline QPacket() {}
+  inline explicit QPacket(__m128i data) : data_(data) {}
+
+  inline static QPacket<kSSE2> Zero() {
+    return QPacket<kSSE2>(_mm_setzero_si128());
+  }
+  inline static QPacket<kSSE2> Broadcast(const AType *a) {
+    return QPacket<kSSE2>(_mm_set1_epi32(GroupBits(a)));
+  }
+  inline static QPacket<kSSE2> Load(const BType *b) {
+    return QPacket<kSSE2>(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(b)));
+  }
+  inline void Store(int32_t *dst) const {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), data_);
+  }
+};
+
+inline QPacket<kSSE2> QDot(const QPacket<kSSE2> &a, const QPacket<kSSE2> &b,
+                           const QPacket<kSSE2> &acc) {
+  return QPacket<kSSE2>(
+      _mm_add_epi32(acc.data_, _mm_madd_epi16(a.data_, b.data_)));
+}
+#endif // LMLIB_USE_SSE
+
+#if LMLIB_USE_AVX2
+template <> struct QPacket<kAVX2> {
+#if LMLIB_USE_AVXVNNI
+  typedef uint8_t AType;
+  typedef int8_t BType;
+  static const int kGroup = 4;
+#else
+  typedef int16_t AType;
+  typedef int16_t BType;
+  static const int kGroup = 2;
+#endif
+  static const index_t kSize = 8;
+  __m256i data_;
+
+  inline QPacket() {}
+  inline explicit QPacket(__m256i data) : data_(data) {}
+
+  inline static QPacket<kAVX2> Zero() {
+    return QPacket<kAVX2>(_mm256_setzero_si256());
+  }
+  inline static QPacket<kAVX2> Broadcast(const AType *a) {
+    return QPacket<kAVX2>(_mm256_set1_epi32(GroupBits(a)));
+  }
+  inline static QPacket<kAVX2> Load(const BType *b) {
+    return QPacket<kAVX2>(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b)));
+  }
+  inline void Store(int32_t *dst) const {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), data_);
+  }
+};
+
+inline QPacket<kAVX2> QDot(const QPacket<kAVX2> &a, const QPacket<kAVX2> &b,
+                           const QPacket<kAVX2> &acc) {
+#if LMLIB_USE_AVXVNNI
+  return QPacket<kAVX2>(_mm256_dpbusd_avx_epi32(acc.data_, a.data_, b.data_));
+#else
+  return QPacket<kAVX2>(
+      _mm256_add_epi32(acc.data_, _mm256_madd_epi16(a.data_, b.data_)));
+#endif
+}
+#endif // LMLIB_USE_AVX2
+
+#if LMLIB_USE_AVX512 && (LMLIB_USE_AVX512VNNI || LMLIB_USE_AVX512BW)
+template <> struct QPacket<kAVX512> {
+#if LMLIB_USE_AVX512VNNI
+  typedef uint8_t AType;
+  typedef int8_t BType;
+  static const int kGroup = 4;
+#else
+  typedef int16_t AType;
+  typedef int16_t BType;
+  static const int kGroup = 2;
+#endif
+  static const index_t kSize = 16;
+  __m512i data_;
+
+  inline QPacket() {}
+  inline explicit QPacket(__m512i data) : data_(data) {}
+
+  inline static QPacket<kAVX512> Zero() {
+    return QPacket<kAVX512>(_mm512_setzero_si512());
+  }
+  inline static QPacket<kAVX512> Broadcast(const AType *a) {
+    return QPacket<kAVX512>(_mm512_set1_epi32(GroupBits(a)));
+  }
+  inline static QPacket<kAVX512> Load(const BType *b) {
+    return QPacket<kAVX512>(_mm512_loadu_si512(b));
+  }
+  inline void Store(int32_t *dst) const { _mm512_storeu_si512(dst, data_); }
+};
+
+inline QPacket<kAVX512> QDot(const QPacket<kAVX512> &a,
+                             const QPacket<kAVX512> &b,
+                             const QPacket<kAVX512> &acc) {
+#if LMLIB_USE_AVX512VNNI
+  return QPacket<kAVX512>(_mm512_dpbusd_epi32(acc.data_, a.data_, b.data_));
+#else
+  return QPacket<kAVX512>(
+      _mm512_add_epi32(acc.data_, _mm512_madd_epi16(a.data_, b.data_)));
+#endif
+}
+#endif // LMLIB_USE_AVX512 && (LMLIB_USE_AVX512VNNI || LMLIB_USE_AVX512BW)
+
+// the arch of the quantized gemm
+struct QPacketDefault {
+#if LMLIB_USE_AVX512 && (LMLIB_USE_AVX512VNNI || LMLIB_USE_AVX512BW)
+  static const PacketArch kArch = kAVX512;
+#elif LMLIB_USE_AVX2
+  static const PacketArch kArch = kAVX2;
+#elif LMLIB_USE_SSE
+  static const PacketArch kArch = kSSE2;
+#else
+  static const PacketArch kArch = kPlain;
+#endif
+};
+
+} // namespace packet
+} // namespace lmlib
+
+#endif // LMLIB_PACKET_INT8_HPP_
@@ -0,0 +1,182 @@
+#ifndef LMLIB_PACKET_KEY_HPP_
+#define LMLIB_PACKET_KEY_HPP_
+
+#include "../LMBase.hpp"
+
+#if LMLIB_USE_SSE
+#include <immintrin.h>
+#endif
+
+namespace lmlib {
+namespace packet {
+
+// unsigned lanes of the sort keys, with what a sorting network needs: Load,
+// Store and the unsigned Min and Max; kPlain is the generic one element
+// packet.  they are left out of PacketDefault, so maps never pick them
+template <typename UType> struct KeyPacketDefault {
+  static const PacketArch kArch = kPlain;
+};
+template <> struct KeyPacketDefault<uint32_t> {
+  static const PacketArch kArch = LMLIB_DEFAULT_PACKEL;
+};
+// sse2 has no 64 bit compare
+template <> struct KeyPacketDefault<uint64_t> {
+  static const PacketArch kArch =
+      LMLIB_DEFAULT_PACKEL == kSSE2 ? kPlain : LMLIB_DEFAULT_PACKEL;
+};
+
+#if LMLIB_USE_SSE
+template <> struct Packet<uint32_t, kSSE2> {
+  static const index_t kSize = 4;
+  __m128i data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m128i data) : data_(data) {}
+
+  inline static Packet<uint32_t, kSSE2> Load(const uint32_t *src) {
+    return Packet<uint32_t, kSSE2>(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+  }
+  inline void Store(uint32_t *dst) const {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), data_);
+  }
+};
+
+// lanes where lhs > rhs; sse2 compares signed, with the top bits flipped
+// that is the unsigned order
+inline __m128i KeyGreater(const Packet<uint32_t, kSSE2> &lhs,
+                          const Packet<uint32_t, kSSE2> &rhs) {
+  const __m128i sign = _mm_set1_epi32(-0x7FFFFFFF - 1);
+  return _mm_cmpgt_epi32(_mm_xor_si128(lhs.data_, sign),
+                         _mm_xor_si128(rhs.data_, sign));
+}
+inline Packet<uint32_t, kSSE2> Max(const Packet<uint32_t, kSSE2> &lhs,
+                                   const Packet<uint32_t, kSSE2> &rhs) {
+  const __m128i gt = KeyGreater(lhs, rhs);
+  return Packet<uint32_t, kSSE2>(_mm_or_si128(
+      _mm_and_si128(gt, lhs.data_), _mm_andnot_si128(gt, rhs.data_)));
+}
+inline Packet<uint32_t, kSSE2> Min(const Packet<uint32_t, kSSE2> &lhs,
+                                   const Packet<uint32_t, kSSE2> &rhs) {
+  const __m128i gt = KeyGreater(lhs, rhs);
+  return Packet<uint32_t, kSSE2>(_mm_or_si128(
+      _mm_and_si128(gt, rhs.data_), _mm_andnot_si128(gt, lhs.data_)));
+}
+#endif // LMLIB_USE_SSE
+
+#if LMLIB_USE_AVX2
+template <> struct Packet<uint32_t, kAVX2> {
+  static const index_t kSize = 8;
+  __m256i data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m256i data) : data_(data) {}
+
+  inline static Packet<uint32_t, kAVX2> Load(const uint32_t *src) {
+    return Packet<uint32_t, kAVX2>(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)));
+  }
+  inline void Store(uint32_t *dst) const {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), data_);
+  }
+};
+
+inline Packet<uint32_t, kAVX2> Max(const Packet<uint32_t, kAVX2> &lhs,
+                                   const Packet<uint32_t, kAVX2> &rhs) {
+  return Packet<uint32_t, kAVX2>(_mm256_max_epu32(lhs.data_, rhs.data_));
+}
+inline Packet<uint32_t, kAVX2> Min(const Packet<uint32_t, kAVX2> &lhs,
+                                   const Packet<uint32_t, kAVX2> &rhs) {
+  return Packet<uint32_t, kAVX2>(_mm256_min_epu32(lhs.data_, rhs.data_));
+}
+
+template <> struct Packet<uint64_t, kAVX2> {
+  static const index_t kSize = 4;
+  __m256i data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m256i data) : data_(data) {}
+
+  inline static Packet<uint64_t, kAVX2> Load(const uint64_t *src) {
+    return Packet<uint64_t, kAVX2>(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)));
+  }
+  inline void Store(uint64_t *dst) const {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), data_);
+  }
+};
+
+// lanes where lhs > rhs, as KeyGreater of sse2 on 64 bit lanes
+inline __m256i KeyGreater(const Packet<uint64_t, kAVX2> &lhs,
+                          const Packet<uint64_t, kAVX2> &rhs) {
+  const __m256i sign = _mm256_set1_epi64x(-0x7FFFFFFFFFFFFFFFLL - 1);
+  return _mm256_cmpgt_epi64(_mm256_xor_si256(lhs.data_, sign),
+                            _mm256_xor_si256(rhs.data_, sign));
+}
+inline Packet<uint64_t, kAVX2> Max(const Packet<uint64_t, kAVX2> &lhs,
+                                   const Packet<uint64_t, kAVX2> &rhs) {
+  return Packet<uint64_t, kAVX2>(
+      _mm256_blendv_epi8(rhs.data_, lhs.data_, KeyGreater(lhs, rhs)));
+}
+inline Packet<uint64_t, kAVX2> Min(const Packet<uint64_t, kAVX2> &lhs,
+                                   const Packet<uint64_t, kAVX2> &rhs) {
+  return Packet<uint64_t, kAVX2>(
+      _mm256_blendv_epi8(lhs.data_, rhs.data_, KeyGreater(lhs, rhs)));
+}
+#endif // LMLIB_USE_AVX2
+
+#if LMLIB_USE_AVX512
+// the min and max are masked, like Max of the float packets
+template <> struct Packet<uint32_t, kAVX512> {
+  static const index_t kSize = 16;
+  __m512i data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m512i data) : data_(data) {}
+
+  inline static Packet<uint32_t, kAVX512> Load(const uint32_t *src) {
+    return Packet<uint32_t, kAVX512>(_mm512_loadu_si512(src));
+  }
+  inline void Store(uint32_t *dst) const { _mm512_storeu_si512(dst, data_); }
+};
+
+inline Packet<uint32_t, kAVX512> Max(const Packet<uint32_t, kAVX512> &lhs,
+                                     const Packet<uint32_t, kAVX512> &rhs) {
+  return Packet<uint32_t, kAVX512>(_mm512_mask_max_epu32(
+      lhs.data_, __mmask16(0xFFFF), lhs.data_, rhs.data_));
+}
+inline Packet<uint32_t, kAVX512> Min(const Packet<uint32_t, kAVX512> &lhs,
+                                     const Packet<uint32_t, kAVX512> &rhs) {
+  return Packet<uint32_t, kAVX512>(_mm512_mask_min_epu32(
+      lhs.data_, __mmask16(0xFFFF), lhs.data_, rhs.data_));
+}
+
+template <> struct Packet<uint64_t, kAVX512> {
+  static const index_t kSize = 8;
+  __m512i data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m512i data) : data_(data) {}
+
+  inline static Packet<uint64_t, kAVX512> Load(const uint64_t *src) {
+    return Packet<uint64_t, kAVX512>(_mm512_loadu_si512(src));
+  }
+  inline void Store(uint64_t *dst) const { _mm512_storeu_si512(dst, data_); }
+};
+
+inline Packet<uint64_t, kAVX512> Max(const Packet<uint64_t, kAVX512> &lhs,
+                                     const Packet<uint64_t, kAVX512> &rhs) {
+  return Packet<uint64_t, kAVX512>(_mm512_mask_max_epu64(
+      lhs.data_, __mmask8(0xFF), lhs.data_, rhs.data_));
+}
+inline Packet<uint64_t, kAVX512> Min(const Packet<uint64_t, kAVX512> &lhs,
+                                     const Packet<uint64_t, kAVX512> &rhs) {
+  return Packet<uint64_t, kAVX512>(_mm512_mask_min_epu64(
+      lhs.data_, __mmask8(0xFF), lhs.data_, rhs.data_));
+}
+#endif // LMLIB_USE_AVX512
+
+} // namespace packet
+} // namespace lmlib
+
+#endif // LMLIB_PACKET_KEY_HPP_
@@ -0,0 +1,79 @@
+#ifndef LMLIB_PACKET_PLAIN_HPP_
+#define LMLIB_PACKET_PLAIN_HPP_
+
+#include "../LMBase.hpp"
+
+namespace lmlib {
+namespace packet {
+
+// one element per packet, keeps the packet code path valid on any DType
+template <typename DType> struct Packet<DType, kPlain> {
+  static const index_t kSize = 1;
+  DType data_;
+
+  inline Packet() {}
+  inline explicit Packet(DType data) : data_(data) {}
+
+  inline static Packet<DType, kPlain> Fill(DType s) {
+    return Packet<DType, kPlain>(s);
+  }
+  inline static Packet<DType, kPlain> Load(const DType *src) {
+    return Packet<DType, kPlain>(*src);
+  }
+  inline static Packet<DType, kPlain> Convert(const int32_t *src) {
+    return Packet<DType, kPlain>(DType(*src));
+  }
+  inline void Store(DType *dst) const { *dst = data_; }
+  inline DType Sum() const { return data_; }
+};
+
+template <typename DType>
+inline Packet<DType, kPlain> operator+(const Packet<DType, kPlain> &lhs,
+                                       const Packet<DType, kPlain> &rhs) {
+  return Packet<DType, kPlain>(lhs.data_ + rhs.data_);
+}
+template <typename DType>
+inline Packet<DType, kPlain> operator-(const Packet<DType, kPlain> &lhs,
+                                       const Packet<DType, kPlain> &rhs) {
+  return Packet<DType, kPlain>(lhs.data_ - rhs.data_);
+}
+template <typename DType>
+inline Packet<DType, kPlain> operator*(const Packet<DType, kPlain> &lhs,
+                                       const Packet<DType, kPlain> &rhs) {
+  return Packet<DType, kPlain>(lhs.data_ * rhs.data_);
+}
+template <typename DType>
+inline Packet<DType, kPlain> operator/(const Packet<DType, kPlain> &lhs,
+                                       const Packet<DType, kPlain> &rhs) {
+  return Packet<DType, kPlain>(lhs.data_ / rhs.data_);
+}
+
+// a * b + c
+template <typename DType>
+inline Packet<DType, kPlain> FMA(const Packet<DType, kPlain> &a,
+                                 const Packet<DType, kPlain> &b,
+                                 const Packet<DType, kPlain> &c) {
+  return Packet<DType, kPlain>(a.data_ * b.data_ + c.data_);
+}
+
+// elementwise maximum
+template <typename DType>
+inline Packet<DType, kPlain> Max(const Packet<DType, kPlain> &lhs,
+                                 const Packet<DType, kPlain> &rhs) {
+  return Packet<DType, kPlain>(lhs.data_ > rhs.data_ ? lhs.data_ : rhs.data_);
+}
+
+// elementwise minimum
+template <typename DType>
+inline Packet<DType, kPlain> Min(const Packet<DType, kPlain> &lhs,
+                                 const Packet<DType, kPlain> &rhs) {
+  return Packet<DType, kPlain>(rhs.data_ < lhs.data_ ? rhs.data_ : lhs.data_);
+}
+
+// a 1x1 block is its own transpose
+template <typename DType> inline void Transpose(Packet<DType, kPlain> *) {}
+
+} // namespace packet
+} // namespace lmlib
+
+#endif // LMLIB_PACKET_PLAIN_HPP_
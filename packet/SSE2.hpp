@@ -0,0 +1,145 @@
+#ifndef LMLIB_PACKET_SSE2_HPP_
+#define LMLIB_PACKET_SSE2_HPP_
+
+#include "../LMBase.hpp"
+
+#if LMLIB_USE_SSE
+#include <emmintrin.h>
+
+namespace lmlib {
+namespace packet {
+
+template <> struct Packet<float, kSSE2> {
+  static const index_t kSize = 4;
+  __m128 data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m128 data) : data_(data) {}
+
+  inline static Packet<float, kSSE2> Fill(float s) {
+    return Packet<float, kSSE2>(_mm_set1_ps(s));
+  }
+  inline static Packet<float, kSSE2> Load(const float *src) {
+    return Packet<float, kSSE2>(_mm_loadu_ps(src));
+  }
+  // kSize int32 converted to float
+  inline static Packet<float, kSSE2> Convert(const int32_t *src) {
+    return Packet<float, kSSE2>(_mm_cvtepi32_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src))));
+  }
+  inline void Store(float *dst) const { _mm_storeu_ps(dst, data_); }
+  inline float Sum() const {
+    __m128 t = _mm_add_ps(data_, _mm_movehl_ps(data_, data_));
+    t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+    return _mm_cvtss_f32(t);
+  }
+};
+
+inline Packet<float, kSSE2> operator+(const Packet<float, kSSE2> &lhs,
+                                      const Packet<float, kSSE2> &rhs) {
+  return Packet<float, kSSE2>(_mm_add_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kSSE2> operator-(const Packet<float, kSSE2> &lhs,
+                                      const Packet<float, kSSE2> &rhs) {
+  return Packet<float, kSSE2>(_mm_sub_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kSSE2> operator*(const Packet<float, kSSE2> &lhs,
+                                      const Packet<float, kSSE2> &rhs) {
+  return Packet<float, kSSE2>(_mm_mul_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kSSE2> operator/(const Packet<float, kSSE2> &lhs,
+                                      const Packet<float, kSSE2> &rhs) {
+  return Packet<float, kSSE2>(_mm_div_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kSSE2> FMA(const Packet<float, kSSE2> &a,
+                                const Packet<float, kSSE2> &b,
+                                const Packet<float, kSSE2> &c) {
+  return a * b + c;
+}
+inline Packet<float, kSSE2> Max(const Packet<float, kSSE2> &lhs,
+                                const Packet<float, kSSE2> &rhs) {
+  return Packet<float, kSSE2>(_mm_max_ps(lhs.data_, rhs.data_));
+}
+inline Packet<float, kSSE2> Min(const Packet<float, kSSE2> &lhs,
+                                const Packet<float, kSSE2> &rhs) {
+  return Packet<float, kSSE2>(_mm_min_ps(lhs.data_, rhs.data_));
+}
+
+template <> struct Packet<double, kSSE2> {
+  static const index_t kSize = 2;
+  __m128d data_;
+
+  inline Packet() {}
+  inline explicit Packet(__m128d data) : data_(data) {}
+
+  inline static Packet<double, kSSE2> Fill(double s) {
+    return Packet<double, kSSE2>(_mm_set1_pd(s));
+  }
+  inline static Packet<double, kSSE2> Load(const double *src) {
+    return Packet<double, kSSE2>(_mm_loadu_pd(src));
+  }
+  // kSize int32 converted to double
+  inline static Packet<double, kSSE2> Convert(const int32_t *src) {
+    return Packet<double, kSSE2>(_mm_cvtepi32_pd(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src))));
+  }
+  inline void Store(double *dst) const { _mm_storeu_pd(dst, data_); }
+  inline double Sum() const {
+    __m128d t = _mm_add_sd(data_, _mm_unpackhi_pd(data_, data_));
+    return _mm_cvtsd_f64(t);
+  }
+};
+
+inline Packet<double, kSSE2> operator+(const Packet<double, kSSE2> &lhs,
+                                       const Packet<double, kSSE2> &rhs) {
+  return Packet<double, kSSE2>(_mm_add_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kSSE2> operator-(const Packet<double, kSSE2> &lhs,
+                                       const Packet<double, kSSE2> &rhs) {
+  return Packet<double, kSSE2>(_mm_sub_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kSSE2> operator*(const Packet<double, kSSE2> &lhs,
+                                       const Packet<double, kSSE2> &rhs) {
+  return Packet<double, kSSE2>(_mm_mul_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kSSE2> operator/(const Packet<double, kSSE2> &lhs,
+                                       const Packet<double, kSSE2> &rhs) {
+  return Packet<double, kSSE2>(_mm_div_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kSSE2> FMA(const Packet<double, kSSE2> &a,
+                                 const Packet<double, kSSE2> &b,
+                                 const Packet<double, kSSE2> &c) {
+  return a * b + c;
+}
+inline Packet<double, kSSE2> Max(const Packet<double, kSSE2> &lhs,
+                                 const Packet<double, kSSE2> &rhs) {
+  return Packet<double, kSSE2>(_mm_max_pd(lhs.data_, rhs.data_));
+}
+inline Packet<double, kSSE2> Min(const Packet<double, kSSE2> &lhs,
+                                 const Packet<double, kSSE2> &rhs) {
+  return Packet<double, kSSE2>(_mm_min_pd(lhs.data_, rhs.data_));
+}
+
+// transpose the 4x4 or 2x2 block held in row[0..kSize) in registers
+inline void Transpose(Packet<float, kSSE2> *row) {
+  _MM_TRANSPOSE4_PS(row[0].data_, row[1].data_, row[2].data_, row[3].data_);
+}
+inline void Transpose(Packet<double, kSSE2> *row) {
+  const __m128d t0 = _mm_unpacklo_pd(row[0].data_, row[1].data_);
+  row[1].data_ = _mm_unpackhi_pd(row[0].data_, row[1].data_);
+  row[0].data_ = t0;
+}
+
+// the doubles of lo and hi as one packet of floats
+inline Packet<float, kSSE2> Narrow(const Packet<double, kSSE2> &lo,
+                                   const Packet<double, kSSE2> &hi) {
+  return Packet<float, kSSE2>(
+      _mm_movelh_ps(_mm_cvtpd_ps(lo.data_), _mm_cvtpd_ps(hi.data_)));
+}
+
+} // namespace packet
+} // namespace lmlib
+
+#endif // LMLIB_USE_SSE
+
+#endif // LMLIB_PACKET_SSE2_HPP_
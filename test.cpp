@@ -1,9 +1,13 @@
 #include <cassert>
+#include <cmath>
 #include <iostream>
+#include <sstream>
+#include <type_traits>
+#include <vector>
 
 using namespace std;
 
-#include "Shape.hpp"
+#include "lmlib.h"
 
 using namespace lmlib;
 
@@ -30,4 +34,1320 @@ void unittest_shape() {
   cout << "unittest_shape complete.\n";
 }
 
-int main() { unittest_shape(); }
+void unittest_mapexp() {
+  // 13 columns leaves a scalar tail after every packet width
+  const index_t nrow = 5, ncol = 13;
+  std::vector<float> da(nrow * ncol), db(nrow * ncol), dc(nrow * ncol);
+  for (index_t i = 0; i < nrow * ncol; i++) {
+    da[i] = float(i % 7);
+    db[i] = float(1 + i % 5);
+  }
+  Tensor<2, float> a(da.data(), Shape2(nrow, ncol));
+  Tensor<2, float> b(db.data(), Shape2(nrow, ncol));
+  Tensor<2, float> c(dc.data(), Shape2(nrow, ncol));
+  c = a * b + expr::scalar(2.0f);
+  c += a / b;
+  c -= 1.0f;
+  for (index_t i = 0; i < nrow * ncol; i++) {
+    assert(std::fabs(dc[i] - (da[i] * db[i] + 1.0f + da[i] / db[i])) < 1e-4f);
+  }
+  std::vector<int> di(ncol);
+  Tensor<1, int> v(di.data(), Shape1(ncol));
+  v = 3;
+  v += v * v;
+  assert(di[ncol - 1] == 12);
+  cout << "unittest_mapexp complete.\n";
+}
+
+void unittest_parallel_mapexp() {
+  Stream stream(4);
+  stream.SetGrainSize(16);
+  for (index_t nrow : {1, 3, 64}) {
+    const index_t ncol = 1001;
+    std::vector<float> da(nrow * ncol), dc(nrow * ncol, 1.0f);
+    for (index_t i = 0; i < nrow * ncol; i++)
+      da[i] = float(i % 100);
+    Tensor<2, float> a(da.data(), Shape2(nrow, ncol));
+    Tensor<2, float> c(dc.data(), Shape2(nrow, ncol), &stream);
+    c += a * a;
+    stream.Wait();
+    for (index_t i = 0; i < nrow * ncol; i++)
+      assert(dc[i] == 1.0f + da[i] * da[i]);
+  }
+  cout << "unittest_parallel_mapexp complete.\n";
+}
+
+void unittest_stream() {
+  Stream *producer = NewStream(), *consumer = NewStream();
+  const index_t n = 100000;
+  std::vector<double> da(n), db(n), dc(n);
+  Tensor<1, double> a(da.data(), Shape1(n), producer);
+  Tensor<1, double> b(db.data(), Shape1(n), consumer);
+  Tensor<1, double> c(dc.data(), Shape1(n), consumer);
+  a = 2.0;
+  a *= a;
+  Event ready;
+  ready.Record(producer);
+  ready.StreamWait(consumer);
+  Copy(b, a, consumer);
+  c = b + expr::scalar(1.0);
+  consumer->Wait();
+  producer->Wait();
+  assert(ready.Query() && producer->CheckIdle() && consumer->CheckIdle());
+  assert(db[n - 1] == 4.0 && dc[0] == 5.0);
+  DeleteStream(producer);
+  DeleteStream(consumer);
+  cout << "unittest_stream complete.\n";
+}
+
+// reference op(A) * op(B) for row major A (m x k or k x m), B (k x n or n x k)
+template <typename DType>
+DType naive_dot(const std::vector<DType> &da, const std::vector<DType> &db,
+                index_t m, index_t n, index_t k, bool ta, bool tb, index_t i,
+                index_t j) {
+  DType ret = 0;
+  for (index_t p = 0; p < k; p++)
+    ret += (ta ? da[p * m + i] : da[i * k + p]) *
+           (tb ? db[j * k + p] : db[p * n + j]);
+  return ret;
+}
+
+void unittest_dot() {
+  // sizes that are not multiples of the register tile or the cache blocks
+  const index_t m = 37, n = 51, k = 300;
+  std::vector<double> da(m * k), db(k * n), dc(m * n);
+  for (index_t i = 0; i < m * k; i++)
+    da[i] = double(i % 13) - 6;
+  for (index_t i = 0; i < k * n; i++)
+    db[i] = double(i % 7) - 3;
+  Tensor<2, double> c(dc.data(), Shape2(m, n));
+  for (int t = 0; t < 4; t++) {
+    const bool ta = (t & 1) != 0, tb = (t & 2) != 0;
+    Tensor<2, double> a(da.data(), ta ? Shape2(k, m) : Shape2(m, k));
+    Tensor<2, double> b(db.data(), tb ? Shape2(n, k) : Shape2(k, n));
+    if (!ta && !tb)
+      c = dot(a, b);
+    if (!ta && tb)
+      c = dot(a, b.T());
+    if (ta && !tb)
+      c = dot(a.T(), b);
+    if (ta && tb)
+      c = dot(a.T(), b.T());
+    for (index_t i = 0; i < m; i++) {
+      for (index_t j = 0; j < n; j++)
+        assert(dc[i * n + j] == naive_dot(da, db, m, n, k, ta, tb, i, j));
+    }
+  }
+  // accumulate into dst, scalars fold into the dot
+  Tensor<2, double> a(da.data(), Shape2(m, k)), b(db.data(), Shape2(k, n));
+  c = 1.0;
+  c += dot(a, b);
+  c -= dot(a, b) * 3.0;
+  c += expr::scalar(0.5) * dot(a, b);
+  for (index_t i = 0; i < m; i++) {
+    for (index_t j = 0; j < n; j++)
+      assert(dc[i * n + j] ==
+             1.0 - 1.5 * naive_dot(da, db, m, n, k, false, false, i, j));
+  }
+  cout << "unittest_dot complete.\n";
+}
+
+void unittest_batch_dot() {
+  Stream stream(3);
+  const index_t nbatch = 5, m = 7, n = 9, k = 11;
+  std::vector<float> da(nbatch * m * k), db(k * n), dc(nbatch * m * n);
+  for (index_t i = 0; i < nbatch * m * k; i++)
+    da[i] = float(i % 5);
+  for (index_t i = 0; i < k * n; i++)
+    db[i] = float(i % 3);
+  Tensor<3, float> a(da.data(), Shape3(nbatch, m, k));
+  Tensor<3, float> c(dc.data(), Shape3(nbatch, m, n), &stream);
+  // the same b for every batch without copying it
+  Tensor<2, float> b(db.data(), Shape2(k, n));
+  c = expr::batch_dot<false, false>(a, b);
+  stream.Wait();
+  for (index_t t = 0; t < nbatch; t++) {
+    std::vector<float> dat(da.begin() + t * m * k,
+                           da.begin() + (t + 1) * m * k);
+    for (index_t i = 0; i < m; i++) {
+      for (index_t j = 0; j < n; j++)
+        assert(dc[(t * m + i) * n + j] ==
+               naive_dot(dat, db, m, n, k, false, false, i, j));
+    }
+  }
+  // per batch rhs, transposed
+  std::vector<float> dbt(nbatch * n * k);
+  for (index_t i = 0; i < nbatch * n * k; i++)
+    dbt[i] = float(i % 7);
+  Tensor<3, float> bt(dbt.data(), Shape3(nbatch, n, k));
+  c = expr::batch_dot<false, true>(a, bt);
+  stream.Wait();
+  for (index_t t = 0; t < nbatch; t++) {
+    std::vector<float> dat(da.begin() + t * m * k,
+                           da.begin() + (t + 1) * m * k);
+    std::vector<float> dbtt(dbt.begin() + t * n * k,
+                            dbt.begin() + (t + 1) * n * k);
+    for (index_t i = 0; i < m; i++) {
+      for (index_t j = 0; j < n; j++)
+        assert(dc[(t * m + i) * n + j] ==
+               naive_dot(dat, dbtt, m, n, k, false, true, i, j));
+    }
+  }
+  cout << "unittest_batch_dot complete.\n";
+}
+
+void unittest_conv2d() {
+  Stream stream(2);
+  const index_t nbatch = 3, nchan = 4, h = 11, w = 13, nfilter = 5, r = 3,
+                s = 2;
+  const index_t stride = 2, pad = 1, dilate = 2;
+  const index_t oh = (h + 2 * pad - dilate * (r - 1) - 1) / stride + 1;
+  const index_t ow = (w + 2 * pad - dilate * (s - 1) - 1) / stride + 1;
+  std::vector<float> dx(nbatch * nchan * h * w), dw(nfilter * nchan * r * s);
+  std::vector<float> dy(nbatch * nfilter * oh * ow, 1.0f);
+  for (index_t i = 0; i < index_t(dx.size()); i++)
+    dx[i] = float(i % 7);
+  for (index_t i = 0; i < index_t(dw.size()); i++)
+    dw[i] = float(i % 5) - 2.0f;
+  Tensor<4, float> x(dx.data(), Shape4(nbatch, nchan, h, w));
+  Tensor<4, float> wt(dw.data(), Shape4(nfilter, nchan, r, s));
+  Tensor<4, float> y(dy.data(), Shape4(nbatch, nfilter, oh, ow), &stream);
+  y += expr::conv2d(x, wt, stride, pad, dilate) * 2.0f;
+  stream.Wait();
+  for (index_t n = 0; n < nbatch; n++) {
+    for (index_t f = 0; f < nfilter; f++) {
+      for (index_t i = 0; i < oh; i++) {
+        for (index_t j = 0; j < ow; j++) {
+          float sum = 0.0f;
+          for (index_t c = 0; c < nchan; c++) {
+            for (index_t p = 0; p < r; p++) {
+              for (index_t q = 0; q < s; q++) {
+                index_t yy = i * stride + p * dilate - pad;
+                index_t xx = j * stride + q * dilate - pad;
+                if (yy < 0 || yy >= h || xx < 0 || xx >= w)
+                  continue;
+                sum += dx[((n * nchan + c) * h + yy) * w + xx] *
+                       dw[((f * nchan + c) * r + p) * s + q];
+              }
+            }
+          }
+          assert(dy[((n * nfilter + f) * oh + i) * ow + j] == 1.0f + 2 * sum);
+        }
+      }
+    }
+  }
+  cout << "unittest_conv2d complete.\n";
+}
+
+void unittest_broadcast() {
+  const index_t n = 2, c = 3, h = 4, w = 37;
+  std::vector<float> dx(n * c * h * w), dy(n * c * h * w), dbc(c), dbw(w);
+  for (index_t i = 0; i < n * c * h * w; i++)
+    dx[i] = float(i % 11);
+  for (index_t i = 0; i < c; i++)
+    dbc[i] = float(i + 1) * 100.0f;
+  for (index_t i = 0; i < w; i++)
+    dbw[i] = float(i) * 1000.0f;
+  Shape<4> shape = Shape4(n, c, h, w);
+  Tensor<4, float> x(dx.data(), shape), y(dy.data(), shape);
+  Tensor<1, float> bc(dbc.data(), Shape1(c)), bw(dbw.data(), Shape1(w));
+  y = x + expr::broadcast<1>(bc, shape) + expr::broadcast<3>(bw, shape);
+  for (index_t i = 0; i < n * c * h * w; i++) {
+    index_t ic = i / (h * w) % c, iw = i % w;
+    assert(dy[i] == dx[i] + dbc[ic] + dbw[iw]);
+  }
+  // the leading dimension, and a non-packet saver
+  std::vector<float> dbn(n);
+  for (index_t i = 0; i < n; i++)
+    dbn[i] = float(i + 2);
+  Tensor<1, float> bn(dbn.data(), Shape1(n));
+  y *= expr::broadcast<0>(bn, shape);
+  for (index_t i = 0; i < n * c * h * w; i++) {
+    index_t in = i / (c * h * w), ic = i / (h * w) % c, iw = i % w;
+    assert(dy[i] == (dx[i] + dbc[ic] + dbw[iw]) * dbn[in]);
+  }
+  cout << "unittest_broadcast complete.\n";
+}
+
+void unittest_reduce() {
+  Stream stream(3);
+  const index_t n = 3, c = 5, h = 70, w = 37;
+  std::vector<float> dx(n * c * h * w);
+  for (index_t i = 0; i < n * c * h * w; i++)
+    dx[i] = float(i % 13) - 6.0f;
+  Tensor<4, float> x(dx.data(), Shape4(n, c, h, w));
+  std::vector<float> dcol(w, 1.0f), dchan(c), dmax(n), dmean(c);
+  Tensor<1, float> col(dcol.data(), Shape1(w), &stream);
+  Tensor<1, float> chan(dchan.data(), Shape1(c), &stream);
+  Tensor<1, float> vmax(dmax.data(), Shape1(n), &stream);
+  Tensor<1, float> vmean(dmean.data(), Shape1(c), &stream);
+  col += expr::sum_rows(x * x);
+  chan = expr::sumall_except_dim<1>(x);
+  vmax = expr::reduce_max<0>(x);
+  vmean = expr::mean<1>(x);
+  stream.Wait();
+  for (index_t j = 0; j < w; j++) {
+    float sum = 1.0f;
+    for (index_t i = 0; i < n * c * h; i++)
+      sum += dx[i * w + j] * dx[i * w + j];
+    assert(dcol[j] == sum);
+  }
+  for (index_t k = 0; k < c; k++) {
+    float sum = 0.0f;
+    for (index_t i = 0; i < n * c * h * w; i++) {
+      if (i / (h * w) % c == k)
+        sum += dx[i];
+    }
+    assert(dchan[k] == sum);
+    assert(std::fabs(dmean[k] - sum / float(n * h * w)) < 1e-5f);
+  }
+  for (index_t k = 0; k < n; k++) {
+    float vm = dx[k * c * h * w];
+    for (index_t i = k * c * h * w; i < (k + 1) * c * h * w; i++)
+      vm = std::max(vm, dx[i]);
+    assert(dmax[k] == vm);
+  }
+  cout << "unittest_reduce complete.\n";
+}
+
+void unittest_alloc() {
+  PoolAllocator pool;
+  {
+    AllocatorScope scope(&pool);
+    Tensor<2, float> a = NewTensor(Shape2(5, 7), 3.0f);
+    assert(a.stride_ == 16);
+    assert(size_t(a.dptr_) % kAllocAlign == 0);
+    for (index_t i = 0; i < 5; i++) {
+      for (index_t j = 0; j < 7; j++)
+        assert(a.dptr_[i * a.stride_ + j] == 3.0f);
+    }
+    Tensor<2, float> b = NewTensor(Shape2(5, 7), 0.0f, false);
+    assert(b.stride_ == 7);
+    assert(pool.Stats().live_bytes > 0);
+    float *dptr = a.dptr_;
+    FreeSpace(&a);
+    // the same size class comes back from the pool
+    Tensor<2, float> c = NewTensor(Shape2(5, 7), 1.0f);
+    assert(c.dptr_ == dptr);
+    FreeSpace(&b);
+    FreeSpace(&c);
+  }
+  AllocStats stats = pool.Stats();
+  assert(stats.live_bytes == 0 && stats.peak_bytes > 0);
+  assert(stats.num_backing_alloc == 2 && stats.cached_bytes > 0);
+  pool.Trim();
+  assert(pool.Stats().cached_bytes == 0);
+
+  // per iteration scratch tensors
+  Arena arena(1 << 12);
+  float *prev = nullptr;
+  for (int iter = 0; iter < 3; iter++) {
+    ArenaScope scope(&arena);
+    Tensor<1, float> x = NewTensor(Shape1(1000), 1.0f);
+    Tensor<3, float> y = NewTensor(Shape3(4, 5, 100), 2.0f);
+    assert(y.dptr_[0] == 2.0f);
+    // the two chunks of the first iteration are merged into one
+    if (iter == 2)
+      assert(x.dptr_ == prev);
+    prev = x.dptr_;
+    FreeSpace(&x);
+  }
+  assert(arena.Stats().num_backing_alloc == 2);
+  assert(arena.Stats().live_bytes == 0 && arena.Stats().peak_bytes > 0);
+  cout << "unittest_alloc complete.\n";
+}
+
+void unittest_pitch() {
+  size_t pitch;
+  char *small = static_cast<char *>(packet::AlignedMallocPitch(&pitch, 100, 3));
+  assert(pitch == 128 && size_t(small) % 64 == 0);
+  packet::AlignedFreePages(small, pitch * 3);
+
+  // big buffers are huge page aligned and first touched by the pool
+  ThreadPool pool(4);
+  packet::PagePolicy policy;
+  for (int mode = 0; mode < 3; mode++) {
+    policy.huge_page = packet::HugePageMode(mode);
+    policy.numa = mode == 1 ? packet::kNumaInterleave : packet::kNumaLocal;
+    const size_t nline = mode == 2 ? 2 : 1000;
+    const size_t lspace = (size_t(5) << 20) / nline + 4;
+    float *big = static_cast<float *>(
+        packet::AlignedMallocPitch(&pitch, lspace, nline, &pool, policy));
+    assert(pitch % 64 == 0 && pitch >= lspace && pitch < lspace + 64);
+    assert(size_t(big) % packet::kHugePageSize == 0);
+    const size_t n = pitch * nline / sizeof(float);
+    for (size_t i = 0; i < n; i++)
+      big[i] = float(i % 7);
+    assert(big[n - 1] == float((n - 1) % 7));
+    packet::AlignedFreePages(big, pitch * nline);
+  }
+
+  // the system allocator maps big blocks the same way
+  Tensor<2, float> a = NewTensor(Shape2(1024, 1025), 1.0f);
+  assert(a.stride_ == 1040 && a.dptr_[1023 * 1040 + 1024] == 1.0f);
+  FreeSpace(&a);
+  cout << "unittest_pitch complete.\n";
+}
+
+// sorts keys by SortByKey and by std::stable_sort and compares
+template <typename KDType>
+void check_sort_by_key(std::vector<KDType> dk, bool is_ascend,
+                       Stream *stream) {
+  const index_t n = index_t(dk.size());
+  std::vector<int> dv(n);
+  std::vector<std::pair<KDType, int> > ref(n);
+  for (index_t i = 0; i < n; i++) {
+    dv[i] = int(i);
+    ref[i] = std::make_pair(dk[i], int(i));
+  }
+  std::stable_sort(ref.begin(), ref.end(),
+                   [=](const std::pair<KDType, int> &a,
+                       const std::pair<KDType, int> &b) {
+                     return is_ascend ? a.first < b.first : b.first < a.first;
+                   });
+  Tensor<1, KDType> keys(dk.data(), Shape1(n), stream);
+  Tensor<1, int> values(dv.data(), Shape1(n), stream);
+  SortByKey(keys, values, is_ascend);
+  if (stream != nullptr)
+    stream->Wait();
+  for (index_t i = 0; i < n; i++)
+    assert(dk[i] == ref[i].first && dv[i] == ref[i].second);
+}
+
+void unittest_sort() {
+  Stream stream(3);
+  uint32_t seed = 1;
+  std::vector<float> fk(100000);
+  std::vector<int> ik(100000);
+  std::vector<uint64_t> uk(3000);
+  for (size_t i = 0; i < fk.size(); i++) {
+    seed = seed * 1664525u + 1013904223u;
+    fk[i] = float(int(seed >> 8) % 20001 - 10000) * 0.25f;
+    ik[i] = int(seed) >> 12;
+  }
+  for (size_t i = 0; i < uk.size(); i++)
+    uk[i] = uint64_t(i % 37) << 40 | (i % 5);
+  for (int ascend = 0; ascend < 2; ascend++) {
+    check_sort_by_key(fk, ascend != 0, &stream);
+    check_sort_by_key(ik, ascend != 0, &stream);
+    check_sort_by_key(uk, ascend != 0, nullptr);
+    // small inputs take the comparison sort
+    check_sort_by_key(std::vector<double>(fk.begin(), fk.begin() + 500),
+                      ascend != 0, nullptr);
+  }
+  cout << "unittest_sort complete.\n";
+}
+
+void unittest_segment_sort() {
+  Stream stream(3);
+  uint32_t seed = 7;
+  std::vector<float> dv;
+  std::vector<int> ds;
+  // short segments of 1 to 200 values, then two that take the merge path
+  for (int seg = 0; seg < 2000; seg++) {
+    seed = seed * 1664525u + 1013904223u;
+    const int len = seg < 1998 ? int(seed >> 8) % 200 + 1 : 70001 + seg;
+    for (int i = 0; i < len; i++) {
+      seed = seed * 1664525u + 1013904223u;
+      dv.push_back(float(int(seed >> 8) % 2001 - 1000) * 0.5f);
+      ds.push_back(seg * 3);
+    }
+  }
+  std::vector<float> ref = dv;
+  std::vector<int> dsi(dv.size());
+  for (size_t i = 0; i < dv.size(); i++)
+    dsi[i] = int(dv[i] * 2.0f);
+  std::vector<int> refi = dsi;
+  for (size_t b = 0, e; b < ds.size(); b = e) {
+    for (e = b; e < ds.size() && ds[e] == ds[b]; e++) {
+    }
+    std::stable_sort(ref.begin() + b, ref.begin() + e);
+    std::stable_sort(refi.begin() + b, refi.begin() + e);
+  }
+  const Shape<1> shape = Shape1(index_t(dv.size()));
+  VectorizedSort(Tensor<1, float>(dv.data(), shape, &stream),
+                 Tensor<1, int>(ds.data(), shape, &stream));
+  stream.Wait();
+  VectorizedSort(Tensor<1, int>(dsi.data(), shape),
+                 Tensor<1, int>(ds.data(), shape));
+  for (size_t i = 0; i < dv.size(); i++) {
+    assert(dv[i] == ref[i] && dsi[i] == refi[i]);
+    assert(i == 0 || ds[i] >= ds[i - 1]);
+  }
+  // doubles take the 64 bit key lanes, each segment starts out descending
+  std::vector<double> dd(dv.size());
+  for (size_t i = 0; i < dv.size(); i++)
+    dd[i] = -double(dv[i]) / 3.0;
+  std::vector<double> refd = dd;
+  for (size_t b = 0, e; b < ds.size(); b = e) {
+    for (e = b; e < ds.size() && ds[e] == ds[b]; e++) {
+    }
+    std::stable_sort(refd.begin() + b, refd.begin() + e);
+  }
+  VectorizedSort(Tensor<1, double>(dd.data(), shape),
+                 Tensor<1, int>(ds.data(), shape));
+  for (size_t i = 0; i < dd.size(); i++)
+    assert(dd[i] == refd[i]);
+  cout << "unittest_segment_sort complete.\n";
+}
+
+void unittest_gather() {
+  Stream stream(3);
+  const index_t nrow = 300, ncol = 129, n = 500;
+  std::vector<float> dtable(nrow * ncol), dsrc(n * ncol);
+  std::vector<float> dtake(n * ncol), dfill(nrow * ncol, -1.0f);
+  std::vector<int> didx(n);
+  for (index_t i = 0; i < nrow * ncol; i++)
+    dtable[i] = float(i);
+  for (index_t i = 0; i < n * ncol; i++)
+    dsrc[i] = float(i % 1000);
+  for (index_t i = 0; i < n; i++)
+    didx[i] = int(i * 37 % nrow);
+  didx[3] = -5;
+  didx[4] = nrow + 7;
+  Tensor<2, float> table(dtable.data(), Shape2(nrow, ncol));
+  Tensor<2, float> src(dsrc.data(), Shape2(n, ncol));
+  Tensor<1, int> idx(didx.data(), Shape1(n));
+  Tensor<2, float> out(dtake.data(), Shape2(n, ncol), &stream);
+  // gathered rows feed the map directly, out of range rows are clipped
+  out = expr::take(table, idx) * expr::scalar(2.0f) + expr::scalar(1.0f);
+  stream.Wait();
+  for (index_t i = 0; i < n; i++) {
+    const index_t row = i == 3 ? 0 : (i == 4 ? nrow - 1 : didx[i]);
+    for (index_t j = 0; j < ncol; j++)
+      assert(dtake[i * ncol + j] == dtable[row * ncol + j] * 2.0f + 1.0f);
+  }
+  // scatter, the last of the repeated rows wins
+  didx[3] = 1;
+  didx[4] = 2;
+  for (int pass = 0; pass < 2; pass++) {
+    Tensor<2, float> fill(dfill.data(), Shape2(nrow, ncol),
+                          pass == 0 ? nullptr : &stream);
+    IndexFill(fill, idx, src);
+    stream.Wait();
+    std::vector<index_t> last(nrow, -1);
+    for (index_t i = 0; i < n; i++)
+      last[didx[i]] = i;
+    for (index_t r = 0; r < nrow; r++) {
+      for (index_t j = 0; j < ncol; j++) {
+        const float want = last[r] < 0 ? -1.0f : dsrc[last[r] * ncol + j];
+        assert(dfill[r * ncol + j] == want);
+      }
+    }
+  }
+  cout << "unittest_gather complete.\n";
+}
+
+void unittest_copy() {
+  Stream stream(3);
+  // small and big contiguous copies, pitched rows, and two long pitched rows
+  // that get cut into pieces; the big ones take the streaming stores
+  const index_t rows[4] = {3, 2000, 1500, 2};
+  const index_t cols[4] = {5, 1000, 1001, 1500001};
+  const index_t pads[4] = {0, 0, 15, 3};
+  for (int t = 0; t < 4; t++) {
+    const index_t stride = cols[t] + pads[t];
+    std::vector<float> da(rows[t] * stride), db(rows[t] * stride, -1.0f);
+    for (size_t i = 0; i < da.size(); i++)
+      da[i] = float(i % 4099);
+    Tensor<2, float> a(da.data(), Shape2(rows[t], cols[t]), stride, nullptr);
+    Tensor<2, float> b(db.data(), Shape2(rows[t], cols[t]), stride, nullptr);
+    Copy(b, a, t % 2 == 0 ? nullptr : &stream);
+    stream.Wait();
+    for (index_t i = 0; i < rows[t]; i++) {
+      for (index_t j = 0; j < stride; j++) {
+        const float want = j < cols[t] ? da[i * stride + j] : -1.0f;
+        assert(db[i * stride + j] == want);
+      }
+    }
+  }
+  std::vector<double> dx(2 * 3 * 4, 1.5), dy(2 * 3 * 4);
+  Copy(Tensor<3, double>(dy.data(), Shape3(2, 3, 4)),
+       Tensor<3, double>(dx.data(), Shape3(2, 3, 4)), &stream);
+  stream.Wait();
+  assert(dy == dx);
+  cout << "unittest_copy complete.\n";
+}
+
+template <typename DType> void check_transpose(index_t m, index_t n) {
+  Stream stream(3);
+  std::vector<DType> da(m * n), db(n * m), dc(n * m, DType(1)), dd(n * m);
+  for (index_t i = 0; i < m * n; i++) {
+    da[i] = DType(i);
+    db[i] = DType(i % 7);
+  }
+  Tensor<2, DType> a(da.data(), Shape2(m, n));
+  Tensor<2, DType> b(db.data(), Shape2(n, m));
+  Tensor<2, DType> c(dc.data(), Shape2(n, m), &stream);
+  Tensor<2, DType> d(dd.data(), Shape2(n, m));
+  c += a.T();
+  // a transpose inside a fused map
+  d = a.T() * b + expr::scalar(DType(2));
+  stream.Wait();
+  for (index_t i = 0; i < n; i++) {
+    for (index_t j = 0; j < m; j++) {
+      assert(dc[i * m + j] == da[j * n + i] + DType(1));
+      assert(dd[i * m + j] == da[j * n + i] * db[i * m + j] + DType(2));
+    }
+  }
+}
+
+void unittest_transpose() {
+  check_transpose<float>(67, 45);
+  check_transpose<float>(256, 3);
+  check_transpose<double>(41, 70);
+  check_transpose<int>(9, 13);
+  cout << "unittest_transpose complete.\n";
+}
+
+// an optimizer step run eagerly and then deferred, with the intermediate in
+// a tensor or a temp of the scope
+template <int dim>
+void check_fusion(const Shape<dim> &shape, Stream *stream, bool temp) {
+  const index_t n = shape.Size();
+  std::vector<float> dg(n), dw(n), dm(n, 0.5f), dt(n);
+  for (index_t i = 0; i < n; i++) {
+    dg[i] = float(i % 13) - 6.0f;
+    dw[i] = float(i % 7) * 0.25f;
+  }
+  std::vector<float> ew(dw), em(dm), et(n);
+  Tensor<dim, float> g(dg.data(), shape, stream);
+  Tensor<dim, float> w(dw.data(), shape, stream);
+  Tensor<dim, float> m(dm.data(), shape, stream);
+  {
+    Tensor<dim, float> w2(ew.data(), shape), m2(em.data(), shape);
+    Tensor<dim, float> t2(et.data(), shape);
+    t2 = g + expr::scalar(0.1f) * w2;
+    m2 = expr::scalar(0.9f) * m2 + expr::scalar(0.1f) * t2;
+    w2 -= expr::scalar(0.5f) * m2;
+  }
+  {
+    FusionScope scope(stream);
+    Tensor<dim, float> t = temp ? scope.Temp<float>(shape)
+                                : Tensor<dim, float>(dt.data(), shape, stream);
+    t = g + expr::scalar(0.1f) * w;
+    m = expr::scalar(0.9f) * m + expr::scalar(0.1f) * t;
+    w -= expr::scalar(0.5f) * m;
+  }
+  if (stream != nullptr)
+    stream->Wait();
+  for (index_t i = 0; i < n; i++) {
+    assert(std::abs(dw[i] - ew[i]) < 1e-5f);
+    assert(std::abs(dm[i] - em[i]) < 1e-5f);
+    if (!temp)
+      assert(std::abs(dt[i] - et[i]) < 1e-5f);
+  }
+}
+
+void unittest_fusion() {
+  Stream stream(3);
+  for (int temp = 0; temp < 2; temp++) {
+    check_fusion(Shape1(5), nullptr, temp != 0);
+    check_fusion(Shape1(100003), &stream, temp != 0);
+    check_fusion(Shape2(300, 517), &stream, temp != 0);
+    check_fusion(Shape3(7, 33, 65), nullptr, temp != 0);
+  }
+  // a read of a pending target at another offset, and a transpose, which is
+  // not elementwise, both run the pending statements first
+  const index_t n = 5000;
+  std::vector<float> da(n + 1, 0.0f), db(n + 1), dc(n);
+  for (index_t i = 0; i <= n; i++)
+    db[i] = float(i);
+  Tensor<1, float> a0(da.data(), Shape1(n)), a1(da.data() + 1, Shape1(n));
+  Tensor<1, float> b1(db.data() + 1, Shape1(n)), c(dc.data(), Shape1(n));
+  std::vector<float> dx(64 * 64), dy(64 * 64), dz(64 * 64);
+  for (index_t i = 0; i < 64 * 64; i++)
+    dx[i] = float(i);
+  Tensor<2, float> x(dx.data(), Shape2(64, 64)), y(dy.data(), Shape2(64, 64));
+  Tensor<2, float> z(dz.data(), Shape2(64, 64));
+  {
+    FusionScope scope;
+    a0 = b1 + expr::scalar(1.0f);
+    c = a1 * expr::scalar(2.0f);
+    y = x + expr::scalar(1.0f);
+    z = y.T();
+  }
+  for (index_t i = 0; i + 1 < n; i++)
+    assert(dc[i] == 2.0f * (db[i + 2] + 1.0f));
+  for (index_t i = 0; i < 64; i++) {
+    for (index_t j = 0; j < 64; j++)
+      assert(dz[i * 64 + j] == dx[j * 64 + i] + 1.0f);
+  }
+  // a tensor allocated after a temp may sit where the fake range of the temp
+  // runs on, temps never take part in the overlap checks
+  {
+    const index_t len = 20000;
+    std::vector<float> dg(len, 1.0f), dx1(len);
+    Tensor<1, float> g(dg.data(), Shape1(len)), x1(dx1.data(), Shape1(len));
+    FusionScope scope;
+    Tensor<1, float> t = scope.Temp<float>(Shape1(len));
+    std::vector<float> dm(len);
+    Tensor<1, float> m(dm.data(), Shape1(len));
+    t = g * expr::scalar(2.0f);
+    m = g + expr::scalar(1.0f);
+    x1 = t + m;
+    scope.Flush();
+    for (index_t i = 0; i < len; i++)
+      assert(dx1[i] == 4.0f);
+  }
+  cout << "unittest_fusion complete.\n";
+}
+
+void unittest_rewrite() {
+  using expr::scalar;
+  // chains of scalars and double transposes vanish while building
+  static_assert(std::is_same<decltype(scalar(2.0f) * scalar(3.0f) -
+                                      scalar(1.0f) / scalar(4.0f)),
+                             expr::ScalarExp<float>>::value,
+                "scalar chain not folded");
+  const index_t n = 1003;
+  std::vector<float> dx(n), dy(n), dz(n);
+  for (index_t i = 0; i < n; i++) {
+    dx[i] = float(i % 17) - 8.0f;
+    dy[i] = float(i % 5) * 0.5f;
+  }
+  Tensor<2, float> x(dx.data(), Shape2(17, 59)), y(dy.data(), Shape2(17, 59));
+  Tensor<2, float> z(dz.data(), Shape2(17, 59));
+  static_assert(
+      std::is_same<decltype(x.T().T()), const Tensor<2, float> &>::value,
+      "double transpose not cancelled");
+  z = scalar(2.0f) * scalar(3.0f) * x;
+  for (index_t i = 0; i < n; i++)
+    assert(dz[i] == 6.0f * dx[i]);
+  // a division by a power of two is exact as a multiply
+  z = x / scalar(4.0f);
+  for (index_t i = 0; i < n; i++)
+    assert(dz[i] == dx[i] * 0.25f);
+  z = x / scalar(3.0f);
+  for (index_t i = 0; i < n; i++)
+    assert(std::abs(dz[i] - dx[i] / 3.0f) <= 1e-6f * std::abs(dx[i]));
+  // axpy in both operand orders, and a product of scalars built with F
+  z = x * scalar(1.5f) + y;
+  for (index_t i = 0; i < n; i++)
+    assert(dz[i] == dx[i] * 1.5f + dy[i]);
+  z = scalar(0.5f) * x + y * scalar(2.0f);
+  for (index_t i = 0; i < n; i++)
+    assert(dz[i] == 0.5f * dx[i] + dy[i] * 2.0f);
+  // the scalar tail of an axpy rounds like its packets, equal inputs give
+  // equal outputs wherever they fall in a row
+  std::vector<float> ex(19, 1.0f + 1.0f / 4096.0f), ey(19, -1.0f), ez(19);
+  Tensor<1, float> vx(ex.data(), Shape1(19)), vy(ey.data(), Shape1(19));
+  Tensor<1, float> vz(ez.data(), Shape1(19));
+  vz = vx * scalar(1.0f + 1.0f / 4096.0f) + vy;
+  for (index_t i = 1; i < 19; i++)
+    assert(ez[i] == ez[0]);
+  z = expr::F<op::mul>(scalar(2.0f), scalar(3.0f)) + y;
+  for (index_t i = 0; i < n; i++)
+    assert(dz[i] == 6.0f + dy[i]);
+  // integers keep the division
+  std::vector<int> di(n), dj(n);
+  for (index_t i = 0; i < n; i++)
+    di[i] = int(i) - 500;
+  Tensor<1, int> vi(di.data(), Shape1(n)), vj(dj.data(), Shape1(n));
+  vj = vi / scalar(7);
+  for (index_t i = 0; i < n; i++)
+    assert(dj[i] == di[i] / 7);
+  // dot(a, b) / s folds into the scale
+  std::vector<double> da(6 * 4), db(4 * 5), dc(6 * 5), dd(6 * 5);
+  for (size_t i = 0; i < da.size(); i++)
+    da[i] = double(i % 5) - 2.0;
+  for (size_t i = 0; i < db.size(); i++)
+    db[i] = double(i % 3) + 1.0;
+  Tensor<2, double> a(da.data(), Shape2(6, 4)), b(db.data(), Shape2(4, 5));
+  Tensor<2, double> c(dc.data(), Shape2(6, 5)), d(dd.data(), Shape2(6, 5));
+  c = dot(a, b) / 4.0;
+  d = scalar(0.5) * dot(a, b) / scalar(2.0);
+  for (index_t i = 0; i < 6; i++) {
+    for (index_t j = 0; j < 5; j++) {
+      const double want = naive_dot(da, db, 6, 5, 4, false, false, i, j) / 4;
+      assert(dc[i * 5 + j] == want && dd[i * 5 + j] == want);
+    }
+  }
+  cout << "unittest_rewrite complete.\n";
+}
+
+template <index_t N> void check_small_inverse() {
+  SmallTensor<N, N, double> a, b, c;
+  for (index_t i = 0; i < N; i++) {
+    for (index_t j = 0; j < N; j++)
+      a(i, j) = double((i * 7 + j * 3) % 5) + (i == j ? 4.0 : 0.0);
+  }
+  b = Inverse(a);
+  c = dot(a, b);
+  for (index_t i = 0; i < N; i++) {
+    for (index_t j = 0; j < N; j++)
+      assert(std::abs(c(i, j) - (i == j ? 1.0 : 0.0)) < 1e-12);
+  }
+  assert(std::abs(Determinant(a) * Determinant(b) - 1.0) < 1e-12);
+}
+
+void unittest_small_tensor() {
+  static_assert(StaticShape<3, 4, 5>::kSize == 60, "StaticShape size");
+  assert((StaticShape<3, 4>::Get() == Shape2(3, 4)));
+  SmallTensor<3, 3, float> r = {0, -1, 0, 1, 0, 0, 0, 0, 1};
+  SmallTensor<3, 1, float> p = {1, 2, 3}, q, t = {10, 20, 30};
+  q = dot(r, p);
+  q += t;
+  assert(q(0, 0) == 8 && q(1, 0) == 21 && q(2, 0) == 33);
+  // in place transpose, scaled products with both transposes
+  SmallTensor<3, 3, float> s = r;
+  s = s.T();
+  for (index_t i = 0; i < 3; i++) {
+    for (index_t j = 0; j < 3; j++)
+      assert(s(i, j) == r(j, i));
+  }
+  SmallTensor<3, 3, float> e;
+  e = dot(r, r.T());
+  e -= dot(s.T(), s) * 2.0f;
+  for (index_t i = 0; i < 3; i++) {
+    for (index_t j = 0; j < 3; j++)
+      assert(e(i, j) == (i == j ? -1.0f : 0.0f));
+  }
+  SmallTensor<2, 3, float> m = {1, 2, 3, 4, 5, 6};
+  SmallTensor<3, 2, float> mt;
+  mt = m.T() * expr::scalar(2.0f) + expr::scalar(1.0f);
+  assert(mt(2, 1) == 13.0f && mt(0, 1) == 9.0f);
+  // a small tensor as an operand of a regular tensor
+  std::vector<float> dx(6, 1.0f);
+  Tensor<2, float> x(dx.data(), Shape2(2, 3));
+  x += m;
+  x = 0.0f;
+  x = m * m.View();
+  assert(dx[5] == 36.0f);
+  assert(Determinant(r) == 1.0f);
+  SmallTensor<5, 5, double> sing;
+  sing = 1.0;
+  assert(Determinant(sing) == 0.0);
+  check_small_inverse<2>();
+  check_small_inverse<3>();
+  check_small_inverse<4>();
+  check_small_inverse<5>();
+  cout << "unittest_small_tensor complete.\n";
+}
+
+template <typename DType> void check_interleaved(index_t nbatch, index_t n) {
+  Stream stream(3);
+  stream.SetGrainSize(64);
+  // diagonally dominant systems a x = b with a known x
+  std::vector<DType> da(nbatch * n * n), dx(nbatch * n * 2), db(nbatch * n * 2);
+  for (index_t t = 0; t < nbatch; t++) {
+    for (index_t i = 0; i < n; i++) {
+      for (index_t j = 0; j < n; j++)
+        da[(t * n + i) * n + j] = DType((t + i * 3 + j * 5) % 7) - DType(3) +
+                                  (i == j ? DType(4 * n) : DType(0));
+      dx[(t * n + i) * 2] = DType(i + 1);
+      dx[(t * n + i) * 2 + 1] = DType(t % 5) - DType(i);
+    }
+    for (index_t i = 0; i < n; i++) {
+      for (index_t j = 0; j < 2; j++) {
+        DType sum = 0;
+        for (index_t k = 0; k < n; k++)
+          sum += da[(t * n + i) * n + k] * dx[(t * n + k) * 2 + j];
+        db[(t * n + i) * 2 + j] = sum;
+      }
+    }
+  }
+  Tensor<3, DType> a(da.data(), Shape3(nbatch, n, n));
+  Tensor<3, DType> b(db.data(), Shape3(nbatch, n, 2));
+  InterleavedTensor<DType> ia = NewInterleaved<DType>(nbatch, n, n, &stream);
+  InterleavedTensor<DType> ib = NewInterleaved<DType>(nbatch, n, 2, &stream);
+  InterleavedTensor<DType> ic = NewInterleaved<DType>(nbatch, n, 2, &stream);
+  InterleavedTensor<DType> id = NewInterleaved<DType>(nbatch, n, n, &stream);
+  Interleave(ia, a);
+  Interleave(ib, b);
+  // a^T a and a b through the batched dot, then back to Tensor<3>
+  std::vector<DType> dp(nbatch * n * n), dq(nbatch * n * 2);
+  BatchDot<true, false>(id, ia, ia);
+  BatchDot<false, false>(ic, ia, ib, DType(2));
+  Deinterleave(Tensor<3, DType>(dp.data(), Shape3(nbatch, n, n)), id);
+  Deinterleave(Tensor<3, DType>(dq.data(), Shape3(nbatch, n, 2)), ic);
+  stream.Wait();
+  for (index_t t = 0; t < nbatch; t++) {
+    for (index_t i = 0; i < n; i++) {
+      for (index_t j = 0; j < n; j++) {
+        DType sum = 0;
+        for (index_t k = 0; k < n; k++)
+          sum += da[(t * n + k) * n + i] * da[(t * n + k) * n + j];
+        assert(std::abs(dp[(t * n + i) * n + j] - sum) <=
+               DType(1e-4) * std::abs(sum) + DType(1e-4));
+      }
+      for (index_t j = 0; j < 2; j++) {
+        DType sum = 0;
+        for (index_t k = 0; k < n; k++)
+          sum += da[(t * n + i) * n + k] * db[(t * n + k) * 2 + j];
+        assert(std::abs(dq[(t * n + i) * 2 + j] - 2 * sum) <=
+               DType(1e-4) * std::abs(sum) + DType(1e-4));
+      }
+    }
+  }
+  // solve, then invert a fresh copy and check a inv(a) = I
+  BatchSolve(ia, ib);
+  Deinterleave(b, ib);
+  Interleave(ia, a);
+  BatchInverse(id, ia);
+  Interleave(ia, a);
+  std::vector<DType> di(nbatch * n * n);
+  InterleavedTensor<DType> ie = NewInterleaved<DType>(nbatch, n, n, &stream);
+  BatchDot<false, false>(ie, ia, id);
+  Deinterleave(Tensor<3, DType>(di.data(), Shape3(nbatch, n, n)), ie);
+  stream.Wait();
+  for (index_t t = 0; t < nbatch; t++) {
+    for (index_t i = 0; i < n; i++) {
+      for (index_t j = 0; j < 2; j++)
+        assert(std::abs(db[(t * n + i) * 2 + j] - dx[(t * n + i) * 2 + j]) <
+               DType(1e-3));
+      for (index_t j = 0; j < n; j++)
+        assert(std::abs(di[(t * n + i) * n + j] - DType(i == j)) <
+               DType(1e-4));
+    }
+  }
+  FreeSpace(&ia);
+  FreeSpace(&ib);
+  FreeSpace(&ic);
+  FreeSpace(&id);
+  FreeSpace(&ie);
+}
+
+void unittest_interleaved() {
+  check_interleaved<double>(37, 6);
+  check_interleaved<float>(100, 3);
+  check_interleaved<double>(5, 1);
+  cout << "unittest_interleaved complete.\n";
+}
+
+// floats around every rounding boundary of a 16 bit type, and random bits
+inline std::vector<float> conversion_samples() {
+  std::vector<float> res;
+  for (uint32_t h = 0; h < 0x10000; h++) {
+    const uint32_t x = FloatBits(HalfBitsToFloat(uint16_t(h)));
+    for (uint32_t d : {0u, 1u, 0xFFFu, 0x1000u, 0x1001u, 0x7FFFu, 0x8000u})
+      res.push_back(BitsFloat(x + d));
+    res.push_back(BitsFloat(uint32_t(h) << 16 | 0x8000));
+    res.push_back(BitsFloat(uint32_t(h) << 16 | 0x8001));
+  }
+  uint32_t seed = 12345;
+  for (int i = 0; i < 100000; i++) {
+    seed = seed * 1664525u + 1013904223u;
+    res.push_back(BitsFloat(seed));
+  }
+  res.resize(res.size() / 16 * 16 + 5);
+  return res;
+}
+
+template <typename DType>
+void check_half_conversion(uint16_t (*to_bits)(float),
+                           float (*from_bits)(uint16_t)) {
+  // every bit pattern widens like the scalar conversion
+  std::vector<DType> dh(0x10000);
+  std::vector<float> df(0x10000);
+  for (index_t i = 0; i < 0x10000; i++)
+    dh[i] = DType::FromBits(uint16_t(i));
+  Tensor<1, DType> h(dh.data(), Shape1(0x10000));
+  Tensor<1, float> f(df.data(), Shape1(0x10000));
+  f = expr::typecast<float>(h);
+  for (index_t i = 0; i < 0x10000; i++)
+    assert(FloatBits(df[i]) == FloatBits(from_bits(uint16_t(i))));
+  // and floats narrow like it
+  std::vector<float> ds = conversion_samples();
+  std::vector<DType> dn(ds.size());
+  Tensor<1, float> s(ds.data(), Shape1(index_t(ds.size())));
+  Tensor<1, DType> n(dn.data(), Shape1(index_t(ds.size())));
+  n = expr::typecast<DType>(s);
+  for (size_t i = 0; i < ds.size(); i++)
+    assert(dn[i].bits_ == to_bits(ds[i]));
+}
+
+// a * b - a over a row of 19, 16 packet columns and a tail of 3 that must
+// round the same: once, on store
+template <typename DType> void check_wide_tail(float v) {
+  std::vector<DType> da(19, DType(v)), dc(19);
+  Tensor<2, DType> a(da.data(), Shape2(1, 19)), c(dc.data(), Shape2(1, 19));
+  c = a * a - a;
+  for (index_t i = 1; i < 19; i++)
+    assert(dc[i].bits_ == dc[0].bits_);
+  c += a * expr::scalar(DType(v)) + a;
+  for (index_t i = 1; i < 19; i++)
+    assert(dc[i].bits_ == dc[0].bits_);
+}
+
+void unittest_half() {
+  check_half_conversion<half_t>(FloatToHalfBits, HalfBitsToFloat);
+  check_half_conversion<bf16_t>(FloatToBF16Bits, BF16BitsToFloat);
+  check_wide_tail<half_t>(1.0f + std::ldexp(1.0f, -10));
+  check_wide_tail<bf16_t>(1.0f + std::ldexp(1.0f, -7));
+  assert(FloatToHalfBits(65504.0f) == 0x7BFF);
+  assert(FloatToHalfBits(65520.0f) == 0x7C00);
+  assert(FloatToHalfBits(std::ldexp(1.0f, -24)) == 0x0001);
+  assert(FloatToHalfBits(std::ldexp(1.0f, -25)) == 0x0000);
+  assert(FloatToBF16Bits(1.00390625f) == 0x3F80);
+  const packet::PacketArch kArch = packet::PacketDefault<float>::kArch;
+  typedef decltype(expr::typecast<float>(Tensor<2, half_t>())) WidenExp;
+  static_assert(kArch == packet::kPlain ||
+                    expr::PacketCheck<WidenExp, kArch>::kPass,
+                "typecast from half is not vectorized");
+  // the lanes of a fused map over half tensors stay in float, a row of 37
+  // has a tail after its packets
+  const index_t rows = 7, cols = 37;
+  std::vector<half_t> da(rows * cols), db(rows * cols), dc(rows * cols);
+  std::vector<float> dr(rows * cols);
+  for (index_t i = 0; i < rows * cols; i++) {
+    da[i] = half_t(float(i % 13) * 0.37f - 2.0f);
+    db[i] = half_t(float(i % 7) * 0.11f + 0.5f);
+  }
+  Tensor<2, half_t> a(da.data(), Shape2(rows, cols));
+  Tensor<2, half_t> b(db.data(), Shape2(rows, cols));
+  Tensor<2, half_t> c(dc.data(), Shape2(rows, cols));
+  Tensor<2, float> r(dr.data(), Shape2(rows, cols));
+  c = a * b + a * expr::scalar(half_t(3.0f));
+  r = expr::typecast<float>(c) - expr::typecast<float>(a);
+  for (index_t i = 0; i < rows * cols; i++) {
+    const float want = float(da[i]) * float(db[i]) + float(da[i]) * 2.0f;
+    assert(std::abs(dr[i] - want) <= 2e-3f * (std::abs(float(da[i])) + 1.0f));
+  }
+  // double, float and int32
+  std::vector<double> dd(rows * cols), de(rows * cols);
+  std::vector<int32_t> di(rows * cols);
+  for (index_t i = 0; i < rows * cols; i++) {
+    dd[i] = double(i) / 3.0 - 100.0;
+    di[i] = int32_t(i * 7919) - 5000;
+  }
+  Tensor<2, double> d(dd.data(), Shape2(rows, cols));
+  Tensor<2, double> e(de.data(), Shape2(rows, cols));
+  Tensor<2, int32_t> k(di.data(), Shape2(rows, cols));
+  r = expr::typecast<float>(d) * expr::scalar(2.0f);
+  for (index_t i = 0; i < rows * cols; i++)
+    assert(dr[i] == float(dd[i]) * 2.0f);
+  e = expr::typecast<double>(r) + expr::typecast<double>(k);
+  for (index_t i = 0; i < rows * cols; i++)
+    assert(de[i] == double(dr[i]) + double(di[i]));
+  r = expr::typecast<float>(k);
+  for (index_t i = 0; i < rows * cols; i++)
+    assert(dr[i] == float(di[i]));
+  // dot of half matrices accumulates in float
+  const index_t m = 19, kk = 300, nn = 23;
+  std::vector<half_t> dx(m * kk), dy(kk * nn), dz(m * nn);
+  for (index_t i = 0; i < m * kk; i++)
+    dx[i] = half_t(float(i % 11) * 0.25f - 1.0f);
+  for (index_t i = 0; i < kk * nn; i++)
+    dy[i] = half_t(float(i % 5) * 0.5f - 1.0f);
+  Tensor<2, half_t> x(dx.data(), Shape2(m, kk)), y(dy.data(), Shape2(kk, nn));
+  Tensor<2, half_t> z(dz.data(), Shape2(m, nn));
+  z = dot(x, y);
+  for (index_t i = 0; i < m; i++) {
+    for (index_t j = 0; j < nn; j++) {
+      float want = 0.0f;
+      for (index_t l = 0; l < kk; l++)
+        want += float(dx[i * kk + l]) * float(dy[l * nn + j]);
+      assert(dz[i * nn + j].bits_ == half_t(want).bits_);
+    }
+  }
+  cout << "unittest_half complete.\n";
+}
+
+// exact (A - za)(B - zb) of row i and column j of qdot
+int64_t naive_qdot(const std::vector<uint8_t> &a, const std::vector<int8_t> &b,
+                   index_t n, index_t k, bool tb, int32_t za, int32_t zb,
+                   index_t i, index_t j) {
+  int64_t res = 0;
+  for (index_t l = 0; l < k; l++) {
+    const int8_t bv = tb ? b[j * k + l] : b[l * n + j];
+    res += int64_t(a[i * k + l] - za) * (bv - zb);
+  }
+  return res;
+}
+
+void unittest_qdot() {
+  Stream stream(3);
+  // full ranges, 255 * -128 twice overflows an int16 pair sum
+  const index_t m = 37, n = 51;
+  std::vector<float> dsa(m), dsb(n);
+  std::vector<int32_t> dza(m), dzb(n);
+  for (index_t i = 0; i < m; i++) {
+    dsa[i] = 0.01f * float(i % 7 + 1);
+    dza[i] = 120 + int32_t(i % 9);
+  }
+  for (index_t j = 0; j < n; j++) {
+    dsb[j] = 0.002f * float(j % 5 + 1);
+    dzb[j] = int32_t(j % 3) - 1;
+  }
+  Tensor<1, float> sa(dsa.data(), Shape1(m)), sb(dsb.data(), Shape1(n));
+  Tensor<1, int32_t> za(dza.data(), Shape1(m)), zb(dzb.data(), Shape1(n));
+  // one block of k is exact up to the float scaling, more blocks add floats
+  const index_t ks[] = {300, 1100};
+  for (index_t k : ks) {
+    std::vector<uint8_t> da(m * k);
+    std::vector<int8_t> db(k * n);
+    std::vector<float> dc(m * n);
+    for (index_t i = 0; i < m * k; i++)
+      da[i] = uint8_t(i % 3 == 0 ? 255 : (i * 37) % 256);
+    for (index_t i = 0; i < k * n; i++)
+      db[i] = int8_t(i % 5 == 0 ? -128 : int32_t((i * 53) % 256) - 128);
+    Tensor<2, uint8_t> a(da.data(), Shape2(m, k));
+    Tensor<2, float> c(dc.data(), Shape2(m, n), &stream);
+    for (int tb = 0; tb < 2; tb++) {
+      Tensor<2, int8_t> b(db.data(), tb ? Shape2(n, k) : Shape2(k, n));
+      if (tb) {
+        c = expr::qdot(a, sa, za, b.T(), sb, zb);
+      } else {
+        c = expr::qdot(a, sa, za, b, sb, zb);
+      }
+      stream.Wait();
+      for (index_t i = 0; i < m; i++) {
+        for (index_t j = 0; j < n; j++) {
+          const int64_t s =
+              naive_qdot(da, db, n, k, tb != 0, dza[i], dzb[j], i, j);
+          const float want = dsa[i] * dsb[j] * float(s);
+          if (k == 300)
+            assert(dc[i * n + j] == want);
+          else
+            assert(std::fabs(dc[i * n + j] - want) <=
+                   1e-6f * dsa[i] * dsb[j] * float(255 * 255 * k));
+        }
+      }
+    }
+    if (k != 300)
+      continue;
+    // a scale and zero point shared by all rows, accumulate into dst
+    float one_scale = 0.05f;
+    int32_t one_zero = 128;
+    Tensor<1, float> sa1(&one_scale, Shape1(1));
+    Tensor<1, int32_t> za1(&one_zero, Shape1(1));
+    Tensor<2, int8_t> b(db.data(), Shape2(k, n));
+    c = 1.0f;
+    c += expr::qdot(a, sa1, za1, b, sb, zb) * 0.5f;
+    stream.Wait();
+    for (index_t i = 0; i < m; i++) {
+      for (index_t j = 0; j < n; j++) {
+        const int64_t s = naive_qdot(da, db, n, k, false, 128, dzb[j], i, j);
+        const float want = 0.5f * 0.05f * dsb[j] * float(s) + 1.0f;
+        assert(std::fabs(dc[i * n + j] - want) <= 1e-6f * std::fabs(want));
+      }
+    }
+  }
+  // quantize rounds half to even and clamps, dequantize maps back
+  const index_t len = 1000;
+  std::vector<float> dx(len), dy(len);
+  std::vector<uint8_t> dq(len);
+  std::vector<int8_t> dw(len);
+  for (index_t i = 0; i < len; i++)
+    dx[i] = float(i) * 0.0137f - 6.0f;
+  dx[0] = std::numeric_limits<float>::quiet_NaN();
+  dx[1] = 0.125f;
+  Tensor<1, float> x(dx.data(), Shape1(len)), y(dy.data(), Shape1(len));
+  Tensor<1, uint8_t> q(dq.data(), Shape1(len));
+  Tensor<1, int8_t> w(dw.data(), Shape1(len));
+  q = expr::quantize<uint8_t>(x, 0.05f, 100);
+  y = expr::dequantize(q, 0.05f, 100);
+  w = expr::quantize<int8_t>(x * expr::scalar(2.0f), 0.1f);
+  assert(dq[0] == 0 && dq[1] == 102 && dw[1] == 2);
+  for (index_t i = 2; i < len; i++) {
+    const float v = std::nearbyint(dx[i] * 20.0f) + 100.0f;
+    assert(dq[i] == uint8_t(v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v)));
+    if (v >= 0.0f && v <= 255.0f)
+      assert(std::fabs(dy[i] - dx[i]) <= 0.025f + 1e-6f);
+    assert(dw[i] == int8_t(std::max(-128.0f, std::min(
+                        127.0f, std::nearbyint(dx[i] * 2.0f * 10.0f)))));
+  }
+  cout << "unittest_qdot complete.\n";
+}
+
+void unittest_packed() {
+  Stream stream(3);
+  // crosses the kKC and kNC blocks, few rows like a small inference batch
+  const index_t m = 9, n = 3100, k = 600;
+  std::vector<double> da(m * k), db(k * n), dc(m * n);
+  for (index_t i = 0; i < m * k; i++)
+    da[i] = double(i % 13) - 6;
+  for (index_t i = 0; i < k * n; i++)
+    db[i] = double(i % 7) - 3;
+  Tensor<2, double> c(dc.data(), Shape2(m, n), &stream);
+  for (int t = 0; t < 4; t++) {
+    const bool ta = (t & 1) != 0, tb = (t & 2) != 0;
+    Tensor<2, double> a(da.data(), ta ? Shape2(k, m) : Shape2(m, k));
+    Tensor<2, double> b(db.data(), tb ? Shape2(n, k) : Shape2(k, n));
+    PackedMatrix<double> w = NewPacked(b, tb);
+    assert(w.shape() == Shape2(k, n));
+    if (ta)
+      c = dot(a.T(), w);
+    else
+      c = dot(a, w);
+    stream.Wait();
+    for (index_t i = 0; i < m; i++) {
+      for (index_t j = 0; j < n; j++)
+        assert(dc[i * n + j] == naive_dot(da, db, m, n, k, ta, tb, i, j));
+    }
+    FreeSpace(&w);
+  }
+  // a saved matrix loads back, scalars and += fold into the gemm
+  Tensor<2, double> a(da.data(), Shape2(m, k)), b(db.data(), Shape2(k, n));
+  PackedMatrix<double> w = NewPacked(b);
+  std::stringstream ss;
+  SavePacked(ss, w);
+  PackedMatrix<double> v = LoadPacked<double>(ss);
+  c = 1.0;
+  c += dot(a, v) * 2.0;
+  stream.Wait();
+  for (index_t i = 0; i < m; i++) {
+    for (index_t j = 0; j < n; j++)
+      assert(dc[i * n + j] ==
+             1.0 + 2.0 * naive_dot(da, db, m, n, k, false, false, i, j));
+  }
+  // one column per panel and one block is B column major, another blocking
+  // than this build so the load packs it again
+  PackedHeader header;
+  std::memcpy(header.magic, "LMPK", 4);
+  header.elem_size = uint32_t(sizeof(double));
+  header.nr = 1;
+  header.kc = k;
+  header.nc = n;
+  header.k = k;
+  header.n = n;
+  std::stringstream cm;
+  cm.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (index_t j = 0; j < n; j++) {
+    for (index_t p = 0; p < k; p++)
+      cm.write(reinterpret_cast<const char *>(&db[p * n + j]), sizeof(double));
+  }
+  PackedMatrix<double> u = LoadPacked<double>(cm);
+  c = dot(a, u);
+  stream.Wait();
+  for (index_t i = 0; i < m; i++) {
+    for (index_t j = 0; j < n; j++)
+      assert(dc[i * n + j] == naive_dot(da, db, m, n, k, false, false, i, j));
+  }
+  FreeSpace(&w);
+  FreeSpace(&v);
+  FreeSpace(&u);
+  cout << "unittest_packed complete.\n";
+}
+
+void unittest_gemv() {
+  Stream stream(3);
+  // a small grain so the rows split over the pool, more columns than one
+  // slice of partial sums
+  stream.SetGrainSize(1000);
+  const index_t m = 37, n = 2100;
+  std::vector<double> da(m * n), dx(n), dy(m), du(m), dv(n);
+  for (index_t i = 0; i < m * n; i++)
+    da[i] = double(i % 13) - 6;
+  for (index_t i = 0; i < n; i++)
+    dx[i] = double(i % 7) - 3;
+  for (index_t i = 0; i < m; i++)
+    du[i] = double(i % 5) - 2;
+  Tensor<2, double> a(da.data(), Shape2(m, n));
+  Tensor<1, double> x(dx.data(), Shape1(n)), u(du.data(), Shape1(m));
+  Tensor<1, double> y(dy.data(), Shape1(m), &stream);
+  Tensor<1, double> v(dv.data(), Shape1(n), &stream);
+  for (int t = 0; t < 2; t++) {
+    if (t == 0) {
+      y = dot(a, x);
+      v = dot(a.T(), u);
+    } else {
+      y = dot(x, a.T());
+      v = dot(u, a);
+    }
+    stream.Wait();
+    for (index_t i = 0; i < m; i++)
+      assert(dy[i] == naive_dot(da, dx, m, 1, n, false, false, i, 0));
+    for (index_t j = 0; j < n; j++)
+      assert(dv[j] == naive_dot(da, du, n, 1, m, true, false, j, 0));
+  }
+  // accumulate into dst, scalars fold into the gemv
+  y = 1.0;
+  v = 1.0;
+  y += dot(a, x) * 2.0;
+  v -= expr::scalar(0.5) * dot(u, a);
+  stream.Wait();
+  for (index_t i = 0; i < m; i++)
+    assert(dy[i] == 1.0 + 2.0 * naive_dot(da, dx, m, 1, n, false, false, i, 0));
+  for (index_t j = 0; j < n; j++)
+    assert(dv[j] == 1.0 - 0.5 * naive_dot(da, du, n, 1, m, true, false, j, 0));
+  // an Inf in a row of the leftover rows stays Inf, a zero weight never
+  // multiplies it
+  std::vector<float> fa(5 * 16, 1.0f), fu(5, 1.0f), fv(16);
+  fa[4 * 16] = std::numeric_limits<float>::infinity();
+  Tensor<2, float> fat(fa.data(), Shape2(5, 16));
+  Tensor<1, float> fut(fu.data(), Shape1(5)), fvt(fv.data(), Shape1(16));
+  fvt = dot(fat.T(), fut);
+  assert(std::isinf(fv[0]) && fv[0] > 0.0f);
+  for (index_t j = 1; j < 16; j++)
+    assert(fv[j] == 5.0f);
+  cout << "unittest_gemv complete.\n";
+}
+
+void unittest_syrk() {
+  Stream stream(3);
+  // several row blocks of the triangle, not a multiple of them
+  const index_t n = 250, k = 70;
+  std::vector<double> da(n * k), dc(n * n), dfull(n * n);
+  for (index_t i = 0; i < n * k; i++)
+    da[i] = double(i % 13) - 6;
+  Tensor<2, double> c(dc.data(), Shape2(n, n), &stream);
+  for (int t = 0; t < 2; t++) {
+    Tensor<2, double> a(da.data(), t ? Shape2(k, n) : Shape2(n, k));
+    if (t)
+      c = dot(a.T(), a);
+    else
+      c = dot(a, a.T());
+    stream.Wait();
+    for (index_t i = 0; i < n; i++) {
+      for (index_t j = 0; j < n; j++)
+        assert(dc[i * n + j] ==
+               naive_dot(da, da, n, n, k, t != 0, t == 0, i, j));
+    }
+  }
+  // += keeps a dst that is not symmetric right in both halves
+  Tensor<2, double> a(da.data(), Shape2(n, k));
+  for (index_t i = 0; i < n * n; i++)
+    dc[i] = double(i % 11);
+  c += dot(a, a.T()) * 2.0;
+  stream.Wait();
+  for (index_t i = 0; i < n; i++) {
+    for (index_t j = 0; j < n; j++)
+      assert(dc[i * n + j] ==
+             double((i * n + j) % 11) +
+                 2.0 * naive_dot(da, da, n, n, k, false, true, i, j));
+  }
+  // only the packed lower triangle, read back as the full matrix
+  TriangularTensor<double> g = NewTriangular<double>(n, &stream);
+  g = dot(a, a.T());
+  g -= dot(a, a.T()) * 0.5;
+  Tensor<2, double> full(dfull.data(), Shape2(n, n), &stream);
+  full = g;
+  stream.Wait();
+  for (index_t i = 0; i < n; i++) {
+    for (index_t j = 0; j < n; j++)
+      assert(dfull[i * n + j] ==
+             0.5 * naive_dot(da, da, n, n, k, false, true, i, j));
+  }
+  FreeSpace(&g);
+  cout << "unittest_syrk complete.\n";
+}
+
+int main() {
+  unittest_shape();
+  unittest_mapexp();
+  unittest_parallel_mapexp();
+  unittest_stream();
+  unittest_dot();
+  unittest_batch_dot();
+  unittest_conv2d();
+  unittest_broadcast();
+  unittest_reduce();
+  unittest_alloc();
+  unittest_pitch();
+  unittest_sort();
+  unittest_segment_sort();
+  unittest_gather();
+  unittest_copy();
+  unittest_transpose();
+  unittest_fusion();
+  unittest_rewrite();
+  unittest_small_tensor();
+  unittest_interleaved();
+  unittest_half();
+  unittest_qdot();
+  unittest_packed();
+  unittest_gemv();
+  unittest_syrk();
+}